@@ -0,0 +1,84 @@
+#include "graph.h"
+
+/* Выравнивание выделяемых кусков (хватает для double и Token) */
+#define ARENA_ALIGN 16
+
+/* Заголовок блока, округлённый до выравнивания: данные идут сразу за ним */
+#define ARENA_HEADER \
+  ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/*============================================================================
+ * Локальная функция: новый блок арены на size байт данных
+ *===========================================================================*/
+static ArenaBlock *newArenaBlock(size_t size, ArenaBlock *prev) {
+  ArenaBlock *block = (ArenaBlock *)malloc(ARENA_HEADER + size);
+  block->prev = prev;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+/*============================================================================
+ * Создание арены с первым блоком на size байт
+ *===========================================================================*/
+void initArena(Arena *arena, size_t size) {
+  arena->total = (size > 0) ? size : ARENA_ALIGN;
+  arena->block = newArenaBlock(arena->total, NULL);
+}
+
+/*============================================================================
+ * Выделение bytes байт сдвигом указателя. Если текущий блок кончился,
+ * заводится новый (не меньше удвоенного предыдущего).
+ *===========================================================================*/
+void *arenaAlloc(Arena *arena, size_t bytes) {
+  ArenaBlock *block = arena->block;
+  bytes = (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (block->used + bytes > block->size) {
+    size_t size = 2 * block->size;
+    size = (size > bytes) ? size : bytes;
+    block = newArenaBlock(size, block);
+    arena->block = block;
+    arena->total += size;
+  }
+  void *p = (char *)block + ARENA_HEADER + block->used;
+  block->used += bytes;
+  return p;
+}
+
+/*============================================================================
+ * Освобождение всего выделенного разом. Обычно это O(1). Если арене
+ * не хватило первого блока, блоки сливаются в один общего размера,
+ * чтобы следующему выражению их уже хватило.
+ *===========================================================================*/
+void resetArena(Arena *arena) {
+  if (arena->block->prev != NULL) {
+    freeArena(arena);
+    arena->block = newArenaBlock(arena->total, NULL);
+  } else {
+    arena->block->used = 0;
+  }
+}
+
+/*============================================================================
+ * Освобождение памяти арены (все блоки)
+ *===========================================================================*/
+void freeArena(Arena *arena) {
+  ArenaBlock *block = arena->block;
+  while (block != NULL) {
+    ArenaBlock *prev = block->prev;
+    free(block);
+    block = prev;
+  }
+  arena->block = NULL;
+}
+
+/*============================================================================
+ * Сколько байт нужно арене на разбор строки длиной len: массив токенов
+ * (у потокового лексера), узлы дерева, стек разбора (его элемент не
+ * больше узла) и номера узлов при свёртке. Токенов не больше, чем
+ * символов, так что каждому хватает len + 16 элементов.
+ *===========================================================================*/
+size_t exprArenaSize(size_t len) {
+  return (len + 16) * (sizeof(Token) + 2 * sizeof(ExprNode) + sizeof(int)) +
+         4 * ARENA_ALIGN;
+}
@@ -0,0 +1,1029 @@
+#include "graph.h"
+
+#include <time.h>                        /* clock_gettime */
+#include <unistd.h>                      /* sysconf, close, unlink */
+
+/* Выражение средней длины (на нём же меряем ширину холста) */
+#define BENCH_EXPR "sin(x)*cos(2*x)+sqrt(x)/10-ln(x+1)/4"
+
+/* Сколько слагаемых в длинном выражении и уровней в глубоком */
+#define LONG_TERMS 200
+#define NESTED_DEPTH 200
+
+/* Сколько x вычисляется за одну итерацию стадий eval */
+#define EVAL_POINTS 4096
+
+/* Сколько выражений стадия fill-series рисует на одном холсте */
+#define BENCH_SERIES 16
+
+/* Сколько сдвигов делает стадия pan за один повтор */
+#define PAN_FRAMES 64
+
+/* Сколько точек проверяет --accuracy на каждом отрезке и ширина
+ * отрезков по обе стороны FAST_TRIG_MAX */
+#define ACCURACY_POINTS 2000000
+#define ACCURACY_EDGE 1000.0
+
+/* --jit-check: случайных выражений, точек x на каждое, глубина дерева
+ * случайного выражения и вложенность глубоких (стек больше
+ * PROGRAM_SMALL_STACK - кадр в куче) */
+#define JIT_CHECK_EXPRS 3000
+#define JIT_CHECK_POINTS 512
+#define JIT_CHECK_TREE_DEPTH 7
+#define JIT_CHECK_DEEP 1000
+#define JIT_CHECK_DEEP_EXPRS 20
+
+/* Сколько расхождений --jit-check печатает подробно */
+#define JIT_CHECK_REPORT 10
+
+/* Замеры по умолчанию, прогревочные замеры, длительность одного замера */
+#define DEFAULT_SAMPLES 31
+#define WARMUP_SAMPLES 3
+#define SAMPLE_TARGET_NS 2e5
+
+/* Счётчик вызовов malloc/realloc из кода проекта (через -Wl,--wrap) */
+static unsigned long allocCount = 0;
+
+/* Сюда складываются результаты, чтобы компилятор не выбросил вычисления */
+static volatile double benchSink = 0.0;
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *p, size_t size);
+
+/*============================================================================
+ * Обёртки malloc/realloc: считают вызовы и передают их в libc
+ *===========================================================================*/
+void *__wrap_malloc(size_t size) {
+  allocCount++;
+  return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  allocCount++;
+  return __real_realloc(p, size);
+}
+
+/*-----------------------------------------------------------------------------
+ * Выражение из набора и всё, что для него готовится заранее
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  const char *name;       /* Короткое имя для отчёта */
+  char *text;             /* Текст выражения */
+  TokenArray infix;       /* Токены (вход для parseTokens) */
+  TokenArray postfix;     /* ОПН после свёртки (вход для вычисления) */
+  Program prog;           /* Байткод */
+  Program fastProg;       /* Он же с --precision fast */
+  JitProgram jit;         /* Машинный код */
+  JitProgram fastJit;     /* Машинный код fastProg */
+  Arena arena;            /* Арена для стадий разбора */
+  ProgramLibrary lib;     /* Тот же байткод в библиотеке на диске */
+} BenchExpr;
+
+/*-----------------------------------------------------------------------------
+ * Функция для стадий fn-*: libm, быстрая замена и её версия над дорожками
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  const char *name;             /* Имя для отчёта */
+  double (*exact)(double);      /* libm */
+  double (*fast)(double);       /* fastmath.c, одно значение */
+  void (*lanes)(double *restrict a);  /* fastmath.c, BATCH_LANES значений */
+} BenchFunc;
+
+/*-----------------------------------------------------------------------------
+ * Отрезок проверки --accuracy для функции из kBenchFuncs
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  int func;                     /* Номер функции в kBenchFuncs */
+  double lo;                    /* Отрезок */
+  double hi;
+  int logScale;                 /* 1 - точки по отрезку в log-масштабе */
+} AccuracyRange;
+
+/*-----------------------------------------------------------------------------
+ * Общие данные всех стадий
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  BenchExpr *expr;        /* Текущее выражение */
+  const BenchFunc *func;  /* Текущая функция стадий fn-* (или NULL) */
+  int width;              /* Ширина холста для стадий fill/frame */
+  ThreadPool *pool;       /* Пул для стадии fill-pool */
+  FILE *devnull;          /* Куда печатать кадры */
+  double xs[EVAL_POINTS]; /* Точки для стадий eval */
+  double ys[EVAL_POINTS];
+} BenchCtx;
+
+/* Стадия: iters повторов, возвращает число единиц измерения (токенов...) */
+typedef double (*StageFn)(BenchCtx *ctx, long iters);
+
+/*============================================================================
+ * Локальная функция: 1 / tan(x) из libm (эталон для fastCtg)
+ *===========================================================================*/
+static double libmCtg(double x) {
+  return 1.0 / tan(x);
+}
+
+/* Функции стадий fn-* и проверки --accuracy */
+static const BenchFunc kBenchFuncs[] = {
+    {"sin", sin, fastSin, fastSinLanes},
+    {"cos", cos, fastCos, fastCosLanes},
+    {"tan", tan, fastTan, fastTanLanes},
+    {"ctg", libmCtg, fastCtg, fastCtgLanes},
+    {"ln", log, fastLog, fastLogLanes}};
+
+/* Край отрезка приведения: проверяется по ACCURACY_EDGE с обеих сторон */
+#define FAST_TRIG_LO (FAST_TRIG_MAX - ACCURACY_EDGE)
+#define FAST_TRIG_HI (FAST_TRIG_MAX + ACCURACY_EDGE)
+
+/* Отрезки --accuracy. У sin, cos, tan, ctg: около нуля (частые точки),
+ * весь отрезок приведения (к его концу копится ошибка приведения) и
+ * обе стороны FAST_TRIG_MAX, где ядро сменяется на libm. */
+static const AccuracyRange kAccuracyRanges[] = {
+    {0, -1000.0, 1000.0, 0},          {0, -FAST_TRIG_MAX, FAST_TRIG_MAX, 0},
+    {0, FAST_TRIG_LO, FAST_TRIG_HI, 0}, {0, -FAST_TRIG_HI, -FAST_TRIG_LO, 0},
+    {1, -1000.0, 1000.0, 0},          {1, -FAST_TRIG_MAX, FAST_TRIG_MAX, 0},
+    {1, FAST_TRIG_LO, FAST_TRIG_HI, 0}, {1, -FAST_TRIG_HI, -FAST_TRIG_LO, 0},
+    {2, -1000.0, 1000.0, 0},          {2, -FAST_TRIG_MAX, FAST_TRIG_MAX, 0},
+    {2, FAST_TRIG_LO, FAST_TRIG_HI, 0}, {2, -FAST_TRIG_HI, -FAST_TRIG_LO, 0},
+    {3, -1000.0, 1000.0, 0},          {3, -FAST_TRIG_MAX, FAST_TRIG_MAX, 0},
+    {3, FAST_TRIG_LO, FAST_TRIG_HI, 0}, {3, -FAST_TRIG_HI, -FAST_TRIG_LO, 0},
+    {4, 1e-5, 1e5, 1}};
+
+/*============================================================================
+ * Локальная функция: текущее время в наносекундах (монотонные часы)
+ *===========================================================================*/
+static double nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*============================================================================
+ * Стадия tokenize: строка -> токены в арене
+ *===========================================================================*/
+static double stageTokenize(BenchCtx *ctx, long iters) {
+  BenchExpr *e = ctx->expr;
+  int len = (int)strlen(e->text);
+  double units = 0.0;
+  for (long i = 0; i < iters; i++) {
+    TokenArray infix;
+    resetArena(&e->arena);
+    initTokenArrayArena(&infix, &e->arena, len + 1);
+    tokenize(e->text, &infix);
+    units += infix.size;            /* ns на токен */
+  }
+  return units;
+}
+
+/*============================================================================
+ * Стадия parse-tokens: готовые токены -> дерево
+ *===========================================================================*/
+static double stageParseTokens(BenchCtx *ctx, long iters) {
+  BenchExpr *e = ctx->expr;
+  for (long i = 0; i < iters; i++) {
+    ExprAst ast;
+    resetArena(&e->arena);
+    parseTokens(&e->infix, &e->arena, &ast);
+  }
+  return (double)iters * e->infix.size;  /* ns на входной токен */
+}
+
+/*============================================================================
+ * Стадия parse: строка -> свёрнутое дерево за один проход, в арене со
+ * сбросом между выражениями
+ *===========================================================================*/
+static double stageParse(BenchCtx *ctx, long iters) {
+  BenchExpr *e = ctx->expr;
+  for (long i = 0; i < iters; i++) {
+    ExprAst ast;
+    resetArena(&e->arena);          /* O(1): прошлое выражение не нужно */
+    parseExpr(e->text, &e->arena, &ast);
+    foldAst(&ast);
+  }
+  return (double)iters;             /* ns на выражение */
+}
+
+/*============================================================================
+ * Стадия compile: строка -> байткод (разбор, свёртка, DAG)
+ *===========================================================================*/
+static double stageCompile(BenchCtx *ctx, long iters) {
+  BenchExpr *e = ctx->expr;
+  Program prog;
+  initProgram(&prog);
+  for (long i = 0; i < iters; i++) {
+    ExprAst ast;
+    resetArena(&e->arena);
+    parseExpr(e->text, &e->arena, &ast);
+    foldAst(&ast);
+    compileAst(&ast, &prog);
+  }
+  freeProgram(&prog);
+  return (double)iters;             /* ns на выражение */
+}
+
+/*============================================================================
+ * Стадия load-library: готовый байткод из отображённой библиотеки
+ * (проверка записи и байткода вместо разбора; сравнивать с compile)
+ *===========================================================================*/
+static double stageLoadLibrary(BenchCtx *ctx, long iters) {
+  const ProgramLibrary *lib = &ctx->expr->lib;
+  Program prog;
+  int loaded = 0;
+  for (long i = 0; lib->programCount > 0 && i < iters; i++) {
+    loaded += libraryProgram(lib, 0, &prog);
+  }
+  benchSink = loaded;
+  return (double)loaded;            /* ns на выражение */
+}
+
+/*============================================================================
+ * Стадия evalRPN: эталонный интерпретатор ОПН по точке
+ *===========================================================================*/
+static double stageEvalRPN(BenchCtx *ctx, long iters) {
+  double sum = 0.0;
+  for (long i = 0; i < iters; i++) {
+    for (int k = 0; k < EVAL_POINTS; k++) {
+      sum += evalRPN(&ctx->expr->postfix, ctx->xs[k]);
+    }
+  }
+  benchSink = sum;
+  return (double)iters * EVAL_POINTS;  /* ns на точку */
+}
+
+/*============================================================================
+ * Стадии eval-batch и eval-jit: весь массив точек за вызов
+ *===========================================================================*/
+static double stageEvalBatch(BenchCtx *ctx, long iters) {
+  for (long i = 0; i < iters; i++) {
+    evalProgramBatch(&ctx->expr->prog, ctx->xs, ctx->ys, EVAL_POINTS);
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+static double stageEvalJit(BenchCtx *ctx, long iters) {
+  for (long i = 0; i < iters; i++) {
+    evalJitBatch(&ctx->expr->jit, ctx->xs, ctx->ys, EVAL_POINTS);
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+static double stageEvalFast(BenchCtx *ctx, long iters) {
+  for (long i = 0; i < iters; i++) {
+    evalProgramBatch(&ctx->expr->fastProg, ctx->xs, ctx->ys, EVAL_POINTS);
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+static double stageEvalJitFast(BenchCtx *ctx, long iters) {
+  for (long i = 0; i < iters; i++) {
+    evalJitBatch(&ctx->expr->fastJit, ctx->xs, ctx->ys, EVAL_POINTS);
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+/*============================================================================
+ * Стадии fn-libm и fn-fast: одна функция по точке (через указатель, как
+ * её вызывает JIT), fn-lanes - блоками по BATCH_LANES, как eval-batch
+ *===========================================================================*/
+static double stageFnLibm(BenchCtx *ctx, long iters) {
+  double (*fn)(double) = ctx->func->exact;
+  for (long i = 0; i < iters; i++) {
+    for (int k = 0; k < EVAL_POINTS; k++) {
+      ctx->ys[k] = fn(ctx->xs[k]);
+    }
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+static double stageFnFast(BenchCtx *ctx, long iters) {
+  double (*fn)(double) = ctx->func->fast;
+  for (long i = 0; i < iters; i++) {
+    for (int k = 0; k < EVAL_POINTS; k++) {
+      ctx->ys[k] = fn(ctx->xs[k]);
+    }
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+static double stageFnLanes(BenchCtx *ctx, long iters) {
+  for (long i = 0; i < iters; i++) {
+    memcpy(ctx->ys, ctx->xs, sizeof(ctx->ys));
+    for (int k = 0; k < EVAL_POINTS; k += BATCH_LANES) {
+      ctx->func->lanes(ctx->ys + k);
+    }
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+/*============================================================================
+ * Локальная функция: iters раз заполнить холст шириной ctx->width
+ * (и напечатать его, если frame). Возвращает число столбцов или кадров.
+ *===========================================================================*/
+static double stageCanvas(BenchCtx *ctx, long iters, EvalMode mode,
+                          ThreadPool *pool, int frame) {
+  Viewport view;
+  Canvas canvas;
+  FrameSink sink = {fileno(ctx->devnull), NULL, 0, 0, 0};  /* Без mmap */
+  initViewport(&view);
+  view.width = ctx->width;
+  initCanvas(&canvas, &view);
+  for (long i = 0; i < iters; i++) {
+    fillCanvas(&canvas, &ctx->expr->postfix, mode, pool);
+    if (frame) {
+      writeFrame(&sink, &canvas, 0);
+    }
+  }
+  freeCanvas(&canvas);
+  return frame ? (double)iters : (double)iters * ctx->width;
+}
+
+/*============================================================================
+ * Стадия frame: fillCanvas + writeFrame на холсте 80x25
+ *===========================================================================*/
+static double stageFrame(BenchCtx *ctx, long iters) {
+  return stageCanvas(ctx, iters, EVAL_BATCH, NULL, 1);  /* ms на кадр */
+}
+
+/*============================================================================
+ * Стадии fill-*: fillCanvas на разной ширине разными способами
+ *===========================================================================*/
+static double stageFillBatch(BenchCtx *ctx, long iters) {
+  return stageCanvas(ctx, iters, EVAL_BATCH, NULL, 0);  /* ns на столбец */
+}
+
+static double stageFillJit(BenchCtx *ctx, long iters) {
+  return stageCanvas(ctx, iters, EVAL_JIT, NULL, 0);
+}
+
+static double stageFillPool(BenchCtx *ctx, long iters) {
+  return stageCanvas(ctx, iters, EVAL_JIT, ctx->pool, 0);
+}
+
+static double stageFillInterval(BenchCtx *ctx, long iters) {
+  return stageCanvas(ctx, iters, EVAL_INTERVAL, NULL, 0);
+}
+
+/*============================================================================
+ * Стадия fill-adaptive: значение и производная на дуальных числах в узлах
+ * грубой сетки, пологие отрезки интерполируются, крутые делятся, крутые
+ * столбцы досчитываются (сравнивать с fill-interval; сколько вычислений
+ * это сберегло - evals-adaptive против evals-dense)
+ *===========================================================================*/
+static double stageFillAdaptive(BenchCtx *ctx, long iters) {
+  return stageCanvas(ctx, iters, EVAL_ADAPTIVE, NULL, 0);
+}
+
+/*============================================================================
+ * Локальная функция: счётная стадия - сколько раз выражение вычислено
+ * на столбец при одном заполнении холста ширины ctx->width способом
+ * mode. Время не замеряется: в строке таблицы одно и то же число.
+ *===========================================================================*/
+static void countEvaluations(BenchCtx *ctx, const char *stage, EvalMode mode,
+                             int tsv) {
+  Viewport view;
+  Canvas canvas;
+  initViewport(&view);
+  view.width = ctx->width;
+  initCanvas(&canvas, &view);
+  fillCanvasProgram(&canvas, &ctx->expr->prog, mode, NULL);
+  double perCol = (double)canvas.evaluations / ctx->width;
+  freeCanvas(&canvas);
+  printf(tsv ? "%s\t%s\t%d\t%s\t%.4g\t%.4g\t%.4g\t%.4g\t%.2f\n"
+             : "%-14s %-7s %7d %-10s %10.4g %10.4g %10.4g %10.4g %7.2f\n",
+         stage, ctx->expr->name, ctx->width, "evals/col", perCol, perCol,
+         perCol, perCol, 0.0);
+}
+
+/*============================================================================
+ * Стадия fill-heatmap: сетка f(x, y) ширины ctx->width и высоты 25,
+ * плитки строк делятся между потоками пула (ns на клетку)
+ *===========================================================================*/
+static double stageFillHeatmap(BenchCtx *ctx, long iters) {
+  Viewport view;
+  Canvas canvas;
+  initViewport(&view);
+  view.width = ctx->width;
+  initCanvas(&canvas, &view);
+  for (long i = 0; i < iters; i++) {
+    fillCanvasProgram(&canvas, &ctx->expr->prog, EVAL_HEATMAP, ctx->pool);
+  }
+  freeCanvas(&canvas);
+  return (double)iters * ctx->width * view.height;
+}
+
+/*============================================================================
+ * Стадия fill-series: BENCH_SERIES копий выражения на одном холсте
+ * за один проход по x (сравнивать с fill-batch: ns на столбец и график)
+ *===========================================================================*/
+static double stageFillSeries(BenchCtx *ctx, long iters) {
+  Program progs[BENCH_SERIES];      /* Копии структуры: байткод общий */
+  Viewport view;
+  Canvas canvas;
+  for (int s = 0; s < BENCH_SERIES; s++) {
+    progs[s] = ctx->expr->prog;
+  }
+  initViewport(&view);
+  view.width = ctx->width;
+  initCanvas(&canvas, &view);
+  for (long i = 0; i < iters; i++) {
+    fillCanvasPrograms(&canvas, progs, NULL, BENCH_SERIES, EVAL_BATCH, NULL);
+  }
+  freeCanvas(&canvas);
+  return (double)iters * ctx->width * BENCH_SERIES;
+}
+
+/*============================================================================
+ * Локальная функция: iters раз растеризовать на пустом холсте ширины
+ * ctx->width готовый ряд sin(x)*x/5 - только стадия растеризации,
+ * без вычисления (ns на столбец холста)
+ *===========================================================================*/
+static double stageRaster(BenchCtx *ctx, long iters, RasterStyle raster) {
+  Viewport view;
+  Viewport dots;
+  Canvas canvas;
+  initViewport(&view);
+  view.width = ctx->width;
+  view.raster = raster;
+  rasterGrid(&view, &dots);
+  double *ys = (double *)malloc(sizeof(double) * dots.width);
+  for (int c = 0; c < dots.width; c++) {
+    double x = columnX(&dots, c);
+    ys[c] = sin(x) * x / 5;
+  }
+  initCanvas(&canvas, &view);
+  for (long i = 0; i < iters; i++) {
+    clearRaster(&canvas);
+    rasterSeries(&canvas, ys, 0, (size_t)dots.width, '*');
+  }
+  freeCanvas(&canvas);
+  free(ys);
+  return (double)iters * ctx->width;
+}
+
+/*============================================================================
+ * Стадии raster-*: точки, вертикальные отрезки линий и точки Брайля 2x4
+ *===========================================================================*/
+static double stageRasterPoints(BenchCtx *ctx, long iters) {
+  return stageRaster(ctx, iters, RASTER_POINTS);
+}
+
+static double stageRasterLines(BenchCtx *ctx, long iters) {
+  return stageRaster(ctx, iters, RASTER_LINES);
+}
+
+static double stageRasterBraille(BenchCtx *ctx, long iters) {
+  return stageRaster(ctx, iters, RASTER_BRAILLE);
+}
+
+/*============================================================================
+ * Стадия pan: сдвиг на столбец туда-обратно с кэшем отсчётов,
+ * за кадр заново считаются и рисуются один столбец и стыки. С шириной
+ * растёт только сдвиг отсчётов и строк холста (memmove). Первый полный
+ * кадр делится на PAN_FRAMES сдвигов на повтор, чтобы почти не влиять
+ * на замер.
+ *===========================================================================*/
+static double stagePan(BenchCtx *ctx, long iters) {
+  Viewport view;
+  Canvas canvas;
+  SampleCache samples;
+  initViewport(&view);
+  view.width = ctx->width;
+  double step = (view.xMax - view.xMin) / (view.width - 1);
+  initCanvas(&canvas, &view);
+  initSampleCache(&samples);
+  fillCanvasSamples(&canvas, &ctx->expr->prog, NULL, EVAL_BATCH, NULL,
+                    &samples);
+  for (long i = 0; i < iters * PAN_FRAMES; i++) {
+    double shift = (i % 2 == 0) ? step : -step;
+    view.xMin += shift;
+    view.xMax += shift;
+    canvas.view = view;
+    fillCanvasSamples(&canvas, &ctx->expr->prog, NULL, EVAL_BATCH, NULL,
+                    &samples);
+  }
+  freeSampleCache(&samples);
+  freeCanvas(&canvas);
+  return (double)iters * PAN_FRAMES;  /* us на кадр */
+}
+
+/*============================================================================
+ * Локальная функция: сравнение double для qsort
+ *===========================================================================*/
+static int compareDouble(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/*============================================================================
+ * Локальная функция: перцентиль p (0..100) отсортированного массива
+ *===========================================================================*/
+static double percentile(const double *sorted, int n, double p) {
+  int idx = (int)ceil(p / 100.0 * n) - 1;
+  idx = (idx < 0) ? 0 : idx;
+  return sorted[idx];
+}
+
+/*============================================================================
+ * Локальная функция: замер одной стадии. Сначала подбирается число
+ * повторов, чтобы замер длился около SAMPLE_TARGET_NS, потом прогрев
+ * и samples замеров. Печатает мин/p50/p90/p99 на единицу и число
+ * выделений памяти на повтор.
+ *===========================================================================*/
+static void runStage(BenchCtx *ctx, const char *stage, const char *unit,
+                     double scale, StageFn fn, int samples, int tsv) {
+  long iters = 1;
+  while (iters < (1L << 30)) {      /* Калибровка числа повторов */
+    double start = nowNs();
+    fn(ctx, iters);
+    if (nowNs() - start >= SAMPLE_TARGET_NS) {
+      break;
+    }
+    iters *= 2;
+  }
+  for (int i = 0; i < WARMUP_SAMPLES; i++) {
+    fn(ctx, iters);
+  }
+  double *perUnit = (double *)malloc(sizeof(double) * samples);
+  unsigned long allocsBefore = allocCount;
+  for (int i = 0; i < samples; i++) {
+    double start = nowNs();
+    double units = fn(ctx, iters);
+    perUnit[i] = (nowNs() - start) * scale / (units > 0 ? units : 1.0);
+  }
+  double allocs = (double)(allocCount - allocsBefore) / samples / iters;
+  qsort(perUnit, samples, sizeof(double), compareDouble);
+  printf(tsv ? "%s\t%s\t%d\t%s\t%.4g\t%.4g\t%.4g\t%.4g\t%.2f\n"
+             : "%-14s %-7s %7d %-10s %10.4g %10.4g %10.4g %10.4g %7.2f\n",
+         stage, (ctx->func != NULL) ? ctx->func->name : ctx->expr->name,
+         ctx->width, unit, perUnit[0],
+         percentile(perUnit, samples, 50), percentile(perUnit, samples, 90),
+         percentile(perUnit, samples, 99), allocs);
+  fflush(stdout);
+  free(perUnit);
+}
+
+/*============================================================================
+ * Локальная функция: подготовка выражения (токены, дерево, ОПН, байткод, JIT)
+ *===========================================================================*/
+static void initBenchExpr(BenchExpr *e, const char *name, char *text) {
+  e->name = name;
+  e->text = text;
+  ExprAst ast;
+  initArena(&e->arena, exprArenaSize(strlen(text)));
+  initTokenArray(&e->infix);
+  initTokenArray(&e->postfix);
+  tokenize(text, &e->infix);
+  parseExpr(text, &e->arena, &ast);
+  foldAst(&ast);
+  lowerAst(&ast, &e->postfix);
+  initProgram(&e->prog);
+  compileAst(&ast, &e->prog);
+  compileJit(&e->prog, &e->jit);
+  copyProgram(&e->fastProg, &e->prog);
+  setProgramPrecision(&e->fastProg, 1, PRECISION_FAST);
+  compileJit(&e->fastProg, &e->fastJit);
+  char path[] = "/tmp/graph-bench-XXXXXX";
+  int fd = mkstemp(path);
+  LibraryWriter w;
+  initLibraryWriter(&w);
+  addLibraryFrame(&w, text, &e->prog, 1);
+  if (fd < 0 || !saveLibrary(&w, path) ||
+      !openProgramLibrary(&e->lib, path)) {
+    e->lib.programCount = 0;        /* Стадия load-library пропустится */
+  }
+  if (fd >= 0) {
+    close(fd);
+    unlink(path);                   /* Отображение остаётся */
+  }
+  freeLibraryWriter(&w);
+}
+
+/*============================================================================
+ * Локальная функция: освобождение всего, что подготовил initBenchExpr
+ *===========================================================================*/
+static void freeBenchExpr(BenchExpr *e) {
+  freeJit(&e->jit);
+  freeJit(&e->fastJit);
+  if (e->lib.programCount > 0) {
+    closeProgramLibrary(&e->lib);
+  }
+  freeProgram(&e->prog);
+  freeProgram(&e->fastProg);
+  freeTokenArray(&e->infix);
+  freeTokenArray(&e->postfix);
+  freeArena(&e->arena);
+  free(e->text);
+}
+
+/*============================================================================
+ * Локальная функция: копия строки в куче
+ *===========================================================================*/
+static char *copyText(const char *text) {
+  size_t len = strlen(text);
+  char *s = (char *)malloc(len + 1);
+  memcpy(s, text, len + 1);
+  return s;
+}
+
+/*============================================================================
+ * Локальная функция: длинное выражение sin(x*1)+cos(x*2)+... из n слагаемых
+ *===========================================================================*/
+static char *makeLongExpr(int n) {
+  char *s = (char *)malloc((size_t)n * 24 + 1);
+  size_t len = 0;
+  for (int i = 0; i < n; i++) {
+    len += (size_t)sprintf(s + len, "%s%s(x*%d)", (i > 0) ? "+" : "",
+                           (i % 2) ? "cos" : "sin", i + 1);
+  }
+  return s;
+}
+
+/*============================================================================
+ * Локальная функция: глубоко вложенное (x+(x+(...(x)...))) глубины depth
+ *===========================================================================*/
+static char *makeNestedExpr(int depth) {
+  char *s = (char *)malloc((size_t)depth * 5 + 2);
+  size_t len = 0;
+  for (int i = 0; i < depth; i++) {
+    memcpy(s + len, "(x+", 3);
+    len += 3;
+  }
+  s[len++] = 'x';
+  memset(s + len, ')', depth);
+  len += depth;
+  s[len] = '\0';
+  return s;
+}
+
+/*============================================================================
+ * Локальная функция: проверка быстрых функций против libm на
+ * ACCURACY_POINTS точках каждого отрезка kAccuracyRanges. Ошибка -
+ * |fast - libm|, делённая на max(1, |libm|): абсолютная около нуля,
+ * относительная у больших значений (tan у полюса, ln у 0 и
+ * бесконечности). Дорожки должны давать то же, что одно значение.
+ * Возвращает 0, если что-то не сошлось.
+ *===========================================================================*/
+static int checkAccuracy(void) {
+  int ok = 1;
+  printf("%-5s %10s %10s %12s %12s %8s\n", "func", "from", "to", "max error",
+         "at x", "lanes");
+  size_t count = sizeof(kAccuracyRanges) / sizeof(kAccuracyRanges[0]);
+  for (size_t r = 0; r < count; r++) {
+    const AccuracyRange *range = &kAccuracyRanges[r];
+    const BenchFunc *fn = &kBenchFuncs[range->func];
+    double worst = 0.0;
+    double worstX = range->lo;
+    int lanesOk = 1;
+    double a[BATCH_LANES];
+    for (int i = 0; i < ACCURACY_POINTS; i += BATCH_LANES) {
+      for (int l = 0; l < BATCH_LANES; l++) {
+        double t = (double)(i + l) / (ACCURACY_POINTS - 1);
+        a[l] = range->logScale
+                   ? range->lo * pow(range->hi / range->lo, t)
+                   : range->lo + (range->hi - range->lo) * t;
+      }
+      double x[BATCH_LANES];
+      memcpy(x, a, sizeof(x));
+      fn->lanes(a);
+      for (int l = 0; l < BATCH_LANES; l++) {
+        double exact = fn->exact(x[l]);
+        double fast = fn->fast(x[l]);
+        double err = fabs(fast - exact) / fmax(1.0, fabs(exact));
+        if (err > worst) {
+          worst = err;
+          worstX = x[l];
+        }
+        lanesOk = lanesOk && (a[l] == fast || (isnan(a[l]) && isnan(fast)));
+      }
+    }
+    printf("%-5s %10.4g %10.4g %12.3g %12.6g %8s\n", fn->name, range->lo,
+           range->hi, worst, worstX, lanesOk ? "same" : "DIFFER");
+    ok = ok && lanesOk && worst < 1e-10;
+  }
+  return ok;
+}
+
+/*-----------------------------------------------------------------------------
+ * Генератор случайных выражений для --jit-check: xorshift64 (одинаковая
+ * последовательность при каждом запуске) и текст в растущем буфере
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  unsigned long long state;   /* Состояние xorshift64, не 0 */
+  char *text;                 /* Текст выражения */
+  size_t len;
+  size_t capacity;
+} ExprGen;
+
+/*============================================================================
+ * Локальная функция: следующее псевдослучайное число
+ *===========================================================================*/
+static unsigned long long nextRandom(ExprGen *g) {
+  g->state ^= g->state << 13;
+  g->state ^= g->state >> 7;
+  g->state ^= g->state << 17;
+  return g->state;
+}
+
+/*============================================================================
+ * Локальная функция: дописать строку к тексту выражения
+ *===========================================================================*/
+static void genAppend(ExprGen *g, const char *s) {
+  size_t n = strlen(s);
+  if (g->len + n + 1 > g->capacity) {
+    g->capacity = (g->len + n + 1) * 2;
+    g->text = (char *)realloc(g->text, g->capacity);
+  }
+  memcpy(g->text + g->len, s, n + 1);
+  g->len += n;
+}
+
+/*============================================================================
+ * Локальная функция: лист выражения. Чаще x - тогда есть общие
+ * подвыражения (слоты); константы - в том числе 0 (деление на ноль,
+ * ln 0) и большие (переполнение в бесконечность).
+ *===========================================================================*/
+static void genLeaf(ExprGen *g) {
+  static const char *const kLeaves[] = {
+      "x", "x", "x", "0", "1", "2", "0.5", "3.25", "1000000", "0.000001",
+      "100000000000000000000000000000000000000000000000000000000000"};
+  genAppend(g, kLeaves[nextRandom(g) % (sizeof(kLeaves) /
+                                        sizeof(kLeaves[0]))]);
+}
+
+/*============================================================================
+ * Локальная функция: случайное выражение глубины не больше depth
+ *===========================================================================*/
+static void genExpr(ExprGen *g, int depth) {
+  static const char *const kFuncs[] = {"sin(", "cos(", "tan(", "ctg(",
+                                       "sqrt(", "ln("};
+  static const char *const kOps[] = {"+", "-", "*", "/"};
+  unsigned long long r = nextRandom(g);
+  if (depth == 0 || r % 8 == 0) {
+    genLeaf(g);
+  } else if (r % 8 < 3) {
+    genAppend(g, kFuncs[(r >> 8) % 6]);
+    genExpr(g, depth - 1);
+    genAppend(g, ")");
+  } else if (r % 8 == 3) {
+    genAppend(g, "-(");
+    genExpr(g, depth - 1);
+    genAppend(g, ")");
+  } else {
+    genAppend(g, "(");
+    genExpr(g, depth - 1);
+    genAppend(g, kOps[(r >> 8) % 4]);
+    genExpr(g, depth - 1);
+    genAppend(g, ")");
+  }
+}
+
+/*============================================================================
+ * Локальная функция: глубокое выражение "a op f(b op (... x ...))" -
+ * каждый уровень держит левый операнд на стеке, глубина стека около
+ * JIT_CHECK_DEEP
+ *===========================================================================*/
+static void genDeepExpr(ExprGen *g) {
+  static const char *const kOps[] = {"+(", "-(", "*(", "/(", "+sin(",
+                                     "*cos(", "-sqrt(", "/ln("};
+  for (int i = 0; i < JIT_CHECK_DEEP; i++) {
+    genLeaf(g);
+    genAppend(g, kOps[nextRandom(g) % 8]);
+  }
+  genAppend(g, "x");
+  for (int i = 0; i < JIT_CHECK_DEEP; i++) {
+    genAppend(g, ")");
+  }
+}
+
+/*============================================================================
+ * Локальная функция: совпадают ли два результата бит в бит. NaN равны
+ * любому NaN: полезная нагрузка NaN зависит от порядка операндов в
+ * команде, а он у компилятора и JIT может быть разным.
+ *===========================================================================*/
+static int sameBits(double a, double b) {
+  return (isnan(a) && isnan(b)) || memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+/*============================================================================
+ * Локальная функция: сравнить машинный код выражения с evalProgram во
+ * всех точках xs - по одной точке (evalJit) и пакетом (evalJitBatch).
+ * Печатает первое расхождение, пока всего их (reported) меньше
+ * JIT_CHECK_REPORT. Возвращает число расхождений.
+ *===========================================================================*/
+static long checkJitProgram(const char *text, const Program *prog,
+                            const double *xs, double *ys, int n,
+                            long reported) {
+  JitProgram jit;
+  long bad = 0;
+  compileJit(prog, &jit);
+  evalJitBatch(&jit, xs, ys, (size_t)n);
+  for (int i = 0; i < n; i++) {
+    double want = evalProgram(prog, xs[i]);
+    double one = evalJit(&jit, xs[i]);
+    if (!sameBits(want, one) || !sameBits(want, ys[i])) {
+      if (bad == 0 && reported < JIT_CHECK_REPORT) {
+        printf("MISMATCH %.60s%s at x = %.17g: evalProgram %.17g, "
+               "evalJit %.17g, evalJitBatch %.17g\n", text,
+               (strlen(text) > 60) ? "..." : "", xs[i], want, one, ys[i]);
+      }
+      bad++;
+    }
+  }
+  freeJit(&jit);
+  return bad;
+}
+
+/*============================================================================
+ * Локальная функция: точки проверки - особые значения (±0, ±inf, NaN,
+ * субнормальные, границы double, полюса tan) и случайные: на отрезке
+ * [-20, 20] и произвольные битовые образы
+ *===========================================================================*/
+static void fillCheckPoints(ExprGen *g, double *xs, int n) {
+  static const double kSpecial[] = {
+      0.0, -0.0, 1.0, -1.0, 0.5, M_PI / 2, -M_PI, 1e-310, -1e-310,
+      1e308, -1e308, 1.7976931348623157e308, 4.9e-324, INFINITY, -INFINITY,
+      NAN, -NAN, 1e6, -1e6, 1e20};
+  int special = (int)(sizeof(kSpecial) / sizeof(kSpecial[0]));
+  for (int i = 0; i < n; i++) {
+    unsigned long long r = nextRandom(g);
+    if (i < special) {
+      xs[i] = kSpecial[i];
+    } else if (i % 2) {
+      xs[i] = -20.0 + 40.0 * (double)(r >> 11) / 9007199254740992.0;
+    } else {
+      memcpy(&xs[i], &r, sizeof(xs[i]));
+    }
+  }
+}
+
+/*============================================================================
+ * Локальная функция: JIT против интерпретатора байткода бит в бит на
+ * случайных выражениях (обычная и быстрая точность) и глубоких, где стек
+ * не помещается в PROGRAM_SMALL_STACK. Выражение проходит весь разбор:
+ * дерево, свёртка, общие подвыражения. Возвращает 0 при расхождении.
+ *===========================================================================*/
+static int checkJit(void) {
+  ExprGen g = {0x9E3779B97F4A7C15ull, NULL, 0, 0};
+  double *xs = (double *)malloc(sizeof(double) * JIT_CHECK_POINTS);
+  double *ys = (double *)malloc(sizeof(double) * JIT_CHECK_POINTS);
+  long bad = 0;
+  long points = 0;
+  int compiled = 0;
+  int total = JIT_CHECK_EXPRS + JIT_CHECK_DEEP_EXPRS;
+  fillCheckPoints(&g, xs, JIT_CHECK_POINTS);
+  for (int e = 0; e < total; e++) {
+    g.len = 0;
+    genAppend(&g, "");
+    if (e < JIT_CHECK_EXPRS) {
+      genExpr(&g, 1 + (int)(nextRandom(&g) % JIT_CHECK_TREE_DEPTH));
+    } else {
+      genDeepExpr(&g);
+    }
+    Arena arena;
+    ExprAst ast;
+    Program prog;
+    Program fastProg;
+    initArena(&arena, exprArenaSize(g.len));
+    parseExpr(g.text, &arena, &ast);
+    foldAst(&ast);
+    initProgram(&prog);
+    compileAst(&ast, &prog);
+    copyProgram(&fastProg, &prog);
+    setProgramPrecision(&fastProg, 1, PRECISION_FAST);
+    JitProgram probe;
+    compiled += compileJit(&prog, &probe);
+    freeJit(&probe);
+    bad += checkJitProgram(g.text, &prog, xs, ys, JIT_CHECK_POINTS, bad);
+    bad += checkJitProgram(g.text, &fastProg, xs, ys, JIT_CHECK_POINTS, bad);
+    points += 2 * JIT_CHECK_POINTS;
+    freeProgram(&prog);
+    freeProgram(&fastProg);
+    freeArena(&arena);
+  }
+  printf("jit-check: %d expressions (%d compiled to machine code), "
+         "%ld points, %ld mismatches\n", total, compiled, points, bad);
+  free(g.text);
+  free(xs);
+  free(ys);
+  return bad == 0;
+}
+
+/*============================================================================
+ * Главная функция: замер всех стадий на наборе выражений.
+ * bench [--tsv] [--samples N]; --tsv - строки для diff между коммитами.
+ * bench --accuracy - только проверка быстрых функций против libm.
+ * bench --jit-check - только сравнение JIT с интерпретатором.
+ *===========================================================================*/
+int main(int argc, char **argv) {
+  static const int widths[] = {80, 1000, 10000, 100000};
+  int tsv = 0;
+  int samples = DEFAULT_SAMPLES;
+  int accuracy = 0;
+  int jitCheck = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--tsv")) {
+      tsv = 1;
+    } else if (!strcmp(argv[i], "--accuracy")) {
+      accuracy = 1;
+    } else if (!strcmp(argv[i], "--jit-check")) {
+      jitCheck = 1;
+    } else if (!strcmp(argv[i], "--samples") && i + 1 < argc) {
+      samples = atoi(argv[++i]);
+      samples = (samples > 0) ? samples : 1;
+    }
+  }
+  if (accuracy) {
+    return checkAccuracy() ? 0 : 1;
+  }
+  if (jitCheck) {
+    return checkJit() ? 0 : 1;
+  }
+  BenchExpr exprs[4];
+  initBenchExpr(&exprs[0], "short", copyText("sin(x)"));
+  initBenchExpr(&exprs[1], "medium", copyText(BENCH_EXPR));
+  initBenchExpr(&exprs[2], "long", makeLongExpr(LONG_TERMS));
+  initBenchExpr(&exprs[3], "nested", makeNestedExpr(NESTED_DEPTH));
+  BenchCtx *ctx = (BenchCtx *)malloc(sizeof(BenchCtx));
+  ThreadPool pool;                  /* По потоку на процессор */
+  int threads = initThreadPool(&pool, (int)sysconf(_SC_NPROCESSORS_ONLN));
+  ctx->pool = &pool;
+  ctx->func = NULL;
+  ctx->devnull = fopen("/dev/null", "w");
+  for (int k = 0; k < EVAL_POINTS; k++) {
+    ctx->xs[k] = 4.0 * M_PI * k / EVAL_POINTS;
+  }
+  if (!tsv) {
+    printf("threads: %d, samples: %d\n", threads, samples);
+    printf("medium: %s\n", BENCH_EXPR);
+    printf("%-14s %-7s %7s %-10s %10s %10s %10s %10s %7s\n", "stage", "expr",
+           "width", "unit", "min", "p50", "p90", "p99", "allocs");
+  } else {
+    printf("stage\texpr\twidth\tunit\tmin\tp50\tp90\tp99\tallocs\n");
+  }
+  for (int i = 0; i < 4; i++) {
+    ctx->expr = &exprs[i];
+    ctx->width = 80;
+    runStage(ctx, "tokenize", "ns/token", 1.0, stageTokenize, samples, tsv);
+    runStage(ctx, "parse-tokens", "ns/token", 1.0, stageParseTokens, samples,
+             tsv);
+    runStage(ctx, "parse", "ns/expr", 1.0, stageParse, samples, tsv);
+    runStage(ctx, "compile", "ns/expr", 1.0, stageCompile, samples, tsv);
+    runStage(ctx, "load-library", "ns/expr", 1.0, stageLoadLibrary, samples,
+             tsv);
+    runStage(ctx, "evalRPN", "ns/sample", 1.0, stageEvalRPN, samples, tsv);
+    runStage(ctx, "eval-batch", "ns/sample", 1.0, stageEvalBatch, samples,
+             tsv);
+    runStage(ctx, "eval-jit", "ns/sample", 1.0, stageEvalJit, samples, tsv);
+    runStage(ctx, "eval-fast", "ns/sample", 1.0, stageEvalFast, samples,
+             tsv);
+    runStage(ctx, "eval-jit-fast", "ns/sample", 1.0, stageEvalJitFast,
+             samples, tsv);
+    runStage(ctx, "frame", "ms/frame", 1e-6, stageFrame, samples, tsv);
+  }
+  ctx->width = 80;
+  for (size_t f = 0; f < sizeof(kBenchFuncs) / sizeof(kBenchFuncs[0]); f++) {
+    ctx->func = &kBenchFuncs[f];    /* libm против быстрых замен */
+    runStage(ctx, "fn-libm", "ns/sample", 1.0, stageFnLibm, samples, tsv);
+    runStage(ctx, "fn-fast", "ns/sample", 1.0, stageFnFast, samples, tsv);
+    runStage(ctx, "fn-lanes", "ns/sample", 1.0, stageFnLanes, samples, tsv);
+  }
+  ctx->func = NULL;
+  ctx->expr = &exprs[1];            /* Ширина холста - на среднем */
+  for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+    ctx->width = widths[i];
+    runStage(ctx, "fill-batch", "ns/col", 1.0, stageFillBatch, samples, tsv);
+    runStage(ctx, "fill-jit", "ns/col", 1.0, stageFillJit, samples, tsv);
+    runStage(ctx, "fill-pool", "ns/col", 1.0, stageFillPool, samples, tsv);
+    runStage(ctx, "fill-interval", "ns/col", 1.0, stageFillInterval, samples,
+             tsv);
+    runStage(ctx, "fill-adaptive", "ns/col", 1.0, stageFillAdaptive, samples,
+             tsv);
+    countEvaluations(ctx, "evals-dense", EVAL_BATCH, tsv);
+    countEvaluations(ctx, "evals-adaptive", EVAL_ADAPTIVE, tsv);
+    runStage(ctx, "fill-series", "ns/col", 1.0, stageFillSeries, samples,
+             tsv);
+    runStage(ctx, "fill-heatmap", "ns/cell", 1.0, stageFillHeatmap, samples,
+             tsv);
+    runStage(ctx, "raster-points", "ns/col", 1.0, stageRasterPoints,
+             samples, tsv);
+    runStage(ctx, "raster-lines", "ns/col", 1.0, stageRasterLines, samples,
+             tsv);
+    runStage(ctx, "raster-braille", "ns/col", 1.0, stageRasterBraille,
+             samples, tsv);
+    runStage(ctx, "pan", "us/frame", 1e-3, stagePan, samples, tsv);
+  }
+  fclose(ctx->devnull);
+  freeThreadPool(&pool);
+  free(ctx);
+  for (int i = 0; i < 4; i++) {
+    freeBenchExpr(&exprs[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,243 @@
+#include "graph.h"
+
+#include <float.h>                       /* DBL_MIN, DBL_MAX */
+
+/* Округление к целому прибавлением 1.5 * 2^52 (при |v| < 2^51) */
+#define ROUND_MAGIC 6755399441055744.0
+
+/* 2/pi и pi/2 из трёх частей (fdlibm): k * PIO2_1 и k * PIO2_2 точны
+ * при |k| < 2^20 */
+#define TWO_OVER_PI 6.36619772367581382433e-01
+#define PIO2_1 1.57079632673412561417e+00
+#define PIO2_2 6.07710050630396597660e-11
+#define PIO2_3 2.02226624879595063154e-21
+
+/* Минимаксные многочлены на [-pi/4, pi/4]: sin - до r^9 (ошибка
+ * 2.4e-12), cos - до r^10 (ошибка 1e-13) */
+#define SIN_1 -0.16666666627999049
+#define SIN_2 0.0083333282387153366
+#define SIN_3 -0.00019839043770329736
+#define SIN_4 2.7160140157145634e-06
+#define COS_1 0.041666666622827225
+#define COS_2 -0.0013888883753335099
+#define COS_3 2.4799519990221825e-05
+#define COS_4 -2.7210236378867672e-07
+
+/* ln(m) = 2s + s^3 * P(s^2), s = (m-1)/(m+1), m в [sqrt(1/2), sqrt(2)):
+ * ошибка многочлена 1e-12 */
+#define LOG_1 0.66666665085294752
+#define LOG_2 0.40000433871016577
+#define LOG_3 0.28532066962387914
+#define LOG_4 0.23668787274500433
+
+/* Биты sqrt(1/2): от них отсчитывается порядок в fastLog */
+#define LOG_OFFSET 0x3fe6a09e667f3bcdULL
+
+/* ln 2 из двух частей: k * LN2_HI точно */
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+
+/*============================================================================
+ * Локальная функция: приведение x = r + k*pi/2, |r| <= pi/4. Четверть
+ * (k + shift) mod 4 раскладывается на *odd (нечётная: sin и cos меняются
+ * местами) и *half (2-я или 3-я: знак минус) - числа 0 или 1, чтобы
+ * выбирать умножением: сравнения в цикле по дорожкам компилятор
+ * превращает в ветвления, и он не векторизуется.
+ *===========================================================================*/
+static inline double reduceQuarter(double x, double shift, double *odd,
+                                   double *half) {
+  double k = (x * TWO_OVER_PI + ROUND_MAGIC) - ROUND_MAGIC;
+  double t = k + shift;
+  t -= 4.0 * (((t * 0.25 - 0.375) + ROUND_MAGIC) - ROUND_MAGIC);  /* 0..3 */
+  *half = ((t * 0.5 - 0.25) + ROUND_MAGIC) - ROUND_MAGIC;  /* floor(t/2) */
+  *odd = t - 2.0 * *half;
+  return ((x - k * PIO2_1) - k * PIO2_2) - k * PIO2_3;
+}
+
+/*============================================================================
+ * Локальные функции: sin и cos на [-pi/4, pi/4]
+ *===========================================================================*/
+static inline double sinPoly(double r) {
+  double r2 = r * r;
+  return r + r * r2 * (SIN_1 + r2 * (SIN_2 + r2 * (SIN_3 + r2 * SIN_4)));
+}
+
+static inline double cosPoly(double r) {
+  double r2 = r * r;
+  return 1.0 - 0.5 * r2 +
+         r2 * r2 * (COS_1 + r2 * (COS_2 + r2 * (COS_3 + r2 * COS_4)));
+}
+
+/*============================================================================
+ * Локальные функции: ядра sin, cos, tg, ctg для |x| <= FAST_TRIG_MAX.
+ * cos(x) = sin(x + pi/2) - та же r, четверть на 1 дальше. Умножения на
+ * 0 и 1 точны, поэтому выбор ничего не округляет.
+ *===========================================================================*/
+static inline double sinKernel(double x) {
+  double odd = 0.0;
+  double half = 0.0;
+  double r = reduceQuarter(x, 0.0, &odd, &half);
+  return (1.0 - 2.0 * half) * (odd * cosPoly(r) + (1.0 - odd) * sinPoly(r));
+}
+
+static inline double cosKernel(double x) {
+  double odd = 0.0;
+  double half = 0.0;
+  double r = reduceQuarter(x, 1.0, &odd, &half);
+  return (1.0 - 2.0 * half) * (odd * cosPoly(r) + (1.0 - odd) * sinPoly(r));
+}
+
+static inline double tanKernel(double x) {
+  double odd = 0.0;
+  double half = 0.0;
+  double r = reduceQuarter(x, 0.0, &odd, &half);
+  double s = sinPoly(r);
+  double c = cosPoly(r);
+  return ((1.0 - odd) * s - odd * c) / ((1.0 - odd) * c + odd * s);
+}
+
+static inline double ctgKernel(double x) {
+  double odd = 0.0;
+  double half = 0.0;
+  double r = reduceQuarter(x, 0.0, &odd, &half);
+  double s = sinPoly(r);
+  double c = cosPoly(r);
+  return ((1.0 - odd) * c - odd * s) / ((1.0 - odd) * s + odd * c);
+}
+
+/*============================================================================
+ * Локальная функция: sin (shift = 0) или cos (shift = 1) одного значения.
+ * Без векторизации ветвление дешевле второго многочлена.
+ *===========================================================================*/
+static inline double trigScalar(double x, double shift) {
+  double odd = 0.0;
+  double half = 0.0;
+  double r = reduceQuarter(x, shift, &odd, &half);
+  double v = (odd != 0.0) ? cosPoly(r) : sinPoly(r);
+  return (half != 0.0) ? -v : v;
+}
+
+/*============================================================================
+ * Локальная функция: ядро ln для нормальных положительных x.
+ * x = 2^k * m, m в [sqrt(1/2), sqrt(2)); k выделяется целыми операциями
+ * над битами (без преобразования int64 -> double, которого нет в SSE2).
+ *===========================================================================*/
+static inline double logKernel(double x) {
+  uint64_t bits = 0;
+  memcpy(&bits, &x, sizeof(bits));
+  uint64_t tmp = bits - LOG_OFFSET;
+  uint64_t k = ((tmp >> 52) ^ 0x800) - 0x800;  /* Порядок со знаком */
+  uint64_t mBits = bits - (k << 52);
+  uint64_t kBits = k + 0x4338000000000000ULL;  /* ROUND_MAGIC + k */
+  double m = 0.0;
+  double kd = 0.0;
+  memcpy(&m, &mBits, sizeof(m));
+  memcpy(&kd, &kBits, sizeof(kd));
+  kd -= ROUND_MAGIC;
+  double f = m - 1.0;
+  double s = f / (2.0 + f);
+  double s2 = s * s;
+  double lnm = 2.0 * s +
+               s * s2 * (LOG_1 + s2 * (LOG_2 + s2 * (LOG_3 + s2 * LOG_4)));
+  return kd * LN2_HI + (lnm + kd * LN2_LO);
+}
+
+/*============================================================================
+ * Локальная функция: 1 / tan(x) из libm (для значений вне ядра ctg)
+ *===========================================================================*/
+static double exactCtg(double x) {
+  return 1.0 / tan(x);
+}
+
+/*============================================================================
+ * Локальная функция: дорожки, где |x| > FAST_TRIG_MAX (или x не число),
+ * пересчитываются через libm
+ *===========================================================================*/
+static void fixFarTrig(double *a, const double *x, double (*exact)(double)) {
+  for (int l = 0; l < BATCH_LANES; l++) {
+    if (!(fabs(x[l]) <= FAST_TRIG_MAX)) {
+      a[l] = exact(x[l]);
+    }
+  }
+}
+
+/*============================================================================
+ * Быстрые sin, cos, tg, ctg, ln одного значения (--precision fast).
+ * Абсолютная ошибка sin и cos не больше 3e-12 при |x| <= FAST_TRIG_MAX,
+ * дальше и на особых значениях - libm. У tg и ctg ошибка - как у частного
+ * sin/cos (относительная 1e-11 вдали от полюсов). Ошибка ln - 1e-12
+ * (абсолютная при |ln x| < 1, иначе относительная).
+ *===========================================================================*/
+double fastSin(double x) {
+  return (fabs(x) <= FAST_TRIG_MAX) ? trigScalar(x, 0.0) : sin(x);
+}
+
+double fastCos(double x) {
+  return (fabs(x) <= FAST_TRIG_MAX) ? trigScalar(x, 1.0) : cos(x);
+}
+
+double fastTan(double x) {
+  return (fabs(x) <= FAST_TRIG_MAX) ? tanKernel(x) : tan(x);
+}
+
+double fastCtg(double x) {
+  return (fabs(x) <= FAST_TRIG_MAX) ? ctgKernel(x) : exactCtg(x);
+}
+
+double fastLog(double x) {
+  return (x >= DBL_MIN && x <= DBL_MAX) ? logKernel(x) : log(x);
+}
+
+/*============================================================================
+ * То же над BATCH_LANES значениями на месте. Основной цикл без ветвлений
+ * и вызовов компилятор векторизует (SSE2/AVX), редкие значения вне ядра
+ * пересчитываются вторым проходом.
+ *===========================================================================*/
+void fastSinLanes(double *restrict a) {
+  double x[BATCH_LANES];
+  memcpy(x, a, sizeof(x));
+  for (int l = 0; l < BATCH_LANES; l++) {
+    a[l] = sinKernel(x[l]);
+  }
+  fixFarTrig(a, x, sin);
+}
+
+void fastCosLanes(double *restrict a) {
+  double x[BATCH_LANES];
+  memcpy(x, a, sizeof(x));
+  for (int l = 0; l < BATCH_LANES; l++) {
+    a[l] = cosKernel(x[l]);
+  }
+  fixFarTrig(a, x, cos);
+}
+
+void fastTanLanes(double *restrict a) {
+  double x[BATCH_LANES];
+  memcpy(x, a, sizeof(x));
+  for (int l = 0; l < BATCH_LANES; l++) {
+    a[l] = tanKernel(x[l]);
+  }
+  fixFarTrig(a, x, tan);
+}
+
+void fastCtgLanes(double *restrict a) {
+  double x[BATCH_LANES];
+  memcpy(x, a, sizeof(x));
+  for (int l = 0; l < BATCH_LANES; l++) {
+    a[l] = ctgKernel(x[l]);
+  }
+  fixFarTrig(a, x, exactCtg);
+}
+
+void fastLogLanes(double *restrict a) {
+  double x[BATCH_LANES];
+  memcpy(x, a, sizeof(x));
+  for (int l = 0; l < BATCH_LANES; l++) {
+    a[l] = logKernel(x[l]);
+  }
+  for (int l = 0; l < BATCH_LANES; l++) {
+    if (!(x[l] >= DBL_MIN && x[l] <= DBL_MAX)) {
+      a[l] = log(x[l]);             /* 0, отрицательные, inf, NaN, денормали */
+    }
+  }
+}
@@ -1,5 +1,7 @@
 #include "graph.h"
 
+#include <stdatomic.h>                   /* Счётчик вычислений из потоков */
+
 /*============================================================================
  * Инициализация динамического массива токенов
  *===========================================================================*/
@@ -7,13 +9,32 @@ void initTokenArray(TokenArray *arr) {
   arr->size = 0;                /* Начинаем с нулевого количества */
   arr->capacity = 16;           /* Первая емкость (16) */
   arr->data = (Token *)malloc(sizeof(Token) * arr->capacity);
+  arr->arena = NULL;            /* Память из кучи */
+  arr->depth = 0;               /* Глубину посчитает lowerAst */
+}
+
+/*============================================================================
+ * Инициализация массива токенов в арене сразу на cap элементов
+ *===========================================================================*/
+void initTokenArrayArena(TokenArray *arr, Arena *arena, int cap) {
+  arr->size = 0;
+  arr->capacity = (cap > 0) ? cap : 1;
+  arr->data = (Token *)arenaAlloc(arena, sizeof(Token) * arr->capacity);
+  arr->arena = arena;
+  arr->depth = 0;
 }
 
 /*============================================================================
  * Добавление одного токена в динамический массив (с увеличением capacity)
  *===========================================================================*/
 void pushTokenArray(TokenArray *arr, Token t) {
-  if (arr->size == arr->capacity) {                        /* Если места нет */
+  if (arr->size == arr->capacity && arr->arena != NULL) {  /* Арена: копия */
+    Token *grown = (Token *)arenaAlloc(arr->arena,
+                                       sizeof(Token) * 2 * arr->capacity);
+    memcpy(grown, arr->data, sizeof(Token) * arr->size);
+    arr->data = grown;
+    arr->capacity *= 2;
+  } else if (arr->size == arr->capacity) {                 /* Если места нет */
     arr->capacity *= 2;                                    /* Увеличиваем в 2 раза */
     arr->data = (Token *)realloc(arr->data, sizeof(Token) * arr->capacity);
   }
@@ -25,75 +46,14 @@ void pushTokenArray(TokenArray *arr, Token t) {
  * Освобождение памяти динамического массива токенов
  *===========================================================================*/
 void freeTokenArray(TokenArray *arr) {
-  free(arr->data);           /* Отдаём память системе */
+  if (arr->arena == NULL) {
+    free(arr->data);         /* Отдаём память системе (арена - сама) */
+  }
   arr->data = NULL;          /* Чтобы не остался висячий указатель */
   arr->size = 0;
   arr->capacity = 0;
 }
 
-/*============================================================================
- * Инициализация стека токенов
- *===========================================================================*/
-void initTokenStack(TokenStack *st, int cap) {
-  st->data = (Token *)malloc(sizeof(Token) * cap);
-  st->top = -1;              /* Пока стек пуст */
-  st->capacity = cap;        /* Запоминаем максимальную вместимость */
-}
-
-/*============================================================================
- * Добавление (push) токена на вершину стека
- *===========================================================================*/
-void pushTokenStack(TokenStack *st, Token t) {
-  if (st->top < st->capacity - 1) {  /* Проверяем, не переполнен ли стек */
-    st->top++;                       /* Сдвигаем вершину на 1 */
-    st->data[st->top] = t;          /* Кладём токен */
-  }
-}
-
-/*============================================================================
- * Извлечение (pop) токена с вершины стека
- *===========================================================================*/
-Token popTokenStack(TokenStack *st) {
-  Token tmp;                     /* Временная переменная */
-  tmp.type = TOKEN_PLUS;         /* Некий дефолтный тип */
-  tmp.value = 0.0;
-  if (st->top >= 0) {            /* Если стек не пуст */
-    tmp = st->data[st->top];     /* Берём вершину */
-    st->top--;                   /* Сдвигаем указатель вниз */
-  }
-  return tmp;                    /* Один возврат */
-}
-
-/*============================================================================
- * Посмотреть (peek) токен на вершине стека без удаления
- *===========================================================================*/
-Token peekTokenStack(const TokenStack *st) {
-  Token tmp;
-  tmp.type = TOKEN_PLUS;
-  tmp.value = 0.0;
-  if (st->top >= 0) {
-    tmp = st->data[st->top];
-  }
-  return tmp;
-}
-
-/*============================================================================
- * Проверка, пуст ли стек
- *===========================================================================*/
-int isStackEmpty(const TokenStack *st) {
-  return (st->top < 0);         /* Единственное условие */
-}
-
-/*============================================================================
- * Освобождение стека (выделенной памяти)
- *===========================================================================*/
-void freeTokenStack(TokenStack *st) {
-  free(st->data);
-  st->data = NULL;
-  st->top = -1;
-  st->capacity = 0;
-}
-
 /*============================================================================
  * Функция возвращает приоритет оператора
  *===========================================================================*/
@@ -133,6 +93,13 @@ int isOperator(TokenType t) {
   return r;
 }
 
+/*============================================================================
+ * Проверка, является ли токен операндом (число, x или переменная)
+ *===========================================================================*/
+int isOperand(TokenType t) {
+  return (t == TOKEN_NUMBER || t == TOKEN_X || t == TOKEN_VAR);
+}
+
 /*============================================================================
  * Создание токена (type, value)
  *===========================================================================*/
@@ -143,135 +110,442 @@ Token makeToken(TokenType type, double val) {
   return tmp;
 }
 
+/* Точные степени десяти: double хранит их без округления до 1e22 */
+static const double kPow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+/*============================================================================
+ * Локальная функция: число вида 12, 1.5, .5, 2e-3 прямо в строке, без
+ * копии. Цифры копятся в целом, порядок - отдельно; если целое не больше
+ * 2^53, а порядок не больше 22, результат - одно точное умножение или
+ * деление (как у strtod). Иначе тот же отрезок разбирает strtod.
+ * Возвращает длину записи числа.
+ *===========================================================================*/
+static int readNumber(const char *s, double *value) {
+  unsigned long long mant = 0;
+  int digits = 0;                   /* Значащих цифр в mant */
+  int exp10 = 0;                    /* Порядок после точки и e */
+  int n = 0;
+  for (; s[n] >= '0' && s[n] <= '9'; n++) {
+    if (digits < 19) {
+      mant = mant * 10 + (unsigned)(s[n] - '0');
+      digits += (mant > 0);         /* Ведущие нули не считаются */
+    } else {
+      exp10++;                      /* Лишние цифры - только порядок */
+    }
+  }
+  if (s[n] == '.') {
+    for (n++; s[n] >= '0' && s[n] <= '9'; n++) {
+      if (digits < 19) {
+        mant = mant * 10 + (unsigned)(s[n] - '0');
+        digits += (mant > 0);
+        exp10--;
+      }
+    }
+  }
+  int expLen = 0;                   /* Длина "e-12", если она есть */
+  if (s[n] == 'e' || s[n] == 'E') {
+    int k = n + 1;
+    int sign = 1;
+    if (s[k] == '+' || s[k] == '-') {
+      sign = (s[k] == '-') ? -1 : 1;
+      k++;
+    }
+    int e = 0;
+    for (; s[k] >= '0' && s[k] <= '9'; k++) {
+      e = (e < 10000) ? e * 10 + (s[k] - '0') : e;
+    }
+    if (s[k - 1] >= '0' && s[k - 1] <= '9') {  /* "2e" без цифр - не порядок */
+      expLen = k - n;
+      exp10 += sign * e;
+    }
+  }
+  if (mant == 0) {
+    *value = 0.0;
+  } else if (mant <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+    *value = (exp10 >= 0) ? (double)mant * kPow10[exp10]
+                          : (double)mant / kPow10[-exp10];
+  } else {
+    *value = strtod(s, NULL);       /* Редкий случай: длинное или огромное */
+  }
+  return n + expLen;
+}
+
+/*============================================================================
+ * Локальная функция: имя функции в начале строки s (выбор по первой
+ * букве, затем сравнение хвоста). Возвращает длину имени или 0, а тип
+ * пишет в *type.
+ *===========================================================================*/
+static int readFunction(const char *s, TokenType *type) {
+  int len = 0;
+  switch (s[0]) {
+    case 's':
+      if (s[1] == 'i' && s[2] == 'n') {
+        *type = TOKEN_SIN;
+        len = 3;
+      } else if (s[1] == 'q' && s[2] == 'r' && s[3] == 't') {
+        *type = TOKEN_SQRT;
+        len = 4;
+      }
+      break;
+    case 'c':
+      if (s[1] == 'o' && s[2] == 's') {
+        *type = TOKEN_COS;
+        len = 3;
+      } else if (s[1] == 't' && s[2] == 'g') {
+        *type = TOKEN_CTG;
+        len = 3;
+      }
+      break;
+    case 't':
+      if (s[1] == 'a' && s[2] == 'n') {
+        *type = TOKEN_TAN;
+        len = 3;
+      }
+      break;
+    case 'l':
+      if (s[1] == 'n') {
+        *type = TOKEN_LN;
+        len = 2;
+      }
+      break;
+    default:
+      break;
+  }
+  return len;
+}
+
 /*============================================================================
- * Локальная функция: чтение числа (в т.ч. с точкой) из строки
+ * Локальная функция: токен в начале строки s, выбор по первому символу.
+ * prev - предыдущий токен строки (NULL, если его нет): после оператора
+ * и "(" минус унарный. Буква, с которой не начинается имя функции, -
+ * переменная. Возвращает длину токена или 0, если символ непонятен.
  *===========================================================================*/
-static void readNumber(const char *str, int *i, TokenArray *arr) {
-  char buf[64];
-  int j = 0;
-  while ((str[*i] >= '0' && str[*i] <= '9') || str[*i] == '.') {
-    buf[j] = str[*i];
-    j++;
-    (*i)++;
+static int readToken(const char *s, const Token *prev, Token *t) {
+  int len = 1;
+  t->value = 0.0;
+  switch (s[0]) {
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9': case '.':
+      t->type = TOKEN_NUMBER;
+      len = readNumber(s, &t->value);
+      break;
+    case 'x':
+      t->type = TOKEN_X;
+      break;
+    case '+':
+      t->type = TOKEN_PLUS;
+      break;
+    case '-':
+      t->type = (prev == NULL || isOperator(prev->type) ||
+                 prev->type == TOKEN_LPAREN) ? TOKEN_UMINUS : TOKEN_MINUS;
+      break;
+    case '*':
+      t->type = TOKEN_MULT;
+      break;
+    case '/':
+      t->type = TOKEN_DIV;
+      break;
+    case '(':
+      t->type = TOKEN_LPAREN;
+      break;
+    case ')':
+      t->type = TOKEN_RPAREN;
+      break;
+    default:
+      len = readFunction(s, &t->type);
+      if (len == 0 && s[0] >= 'a' && s[0] <= 'z') {
+        t->type = TOKEN_VAR;
+        t->value = (double)(s[0] - 'a');
+        len = 1;
+      }
+      break;
   }
-  buf[j] = '\0';
-  pushTokenArray(arr, makeToken(TOKEN_NUMBER, atof(buf)));
+  return len;
+}
+
+/*============================================================================
+ * Токен в начале строки s для разбора в дерево. Минус здесь всегда
+ * TOKEN_UMINUS: унарный он или бинарный, решает парсер по месту.
+ * Возвращает длину токена или 0, если символ непонятен.
+ *===========================================================================*/
+int lexToken(const char *s, Token *t) {
+  return readToken(s, NULL, t);
 }
 
 /*============================================================================
- * Локальная функция: добавление соответствующего токена-функции (sin/cos/...)
+ * Локальная функция: запомнить позицию column последнего токена
+ * потокового выражения
  *===========================================================================*/
-static void addFunctionToken(const char *str, int *i, TokenArray *arr) {
-  if (!strncmp(&str[*i], "sin", 3)) {
-    pushTokenArray(arr, makeToken(TOKEN_SIN, 0.0));
-    (*i) += 3;
-  } else if (!strncmp(&str[*i], "cos", 3)) {
-    pushTokenArray(arr, makeToken(TOKEN_COS, 0.0));
-    (*i) += 3;
-  } else if (!strncmp(&str[*i], "tan", 3)) {
-    pushTokenArray(arr, makeToken(TOKEN_TAN, 0.0));
-    (*i) += 3;
-  } else if (!strncmp(&str[*i], "ctg", 3)) {
-    pushTokenArray(arr, makeToken(TOKEN_CTG, 0.0));
-    (*i) += 3;
-  } else if (!strncmp(&str[*i], "sqrt", 4)) {
-    pushTokenArray(arr, makeToken(TOKEN_SQRT, 0.0));
-    (*i) += 4;
-  } else if (!strncmp(&str[*i], "ln", 2)) {
-    pushTokenArray(arr, makeToken(TOKEN_LN, 0.0));
-    (*i) += 2;
+static void recordColumn(LexStream *ls, long column) {
+  int i = ls->arr->size - 1 - ls->first;
+  if (i >= ls->columnsCap) {
+    ls->columnsCap = ls->columnsCap ? 2 * ls->columnsCap : 64;
+    ls->columns = (long *)realloc(ls->columns,
+                                  sizeof(long) * ls->columnsCap);
   }
+  ls->columns[i] = column;
 }
 
 /*============================================================================
- * Лексический разбор (строка -> массив токенов)
+ * Локальная функция: разбор строки str в конец arr за один проход.
+ * Выражение началось с токена first (он может быть из прошлого куска),
+ * от этого зависит, унарный ли минус. Непонятные символы пропускаются.
+ * Если ls не NULL, позиция каждого токена запоминается в нём.
+ * Возвращает позицию первого непонятного символа или -1.
  *===========================================================================*/
-void tokenize(const char *str, TokenArray *arr) {
+static int lexSpan(const char *str, TokenArray *arr, int first,
+                   LexStream *ls) {
+  TRACE_BEGIN(span);
+  TRACE_LOCAL(int startSize = arr->size;)
+  int errorPos = -1;
   int i = 0;
   while (str[i] != '\0') {
-    if (str[i] == ' ' || str[i] == '\t') {
-      i++;
-    } else if ((str[i] >= '0' && str[i] <= '9') || str[i] == '.') {
-      readNumber(str, &i, arr);
-    } else if (!strncmp(&str[i], "sin", 3) ||
-               !strncmp(&str[i], "cos", 3) ||
-               !strncmp(&str[i], "tan", 3) ||
-               !strncmp(&str[i], "ctg", 3) ||
-               !strncmp(&str[i], "sqrt", 4) ||
-               !strncmp(&str[i], "ln", 2)) {
-      addFunctionToken(str, &i, arr);
-    } else if (str[i] == 'x') {
-      pushTokenArray(arr, makeToken(TOKEN_X, 0.0));
-      i++;
-    } else if (str[i] == '+') {
-      pushTokenArray(arr, makeToken(TOKEN_PLUS, 0.0));
-      i++;
-    } else if (str[i] == '-') {
-      if (i == 0 || isOperator(arr->data[arr->size - 1].type) ||
-          arr->data[arr->size - 1].type == TOKEN_LPAREN) {
-        pushTokenArray(arr, makeToken(TOKEN_UMINUS, 0.0));
-      } else {
-        pushTokenArray(arr, makeToken(TOKEN_MINUS, 0.0));
+    int len = 1;                    /* Пробел или непонятный символ */
+    if (str[i] != ' ' && str[i] != '\t') {
+      const Token *prev =
+          (arr->size > first) ? &arr->data[arr->size - 1] : NULL;
+      Token t;
+      int n = readToken(&str[i], prev, &t);
+      if (n > 0) {
+        pushTokenArray(arr, t);
+        if (ls != NULL) {
+          recordColumn(ls, ls->offset + i);
+        }
+        len = n;
+      } else if (errorPos < 0) {
+        errorPos = i;
       }
-      i++;
-    } else if (str[i] == '*') {
-      pushTokenArray(arr, makeToken(TOKEN_MULT, 0.0));
-      i++;
-    } else if (str[i] == '/') {
-      pushTokenArray(arr, makeToken(TOKEN_DIV, 0.0));
-      i++;
-    } else if (str[i] == '(') {
-      pushTokenArray(arr, makeToken(TOKEN_LPAREN, 0.0));
-      i++;
-    } else if (str[i] == ')') {
-      pushTokenArray(arr, makeToken(TOKEN_RPAREN, 0.0));
-      i++;
-    } else {
-      i++;
     }
+    i += len;
   }
+  TRACE_COUNT(COUNTER_TOKENS, arr->size - startSize);
+  TRACE_END(span, STAGE_LEX);
+  return errorPos;
 }
 
 /*============================================================================
- * Перевод инфиксной записи в ОПН (Алгоритм сортировочной станции)
+ * Лексический разбор (строка -> массив токенов) за один проход.
+ * Непонятные символы пропускаются. Возвращает позицию первого из них
+ * или -1, если разобрана вся строка.
  *===========================================================================*/
-void toRPN(const TokenArray *infix, TokenArray *postfix) {
-  TokenStack stack;
-  initTokenStack(&stack, infix->size + 10);
-  for (int i = 0; i < infix->size; i++) {
-    Token t = infix->data[i];
-    if (t.type == TOKEN_NUMBER || t.type == TOKEN_X) {
-      pushTokenArray(postfix, t);
-    } else if (isFunction(t.type) || t.type == TOKEN_UMINUS) {
-      pushTokenStack(&stack, t);
-    } else if (isOperator(t.type)) {
-      while (!isStackEmpty(&stack) &&
-             isOperator(peekTokenStack(&stack).type) &&
-             precedence(peekTokenStack(&stack).type) >= precedence(t.type)) {
-        pushTokenArray(postfix, popTokenStack(&stack));
-      }
-      pushTokenStack(&stack, t);
-    } else if (t.type == TOKEN_LPAREN) {
-      pushTokenStack(&stack, t);
-    } else if (t.type == TOKEN_RPAREN) {
-      while (!isStackEmpty(&stack) &&
-             peekTokenStack(&stack).type != TOKEN_LPAREN) {
-        pushTokenArray(postfix, popTokenStack(&stack));
-      }
-      if (!isStackEmpty(&stack) &&
-          peekTokenStack(&stack).type == TOKEN_LPAREN) {
-        popTokenStack(&stack);
-      }
-      if (!isStackEmpty(&stack) &&
-          isFunction(peekTokenStack(&stack).type)) {
-        pushTokenArray(postfix, popTokenStack(&stack));
-      }
+int tokenize(const char *str, TokenArray *arr) {
+  return lexSpan(str, arr, arr->size, NULL);
+}
+
+/*============================================================================
+ * Начать потоковый разбор выражения, токены пойдут в конец arr
+ *===========================================================================*/
+void initLexStream(LexStream *ls, TokenArray *arr) {
+  ls->arr = arr;
+  ls->first = arr->size;
+  ls->tail = NULL;
+  ls->tailLen = 0;
+  ls->tailCap = 0;
+  ls->offset = 0;
+  ls->errorPos = -1;
+  ls->errorChar = '\0';
+  ls->columns = NULL;
+  ls->columnsCap = 0;
+}
+
+/*============================================================================
+ * Локальная функция: разобрать первые n символов хвоста и сдвинуть
+ * остаток в начало буфера
+ *===========================================================================*/
+static void lexTail(LexStream *ls, size_t n) {
+  char saved = ls->tail[n];
+  ls->tail[n] = '\0';               /* Временный конец строки */
+  int bad = lexSpan(ls->tail, ls->arr, ls->first, ls);
+  ls->tail[n] = saved;
+  if (bad >= 0 && ls->errorPos < 0) {
+    ls->errorPos = ls->offset + bad;
+    ls->errorChar = ls->tail[bad];
+  }
+  memmove(ls->tail, ls->tail + n, ls->tailLen - n);
+  ls->tailLen -= n;
+  ls->offset += (long)n;
+}
+
+/*============================================================================
+ * Локальная функция: можно ли резать кусок сразу после символа s[k].
+ * Ни один многосимвольный токен не содержит скобок, '*', '/', 'x' и
+ * пробелов; '+' и '-' - только в порядке числа ("2e-3").
+ *===========================================================================*/
+static int isLexBoundary(const char *s, size_t k) {
+  char c = s[k];
+  int ok = (c == '(' || c == ')' || c == '*' || c == '/' || c == 'x' ||
+            c == ' ' || c == '\t');
+  if (c == '+' || c == '-') {
+    ok = (k == 0 || (s[k - 1] != 'e' && s[k - 1] != 'E'));
+  }
+  return ok;
+}
+
+/*============================================================================
+ * Подать очередной кусок выражения (без '\0' на конце). Разбирается всё
+ * до последней границы токена, остаток ждёт следующего куска.
+ *===========================================================================*/
+void feedLexStream(LexStream *ls, const char *data, size_t n) {
+  if (ls->tailLen + n + 1 > ls->tailCap) {
+    ls->tailCap = ls->tailCap ? ls->tailCap : 256;
+    while (ls->tailLen + n + 1 > ls->tailCap) {
+      ls->tailCap *= 2;
     }
+    ls->tail = (char *)realloc(ls->tail, ls->tailCap);
+  }
+  memcpy(ls->tail + ls->tailLen, data, n);
+  ls->tailLen += n;
+  size_t cut = ls->tailLen;
+  while (cut > 0 && !isLexBoundary(ls->tail, cut - 1)) {
+    cut--;                          /* Последний токен может продолжиться */
+  }
+  if (cut > 0) {
+    lexTail(ls, cut);
+  }
+}
+
+/*============================================================================
+ * Закончить разбор: разобрать остаток и освободить буфер хвоста (позиции
+ * токенов остаются до freeLexStream).
+ * Возвращает позицию первого непонятного символа или -1.
+ *===========================================================================*/
+long finishLexStream(LexStream *ls) {
+  if (ls->tailLen > 0) {
+    lexTail(ls, ls->tailLen);
+  }
+  free(ls->tail);
+  ls->tail = NULL;
+  ls->tailCap = 0;
+  return ls->errorPos;
+}
+
+/*============================================================================
+ * Позиция в выражении токена номер token массива arr (так ошибку
+ * parseTokens можно показать в строке). Номер за последним токеном -
+ * конец выражения.
+ *===========================================================================*/
+long lexColumn(const LexStream *ls, long token) {
+  long i = token - ls->first;
+  return (i >= 0 && i < ls->arr->size - ls->first) ? ls->columns[i]
+                                                   : ls->offset;
+}
+
+/*============================================================================
+ * Освободить позиции токенов после finishLexStream
+ *===========================================================================*/
+void freeLexStream(LexStream *ls) {
+  free(ls->columns);
+  ls->columns = NULL;
+  ls->columnsCap = 0;
+}
+
+/*============================================================================
+ * Локальная функция: учесть токен ОПН в высоте стека вычисления *top и
+ * её максимуме *depth. Нехватка операндов делает *top отрицательным
+ * навсегда: такую ОПН вычислять нельзя.
+ *===========================================================================*/
+static void trackRPN(TokenType type, int *top, int *depth) {
+  if (*top < 0) {
+    *top = -1;                      /* Ошибка уже была */
+  } else if (isOperand(type)) {
+    (*top)++;
+    *depth = (*top > *depth) ? *top : *depth;
+  } else if (isFunction(type) || type == TOKEN_UMINUS) {
+    *top = (*top >= 1) ? *top : -1;
+  } else if (isOperator(type)) {
+    *top = (*top >= 2) ? *top - 1 : -1;
+  }
+}
+
+/*============================================================================
+ * Глубина стека, нужная для вычисления ОПН, или 0, если ОПН пуста или
+ * некорректна (операции не хватает операндов)
+ *===========================================================================*/
+int rpnDepth(const TokenArray *postfix) {
+  int top = 0;
+  int depth = 0;
+  for (int i = 0; i < postfix->size; i++) {
+    trackRPN(postfix->data[i].type, &top, &depth);
   }
-  while (!isStackEmpty(&stack)) {
-    pushTokenArray(postfix, popTokenStack(&stack));
+  return (top > 0) ? depth : 0;
+}
+
+/*============================================================================
+ * Сколько выражений в строке: они разделяются ';' ("sin(x); cos(x)")
+ *===========================================================================*/
+int countSeries(const char *text) {
+  int count = 1;
+  for (const char *p = strchr(text, ';'); p != NULL; p = strchr(p + 1, ';')) {
+    count++;
+  }
+  return count;
+}
+
+/*============================================================================
+ * Все параметры не заданы (NAN: выражение с ними не рисуется)
+ *===========================================================================*/
+void initVars(double *vars) {
+  for (int v = 0; v < VAR_COUNT; v++) {
+    vars[v] = NAN;
+  }
+}
+
+/*============================================================================
+ * Локальная функция: номер переменной по имени-букве или -1 (x - аргумент,
+ * а не параметр)
+ *===========================================================================*/
+static int varIndex(const char *name, size_t len) {
+  int v = -1;
+  if (len == 1 && name[0] >= 'a' && name[0] <= 'z' && name[0] != 'x') {
+    v = name[0] - 'a';
+  }
+  return v;
+}
+
+/*============================================================================
+ * Параметр из текста "a=1.5" в vars. Возвращает 0, если текст неверен.
+ *===========================================================================*/
+int parseVar(const char *text, double *vars) {
+  const char *eq = strchr(text, '=');
+  int v = (eq != NULL) ? varIndex(text, (size_t)(eq - text)) : -1;
+  char *end = NULL;
+  double value = (v >= 0) ? strtod(eq + 1, &end) : 0.0;
+  int ok = (v >= 0 && end != eq + 1 && *end == '\0');
+  if (ok) {
+    vars[v] = value;
+  }
+  return ok;
+}
+
+/*============================================================================
+ * Перебор из текста "a=FROM:TO:FRAMES". Возвращает 0, если текст неверен.
+ *===========================================================================*/
+int parseSweep(const char *text, ParamSweep *sweep) {
+  const char *eq = strchr(text, '=');
+  int v = (eq != NULL) ? varIndex(text, (size_t)(eq - text)) : -1;
+  ParamSweep s;
+  int used = 0;
+  int ok = v >= 0 && sscanf(eq + 1, "%lf:%lf:%d%n", &s.from, &s.to,
+                            &s.frames, &used) == 3 &&
+           eq[1 + used] == '\0' && s.frames >= 1;
+  if (ok) {
+    s.var = v;
+    *sweep = s;
+  }
+  return ok;
+}
+
+/*============================================================================
+ * Значение перебираемого параметра в кадре step (от 0 до frames - 1)
+ *===========================================================================*/
+void sweepVars(const ParamSweep *sweep, int step, double *vars) {
+  if (sweep->var >= 0) {
+    double t = (sweep->frames > 1)
+                   ? (double)step / (double)(sweep->frames - 1) : 0.0;
+    vars[sweep->var] = sweep->from + (sweep->to - sweep->from) * t;
   }
-  freeTokenStack(&stack);
 }
 
 /*============================================================================
@@ -296,12 +570,19 @@ double computeFunction(TokenType t, double val) {
 }
 
 /*============================================================================
- * Вычисление значения выражения в ОПН при подстановке x = xval
+ * Вычисление значения выражения в ОПН при подстановке x = xval.
+ * Стек размером postfix->depth; некорректная ОПН (depth == 0) - NAN.
+ * Остальные переменные здесь не заданы и тоже дают NAN.
  *===========================================================================*/
 double evalRPN(const TokenArray *postfix, double xval) {
-  double stack[256];
+  double small[RPN_STACK_SIZE];     /* Обычно хватает стека на кадре */
+  double *stack = small;
+  if (postfix->depth > RPN_STACK_SIZE) {
+    stack = (double *)malloc(sizeof(double) * postfix->depth);
+  }
   int top = -1;
-  int count = postfix->size;
+  int count = (postfix->depth > 0) ? postfix->size : 0;
+  TRACE_LOCAL(int highWater = -1;)  /* Наибольший top за вычисление */
   for (int i = 0; i < count; i++) {
     Token t = postfix->data[i];
     if (t.type == TOKEN_NUMBER) {
@@ -310,6 +591,9 @@ double evalRPN(const TokenArray *postfix, double xval) {
     } else if (t.type == TOKEN_X) {
       top++;
       stack[top] = xval;
+    } else if (t.type == TOKEN_VAR) {
+      top++;
+      stack[top] = NAN;
     } else if (t.type == TOKEN_UMINUS) {
       stack[top] = -stack[top];
     } else if (isOperator(t.type) && t.type != TOKEN_UMINUS) {
@@ -329,71 +613,738 @@ double evalRPN(const TokenArray *postfix, double xval) {
     } else if (isFunction(t.type)) {
       stack[top] = computeFunction(t.type, stack[top]);
     }
+    TRACE_LOCAL(highWater = (top > highWater) ? top : highWater;)
+  }
+  TRACE_MAX(COUNTER_RPN_STACK, highWater + 1);
+  double res = (top >= 0) ? stack[top] : NAN;
+  if (stack != small) {
+    free(stack);
+  }
+  return res; /* Единственный выход */
+}
+
+/*-----------------------------------------------------------------------------
+ * Общие данные для потоков, заполняющих холст
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  Canvas *canvas;             /* Холст (каждый поток пишет свои столбцы) */
+  const Program *prog;        /* Байткод выражений (count подряд) */
+  const JitProgram *jit;      /* Машинный код (count подряд) или NULL */
+  int count;                  /* Сколько выражений на холсте */
+  EvalMode mode;              /* Способ вычисления */
+  double *xs;                 /* x по столбцам */
+  double *ys;                 /* Значения: по ряду длины stride на выражение */
+  double *dys;                /* Производные так же (EVAL_ADAPTIVE) или NULL */
+  size_t stride;              /* Расстояние между рядами ys */
+  double dx;                  /* Шаг x между столбцами */
+  double rowScale;            /* Строк холста на единицу y */
+  atomic_long *evaluations;   /* Счётчик вычислений в точках или NULL */
+} FillJob;
+
+/* Значки выражений на общем холсте: первое рисуется звёздочкой */
+static const char kSeriesGlyphs[] = "*+ox#@%&=~";
+
+/*============================================================================
+ * Значок выражения номер s
+ *===========================================================================*/
+char seriesGlyph(int s) {
+  return kSeriesGlyphs[s % (int)(sizeof(kSeriesGlyphs) - 1)];
+}
+
+/*============================================================================
+ * Локальная функция: значения и производные выражения s в xs[begin, end)
+ * на дуальных числах. В EVAL_DERIVATIVE в ys идёт сама производная.
+ *===========================================================================*/
+static void evalDualSamples(FillJob *job, int s, size_t begin, size_t end) {
+  double *ys = job->ys + (size_t)s * job->stride;
+  for (size_t c = begin; c < end; c++) {
+    Dual r = evalProgramDual(&job->prog[s], job->xs[c]);
+    ys[c] = (job->mode == EVAL_DERIVATIVE) ? r.d : r.v;
+    if (job->dys != NULL) {
+      job->dys[(size_t)s * job->stride + c] = r.d;
+    }
+  }
+}
+
+/*============================================================================
+ * Локальная функция (задача пула): значения всех выражений в xs[begin, end)
+ *===========================================================================*/
+static void evalSamples(void *arg, size_t begin, size_t end) {
+  FillJob *job = (FillJob *)arg;
+  for (int s = 0; s < job->count; s++) {
+    double *ys = job->ys + (size_t)s * job->stride;
+    if (job->mode == EVAL_ADAPTIVE || job->mode == EVAL_DERIVATIVE) {
+      evalDualSamples(job, s, begin, end);
+    } else if (job->jit != NULL) {
+      evalJitBatch(&job->jit[s], job->xs + begin, ys + begin, end - begin);
+    } else {
+      evalProgramBatch(&job->prog[s], job->xs + begin, ys + begin,
+                       end - begin);
+    }
+  }
+}
+
+/*============================================================================
+ * Локальная функция (задача пула): x и значения функции в столбцах [begin, end).
+ * Выражения считаются блоками по SERIES_BLOCK_COLUMNS столбцов: блок x
+ * остаётся в L1, пока по нему проходят все выражения.
+ *===========================================================================*/
+static void sampleColumns(void *arg, size_t begin, size_t end) {
+  FillJob *job = (FillJob *)arg;
+  Viewport dots;                    /* Столбцы - точки сетки растеризации */
+  rasterGrid(&job->canvas->view, &dots);
+  for (size_t c = begin; c < end; c++) {
+    job->xs[c] = columnX(&dots, (int)c);
+  }
+  for (size_t b = begin; b < end; b += SERIES_BLOCK_COLUMNS) {
+    size_t blockEnd = b + SERIES_BLOCK_COLUMNS;
+    evalSamples(arg, b, (blockEnd < end) ? blockEnd : end);
+  }
+  if (job->evaluations != NULL) {
+    atomic_fetch_add(job->evaluations, (long)(end - begin) * job->count);
+  }
+}
+
+/*============================================================================
+ * Локальная функция: значение и производная выражения s в столбце c;
+ * store - записать их в ys и dys (столбец принадлежит задаче)
+ *===========================================================================*/
+static Dual sampleColumnDual(FillJob *job, int s, const Viewport *dots,
+                             size_t c, int store) {
+  Dual r = evalProgramDual(&job->prog[s], columnX(dots, (int)c));
+  if (store) {
+    job->ys[(size_t)s * job->stride + c] = r.v;
+    job->dys[(size_t)s * job->stride + c] = r.d;
+  }
+  return r;
+}
+
+/*============================================================================
+ * Локальная функция: столбцы строго между c0 и c1 по кубическому
+ * интерполянту Эрмита через значения и производные на концах
+ *===========================================================================*/
+static void interpolateSpan(FillJob *job, int s, size_t c0, Dual f0,
+                            size_t c1, Dual f1) {
+  double *ys = job->ys + (size_t)s * job->stride;
+  double *dys = job->dys + (size_t)s * job->stride;
+  double h = job->dx * (double)(c1 - c0);
+  for (size_t c = c0 + 1; c < c1; c++) {
+    double t = (double)(c - c0) / (double)(c1 - c0);
+    double t2 = t * t;
+    double t3 = t2 * t;
+    ys[c] = (2.0 * t3 - 3.0 * t2 + 1.0) * f0.v + (t3 - 2.0 * t2 + t) * h * f0.d +
+            (3.0 * t2 - 2.0 * t3) * f1.v + (t3 - t2) * h * f1.d;
+    dys[c] = f0.d + (f1.d - f0.d) * t;
+  }
+}
+
+/*============================================================================
+ * Локальная функция: столбцы между c0 и c1 выражения s, когда на концах
+ * уже есть значение и производная. Если кривая на отрезке сдвигается
+ * меньше чем на строку (и по разности значений, и по |f'| * ширина),
+ * столбцы внутри интерполируются без вычислений, иначе отрезок делится
+ * пополам. NaN и бесконечности делят его до соседних столбцов.
+ * Возвращает число вычислений.
+ *===========================================================================*/
+static long refineSpan(FillJob *job, int s, const Viewport *dots, size_t c0,
+                       Dual f0, size_t c1, Dual f1) {
+  long evals = 0;
+  if (c1 - c0 >= 2) {
+    double slope = fmax(fabs(f0.d), fabs(f1.d)) * job->dx * (double)(c1 - c0);
+    double rows = fmax(slope, fabs(f1.v - f0.v)) * job->rowScale;
+    if (rows <= 1.0) {              /* NaN сравнение не проходит */
+      interpolateSpan(job, s, c0, f0, c1, f1);
+    } else {
+      size_t m = c0 + (c1 - c0) / 2;
+      Dual fm = sampleColumnDual(job, s, dots, m, 1);
+      evals = 1 + refineSpan(job, s, dots, c0, f0, m, fm) +
+              refineSpan(job, s, dots, m, fm, c1, f1);
+    }
+  }
+  return evals;
+}
+
+/*============================================================================
+ * Локальная функция (задача пула): адаптивные отсчёты в столбцах
+ * [begin, end). Значение и производная считаются в узлах грубой сетки
+ * через ADAPTIVE_SPAN столбцов, отрезки между ними - refineSpan.
+ * Правый конец последнего отрезка задачи - первый столбец следующей:
+ * он считается, но не записывается.
+ *===========================================================================*/
+static void sampleAdaptive(void *arg, size_t begin, size_t end) {
+  FillJob *job = (FillJob *)arg;
+  Viewport dots;
+  rasterGrid(&job->canvas->view, &dots);
+  size_t last = (end < (size_t)dots.width) ? end : (size_t)dots.width - 1;
+  long evals = 0;
+  for (size_t c = begin; c < end; c++) {
+    job->xs[c] = columnX(&dots, (int)c);
+  }
+  for (int s = 0; s < job->count; s++) {
+    Dual left = sampleColumnDual(job, s, &dots, begin, 1);
+    evals++;
+    for (size_t c0 = begin; c0 < last;) {
+      size_t c1 = (last - c0 > ADAPTIVE_SPAN) ? c0 + ADAPTIVE_SPAN : last;
+      Dual right = sampleColumnDual(job, s, &dots, c1, c1 < end);
+      evals += 1 + refineSpan(job, s, &dots, c0, left, c1, right);
+      left = right;
+      c0 = c1;
+    }
+  }
+  atomic_fetch_add(job->evaluations, evals);
+}
+
+/*============================================================================
+ * Область просмотра по умолчанию: 80x25, x от 0 до 4*pi, y от -1 до 1
+ *===========================================================================*/
+void initViewport(Viewport *view) {
+  view->width = 80;
+  view->height = 25;
+  view->xMin = 0.0;
+  view->xMax = 4.0 * M_PI;
+  view->yMin = -1.0;
+  view->yMax = 1.0;
+  view->autoscaleY = 0;
+  view->raster = RASTER_POINTS;
+}
+
+/*============================================================================
+ * Создание холста под область просмотра (один блок памяти height*stride).
+ * Переводы строк ставятся сразу и дальше не меняются.
+ *===========================================================================*/
+void initCanvas(Canvas *canvas, const Viewport *view) {
+  canvas->view = *view;
+  canvas->stride = (size_t)view->width * rasterCellBytes(view) + 1;
+  canvas->evaluations = 0;
+  canvas->cells = (char *)malloc(canvas->stride * view->height);
+  for (int r = 0; r < view->height; r++) {
+    canvas->cells[(size_t)(r + 1) * canvas->stride - 1] = '\n';
+  }
+}
+
+/*============================================================================
+ * Освобождение памяти холста
+ *===========================================================================*/
+void freeCanvas(Canvas *canvas) {
+  free(canvas->cells);
+  canvas->cells = NULL;
+}
+
+/*============================================================================
+ * Значение x, которое соответствует столбцу c
+ *===========================================================================*/
+double columnX(const Viewport *view, int c) {
+  double x = view->xMin;
+  if (view->width > 1) {
+    x += (view->xMax - view->xMin) * (double)c / (double)(view->width - 1);
+  }
+  return x;
+}
+
+/*============================================================================
+ * Значение y, которое соответствует строке r (как при отрисовке точки:
+ * строка 0 - yMin)
+ *===========================================================================*/
+double rowY(const Viewport *view, int r) {
+  double y = view->yMin;
+  if (view->height > 1) {
+    y += (view->yMax - view->yMin) * (double)r / (double)(view->height - 1);
+  }
+  return y;
+}
+
+/*============================================================================
+ * Локальная функция: подобрать диапазон y по конечным значениям функции
+ *===========================================================================*/
+static void autoscaleRange(Viewport *view, const double *ys, size_t n) {
+  double lo = INFINITY;
+  double hi = -INFINITY;
+  for (size_t i = 0; i < n; i++) {
+    if (isfinite(ys[i])) {
+      lo = (ys[i] < lo) ? ys[i] : lo;
+      hi = (ys[i] > hi) ? ys[i] : hi;
+    }
+  }
+  if (lo < hi) {
+    view->yMin = lo;
+    view->yMax = hi;
+  } else if (lo == hi) {            /* Константа: рамка +-1 вокруг неё */
+    view->yMin = lo - 1.0;
+    view->yMax = hi + 1.0;
+  }
+}
+
+/*============================================================================
+ * Локальная функция: строк холста на единицу y (0, если диапазон y пуст)
+ *===========================================================================*/
+static double rowsPerUnit(const Viewport *view) {
+  return (view->yMax > view->yMin)
+             ? (view->height - 1) / (view->yMax - view->yMin)
+             : 0.0;
+}
+
+/*============================================================================
+ * Локальная функция: поставить значок glyph в столбце c, если y в диапазоне
+ *===========================================================================*/
+static void plotPoint(Canvas *canvas, int c, double y, char glyph) {
+  const Viewport *view = &canvas->view;
+  if (y >= view->yMin && y <= view->yMax) {
+    double scaled = (y - view->yMin) * (view->height - 1) /
+                    (view->yMax - view->yMin);
+    int row = (int)round(scaled);
+    if (row >= 0 && row < view->height) {
+      canvas->cells[(size_t)row * canvas->stride + c] = glyph;
+    }
+  } else {
+    TRACE_COUNT(COUNTER_OFF_CANVAS, 1);  /* Вне диапазона y или NaN */
+  }
+}
+
+/*============================================================================
+ * Локальная функция: адаптивная отрисовка столбца c выражения s.
+ * По |f'| видно, на сколько строк кривая уходит в пределах столбца;
+ * если больше чем на одну, столбец досчитывается столькими точками
+ * (не больше ADAPTIVE_MAX_SAMPLES). Возвращает число этих точек.
+ *===========================================================================*/
+static long plotAdaptive(const FillJob *job, int s, size_t c, char glyph) {
+  size_t i = (size_t)s * job->stride + c;
+  double rows = fabs(job->dys[i]) * job->dx * job->rowScale;
+  long evals = 0;
+  plotPoint(job->canvas, (int)c, job->ys[i], glyph);
+  if (rows > 1.0) {                 /* NaN сравнение не проходит */
+    int n = (rows < ADAPTIVE_MAX_SAMPLES) ? (int)ceil(rows)
+                                          : ADAPTIVE_MAX_SAMPLES;
+    double x0 = job->xs[c] - 0.5 * job->dx;
+    for (int k = 0; k <= n; k++) {
+      double y = evalProgram(&job->prog[s], x0 + job->dx * k / n);
+      plotPoint(job->canvas, (int)c, y, glyph);
+    }
+    TRACE_COUNT(COUNTER_SAMPLES, n + 1);
+    evals = n + 1;
   }
-  return stack[top]; /* Единственный выход */
+  return evals;
 }
 
 /*============================================================================
- * Заполнение холста (25x80) звёздочками, где функция в диапазоне y=-1..1
+ * Локальная функция (задача пула): значки в столбцах [begin, end) сетки
+ * rasterGrid. Блоками, как и вычисление; следующее выражение рисуется
+ * поверх.
  *===========================================================================*/
-void fillCanvas(char canvas[25][80], const TokenArray *postfix) {
-  for (int r = 0; r < 25; r++) {
-    for (int c = 0; c < 80; c++) {
-      canvas[r][c] = '.';
+static void plotColumns(void *arg, size_t begin, size_t end) {
+  FillJob *job = (FillJob *)arg;
+  long evals = 0;
+  for (size_t b = begin; b < end; b += SERIES_BLOCK_COLUMNS) {
+    size_t blockEnd = b + SERIES_BLOCK_COLUMNS;
+    blockEnd = (blockEnd < end) ? blockEnd : end;
+    for (int s = 0; s < job->count; s++) {
+      const double *ys = job->ys + (size_t)s * job->stride;
+      char glyph = seriesGlyph(s);
+      if (job->dys != NULL) {
+        for (size_t c = b; c < blockEnd; c++) {
+          evals += plotAdaptive(job, s, c, glyph);
+        }
+      } else {                      /* Весь блок ряда - растеризатору */
+        rasterSeries(job->canvas, ys, b, blockEnd, glyph);
+      }
+    }
+  }
+  if (evals > 0) {
+    atomic_fetch_add(job->evaluations, evals);
+  }
+}
+
+/*============================================================================
+ * Локальная функция (задача пула): интервальная отрисовка столбцов [begin, end)
+ *===========================================================================*/
+static void intervalColumns(void *arg, size_t begin, size_t end) {
+  FillJob *job = (FillJob *)arg;
+  for (size_t c = begin; c < end; c++) {
+    for (int s = 0; s < job->count; s++) {
+      plotIntervalColumn(job->canvas, &job->prog[s], (int)c, seriesGlyph(s));
     }
   }
-  for (int c = 0; c < 80; c++) {
-    double x = 4.0 * M_PI * (double)c / 79.0;
-    double yVal = evalRPN(postfix, x);
-    if (yVal >= -1.0 && yVal <= 1.0) {
-      double scaled = 12.0 + yVal * 12.0;
-      int row = (int)round(scaled);
-      if (row >= 0 && row < 25) {
-        canvas[row][c] = '*';
+}
+
+/*============================================================================
+ * Локальная функция: графики y = f(x) по столбцам холста.
+ * Каждый x считается один раз, выражения рисуются разными значками.
+ * Столбцы делятся между потоками пула. Диапазон autoscale общий для всех
+ * выражений. В режиме EVAL_INTERVAL значения в точках нужны только
+ * для autoscale; EVAL_DERIVATIVE считает в столбце значение вместе с
+ * производной. EVAL_ADAPTIVE считает их в узлах грубой сетки и там, где
+ * кривая круче строки на отрезок, остальное интерполирует; при
+ * autoscale строки ещё не известны, и он считает каждый столбец.
+ * EVAL_JIT берёт готовый машинный код shared, а без него (NULL)
+ * компилирует выражения на этот кадр.
+ *===========================================================================*/
+static void fillCanvasColumns(Canvas *canvas, const Program *progs,
+                              SharedJit *const *shared, int count,
+                              EvalMode mode, ThreadPool *pool) {
+  Viewport *view = &canvas->view;
+  Viewport dots;
+  rasterGrid(view, &dots);          /* У Брайля x вдвое больше столбцов */
+  size_t width = (size_t)dots.width;
+  JitProgram single;                /* Одно выражение - без malloc */
+  JitProgram *jits = NULL;
+  atomic_long evaluations = 0;
+  FillJob job;
+  job.canvas = canvas;
+  job.prog = progs;
+  job.jit = NULL;
+  job.count = count;
+  job.mode = mode;
+  job.dys = NULL;
+  job.stride = width;
+  job.dx = (width > 1) ? (dots.xMax - dots.xMin) / (double)(width - 1) : 0.0;
+  job.rowScale = rowsPerUnit(view);
+  job.evaluations = &evaluations;
+  if (mode == EVAL_JIT) {
+    jits = (count == 1) ? &single
+                        : (JitProgram *)malloc(sizeof(JitProgram) * count);
+    for (int s = 0; s < count; s++) {
+      if (shared != NULL) {
+        jits[s] = shared[s]->jit;   /* Чужой код: не освобождаем */
+      } else {
+        compileJit(&progs[s], &jits[s]);  /* Не вышло - интерпретатор */
       }
     }
+    job.jit = jits;
+  }
+  job.xs = (double *)malloc(sizeof(double) * width);
+  job.ys = (double *)malloc(sizeof(double) * width * count);
+  if (mode == EVAL_ADAPTIVE) {
+    job.dys = (double *)malloc(sizeof(double) * width * count);
+  }
+  clearRaster(canvas);
+  if (mode != EVAL_INTERVAL || view->autoscaleY) {
+    int adaptive = (mode == EVAL_ADAPTIVE && !view->autoscaleY);
+    TRACE_BEGIN(evalSpan);
+    runThreadPool(pool, adaptive ? sampleAdaptive : sampleColumns, &job,
+                  width, POOL_CHUNK_COLUMNS);
+    TRACE_SAMPLES(job.ys, width * count);
+    TRACE_END(evalSpan, STAGE_EVAL);
+  }
+  TRACE_BEGIN(renderSpan);
+  if (view->autoscaleY) {           /* Нужны все значения - между фазами */
+    autoscaleRange(view, job.ys, width * count);
+    job.rowScale = rowsPerUnit(view);
+  }
+  runThreadPool(pool, (mode == EVAL_INTERVAL) ? intervalColumns : plotColumns,
+                &job, width, POOL_CHUNK_COLUMNS);
+  TRACE_END(renderSpan, STAGE_RENDER);
+  if (jits != NULL) {
+    for (int s = 0; shared == NULL && s < count; s++) {
+      freeJit(&jits[s]);
+    }
+    if (jits != &single) {
+      free(jits);
+    }
+  }
+  free(job.xs);
+  free(job.ys);
+  free(job.dys);
+  canvas->evaluations = atomic_load(&evaluations);
+}
+
+/*============================================================================
+ * Заполнение холста по нескольким скомпилированным выражениям сразу:
+ * графики по столбцам или (EVAL_HEATMAP, EVAL_CONTOUR) f(x, y) по клеткам.
+ * jits - машинный код progs для EVAL_JIT (shareJits, кэш выражений) или
+ * NULL: тогда он компилируется на один этот кадр.
+ *===========================================================================*/
+void fillCanvasPrograms(Canvas *canvas, const Program *progs,
+                        SharedJit *const *jits, int count, EvalMode mode,
+                        ThreadPool *pool) {
+  if (isGridMode(mode)) {
+    fillCanvasGrid(canvas, progs, count, mode, pool);
+  } else {
+    fillCanvasColumns(canvas, progs, jits, count, mode, pool);
+  }
+}
+
+/*============================================================================
+ * Заполнение холста по одному скомпилированному выражению
+ *===========================================================================*/
+void fillCanvasProgram(Canvas *canvas, const Program *prog, EvalMode mode,
+                       ThreadPool *pool) {
+  fillCanvasPrograms(canvas, prog, NULL, 1, mode, pool);
+}
+
+/*============================================================================
+ * Заполнение холста звёздочками: по одному значению функции на столбец.
+ * Выражение компилируется один раз на весь холст.
+ *===========================================================================*/
+void fillCanvas(Canvas *canvas, const TokenArray *postfix, EvalMode mode,
+                ThreadPool *pool) {
+  Program prog;
+  initProgram(&prog);
+  compileRPN(postfix, &prog);
+  fillCanvasProgram(canvas, &prog, mode, pool);
+  freeProgram(&prog);
+}
+
+/*============================================================================
+ * Пустой кэш отсчётов (массивы выделяются под первый кадр)
+ *===========================================================================*/
+void initSampleCache(SampleCache *samples) {
+  samples->cur = NULL;
+  samples->next = NULL;
+  samples->miss = NULL;
+  samples->missCols = NULL;
+  samples->capacity = 0;
+  samples->count = 0;
+  samples->x0 = 0.0;
+  samples->step = 0.0;
+  samples->cells = NULL;
+  samples->reused = 0;
+  samples->evaluated = 0;
+}
+
+/*============================================================================
+ * Забыть отсчёты (выражение сменилось); память и счётчики остаются
+ *===========================================================================*/
+void resetSampleCache(SampleCache *samples) {
+  samples->count = 0;
+}
+
+/*============================================================================
+ * Освобождение памяти кэша отсчётов
+ *===========================================================================*/
+void freeSampleCache(SampleCache *samples) {
+  free(samples->cur);
+  free(samples->next);
+  free(samples->miss);
+  free(samples->missCols);
+  initSampleCache(samples);
+}
+
+/*============================================================================
+ * Локальная функция: массивы кэша не меньше чем на width столбцов.
+ * Отсчёты прошлого кадра переносятся в новый cur.
+ *===========================================================================*/
+static void reserveSamples(SampleCache *samples, int width) {
+  if (width > samples->capacity) {
+    size_t cap = (size_t)width;
+    double *cur = (double *)malloc(sizeof(double) * 2 * cap);
+    if (samples->count > 0) {
+      memcpy(cur, samples->cur, sizeof(double) * samples->count);
+      memcpy(cur + cap, samples->cur + samples->capacity,
+             sizeof(double) * samples->count);
+    }
+    free(samples->cur);
+    free(samples->next);
+    free(samples->miss);
+    free(samples->missCols);
+    samples->cur = cur;
+    samples->next = (double *)malloc(sizeof(double) * 2 * cap);
+    samples->miss = (double *)malloc(sizeof(double) * 2 * cap);
+    samples->missCols = (size_t *)malloc(sizeof(size_t) * cap);
+    samples->capacity = width;
+  }
+}
+
+/*============================================================================
+ * Локальная функция: взять y для x из прошлого кадра, если x лежит
+ * на его сетке (invStep = 1 / шаг сетки). Номер отсчёта только
+ * предполагается по сетке, совпадение проверяется по сохранённому x.
+ * Возвращает 0, если такого отсчёта нет.
+ *===========================================================================*/
+static int findSample(const SampleCache *samples, double invStep, double x,
+                      double *y) {
+  int found = 0;
+  double t = (x - samples->x0) * invStep + 0.5;
+  if (t >= 0.0 && t < (double)samples->count) {
+    size_t k = (size_t)t;           /* Отбрасывание дробной части = round */
+    const double *xs = samples->cur;
+    if (fabs(xs[k] - x) * invStep <= SAMPLE_MATCH_EPS) {
+      *y = xs[samples->capacity + k];
+      found = 1;
+    }
   }
+  return found;
 }
 
 /*============================================================================
- * Печать холста 25x80 на экран
+ * Локальная функция: сдвиг области просмотра на целое число столбцов
+ * сетки dots при том же шаге, диапазоне y (без autoscale) и способе
+ * растеризации, когда прошлый кадр ещё на этом холсте. Сдвиг кратен
+ * клетке (у Брайля - двум точкам), и по краям остаётся хотя бы по
+ * клетке старого кадра. Возвращает сдвиг (новый столбец c - старый
+ * c + shift) или 0, если кадр строится целиком.
  *===========================================================================*/
-void printCanvas(char canvas[25][80]) {
-  for (int r = 0; r < 25; r++) {
-    for (int c = 0; c < 80; c++) {
-      putchar(canvas[r][c]);
+static long panShift(const SampleCache *samples, const Canvas *canvas,
+                     const Viewport *dots) {
+  const Viewport *view = &canvas->view;
+  const Viewport *last = &samples->view;
+  long shift = 0;
+  long cell = dots->width / view->width;
+  if (samples->cells == canvas->cells && samples->count == dots->width &&
+      dots->width > 1 && !view->autoscaleY && !last->autoscaleY &&
+      view->width == last->width && view->height == last->height &&
+      view->raster == last->raster && view->yMin == last->yMin &&
+      view->yMax == last->yMax) {
+    double step = (view->xMax - view->xMin) / (double)(dots->width - 1);
+    double t = (view->xMin - samples->x0) / samples->step;
+    long k = lround(t);
+    if (fabs(step - samples->step) <= SAMPLE_MATCH_EPS * samples->step &&
+        fabs(t - (double)k) <= SAMPLE_MATCH_EPS && k % cell == 0 &&
+        labs(k) + 2 * cell <= dots->width) {
+      shift = k;
     }
-    putchar('\n');
+  }
+  return shift;
+}
+
+/*============================================================================
+ * Локальная функция: кадр после сдвига на shift столбцов (panShift).
+ * Отсчёты и нарисованные клетки сдвигаются, считаются только открывшиеся
+ * столбцы. Заново рисуются они и клетки на стыках: у крайнего старого
+ * столбца линия теперь тянется к новому соседу, а у столбца, ставшего
+ * крайним, - больше не тянется к ушедшему.
+ *===========================================================================*/
+static void panSamples(Canvas *canvas, const Program *prog, SharedJit *shared,
+                       EvalMode mode, ThreadPool *pool, SampleCache *samples,
+                       long shift) {
+  Viewport dots;
+  rasterGrid(&canvas->view, &dots);
+  size_t width = (size_t)dots.width;
+  size_t cap = (size_t)samples->capacity;
+  size_t cell = width / (size_t)canvas->view.width;
+  size_t n = (size_t)labs(shift);
+  size_t keep = width - n;
+  size_t fresh = (shift > 0) ? keep : 0;     /* Первый открывшийся столбец */
+  size_t from = (shift > 0) ? n : 0;         /* Старые отсчёты: откуда */
+  size_t to = (shift > 0) ? 0 : n;           /* и куда */
+  double *xs = samples->cur;
+  double *ys = samples->cur + cap;
+  memmove(xs + to, xs + from, sizeof(double) * keep);
+  memmove(ys + to, ys + from, sizeof(double) * keep);
+  JitProgram jit;
+  FillJob job;
+  job.canvas = canvas;
+  job.prog = prog;
+  job.jit = NULL;
+  job.count = 1;
+  job.mode = mode;
+  job.dys = NULL;
+  job.stride = cap;
+  job.evaluations = NULL;
+  job.xs = xs + fresh;
+  job.ys = ys + fresh;
+  for (size_t i = 0; i < n; i++) {
+    job.xs[i] = columnX(&dots, (int)(fresh + i));
+  }
+  if (mode == EVAL_JIT && shared != NULL) {
+    job.jit = &shared->jit;
+  } else if (mode == EVAL_JIT) {
+    compileJit(prog, &jit);         /* Не вышло - внутри будет интерпретатор */
+    job.jit = &jit;
+  }
+  TRACE_BEGIN(evalSpan);
+  runThreadPool(pool, evalSamples, &job, n, POOL_CHUNK_COLUMNS);
+  TRACE_SAMPLES(job.ys, n);
+  TRACE_END(evalSpan, STAGE_EVAL);
+  samples->reused += keep;
+  samples->evaluated += n;
+  canvas->evaluations = (long)n;
+  TRACE_BEGIN(renderSpan);
+  size_t left = (shift > 0) ? cell : n + cell;      /* Рисуется [0, left) */
+  size_t right = (shift > 0) ? keep - cell : width - cell;  /* и дальше */
+  shiftRaster(canvas, shift);
+  clearRasterColumns(canvas, 0, left);
+  clearRasterColumns(canvas, right, width);
+  rasterSeries(canvas, ys, 0, left, seriesGlyph(0));
+  rasterSeries(canvas, ys, right, width, seriesGlyph(0));
+  TRACE_END(renderSpan, STAGE_RENDER);
+  samples->x0 = canvas->view.xMin;
+  if (job.jit == &jit) {
+    freeJit(&jit);
   }
 }
 
 /*============================================================================
- * Главная функция: считывает строку, строит токены, рисует график
+ * Заполнение холста с переиспользованием отсчётов прошлого кадра того же
+ * выражения: после сдвига считаются только открывшиеся столбцы, после
+ * масштаба - только x, не попавшие на старую сетку. Новые x собираются
+ * подряд и считаются одним пакетом. Сдвиг на целое число столбцов
+ * (panShift) и кадр не перерисовывает, а сдвигает. Остальные режимы
+ * (интервальный, дуальные числа) отсчётов не хранят и рисуют кадр
+ * целиком. shared - готовый машинный код prog для EVAL_JIT или NULL.
  *===========================================================================*/
-int main(void) {
-  int retVal = 0;                   /* Будем возвращать в конце */
-  char input[256];                  /* Буфер ввода */
-  if (!fgets(input, sizeof(input), stdin)) {
-    retVal = 0;                     /* Ранняя проверка (EOF) */
+void fillCanvasSamples(Canvas *canvas, const Program *prog, SharedJit *shared,
+                       EvalMode mode, ThreadPool *pool, SampleCache *samples) {
+  Viewport *view = &canvas->view;
+  Viewport dots;
+  rasterGrid(view, &dots);
+  size_t width = (size_t)dots.width;
+  long shift = 0;
+  if (mode != EVAL_BATCH && mode != EVAL_JIT) {
+    resetSampleCache(samples);
+    fillCanvasProgram(canvas, prog, mode, pool);
+  } else if ((shift = panShift(samples, canvas, &dots)) != 0) {
+    panSamples(canvas, prog, shared, mode, pool, samples, shift);
   } else {
-    size_t len = strlen(input);
-    if (len > 0 && input[len - 1] == '\n') {
-      input[len - 1] = '\0';
+    JitProgram jit;
+    FillJob job;                    /* Все столбцы кадра */
+    FillJob miss;                   /* Только x, которых нет в кэше */
+    size_t missCount = 0;
+    reserveSamples(samples, dots.width);
+    size_t cap = (size_t)samples->capacity;
+    job.canvas = canvas;
+    job.prog = prog;
+    job.jit = NULL;
+    job.count = 1;
+    job.mode = mode;
+    job.dys = NULL;
+    job.stride = cap;
+    job.evaluations = NULL;
+    job.xs = samples->next;
+    job.ys = samples->next + cap;
+    miss = job;
+    miss.xs = samples->miss;
+    miss.ys = samples->miss + cap;
+    double invStep = (samples->step > 0.0) ? 1.0 / samples->step : 1.0;
+    for (size_t c = 0; c < width; c++) {
+      job.xs[c] = columnX(&dots, (int)c);
+      if (!findSample(samples, invStep, job.xs[c], &job.ys[c])) {
+        miss.xs[missCount] = job.xs[c];
+        samples->missCols[missCount++] = c;
+      }
     }
-    TokenArray infix;
-    TokenArray postfix;
-    initTokenArray(&infix);
-    initTokenArray(&postfix);
-    tokenize(input, &infix);
-    toRPN(&infix, &postfix);
-
-    char canvas[25][80];
-    fillCanvas(canvas, &postfix);
-    printCanvas(canvas);
-
-    freeTokenArray(&infix);
-    freeTokenArray(&postfix);
-    retVal = 0;                     /* Успешное завершение */
-  }
-  return retVal;                    /* Один return */
+    if (missCount > 0 && mode == EVAL_JIT && shared != NULL) {
+      miss.jit = &shared->jit;
+    } else if (missCount > 0 && mode == EVAL_JIT) {
+      compileJit(prog, &jit);       /* Не вышло - внутри будет интерпретатор */
+      miss.jit = &jit;
+    }
+    TRACE_BEGIN(evalSpan);
+    runThreadPool(pool, evalSamples, &miss, missCount, POOL_CHUNK_COLUMNS);
+    TRACE_SAMPLES(miss.ys, missCount);
+    TRACE_END(evalSpan, STAGE_EVAL);
+    for (size_t i = 0; i < missCount; i++) {
+      job.ys[samples->missCols[i]] = miss.ys[i];
+    }
+    samples->reused += width - missCount;
+    samples->evaluated += missCount;
+    canvas->evaluations = (long)missCount;
+    TRACE_BEGIN(renderSpan);
+    clearRaster(canvas);
+    if (view->autoscaleY) {
+      autoscaleRange(view, job.ys, width);
+    }
+    runThreadPool(pool, plotColumns, &job, width, POOL_CHUNK_COLUMNS);
+    TRACE_END(renderSpan, STAGE_RENDER);
+    samples->next = samples->cur;   /* Кадр становится новым кэшем */
+    samples->cur = job.xs;
+    samples->count = dots.width;
+    samples->x0 = view->xMin;
+    samples->step = (dots.width > 1) ? (view->xMax - view->xMin) /
+                                           (double)(dots.width - 1)
+                                     : 0.0;
+    samples->view = *view;
+    samples->cells = canvas->cells;
+    if (miss.jit == &jit) {
+      freeJit(&jit);
+    }
+  }
 }
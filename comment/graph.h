@@ -1,10 +1,15 @@
 #ifndef GRAPH_H                           /* Защита от повторного включения */
 #define GRAPH_H
 
+#define _DEFAULT_SOURCE                  /* M_PI, mmap и т.п. при -std=c11 */
+
 #include <stdio.h>                       /* Подключаем для ввода-вывода */
 #include <stdlib.h>                      /* malloc, free, atof и т.д. */
 #include <string.h>                      /* Работа со строками: strncmp, strlen */
 #include <math.h>                        /* Математические функции sin, cos и т.д. */
+#include <pthread.h>                     /* Потоки для параллельной отрисовки */
+#include <stdint.h>                      /* Поля фиксированной ширины в файлах */
+#include <stdatomic.h>                   /* Счётчик ссылок на машинный код */
 
 /*-----------------------------------------------------------------------------
  * Перечисление типов токенов для математического выражения
@@ -24,7 +29,8 @@ typedef enum {
   TOKEN_CTG,      /* Функция ctg (1/tan) */
   TOKEN_SQRT,     /* Функция sqrt */
   TOKEN_LN,       /* Функция ln */
-  TOKEN_UMINUS    /* Унарный минус */
+  TOKEN_UMINUS,   /* Унарный минус */
+  TOKEN_VAR       /* Переменная-буква, кроме x (value - номер буквы от 'a') */
 } TokenType;
 
 /*-----------------------------------------------------------------------------
@@ -35,6 +41,23 @@ typedef struct {
   double value;   /* Числовое значение (актуально, если type == TOKEN_NUMBER) */
 } Token;
 
+/*-----------------------------------------------------------------------------
+ * Блок арены: заголовок, за ним size байт данных
+ *-----------------------------------------------------------------------------*/
+typedef struct ArenaBlock {
+  struct ArenaBlock *prev;  /* Предыдущий (заполненный) блок */
+  size_t size;              /* Сколько байт данных в блоке */
+  size_t used;              /* Сколько из них уже выдано */
+} ArenaBlock;
+
+/*-----------------------------------------------------------------------------
+ * Арена: память выдаётся сдвигом указателя и освобождается вся сразу
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  ArenaBlock *block;        /* Текущий блок */
+  size_t total;             /* Суммарный размер всех блоков */
+} Arena;
+
 /*-----------------------------------------------------------------------------
  * Динамический массив токенов
  *-----------------------------------------------------------------------------*/
@@ -42,45 +65,556 @@ typedef struct {
   Token *data;    /* Указатель на блок памяти под токены */
   int size;       /* Текущее количество токенов */
   int capacity;   /* Текущая емкость (сколько токенов умещается) */
+  Arena *arena;   /* Откуда брать память (NULL - malloc/realloc) */
+  int depth;      /* Глубина стека при вычислении ОПН (0 - ОПН некорректна) */
 } TokenArray;
 
 /*-----------------------------------------------------------------------------
- * Стек для токенов (для алгоритма перевода в ОПН)
+ * Потоковый лексер: выражение подаётся кусками любой длины. Разбирается
+ * всё до последнего разделителя, а хвост (возможно, половина числа или
+ * имени функции) ждёт следующего куска.
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  TokenArray *arr;  /* Куда складываются токены */
+  int first;        /* Индекс первого токена выражения в arr */
+  char *tail;       /* Ещё не разобранный хвост (с местом под '\0') */
+  size_t tailLen;   /* Длина хвоста */
+  size_t tailCap;   /* Ёмкость буфера хвоста */
+  long offset;      /* Сколько символов выражения было до хвоста */
+  long errorPos;    /* Позиция первого непонятного символа или -1 */
+  char errorChar;   /* Сам этот символ */
+  long *columns;    /* Позиция в выражении каждого его токена */
+  int columnsCap;   /* Ёмкость columns */
+} LexStream;
+
+/*-----------------------------------------------------------------------------
+ * Узел дерева выражения: лист (число, x, переменная) или операция.
+ * Операнды - номера узлов того же дерева, -1 - операнда нет.
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  TokenType type; /* Тип листа, операции или функции */
+  int left;       /* Левый (у функции и унарного минуса - единственный) */
+  int right;      /* Правый операнд бинарной операции */
+  double value;   /* Число или номер переменной-буквы */
+} ExprNode;
+
+/*-----------------------------------------------------------------------------
+ * Дерево выражения (AST) в арене. Узлы идут в порядке ОПН: операнды
+ * раньше операций, корень - последний.
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  ExprNode *nodes;    /* Узлы дерева */
+  int size;           /* Сколько их */
+  int root;           /* Корень или -1, если дерево не построено */
+  Arena *arena;       /* Откуда память узлов и рабочих массивов */
+  long errorPos;      /* Где первая ошибка разбора или -1 */
+  const char *error;  /* Что за ошибка (NULL - ошибок не было) */
+} ExprAst;
+
+/*-----------------------------------------------------------------------------
+ * Коды операций байткода (компактная форма ОПН для быстрого вычисления)
+ *-----------------------------------------------------------------------------*/
+typedef enum {
+  OP_CONST,       /* Положить константу из пула (за кодом идёт индекс) */
+  OP_X,           /* Положить значение x */
+  OP_ADD,         /* Сложение двух верхних элементов */
+  OP_SUB,         /* Вычитание */
+  OP_MUL,         /* Умножение */
+  OP_DIV,         /* Деление */
+  OP_NEG,         /* Унарный минус */
+  OP_SIN,         /* sin вершины стека */
+  OP_COS,         /* cos вершины стека */
+  OP_TAN,         /* tan вершины стека */
+  OP_CTG,         /* ctg вершины стека */
+  OP_SQRT,        /* sqrt вершины стека */
+  OP_LN,          /* ln вершины стека */
+  OP_LOAD,        /* Положить значение из слота (за кодом идёт индекс) */
+  OP_STORE,       /* Сохранить вершину в слот, не снимая её со стека */
+  OP_VAR,         /* Положить переменную-букву (за кодом идёт её номер) */
+  OP_FAST_SIN,    /* Приближённые sin, cos, tan, ctg, ln (--precision fast) */
+  OP_FAST_COS,
+  OP_FAST_TAN,
+  OP_FAST_CTG,
+  OP_FAST_LN
+} OpCode;
+
+/* Переменные a..z: x - аргумент графика, y - вторая ось в режимах сетки,
+ * остальные - параметры (задаются --param, --sweep и командой :set) */
+#define VAR_COUNT 26
+#define VAR_Y ('y' - 'a')
+
+/* Глубина стека ОПН, которая помещается в локальный буфер без malloc */
+#define RPN_STACK_SIZE 256
+
+/* Сколько символов выражения читается с ввода за раз */
+#define LEX_CHUNK 65536
+
+/* Глубина стека, которая помещается в локальный буфер без malloc */
+#define PROGRAM_SMALL_STACK 256
+
+/* Пакетный режим: сколько x обрабатывается за один проход байткода */
+#define BATCH_LANES 64
+/* Глубина пакетного стека, которая помещается на кадре без malloc */
+#define BATCH_SMALL_DEPTH 32
+
+/* Быстрые sin, cos, tan, ctg: дальше этого |x| приведение по трём
+ * частям pi/2 теряет точность, считает libm */
+#define FAST_TRIG_MAX 1e6
+
+/* Сетка: строк в плитке, которую поток считает целиком (по блокам x) */
+#define GRID_TILE_ROWS 8
+
+/* Градации яркости тепловой карты, от меньших значений к большим */
+#define HEATMAP_RAMP " .:-=+*#%@"
+
+/* Число уровней, между которыми рисуются линии уровня */
+#define CONTOUR_LEVELS 8
+
+/*-----------------------------------------------------------------------------
+ * Скомпилированное выражение: поток байт-кодов + пул констант
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  unsigned char *code;  /* Поток кодов операций (по одному байту) */
+  int codeSize;         /* Сколько байт занято */
+  int codeCapacity;     /* Сколько байт выделено (0 - память чужая) */
+  double *consts;       /* Пул числовых констант */
+  int constCount;       /* Количество констант */
+  int constCapacity;    /* Емкость пула констант */
+  int slotCount;        /* Сколько слотов под общие подвыражения */
+  int maxDepth;         /* Максимальная глубина стека при вычислении */
+} Program;
+
+/* Машинный код выражения: ys[i] = f(xs[i]), frame - рабочая память */
+typedef void (*JitFn)(const double *xs, double *ys, long n, double *frame);
+
+/*-----------------------------------------------------------------------------
+ * Выражение, скомпилированное в машинный код x86-64
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  const Program *source;  /* Байткод (и запасной путь без JIT) */
+  JitFn fn;               /* Точка входа или NULL, если JIT недоступен */
+  void *mem;              /* Исполняемая страница (mmap) */
+  size_t memSize;         /* Её размер */
+} JitProgram;
+
+/*-----------------------------------------------------------------------------
+ * Машинный код с общим владением: его держат запись кэша выражений и
+ * кадры, которые ещё рисуются. Память освобождает последний releaseJit.
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  Program prog;           /* Своя копия байткода (на неё смотрит jit) */
+  JitProgram jit;         /* Машинный код prog */
+  atomic_int refs;        /* Сколько владельцев */
+} SharedJit;
+
+/* Файл библиотеки выражений: сигнатура, версия формата, порядок байт */
+#define LIBRARY_MAGIC "GRAPHLIB"
+#define LIBRARY_VERSION 1
+#define LIBRARY_BYTE_ORDER 0x01020304u
+
+/*-----------------------------------------------------------------------------
+ * Заголовок библиотеки. Дальше таблица кадров, таблица программ и данные;
+ * все смещения - от начала файла, таблицы и константы выровнены на 8.
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  char magic[8];              /* LIBRARY_MAGIC без нуля */
+  uint32_t version;           /* LIBRARY_VERSION */
+  uint32_t byteOrder;         /* LIBRARY_BYTE_ORDER в порядке байт записи */
+  uint64_t frameCount;        /* Сколько строк (кадров) */
+  uint64_t programCount;      /* Сколько выражений во всех кадрах */
+  uint64_t framesOffset;      /* Таблица LibraryFrame */
+  uint64_t programsOffset;    /* Таблица LibraryProgram */
+} LibraryHeader;
+
+/*-----------------------------------------------------------------------------
+ * Кадр библиотеки: строка ввода и её выражения (через ';') подряд
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  uint64_t keyOffset;         /* Нормализованный текст с нулём в конце */
+  uint32_t keyLength;         /* Длина текста без нуля */
+  uint32_t firstProgram;      /* Первое выражение в таблице программ */
+  uint32_t programCount;      /* Сколько выражений */
+  uint32_t reserved;          /* Выравнивание, пишется нулём */
+} LibraryFrame;
+
+/*-----------------------------------------------------------------------------
+ * Выражение библиотеки: байткод и пул констант в данных файла
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  uint64_t codeOffset;        /* Поток кодов (Program.code) */
+  uint64_t constOffset;       /* Пул констант (Program.consts) */
+  uint32_t codeSize;
+  uint32_t constCount;
+  uint32_t slotCount;
+  uint32_t maxDepth;
+} LibraryProgram;
+
+/*-----------------------------------------------------------------------------
+ * Библиотека, отображённая в память: выражения читаются прямо из файла
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  const unsigned char *map;   /* Весь файл */
+  size_t size;                /* Его размер */
+  const LibraryFrame *frames;
+  const LibraryProgram *programs;
+  int frameCount;
+  int programCount;
+} ProgramLibrary;
+
+/*-----------------------------------------------------------------------------
+ * Сборка библиотеки в памяти перед записью в файл. Смещения в таблицах
+ * отсчитываются от начала data, при записи к ним прибавляются размеры
+ * заголовка и таблиц.
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  LibraryFrame *frames;
+  int frameCount;
+  int frameCapacity;
+  LibraryProgram *programs;
+  int programCount;
+  int programCapacity;
+  unsigned char *data;        /* Тексты, константы и байткод */
+  size_t dataSize;
+  size_t dataCapacity;
+} LibraryWriter;
+
+/* Каким способом считать значения функции при отрисовке */
+typedef enum {
+  EVAL_BATCH,     /* Пакетный интерпретатор байткода */
+  EVAL_JIT,       /* Машинный код (если платформа поддерживает) */
+  EVAL_INTERVAL,  /* Интервальная арифметика: все строки, где проходит кривая */
+  EVAL_ADAPTIVE,  /* Дуальные числа: больше точек там, где |f'| велика */
+  EVAL_DERIVATIVE, /* Дуальные числа: рисуется f'(x) вместо f(x) */
+  EVAL_HEATMAP,   /* Сетка f(x, y): яркость клетки по значению */
+  EVAL_CONTOUR    /* Сетка f(x, y): линии уровня */
+} EvalMode;
+
+/* Точность функций в байткоде: libm или быстрые многочлены (ошибка ~1e-12,
+ * для холста в десятки строк это незаметно) */
+typedef enum {
+  PRECISION_EXACT,  /* sin, cos, tan, log из libm */
+  PRECISION_FAST    /* fastSin и другие из fastmath.c */
+} MathPrecision;
+
+/*-----------------------------------------------------------------------------
+ * Перебор параметра по кадрам: var идёт от from до to за frames кадров
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  int var;        /* Номер буквы параметра или -1 - перебора нет */
+  double from;    /* Значение в первом кадре */
+  double to;      /* Значение в последнем кадре */
+  int frames;     /* Сколько кадров */
+} ParamSweep;
+
+/*-----------------------------------------------------------------------------
+ * Отрезок значений [lo, hi]. Пустой (функция нигде не определена) - NaN.
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  double lo;            /* Нижняя граница */
+  double hi;            /* Верхняя граница */
+} Interval;
+
+/* Интервальная отрисовка: сколько раз можно делить столбец пополам */
+#define INTERVAL_MAX_DEPTH 10
+
+/*-----------------------------------------------------------------------------
+ * Дуальное число v + d*eps (eps^2 = 0): значение и производная по x
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  double v;             /* Значение */
+  double d;             /* Производная */
+} Dual;
+
+/* Адаптивная отрисовка: наибольшее число дополнительных точек в столбце */
+#define ADAPTIVE_MAX_SAMPLES 32
+
+/* Адаптивная отрисовка: шаг грубой сетки столбцов, пологие отрезки
+ * между её узлами заполняются без вычислений */
+#define ADAPTIVE_SPAN 16
+
+/* Как кривая ложится на холст в режимах по столбцам */
+typedef enum {
+  RASTER_POINTS,  /* Точка на столбец, вне диапазона y - ничего */
+  RASTER_LINES,   /* Соседние точки соединяются вертикальными отрезками */
+  RASTER_BRAILLE  /* Линии по знакам Брайля: 2x4 точки в клетке */
+} RasterStyle;
+
+/* Клетка холста в RASTER_BRAILLE - знак U+2800..U+28FF в UTF-8 */
+#define BRAILLE_BYTES 3
+
+/*-----------------------------------------------------------------------------
+ * Область просмотра: размер холста в символах и диапазоны x/y
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  int width;              /* Количество столбцов */
+  int height;             /* Количество строк */
+  double xMin;            /* x в первом столбце */
+  double xMax;            /* x в последнем столбце */
+  double yMin;            /* y в первой строке */
+  double yMax;            /* y в последней строке */
+  int autoscaleY;         /* 1 - подобрать yMin/yMax по значениям функции */
+  RasterStyle raster;     /* Точки, линии или Брайль */
+} Viewport;
+
+/*-----------------------------------------------------------------------------
+ * Холст произвольного размера: строки подряд в одном блоке памяти, каждая
+ * уже с '\n' в конце - кадр выводится как есть, одной записью
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  Viewport view;          /* Параметры, с которыми холст заполнен */
+  char *cells;            /* height * stride символов */
+  size_t stride;          /* Байт в строке с '\n': width * клетка + 1 */
+  long evaluations;       /* Вычислений в точках при заполнении по x */
+} Canvas;
+
+/*-----------------------------------------------------------------------------
+ * Куда уходят кадры: файловый дескриптор (write/writev) или файл,
+ * отображённый в память (кадры копируются прямо в отображение)
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  int fd;                 /* Дескриптор вывода */
+  char *map;              /* Отображение файла или NULL */
+  size_t mapSize;         /* Размер отображения (и файла) */
+  size_t used;            /* Сколько байт кадров записано */
+  int failed;             /* 1 - была ошибка записи */
+} FrameSink;
+
+/* Начальный размер отображённого файла вывода; дальше растёт вдвое */
+#define FRAME_MAP_INITIAL (1 << 20)
+
+/* Насколько x может отличаться от сохранённого отсчёта (доля шага сетки) */
+#define SAMPLE_MATCH_EPS 1e-9
+
+/*-----------------------------------------------------------------------------
+ * Отсчёты одного выражения с прошлого кадра: пары (x, y) на сетке
+ * x = x0 + step * i. При сдвиге и масштабе считаются только новые x,
+ * а при сдвиге на целое число столбцов сдвигается и нарисованный кадр.
+ * Массивы живут между кадрами: cur и next меняются местами.
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  double *cur;            /* Прошлый кадр: capacity x, затем capacity y */
+  double *next;           /* Так же для кадра, который строится */
+  double *miss;           /* x и y, которых не нашлось в cur */
+  size_t *missCols;       /* Их столбцы */
+  int capacity;           /* На сколько столбцов выделены массивы */
+  int count;              /* Сколько отсчётов в cur (0 - кэш пуст) */
+  double x0;              /* x первого отсчёта */
+  double step;            /* Шаг сетки (0, если столбец один) */
+  Viewport view;          /* С какой областью нарисован кадр */
+  const char *cells;      /* На каком холсте он остался (NULL - ни на каком) */
+  unsigned long reused;   /* Сколько значений взято из кэша */
+  unsigned long evaluated;  /* Сколько посчитано заново */
+} SampleCache;
+
+/* Сколько столбцов поток берёт за раз: xs и ys куска (16 КБ) лежат в L1 */
+#define POOL_CHUNK_COLUMNS 1024
+
+/* Несколько выражений на холсте: блок x, по которому проходят все выражения */
+#define SERIES_BLOCK_COLUMNS 256
+
+/* Работа для пула: обработать элементы с номерами [begin, end) */
+typedef void (*PoolTask)(void *arg, size_t begin, size_t end);
+
+/*-----------------------------------------------------------------------------
+ * Постоянный пул потоков: рабочие ждут задачу и разбирают её кусками
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  pthread_t *threads;         /* Рабочие потоки */
+  int threadCount;            /* Сколько их запущено */
+  pthread_mutex_t lock;       /* Защищает все поля ниже */
+  pthread_cond_t wake;        /* Появилась задача или пора завершаться */
+  pthread_cond_t done;        /* Все куски задачи выполнены */
+  PoolTask task;              /* Текущая задача */
+  void *arg;                  /* Её аргумент */
+  size_t total;               /* Размер диапазона задачи */
+  size_t chunk;               /* Размер одного куска */
+  size_t next;                /* Начало следующего свободного куска */
+  int active;                 /* Сколько кусков сейчас в работе */
+  unsigned long generation;   /* Номер задачи (растёт с каждым запуском) */
+  int stop;                   /* 1 - рабочим пора завершиться */
+} ThreadPool;
+
+/*-----------------------------------------------------------------------------
+ * Счётчики свёртки констант: сколько узлов было в деревьях и сколько из
+ * них убрал foldAst (печатаются по --cache-stats и без трассировки)
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  unsigned long nodes;        /* Узлов до свёртки */
+  unsigned long folded;       /* Убрано свёрткой */
+} FoldStats;
+
+/*-----------------------------------------------------------------------------
+ * Запись кэша: нормализованный текст -> байткод и, если нужно, готовый кадр
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  char *key;                  /* Нормализованный текст выражения */
+  unsigned int hash;          /* Хеш ключа */
+  Program prog;               /* Скомпилированное выражение */
+  int hasProgram;             /* 1 - prog заполнена */
+  SharedJit *jit;             /* Машинный код prog или NULL */
+  char *frame;                /* Клетки отрисованного холста или NULL */
+  Viewport frameView;         /* Область просмотра этого кадра */
+  int chain;                  /* Следующая запись в корзине хеш-таблицы */
+  int newer;                  /* Соседи в списке LRU (-1 - нет) */
+  int older;
+} CacheEntry;
+
+/*-----------------------------------------------------------------------------
+ * Кэш выражений с вытеснением давно не использованных (LRU)
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  CacheEntry *entries;        /* Записи (не больше capacity) */
+  int size;                   /* Сколько записей занято */
+  int capacity;               /* Наибольшее число записей, 0 - выключен */
+  int *buckets;               /* Головы цепочек хеш-таблицы */
+  int bucketCount;            /* Размер таблицы (степень двойки) */
+  int newest;                 /* Самая свежая запись */
+  int oldest;                 /* Кандидат на вытеснение */
+  unsigned long hits;         /* Счётчики обращений */
+  unsigned long misses;
+  unsigned long evictions;
+  FoldStats fold;             /* Свёртка выражений, разобранных при промахах */
+} ExprCache;
+
+/*-----------------------------------------------------------------------------
+ * Параметры пакетного режима
  *-----------------------------------------------------------------------------*/
 typedef struct {
-  Token *data;    /* Указатель на массив (стек) */
-  int top;        /* Индекс вершины стека (>= 0) */
-  int capacity;   /* Максимальная вместимость стека */
-} TokenStack;
+  Viewport view;              /* Область просмотра всех кадров */
+  EvalMode mode;              /* Способ вычисления */
+  int cacheSize;              /* Ёмкость кэша выражений (0 - без кэша) */
+  int cacheFrames;            /* 1 - кэшировать и готовые кадры */
+  int cacheStats;             /* 1 - напечатать счётчики кэша в stderr */
+  const ProgramLibrary *library;  /* Кадры из библиотеки, а не из ввода */
+  double vars[VAR_COUNT];     /* Начальные значения параметров (NAN - нет) */
+  ParamSweep sweep;           /* Каждое выражение - frames кадров */
+  MathPrecision precision;    /* Точность функций в байткоде */
+} BatchConfig;
+
+/*-----------------------------------------------------------------------------
+ * Узел DAG выражения: одинаковые поддеревья хранятся один раз
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  unsigned char op;     /* Код операции (OpCode) */
+  int a;                /* Левый (или единственный) операнд, -1 если нет */
+  int b;                /* Правый операнд, -1 если нет */
+  double value;         /* Значение для OP_CONST, номер буквы для OP_VAR */
+  int uses;             /* Сколько раз на узел ссылаются */
+  int next;             /* Следующий узел в цепочке хеш-таблицы */
+} DagNode;
+
+/*-----------------------------------------------------------------------------
+ * DAG выражения с хеш-таблицей для поиска одинаковых узлов
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  DagNode *nodes;       /* Узлы в порядке создания (операнды раньше) */
+  int size;             /* Количество узлов */
+  int capacity;         /* Емкость массива узлов */
+  int *buckets;         /* Головы цепочек хеш-таблицы */
+  int bucketCount;      /* Размер таблицы (степень двойки) */
+  int root;             /* Корень выражения */
+} ExprDag;
+
+/* Стадии обработки выражения, которые замеряет трассировка */
+typedef enum {
+  STAGE_LEX,              /* tokenize */
+  STAGE_PARSE,            /* Разбор в дерево */
+  STAGE_EVAL,             /* Значения функции по столбцам */
+  STAGE_RENDER,           /* Звёздочки на холсте */
+  STAGE_OUTPUT,           /* writeFrame */
+  STAGE_COUNT
+} TraceStage;
+
+/* Счётчики трассировки */
+typedef enum {
+  COUNTER_TOKENS,         /* Токенов после лексического разбора */
+  COUNTER_FOLDED,         /* Узлов, убранных свёрткой констант */
+  COUNTER_RPN_STACK,      /* Наибольшая глубина стека evalRPN */
+  COUNTER_PROGRAM_DEPTH,  /* Наибольшая глубина стека байткода */
+  COUNTER_SAMPLES,        /* Вычислено значений функции */
+  COUNTER_NAN,            /* Из них NaN */
+  COUNTER_INF,            /* Из них бесконечностей */
+  COUNTER_OFF_CANVAS,     /* Значений, не попавших на холст */
+  COUNTER_COUNT
+} TraceCounter;
+
+/* Начало замеряемого интервала */
+typedef struct {
+  double ns;                  /* Монотонное время */
+  unsigned long long cycles;  /* Такты процессора */
+} TraceSpan;
+
+/*-----------------------------------------------------------------------------
+ * Трассировка включается при сборке (-DGRAPH_TRACE, цель make trace).
+ * Без флага макросы ниже раскрываются в пустоту и ничего не стоят.
+ *-----------------------------------------------------------------------------*/
+#ifdef GRAPH_TRACE
+#define TRACE_LOCAL(code) code
+#define TRACE_BEGIN(span) TraceSpan span; traceBegin(&span)
+#define TRACE_END(span, stage) traceEnd(&span, stage)
+#define TRACE_COUNT(counter, n) traceCount(counter, n)
+#define TRACE_MAX(counter, v) traceMax(counter, v)
+#define TRACE_SAMPLES(ys, n) traceSamples(ys, n)
+#else
+#define TRACE_LOCAL(code)
+#define TRACE_BEGIN(span)
+#define TRACE_END(span, stage) ((void)0)
+#define TRACE_COUNT(counter, n) ((void)0)
+#define TRACE_MAX(counter, v) ((void)0)
+#define TRACE_SAMPLES(ys, n) ((void)0)
+#endif
 
 /*-----------------------------------------------------------------------------
  * Прототипы всех функций
  *-----------------------------------------------------------------------------*/
 
+/* Арена для временных массивов разбора одного выражения */
+void initArena(Arena *arena, size_t size);
+void *arenaAlloc(Arena *arena, size_t bytes);
+void resetArena(Arena *arena);
+void freeArena(Arena *arena);
+size_t exprArenaSize(size_t len);
+
 /* Инициализация и работа с динамическим массивом токенов */
 void initTokenArray(TokenArray *arr);
+void initTokenArrayArena(TokenArray *arr, Arena *arena, int cap);
 void pushTokenArray(TokenArray *arr, Token t);
 void freeTokenArray(TokenArray *arr);
 
-/* Инициализация и работа со стеком токенов */
-void initTokenStack(TokenStack *st, int cap);
-void pushTokenStack(TokenStack *st, Token t);
-Token popTokenStack(TokenStack *st);
-Token peekTokenStack(const TokenStack *st);
-int isStackEmpty(const TokenStack *st);
-void freeTokenStack(TokenStack *st);
-
 /* Проверки и создание токенов */
 int precedence(TokenType t);
 int isFunction(TokenType t);
 int isOperator(TokenType t);
+int isOperand(TokenType t);
 Token makeToken(TokenType type, double val);
 
-/* Лексический разбор (строка -> токены) */
-void tokenize(const char *str, TokenArray *arr);
+/* Лексический разбор (строка -> токены): -1 или позиция ошибки */
+int tokenize(const char *str, TokenArray *arr);
+int lexToken(const char *s, Token *t);
+
+/* Потоковый лексический разбор: finishLexStream - -1 или позиция ошибки,
+ * lexColumn - позиция в выражении токена номер token */
+void initLexStream(LexStream *ls, TokenArray *arr);
+void feedLexStream(LexStream *ls, const char *data, size_t n);
+long finishLexStream(LexStream *ls);
+long lexColumn(const LexStream *ls, long token);
+void freeLexStream(LexStream *ls);
+
+/* Разбор в дерево (Пратт): строка за один проход или готовые токены */
+int parseExpr(const char *str, Arena *arena, ExprAst *ast);
+int parseTokens(const TokenArray *infix, Arena *arena, ExprAst *ast);
 
-/* Преобразование инфиксной записи в ОПН */
-void toRPN(const TokenArray *infix, TokenArray *postfix);
+/* Свёртка констант и упрощения над деревом, возвращает число убранных узлов;
+ * countFold - то же с учётом в stats */
+int foldAst(ExprAst *ast);
+void countFold(ExprAst *ast, FoldStats *stats);
+void printFoldStats(const FoldStats *stats);
+
+/* Понижение дерева в ОПН (для эталонных интерпретаторов) */
+void lowerAst(const ExprAst *ast, TokenArray *postfix);
+
+/* Глубина стека для вычисления ОПН или 0, если ОПН некорректна */
+int rpnDepth(const TokenArray *postfix);
 
 /* Вычисление математической функции типа sin/cos/... */
 double computeFunction(TokenType t, double val);
@@ -88,10 +622,178 @@ double computeFunction(TokenType t, double val);
 /* Вычисление выражения в ОПН при заданном x */
 double evalRPN(const TokenArray *postfix, double xval);
 
-/* Заполнение холста (25x80) звёздочками по значению функции */
-void fillCanvas(char canvas[25][80], const TokenArray *postfix);
+/* Область просмотра и холст */
+void initViewport(Viewport *view);
+void initCanvas(Canvas *canvas, const Viewport *view);
+void freeCanvas(Canvas *canvas);
+double columnX(const Viewport *view, int c);
+double rowY(const Viewport *view, int r);
+char seriesGlyph(int s);
+
+/* Заполнение холста звёздочками по значению функции (pool может быть NULL) */
+void fillCanvas(Canvas *canvas, const TokenArray *postfix, EvalMode mode,
+                ThreadPool *pool);
+void fillCanvasProgram(Canvas *canvas, const Program *prog, EvalMode mode,
+                       ThreadPool *pool);
+void fillCanvasPrograms(Canvas *canvas, const Program *progs,
+                        SharedJit *const *jits, int count, EvalMode mode,
+                        ThreadPool *pool);
+int countSeries(const char *text);
+
+/* Растеризация ряда значений: точки или линии по сетке rasterGrid */
+void rasterGrid(const Viewport *view, Viewport *dots);
+size_t rasterCellBytes(const Viewport *view);
+void clearRaster(Canvas *canvas);
+void clearRasterColumns(Canvas *canvas, size_t begin, size_t end);
+void shiftRaster(Canvas *canvas, long shift);
+void rasterSeries(Canvas *canvas, const double *ys, size_t begin, size_t end,
+                  char glyph);
+
+/* Параметры: все NAN (не заданы), значение в кадре step перебора */
+void initVars(double *vars);
+int parseVar(const char *text, double *vars);
+int parseSweep(const char *text, ParamSweep *sweep);
+void sweepVars(const ParamSweep *sweep, int step, double *vars);
+
+/* Режимы сетки: f(x, y) в каждой клетке холста */
+int isGridMode(EvalMode mode);
+void fillCanvasGrid(Canvas *canvas, const Program *progs, int count,
+                    EvalMode mode, ThreadPool *pool);
+
+/* Перерисовка после сдвига/масштаба: считаются только новые столбцы */
+void initSampleCache(SampleCache *samples);
+void resetSampleCache(SampleCache *samples);
+void freeSampleCache(SampleCache *samples);
+void fillCanvasSamples(Canvas *canvas, const Program *prog, SharedJit *jit,
+                       EvalMode mode, ThreadPool *pool, SampleCache *samples);
+
+/* Вывод кадров: одна запись на кадр, path == NULL - stdout */
+int openFrameSink(FrameSink *sink, const char *path);
+int writeFrame(FrameSink *sink, const Canvas *canvas, int separate);
+int closeFrameSink(FrameSink *sink);
+
+/* Пакетный режим: по кадру на каждую строку потока in */
+int runBatch(FILE *in, const BatchConfig *cfg, ThreadPool *pool,
+             FrameSink *out);
+int compileLibrary(FILE *in, const char *path, int cacheSize);
+int compileSeries(ExprCache *cache, Arena *scratch, char *key,
+                  const long *columns, Program **progs);
+SharedJit **shareSeriesJit(ExprCache *cache, char *key, const Program *progs,
+                           int count);
+int parseBatchCommand(const char *line, Viewport *view, double *vars);
+
+/* Сервер: кадры по запросам через Unix-сокет path */
+int runServer(const char *path, const BatchConfig *cfg, int workers);
+
+/* Компиляция ОПН в байткод и его вычисление */
+void initProgram(Program *prog);
+void freeProgram(Program *prog);
+void copyProgram(Program *dst, const Program *src);
+void emitProgramByte(Program *prog, unsigned char b);
+void emitProgramIndex(Program *prog, unsigned int idx);
+unsigned int addProgramConst(Program *prog, double v);
+int compileRPN(const TokenArray *postfix, Program *prog);
+int compileAst(const ExprAst *ast, Program *prog);
+double evalProgram(const Program *prog, double xval);
+void setProgramPrecision(Program *progs, int count, MathPrecision precision);
+TokenType opToken(unsigned char op);
+
+/* Быстрые приближения функций (--precision fast): одно значение и
+ * BATCH_LANES значений на месте */
+double fastSin(double x);
+double fastCos(double x);
+double fastTan(double x);
+double fastCtg(double x);
+double fastLog(double x);
+void fastSinLanes(double *restrict a);
+void fastCosLanes(double *restrict a);
+void fastTanLanes(double *restrict a);
+void fastCtgLanes(double *restrict a);
+void fastLogLanes(double *restrict a);
+
+/* Переменные в байткоде: маска букв и подстановка значений как констант */
+unsigned int programVars(const Program *prog);
+void bindProgram(const Program *src, const double *vars, unsigned int keep,
+                 Program *dst);
+Program *bindPrograms(const Program *progs, int count, const double *vars,
+                      EvalMode mode);
+void freeBoundPrograms(Program *bound, int count);
+
+/* Библиотека скомпилированных выражений: запись и чтение через mmap */
+void initLibraryWriter(LibraryWriter *w);
+void freeLibraryWriter(LibraryWriter *w);
+void addLibraryFrame(LibraryWriter *w, const char *key, const Program *progs,
+                     int count);
+int saveLibrary(const LibraryWriter *w, const char *path);
+int openProgramLibrary(ProgramLibrary *lib, const char *path);
+void closeProgramLibrary(ProgramLibrary *lib);
+const char *libraryKey(const ProgramLibrary *lib, int f);
+int libraryProgram(const ProgramLibrary *lib, int p, Program *prog);
+
+/* Пакетное вычисление по массиву x (SIMD-дорожки) */
+void evalProgramBatch(const Program *prog, const double *xs, double *ys,
+                      size_t n);
+void evalRPNBatch(const TokenArray *postfix, const double *xs, double *ys,
+                  size_t n);
+void evalProgramGrid(const Program *prog, const double *xs, size_t n,
+                     const double *ys, size_t rows, double *out);
+
+/* DAG выражения: устранение общих подвыражений */
+void initExprDag(ExprDag *dag);
+void freeExprDag(ExprDag *dag);
+int buildExprDag(const TokenArray *postfix, ExprDag *dag);
+int buildAstDag(const ExprAst *ast, ExprDag *dag);
+void compileExprDag(ExprDag *dag, Program *prog);
+
+/* JIT: байткод -> машинный код x86-64 */
+int compileJit(const Program *prog, JitProgram *jit);
+void freeJit(JitProgram *jit);
+void evalJitBatch(const JitProgram *jit, const double *xs, double *ys,
+                  size_t n);
+double evalJit(const JitProgram *jit, double xval);
+SharedJit *shareJit(const Program *prog);
+SharedJit *holdJit(SharedJit *shared);
+void releaseJit(SharedJit *shared);
+SharedJit **shareJits(const Program *progs, int count);
+void releaseJits(SharedJit **jits, int count);
+
+/* Интервальная арифметика и отрисовка столбца по отрезку x */
+int intervalEmpty(Interval v);
+Interval computeOperatorInterval(TokenType t, Interval a, Interval b);
+Interval computeFunctionInterval(TokenType t, Interval v);
+Interval evalRPNInterval(const TokenArray *postfix, Interval x);
+Interval evalProgramInterval(const Program *prog, Interval x);
+void plotIntervalColumn(Canvas *canvas, const Program *prog, int c,
+                        char glyph);
+
+/* Автоматическое дифференцирование (прямой режим, дуальные числа) */
+Dual computeOperatorDual(TokenType t, Dual a, Dual b);
+Dual computeFunctionDual(TokenType t, Dual a);
+Dual evalRPNDual(const TokenArray *postfix, double xval);
+Dual evalProgramDual(const Program *prog, double xval);
+
+/* Кэш скомпилированных выражений */
+size_t normalizeExpr(const char *src, char *dst, long *columns);
+void initExprCache(ExprCache *cache, int capacity);
+void freeExprCache(ExprCache *cache);
+CacheEntry *findExprCache(ExprCache *cache, const char *key);
+CacheEntry *peekExprCache(ExprCache *cache, const char *key);
+CacheEntry *addExprCache(ExprCache *cache, const char *key);
+
+/* Пул потоков для параллельной обработки столбцов */
+int initThreadPool(ThreadPool *pool, int threads);
+void freeThreadPool(ThreadPool *pool);
+void runThreadPool(ThreadPool *pool, PoolTask task, void *arg, size_t total,
+                   size_t chunk);
 
-/* Печать холста (25x80) на экран */
-void printCanvas(char canvas[25][80]);
+/* Трассировка: интервалы стадий, счётчики и итоговый отчёт */
+#ifdef GRAPH_TRACE
+void traceBegin(TraceSpan *span);
+void traceEnd(const TraceSpan *span, TraceStage stage);
+void traceCount(TraceCounter counter, unsigned long long n);
+void traceMax(TraceCounter counter, unsigned long long v);
+void traceSamples(const double *ys, size_t n);
+#endif
+int traceReport(FILE *summary, const char *jsonPath);
 
 #endif /* GRAPH_H */
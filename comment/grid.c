@@ -0,0 +1,181 @@
+#include "graph.h"
+
+/*-----------------------------------------------------------------------------
+ * Общие данные для потоков, заполняющих холст сетки f(x, y)
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  Canvas *canvas;             /* Холст (каждый поток пишет свои строки) */
+  const Program *prog;        /* Байткод выражений (count подряд) */
+  int count;                  /* Сколько выражений */
+  EvalMode mode;              /* EVAL_HEATMAP или EVAL_CONTOUR */
+  double *xs;                 /* x по столбцам */
+  double *ys;                 /* y по строкам */
+  double *values;             /* Значения: по сетке width*height на выражение */
+  double *lo;                 /* Наименьшее конечное значение выражения */
+  double *hi;                 /* Наибольшее */
+} GridJob;
+
+/*============================================================================
+ * Рисуется ли в этом режиме сетка f(x, y), а не график y = f(x)
+ *===========================================================================*/
+int isGridMode(EvalMode mode) {
+  return (mode == EVAL_HEATMAP || mode == EVAL_CONTOUR);
+}
+
+/*============================================================================
+ * Локальная функция (задача пула): значения всех выражений в строках
+ * [begin, end) - одна плитка из GRID_TILE_ROWS строк
+ *===========================================================================*/
+static void evalTiles(void *arg, size_t begin, size_t end) {
+  GridJob *job = (GridJob *)arg;
+  size_t width = (size_t)job->canvas->view.width;
+  size_t cells = width * (size_t)job->canvas->view.height;
+  for (int s = 0; s < job->count; s++) {
+    evalProgramGrid(&job->prog[s], job->xs, width, job->ys + begin,
+                    end - begin, job->values + s * cells + begin * width);
+  }
+}
+
+/*============================================================================
+ * Локальная функция: диапазон конечных значений [*lo, *hi] (если таких
+ * нет, lo > hi)
+ *===========================================================================*/
+static void valueRange(const double *vs, size_t n, double *lo, double *hi) {
+  *lo = INFINITY;
+  *hi = -INFINITY;
+  for (size_t i = 0; i < n; i++) {
+    if (isfinite(vs[i])) {
+      *lo = (vs[i] < *lo) ? vs[i] : *lo;
+      *hi = (vs[i] > *hi) ? vs[i] : *hi;
+    }
+  }
+}
+
+/*============================================================================
+ * Локальная функция: доля пути значения v от lo до hi (константа - 0.5)
+ *===========================================================================*/
+static double valueShare(double v, double lo, double hi) {
+  return (hi > lo) ? (v - lo) / (hi - lo) : 0.5;
+}
+
+/*============================================================================
+ * Локальная функция: значок тепловой карты для v. Где функция не
+ * определена, остаётся пробел, как у наименьших значений.
+ *===========================================================================*/
+static char heatGlyph(double v, double lo, double hi) {
+  int last = (int)sizeof(HEATMAP_RAMP) - 2;
+  int k = 0;
+  if (isfinite(v)) {
+    k = (int)(valueShare(v, lo, hi) * last + 0.5);
+    k = (k < 0) ? 0 : (k > last ? last : k);
+  }
+  return HEATMAP_RAMP[k];
+}
+
+/*============================================================================
+ * Локальная функция: номер полосы между уровнями для v или -1, если v
+ * не конечно
+ *===========================================================================*/
+static int contourBand(double v, double lo, double hi) {
+  int band = -1;
+  if (isfinite(v)) {
+    band = (int)floor(valueShare(v, lo, hi) * CONTOUR_LEVELS);
+    band = (band < 0) ? 0 : (band >= CONTOUR_LEVELS ? CONTOUR_LEVELS - 1
+                                                    : band);
+  }
+  return band;
+}
+
+/*============================================================================
+ * Локальная функция: проходит ли линия уровня между клетками со значениями
+ * a и b (обе определены, полосы разные)
+ *===========================================================================*/
+static int crossesLevel(double a, double b, double lo, double hi) {
+  int ba = contourBand(a, lo, hi);
+  int bb = contourBand(b, lo, hi);
+  return ba >= 0 && bb >= 0 && ba != bb;
+}
+
+/*============================================================================
+ * Локальная функция (задача пула): отрисовка строк [begin, end).
+ * Тепловая карта - по первому выражению; линии уровня - по всем, каждое
+ * своим значком (линия ставится в клетку, за которой меняется полоса).
+ *===========================================================================*/
+static void renderRows(void *arg, size_t begin, size_t end) {
+  GridJob *job = (GridJob *)arg;
+  Canvas *canvas = job->canvas;
+  size_t width = (size_t)canvas->view.width;
+  size_t height = (size_t)canvas->view.height;
+  for (size_t r = begin; r < end; r++) {
+    char *row = canvas->cells + r * canvas->stride;
+    const double *vs = job->values + r * width;
+    if (job->mode == EVAL_HEATMAP) {
+      for (size_t c = 0; c < width; c++) {
+        row[c] = heatGlyph(vs[c], job->lo[0], job->hi[0]);
+      }
+    } else {
+      memset(row, '.', width);
+      for (int s = 0; s < job->count; s++) {
+        const double *v = vs + (size_t)s * width * height;
+        for (size_t c = 0; c < width; c++) {
+          if ((c + 1 < width &&
+               crossesLevel(v[c], v[c + 1], job->lo[s], job->hi[s])) ||
+              (r + 1 < height &&
+               crossesLevel(v[c], v[c + width], job->lo[s], job->hi[s]))) {
+            row[c] = seriesGlyph(s);
+          }
+        }
+      }
+    }
+  }
+}
+
+/*============================================================================
+ * Заполнение холста по сетке: в каждой клетке f(x, y), x - по столбцам,
+ * y - по строкам (как у графика: строка 0 - yMin). Сетка считается
+ * плитками по GRID_TILE_ROWS строк, плитки делятся между потоками пула.
+ * Шкала значений своя у каждого выражения: от наименьшего конечного
+ * значения на холсте до наибольшего. Тепловая карта рисует только первое
+ * выражение, и остальные не считаются вовсе.
+ *===========================================================================*/
+void fillCanvasGrid(Canvas *canvas, const Program *progs, int count,
+                    EvalMode mode, ThreadPool *pool) {
+  const Viewport *view = &canvas->view;
+  size_t width = (size_t)view->width;
+  size_t height = (size_t)view->height;
+  size_t cells = width * height;
+  if (mode == EVAL_HEATMAP) {
+    count = 1;                      /* Вторую карту не на что наложить */
+  }
+  GridJob job;
+  job.canvas = canvas;
+  job.prog = progs;
+  job.count = count;
+  job.mode = mode;
+  job.xs = (double *)malloc(sizeof(double) * width);
+  job.ys = (double *)malloc(sizeof(double) * height);
+  job.values = (double *)malloc(sizeof(double) * cells * count);
+  job.lo = (double *)malloc(sizeof(double) * count);
+  job.hi = (double *)malloc(sizeof(double) * count);
+  for (size_t c = 0; c < width; c++) {
+    job.xs[c] = columnX(view, (int)c);
+  }
+  for (size_t r = 0; r < height; r++) {
+    job.ys[r] = rowY(view, (int)r);
+  }
+  TRACE_BEGIN(evalSpan);
+  runThreadPool(pool, evalTiles, &job, height, GRID_TILE_ROWS);
+  TRACE_SAMPLES(job.values, cells * count);
+  TRACE_END(evalSpan, STAGE_EVAL);
+  TRACE_BEGIN(renderSpan);
+  for (int s = 0; s < count; s++) {
+    valueRange(job.values + s * cells, cells, &job.lo[s], &job.hi[s]);
+  }
+  runThreadPool(pool, renderRows, &job, height, GRID_TILE_ROWS);
+  TRACE_END(renderSpan, STAGE_RENDER);
+  free(job.xs);
+  free(job.ys);
+  free(job.values);
+  free(job.lo);
+  free(job.hi);
+}
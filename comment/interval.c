@@ -0,0 +1,322 @@
+#include "graph.h"
+
+/*============================================================================
+ * Локальная функция: пустой интервал (функция нигде не определена)
+ *===========================================================================*/
+static Interval emptyInterval(void) {
+  Interval r = {NAN, NAN};
+  return r;
+}
+
+/*============================================================================
+ * Пустой ли интервал (NaN в границах сравнение не проходит)
+ *===========================================================================*/
+int intervalEmpty(Interval v) {
+  return !(v.lo <= v.hi);
+}
+
+/*============================================================================
+ * Локальная функция: расширить интервал на шаг округления в обе стороны,
+ * чтобы ошибки округления libm не сузили оценку. NaN в границе
+ * (inf - inf, 0 * inf) заменяется бесконечностью: значение не ограничено.
+ *===========================================================================*/
+static Interval outward(double lo, double hi) {
+  Interval r;
+  r.lo = isnan(lo) ? -INFINITY : nextafter(lo, -INFINITY);
+  r.hi = isnan(hi) ? INFINITY : nextafter(hi, INFINITY);
+  return r;
+}
+
+/*============================================================================
+ * Локальная функция: есть ли в [a, b] точка вида t0 + k * period
+ *===========================================================================*/
+static int hitsPeriod(double a, double b, double t0, double period) {
+  double k = ceil((a - t0) / period);
+  return t0 + k * period <= b;
+}
+
+/*============================================================================
+ * Локальная функция: произведение интервалов - min/max из четырёх углов
+ *===========================================================================*/
+static Interval mulInterval(Interval a, Interval b) {
+  double p1 = a.lo * b.lo;
+  double p2 = a.lo * b.hi;
+  double p3 = a.hi * b.lo;
+  double p4 = a.hi * b.hi;
+  double lo = fmin(fmin(p1, p2), fmin(p3, p4));  /* fmin пропускает NaN */
+  double hi = fmax(fmax(p1, p2), fmax(p3, p4));
+  return outward(lo, hi);
+}
+
+/*============================================================================
+ * Локальная функция: частное интервалов, когда делитель касается нуля.
+ * Как в evalProgram, a/0 - бесконечность со знаком a, 0/0 - NaN (его в
+ * оценке нет). Знак нуля в делителе не различаем: он меняет только знак
+ * бесконечности, которая не рисуется, а дальше даёт 0 или NaN.
+ *===========================================================================*/
+static Interval divByZeroInterval(Interval a, Interval b) {
+  Interval r = {-INFINITY, INFINITY};
+  int positive = (a.lo >= 0.0);     /* Ноль в a здесь даёт только NaN */
+  int negative = (a.hi <= 0.0);     /* или 0 / b */
+  if (a.lo == 0.0 && a.hi == 0.0) {
+    r = (b.lo == 0.0 && b.hi == 0.0) ? emptyInterval() : outward(0.0, 0.0);
+  } else if (b.lo == 0.0 && b.hi == 0.0) {
+    if (positive || negative) {     /* Только a/0 - одна бесконечность */
+      r.lo = positive ? INFINITY : -INFINITY;
+      r.hi = r.lo;
+    }
+  } else if (b.lo == 0.0 && positive) {        /* [0, d]: a/d и выше */
+    r = outward(a.lo / b.hi, INFINITY);
+  } else if (b.lo == 0.0 && negative) {
+    r = outward(-INFINITY, a.hi / b.hi);
+  } else if (b.hi == 0.0 && positive) {        /* [c, 0]: a/c и ниже */
+    r = outward(-INFINITY, a.lo / b.lo);
+  } else if (b.hi == 0.0 && negative) {
+    r = outward(a.hi / b.lo, INFINITY);
+  }
+  return r;
+}
+
+/*============================================================================
+ * Локальная функция: частное интервалов. Делитель без нуля - умножение
+ * на обратный; с нулём на границе частное ограничено с одной стороны
+ * (1/sqrt(x) у нуля - [1/sqrt(d), +inf)), с нулём внутри - нет.
+ *===========================================================================*/
+static Interval divInterval(Interval a, Interval b) {
+  Interval r;
+  if (b.lo > 0.0 || b.hi < 0.0) {
+    Interval inv = outward(1.0 / b.hi, 1.0 / b.lo);
+    r = mulInterval(a, inv);
+  } else {
+    r = divByZeroInterval(a, b);
+  }
+  return r;
+}
+
+/*============================================================================
+ * Интервальная версия бинарного оператора (+ - * /): оценка a op b
+ * для всех значений из a и b
+ *===========================================================================*/
+Interval computeOperatorInterval(TokenType t, Interval a, Interval b) {
+  Interval r;
+  if (intervalEmpty(a) || intervalEmpty(b)) {
+    r = emptyInterval();
+  } else if (t == TOKEN_PLUS) {
+    r = outward(a.lo + b.lo, a.hi + b.hi);
+  } else if (t == TOKEN_MINUS) {
+    r = outward(a.lo - b.hi, a.hi - b.lo);
+  } else if (t == TOKEN_MULT) {
+    r = mulInterval(a, b);
+  } else {
+    r = divInterval(a, b);
+  }
+  return r;
+}
+
+/*============================================================================
+ * Локальная функция: sin или cos (fn) на [v.lo, v.hi] - значения на концах
+ * плюс экстремумы +-1, если внутрь попал максимум (peak + 2k*pi) или минимум
+ *===========================================================================*/
+static Interval waveInterval(Interval v, double (*fn)(double), double peak) {
+  Interval r;
+  if (v.hi - v.lo >= 2.0 * M_PI) {
+    r.lo = -1.0;
+    r.hi = 1.0;
+  } else {
+    double a = fn(v.lo);
+    double b = fn(v.hi);
+    r = outward(fmin(a, b), fmax(a, b));
+    if (hitsPeriod(v.lo, v.hi, peak, 2.0 * M_PI)) {
+      r.hi = 1.0;
+    }
+    if (hitsPeriod(v.lo, v.hi, peak + M_PI, 2.0 * M_PI)) {
+      r.lo = -1.0;
+    }
+    r.lo = fmax(r.lo, -1.0);
+    r.hi = fmin(r.hi, 1.0);
+  }
+  return r;
+}
+
+/*============================================================================
+ * Интервальная версия computeFunction: оценка f(v) для всех значений из v.
+ * Часть v вне области определения (sqrt, ln) отбрасывается; если внутри
+ * полюс (tan, ctg), интервал становится неограниченным.
+ *===========================================================================*/
+Interval computeFunctionInterval(TokenType t, Interval v) {
+  Interval r = emptyInterval();
+  if (intervalEmpty(v)) {
+    r = v;
+  } else if (t == TOKEN_SIN) {
+    r = waveInterval(v, sin, M_PI / 2.0);
+  } else if (t == TOKEN_COS) {
+    r = waveInterval(v, cos, 0.0);
+  } else if (t == TOKEN_TAN || t == TOKEN_CTG) {
+    double pole = (t == TOKEN_TAN) ? M_PI / 2.0 : 0.0;
+    if (v.hi - v.lo >= M_PI || hitsPeriod(v.lo, v.hi, pole, M_PI)) {
+      r.lo = -INFINITY;
+      r.hi = INFINITY;
+    } else if (t == TOKEN_TAN) {    /* Между полюсами tan возрастает */
+      r = outward(tan(v.lo), tan(v.hi));
+    } else {                        /* ... а ctg убывает */
+      r = outward(1.0 / tan(v.hi), 1.0 / tan(v.lo));
+    }
+  } else if (t == TOKEN_SQRT) {
+    if (v.hi >= 0.0) {
+      r = outward(sqrt(fmax(v.lo, 0.0)), sqrt(v.hi));
+      r.lo = fmax(r.lo, 0.0);
+    }
+  } else if (t == TOKEN_LN) {
+    if (v.hi > 0.0) {
+      r = outward((v.lo > 0.0) ? log(v.lo) : -INFINITY, log(v.hi));
+    }
+  }
+  return r;
+}
+
+/*============================================================================
+ * Интервальное вычисление выражения в ОПН: x пробегает отрезок x
+ *===========================================================================*/
+Interval evalRPNInterval(const TokenArray *postfix, Interval x) {
+  Interval small[RPN_STACK_SIZE];
+  Interval *stack = small;
+  if (postfix->depth > RPN_STACK_SIZE) {
+    stack = (Interval *)malloc(sizeof(Interval) * postfix->depth);
+  }
+  int top = -1;
+  int count = (postfix->depth > 0) ? postfix->size : 0;
+  for (int i = 0; i < count; i++) {
+    Token t = postfix->data[i];
+    if (t.type == TOKEN_NUMBER) {
+      stack[++top].lo = t.value;
+      stack[top].hi = t.value;
+    } else if (t.type == TOKEN_X) {
+      stack[++top] = x;
+    } else if (t.type == TOKEN_VAR) {
+      stack[++top] = emptyInterval();
+    } else if (t.type == TOKEN_UMINUS) {
+      double lo = stack[top].lo;
+      stack[top].lo = -stack[top].hi;
+      stack[top].hi = -lo;
+    } else if (isFunction(t.type)) {
+      stack[top] = computeFunctionInterval(t.type, stack[top]);
+    } else if (isOperator(t.type)) {  /* Лишние скобки пропускаем */
+      top--;
+      stack[top] = computeOperatorInterval(t.type, stack[top], stack[top + 1]);
+    }
+  }
+  Interval res = (top >= 0) ? stack[top] : emptyInterval();
+  if (stack != small) {
+    free(stack);
+  }
+  return res;
+}
+
+/*============================================================================
+ * Интервальное вычисление байткода: то же, что evalProgram, но над
+ * отрезками. Результат содержит f(x) для каждого определённого x из x.
+ *===========================================================================*/
+Interval evalProgramInterval(const Program *prog, Interval x) {
+  Interval small[PROGRAM_SMALL_STACK];  /* Обычно хватает стека на кадре */
+  Interval *stack = small;
+  int frameSize = prog->maxDepth + prog->slotCount;
+  if (frameSize > PROGRAM_SMALL_STACK) {
+    stack = (Interval *)malloc(sizeof(Interval) * frameSize);
+  }
+  Interval *slots = stack + prog->maxDepth;  /* Слоты общих подвыражений */
+  const unsigned char *code = prog->code;
+  const unsigned char *end = code + prog->codeSize;
+  unsigned int idx = 0;
+  int top = -1;
+  while (code < end) {
+    unsigned char op = *code++;
+    if (op == OP_CONST) {
+      memcpy(&idx, code, sizeof(idx));
+      code += sizeof(idx);
+      stack[++top].lo = prog->consts[idx];
+      stack[top].hi = prog->consts[idx];
+    } else if (op == OP_X) {
+      stack[++top] = x;
+    } else if (op == OP_LOAD) {
+      memcpy(&idx, code, sizeof(idx));
+      code += sizeof(idx);
+      stack[++top] = slots[idx];
+    } else if (op == OP_STORE) {
+      memcpy(&idx, code, sizeof(idx));
+      code += sizeof(idx);
+      slots[idx] = stack[top];
+    } else if (op == OP_VAR) {      /* Не подставлена - пусто */
+      code += sizeof(idx);
+      stack[++top] = emptyInterval();
+    } else if (op == OP_NEG) {
+      double lo = stack[top].lo;
+      stack[top].lo = -stack[top].hi;
+      stack[top].hi = -lo;
+    } else if (op >= OP_ADD && op <= OP_DIV) {
+      top--;
+      stack[top] = computeOperatorInterval(opToken(op), stack[top],
+                                           stack[top + 1]);
+    } else {
+      stack[top] = computeFunctionInterval(opToken(op), stack[top]);
+    }
+  }
+  Interval res = (top >= 0) ? stack[top] : emptyInterval();
+  if (stack != small) {
+    free(stack);
+  }
+  return res;
+}
+
+/*============================================================================
+ * Локальная функция: строка холста для значения y из [yMin, yMax]
+ *===========================================================================*/
+static int rowOf(const Viewport *view, double y) {
+  double scaled = (y - view->yMin) * (view->height - 1) /
+                  (view->yMax - view->yMin);
+  return (int)round(scaled);
+}
+
+/*============================================================================
+ * Локальная функция: значки glyph в столбце c для x из [a, b].
+ * Отрезок, чьи значения не задевают холст, отбрасывается целиком. Если
+ * оценка y захватывает больше двух строк, отрезок делится пополам -
+ * пока не станет точной или не кончится глубина.
+ *===========================================================================*/
+static void plotInterval(Canvas *canvas, const Program *prog, int c,
+                         char glyph, double a, double b, int depth) {
+  const Viewport *view = &canvas->view;
+  Interval x = {a, b};
+  Interval y = evalProgramInterval(prog, x);
+  TRACE_COUNT(COUNTER_SAMPLES, 1);
+  if (!intervalEmpty(y) && y.hi >= view->yMin && y.lo <= view->yMax) {
+    int lo = rowOf(view, fmax(y.lo, view->yMin));
+    int hi = rowOf(view, fmin(y.hi, view->yMax));
+    if (hi - lo <= 1 || depth >= INTERVAL_MAX_DEPTH) {
+      for (int row = lo; row <= hi; row++) {  /* Кривая проходит все строки */
+        canvas->cells[(size_t)row * canvas->stride + c] = glyph;
+      }
+    } else {
+      double mid = 0.5 * (a + b);
+      plotInterval(canvas, prog, c, glyph, a, mid, depth + 1);
+      plotInterval(canvas, prog, c, glyph, mid, b, depth + 1);
+    }
+  } else {
+    TRACE_COUNT(COUNTER_OFF_CANVAS, 1);  /* Весь отрезок мимо холста */
+  }
+}
+
+/*============================================================================
+ * Интервальная отрисовка столбца c значком glyph: столбец покрывает x
+ * на полшага в обе стороны от columnX, и закрашиваются все строки, которые
+ * кривая пересекает на этом отрезке (крутые участки - без разрывов).
+ *===========================================================================*/
+void plotIntervalColumn(Canvas *canvas, const Program *prog, int c,
+                        char glyph) {
+  const Viewport *view = &canvas->view;
+  double half = 0.0;
+  if (view->width > 1) {
+    half = 0.5 * (view->xMax - view->xMin) / (double)(view->width - 1);
+  }
+  double x = columnX(view, c);
+  plotInterval(canvas, prog, c, glyph, x - half, x + half, 0);
+}
@@ -0,0 +1,405 @@
+#include "graph.h"
+
+#include <sys/mman.h>                    /* mmap, mprotect, munmap */
+#include <stdint.h>                      /* uintptr_t для адресов функций */
+
+#if defined(__x86_64__)
+
+/*-----------------------------------------------------------------------------
+ * Буфер машинного кода и список мест, куда потом подставить адрес константы
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  unsigned char *bytes;   /* Сгенерированные байты */
+  int size;               /* Сколько байт занято */
+  int capacity;           /* Сколько байт выделено */
+  int *fixups;            /* Смещения полей rel32 для констант */
+  int *fixupConsts;       /* Номер константы для каждого поля */
+  int fixupCount;
+  int fixupCapacity;
+} CodeBuf;
+
+/* Номер служебной константы 1.0 (для ctg) - сразу после пула программы */
+#define JIT_ONE(prog) ((prog)->constCount)
+
+/*============================================================================
+ * Локальная функция: дописать байты в буфер кода
+ *===========================================================================*/
+static void emitBytes(CodeBuf *buf, const unsigned char *src, int n) {
+  while (buf->size + n > buf->capacity) {
+    buf->capacity *= 2;
+    buf->bytes = (unsigned char *)realloc(buf->bytes, buf->capacity);
+  }
+  memcpy(buf->bytes + buf->size, src, n);
+  buf->size += n;
+}
+
+/*============================================================================
+ * Локальная функция: дописать 32-битное число (смещение) в буфер кода
+ *===========================================================================*/
+static void emitInt32(CodeBuf *buf, int v) {
+  unsigned char bytes[4];
+  memcpy(bytes, &v, sizeof(bytes));     /* x86-64 - little-endian */
+  emitBytes(buf, bytes, 4);
+}
+
+/*============================================================================
+ * Локальная функция: movsd xmm0, [rbx + 8 * cell] или обратная запись.
+ * opcode 0x10 - загрузка из кадра, 0x11 - сохранение в кадр.
+ *===========================================================================*/
+static void emitFrameAccess(CodeBuf *buf, unsigned char opcode, int cell) {
+  unsigned char ins[] = {0xF2, 0x0F, opcode, 0x83};
+  emitBytes(buf, ins, sizeof(ins));
+  emitInt32(buf, 8 * cell);
+}
+
+/*============================================================================
+ * Локальная функция: movsd xmm0, [rip + rel32] на константу из пула.
+ * Сам rel32 подставляется в jitLink, когда известен адрес данных.
+ *===========================================================================*/
+static void emitConstLoad(CodeBuf *buf, int constIdx) {
+  static const unsigned char ins[] = {0xF2, 0x0F, 0x10, 0x05};
+  emitBytes(buf, ins, sizeof(ins));
+  if (buf->fixupCount == buf->fixupCapacity) {
+    buf->fixupCapacity *= 2;
+    buf->fixups = (int *)realloc(buf->fixups,
+                                 sizeof(int) * buf->fixupCapacity);
+    buf->fixupConsts = (int *)realloc(buf->fixupConsts,
+                                      sizeof(int) * buf->fixupCapacity);
+  }
+  buf->fixups[buf->fixupCount] = buf->size;
+  buf->fixupConsts[buf->fixupCount] = constIdx;
+  buf->fixupCount++;
+  emitInt32(buf, 0);
+}
+
+/*============================================================================
+ * Локальная функция: вызов функции libm (аргумент и результат в xmm0)
+ *===========================================================================*/
+static void emitCall(CodeBuf *buf, double (*fn)(double)) {
+  static const unsigned char movRax[] = {0x48, 0xB8};   /* mov rax, imm64 */
+  static const unsigned char callRax[] = {0xFF, 0xD0};  /* call rax */
+  uint64_t addr = (uint64_t)(uintptr_t)fn;
+  unsigned char imm[8];
+  memcpy(imm, &addr, sizeof(imm));
+  emitBytes(buf, movRax, sizeof(movRax));
+  emitBytes(buf, imm, sizeof(imm));
+  emitBytes(buf, callRax, sizeof(callRax));
+}
+
+/*============================================================================
+ * Локальная функция: xmm0 = [rbx + 8*cell] op xmm0 (левый операнд в памяти)
+ *===========================================================================*/
+static void emitBinary(CodeBuf *buf, unsigned char op, int cell) {
+  static const unsigned char movapd[] = {0x66, 0x0F, 0x28, 0xC8};
+  unsigned char arith[] = {0xF2, 0x0F, 0x58, 0xC1};     /* addsd xmm0,xmm1 */
+  if (op == OP_SUB) {
+    arith[2] = 0x5C;
+  } else if (op == OP_MUL) {
+    arith[2] = 0x59;
+  } else if (op == OP_DIV) {
+    arith[2] = 0x5E;
+  }
+  emitBytes(buf, movapd, sizeof(movapd));               /* xmm1 = правый */
+  emitFrameAccess(buf, 0x10, cell);                     /* xmm0 = левый */
+  emitBytes(buf, arith, sizeof(arith));
+}
+
+/*============================================================================
+ * Локальная функция: унарный минус, sqrt, ctg и вызовы libm (или быстрых
+ * замен из fastmath.c) над xmm0
+ *===========================================================================*/
+static void emitUnary(CodeBuf *buf, const Program *prog, unsigned char op) {
+  static const unsigned char neg[] = {
+      0x66, 0x48, 0x0F, 0x7E, 0xC0,                     /* movq rax, xmm0 */
+      0x48, 0x0F, 0xBA, 0xF8, 0x3F,                     /* btc rax, 63 */
+      0x66, 0x48, 0x0F, 0x6E, 0xC0};                    /* movq xmm0, rax */
+  static const unsigned char sqrtsd[] = {0xF2, 0x0F, 0x51, 0xC0};
+  static const unsigned char movapd[] = {0x66, 0x0F, 0x28, 0xC8};
+  static const unsigned char divsd[] = {0xF2, 0x0F, 0x5E, 0xC1};
+  if (op == OP_NEG) {
+    emitBytes(buf, neg, sizeof(neg));
+  } else if (op == OP_SQRT) {
+    emitBytes(buf, sqrtsd, sizeof(sqrtsd));
+  } else if (op == OP_SIN) {
+    emitCall(buf, sin);
+  } else if (op == OP_COS) {
+    emitCall(buf, cos);
+  } else if (op == OP_LN) {
+    emitCall(buf, log);
+  } else if (op == OP_FAST_SIN) {
+    emitCall(buf, fastSin);
+  } else if (op == OP_FAST_COS) {
+    emitCall(buf, fastCos);
+  } else if (op == OP_FAST_TAN) {
+    emitCall(buf, fastTan);
+  } else if (op == OP_FAST_CTG) {
+    emitCall(buf, fastCtg);
+  } else if (op == OP_FAST_LN) {
+    emitCall(buf, fastLog);
+  } else {                                              /* tan и ctg */
+    emitCall(buf, tan);
+    if (op == OP_CTG) {                                 /* 1.0 / tan */
+      emitBytes(buf, movapd, sizeof(movapd));
+      emitConstLoad(buf, JIT_ONE(prog));
+      emitBytes(buf, divsd, sizeof(divsd));
+    }
+  }
+}
+
+/*============================================================================
+ * Локальная функция: тело выражения. Вершина стека живёт в xmm0, остальные
+ * элементы - в кадре: [rbx] = x, [rbx + 8*(1+d)] - стек, далее слоты.
+ *===========================================================================*/
+static void emitBody(CodeBuf *buf, const Program *prog) {
+  const unsigned char *code = prog->code;
+  const unsigned char *end = code + prog->codeSize;
+  int slotBase = 1 + prog->maxDepth;
+  unsigned int idx = 0;
+  int depth = 0;
+  while (code < end) {
+    unsigned char op = *code++;
+    if (op == OP_CONST || op == OP_X || op == OP_LOAD) {
+      if (depth > 0) {                                  /* Вытесняем вершину */
+        emitFrameAccess(buf, 0x11, depth);
+      }
+      depth++;
+    }
+    if (op == OP_CONST || op == OP_LOAD || op == OP_STORE) {
+      memcpy(&idx, code, sizeof(idx));
+      code += sizeof(idx);
+    }
+    if (op == OP_CONST) {
+      emitConstLoad(buf, (int)idx);
+    } else if (op == OP_X) {
+      emitFrameAccess(buf, 0x10, 0);
+    } else if (op == OP_LOAD) {
+      emitFrameAccess(buf, 0x10, slotBase + (int)idx);
+    } else if (op == OP_STORE) {
+      emitFrameAccess(buf, 0x11, slotBase + (int)idx);
+    } else if (op >= OP_ADD && op <= OP_DIV) {
+      depth--;
+      emitBinary(buf, op, depth);
+    } else {
+      emitUnary(buf, prog, op);
+    }
+  }
+}
+
+/*============================================================================
+ * Локальная функция: функция целиком -
+ *   void f(const double *xs, double *ys, long n, double *frame)
+ * с циклом по всем точкам внутри машинного кода.
+ *===========================================================================*/
+static void emitFunction(CodeBuf *buf, const Program *prog) {
+  static const unsigned char prologue[] = {
+      0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56,  /* push rbx, r12-r14 */
+      0x48, 0x83, 0xEC, 0x08,                    /* sub rsp, 8 (выравнивание) */
+      0x48, 0x89, 0xCB,                          /* mov rbx, rcx  (frame) */
+      0x49, 0x89, 0xFC,                          /* mov r12, rdi  (xs) */
+      0x49, 0x89, 0xF5,                          /* mov r13, rsi  (ys) */
+      0x49, 0x89, 0xD6,                          /* mov r14, rdx  (n) */
+      0x4D, 0x85, 0xF6,                          /* test r14, r14 */
+      0x0F, 0x8E};                               /* jle done (rel32) */
+  static const unsigned char loadX[] = {
+      0xF2, 0x41, 0x0F, 0x10, 0x04, 0x24};       /* movsd xmm0, [r12] */
+  static const unsigned char next[] = {
+      0xF2, 0x41, 0x0F, 0x11, 0x45, 0x00,        /* movsd [r13], xmm0 */
+      0x49, 0x83, 0xC4, 0x08,                    /* add r12, 8 */
+      0x49, 0x83, 0xC5, 0x08,                    /* add r13, 8 */
+      0x49, 0xFF, 0xCE,                          /* dec r14 */
+      0x0F, 0x85};                               /* jnz loop (rel32) */
+  static const unsigned char epilogue[] = {
+      0x48, 0x83, 0xC4, 0x08,                    /* add rsp, 8 */
+      0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B,  /* pop r14-r12, rbx */
+      0xC3};                                     /* ret */
+  emitBytes(buf, prologue, sizeof(prologue));
+  int skipAt = buf->size;
+  emitInt32(buf, 0);
+  int loopAt = buf->size;
+  emitBytes(buf, loadX, sizeof(loadX));
+  emitFrameAccess(buf, 0x11, 0);              /* x -> [rbx] */
+  emitBody(buf, prog);
+  emitBytes(buf, next, sizeof(next));
+  emitInt32(buf, loopAt - (buf->size + 4));
+  int skip = buf->size - (skipAt + 4);
+  memcpy(buf->bytes + skipAt, &skip, sizeof(skip));
+  emitBytes(buf, epilogue, sizeof(epilogue));
+}
+
+/*============================================================================
+ * Локальная функция: разместить код и константы в исполняемой странице.
+ * Страница сначала доступна на запись, потом только на чтение/исполнение.
+ *===========================================================================*/
+static int jitLink(const CodeBuf *buf, const Program *prog, JitProgram *jit) {
+  size_t dataAt = ((size_t)buf->size + 15) & ~(size_t)15;
+  size_t total = dataAt + sizeof(double) * (prog->constCount + 1);
+  unsigned char *mem = (unsigned char *)mmap(NULL, total,
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS,
+                                             -1, 0);
+  int ok = (mem != MAP_FAILED);
+  if (ok) {
+    double one = 1.0;
+    memcpy(mem, buf->bytes, buf->size);
+    memcpy(mem + dataAt, prog->consts, sizeof(double) * prog->constCount);
+    memcpy(mem + dataAt + sizeof(double) * prog->constCount, &one,
+           sizeof(one));
+    for (int i = 0; i < buf->fixupCount; i++) {  /* rel32 от конца команды */
+      int rel = (int)(dataAt + sizeof(double) * buf->fixupConsts[i]) -
+                (buf->fixups[i] + 4);
+      memcpy(mem + buf->fixups[i], &rel, sizeof(rel));
+    }
+    ok = (mprotect(mem, total, PROT_READ | PROT_EXEC) == 0);
+    if (ok) {
+      jit->mem = mem;
+      jit->memSize = total;
+      jit->fn = (JitFn)mem;
+    } else {
+      munmap(mem, total);
+    }
+  }
+  return ok;
+}
+
+/*============================================================================
+ * Компиляция байткода в машинный код x86-64 (скалярный SSE2).
+ * Возвращает 1 при успехе; иначе вычисление пойдёт через интерпретатор.
+ *===========================================================================*/
+int compileJit(const Program *prog, JitProgram *jit) {
+  int ok = 0;
+  jit->source = prog;
+  jit->fn = NULL;
+  jit->mem = NULL;
+  jit->memSize = 0;
+  if (prog->codeSize > 0 &&          /* Пустую программу не компилируем, */
+      programVars(prog) == 0) {      /* как и с неподставленными буквами */
+    CodeBuf buf;
+    buf.size = 0;
+    buf.capacity = 256;
+    buf.bytes = (unsigned char *)malloc(buf.capacity);
+    buf.fixupCount = 0;
+    buf.fixupCapacity = 16;
+    buf.fixups = (int *)malloc(sizeof(int) * buf.fixupCapacity);
+    buf.fixupConsts = (int *)malloc(sizeof(int) * buf.fixupCapacity);
+    emitFunction(&buf, prog);
+    ok = jitLink(&buf, prog, jit);
+    free(buf.bytes);
+    free(buf.fixups);
+    free(buf.fixupConsts);
+  }
+  return ok;
+}
+
+#else
+
+/*============================================================================
+ * На других архитектурах JIT нет - всегда используем интерпретатор
+ *===========================================================================*/
+int compileJit(const Program *prog, JitProgram *jit) {
+  jit->source = prog;
+  jit->fn = NULL;
+  jit->mem = NULL;
+  jit->memSize = 0;
+  return 0;
+}
+
+#endif
+
+/*============================================================================
+ * Освобождение исполняемой страницы
+ *===========================================================================*/
+void freeJit(JitProgram *jit) {
+  if (jit->mem != NULL) {
+    munmap(jit->mem, jit->memSize);
+  }
+  jit->mem = NULL;
+  jit->memSize = 0;
+  jit->fn = NULL;
+}
+
+/*============================================================================
+ * Пакетное вычисление машинным кодом: ys[i] = f(xs[i]).
+ * Без JIT (не x86-64 или ошибка mmap) - пакетный интерпретатор.
+ *===========================================================================*/
+void evalJitBatch(const JitProgram *jit, const double *xs, double *ys,
+                  size_t n) {
+  if (jit->fn != NULL) {
+    const Program *prog = jit->source;
+    double small[PROGRAM_SMALL_STACK];
+    double *frame = small;
+    int frameSize = 1 + prog->maxDepth + prog->slotCount;
+    if (frameSize > PROGRAM_SMALL_STACK) {
+      frame = (double *)malloc(sizeof(double) * frameSize);
+    }
+    jit->fn(xs, ys, (long)n, frame);
+    if (frame != small) {
+      free(frame);
+    }
+  } else {
+    evalProgramBatch(jit->source, xs, ys, n);
+  }
+}
+
+/*============================================================================
+ * Вычисление машинным кодом в одной точке
+ *===========================================================================*/
+double evalJit(const JitProgram *jit, double xval) {
+  double res = 0.0;
+  evalJitBatch(jit, &xval, &res, 1);
+  return res;
+}
+
+/*============================================================================
+ * Машинный код prog с одним владельцем (вызывающим). Байткод копируется:
+ * код живёт дольше кадра и записи кэша, из которых взят prog.
+ *===========================================================================*/
+SharedJit *shareJit(const Program *prog) {
+  SharedJit *shared = (SharedJit *)malloc(sizeof(SharedJit));
+  copyProgram(&shared->prog, prog);
+  compileJit(&shared->prog, &shared->jit);  /* Не вышло - интерпретатор */
+  atomic_init(&shared->refs, 1);
+  return shared;
+}
+
+/*============================================================================
+ * Ещё один владелец машинного кода (из любого потока)
+ *===========================================================================*/
+SharedJit *holdJit(SharedJit *shared) {
+  atomic_fetch_add(&shared->refs, 1);
+  return shared;
+}
+
+/*============================================================================
+ * Владелец отказывается от кода; последний освобождает память (NULL -
+ * ничего не делать)
+ *===========================================================================*/
+void releaseJit(SharedJit *shared) {
+  if (shared != NULL && atomic_fetch_sub(&shared->refs, 1) == 1) {
+    freeJit(&shared->jit);
+    freeProgram(&shared->prog);
+    free(shared);
+  }
+}
+
+/*============================================================================
+ * Машинный код каждого из count выражений (массив для releaseJits)
+ *===========================================================================*/
+SharedJit **shareJits(const Program *progs, int count) {
+  SharedJit **jits = (SharedJit **)malloc(sizeof(SharedJit *) * count);
+  for (int s = 0; s < count; s++) {
+    jits[s] = shareJit(&progs[s]);
+  }
+  return jits;
+}
+
+/*============================================================================
+ * Отказ от кода всех count выражений и от самого массива (NULL - ничего)
+ *===========================================================================*/
+void releaseJits(SharedJit **jits, int count) {
+  if (jits != NULL) {
+    for (int s = 0; s < count; s++) {
+      releaseJit(jits[s]);
+    }
+    free(jits);
+  }
+}
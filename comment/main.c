@@ -0,0 +1,382 @@
+#include "graph.h"
+
+/* Наибольшая ширина/высота холста, которую принимаем из командной строки */
+#define MAX_CANVAS_SIDE 1000000
+
+/* Наибольшее число потоков отрисовки */
+#define MAX_THREADS 1024
+
+/* Ёмкость кэша выражений по умолчанию и наибольшая */
+#define DEFAULT_CACHE_SIZE 4096
+#define MAX_CACHE_SIZE 10000000
+
+/*-----------------------------------------------------------------------------
+ * Параметры запуска из командной строки
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  EvalMode mode;  /* Способ вычисления значений функции */
+  Viewport view;  /* Размер холста и диапазоны x/y */
+  int threads;    /* Сколько потоков заполняют холст */
+  int batch;      /* 1 - рисовать каждую строку ввода до конца потока */
+  int cacheSize;  /* Ёмкость кэша выражений в пакетном режиме */
+  int cacheFrames;  /* 1 - кэшировать и готовые кадры */
+  int cacheStats;   /* 1 - напечатать счётчики кэша */
+  int traceSummary; /* 1 - сводка трассировки в stderr */
+  const char *traceFile;  /* Куда записать Chrome trace (или NULL) */
+  const char *outputFile; /* Файл для кадров через mmap (или NULL - stdout) */
+  const char *compileFile;  /* Скомпилировать ввод в эту библиотеку */
+  const char *libraryFile;  /* Рисовать кадры из этой библиотеки */
+  const char *serveSocket;  /* Отвечать на запросы через этот сокет */
+  double vars[VAR_COUNT];   /* Параметры --param (NAN - не задан) */
+  ParamSweep sweep;         /* Перебор --sweep: кадр на каждое значение */
+  MathPrecision precision;  /* --precision exact|fast */
+} Options;
+
+/*-----------------------------------------------------------------------------
+ * Чтение строки выражений "sin(x); cos(x)" кусками по LEX_CHUNK символов
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  Arena arena;      /* Токены текущего выражения (сбрасывается на ';') */
+  TokenArray infix; /* Токены текущего выражения */
+  LexStream lex;    /* Лексер, в который идут куски текущего выражения */
+  long column;      /* С какого символа строки началось выражение */
+  Program *progs;   /* Байткод уже прочитанных выражений */
+  int count;        /* Сколько их */
+  int capacity;     /* Ёмкость progs */
+  FoldStats *fold;  /* Счётчики свёртки констант */
+} SeriesInput;
+
+/*============================================================================
+ * Локальная функция: разбор параметра с числовым значением (--width 120)
+ *===========================================================================*/
+static int parseValue(Options *opts, const char *name, const char *text) {
+  Viewport *view = &opts->view;
+  char *end = NULL;
+  double v = strtod(text, &end);
+  int ok = (end != text && *end == '\0');  /* Всё число целиком */
+  if (!strcmp(name, "--width") || !strcmp(name, "--height")) {
+    ok = ok && v >= 1.0 && v <= MAX_CANVAS_SIDE;
+  }
+  if (!strcmp(name, "--threads")) {
+    ok = ok && v >= 1.0 && v <= MAX_THREADS;
+  }
+  if (!strcmp(name, "--cache")) {
+    ok = ok && v >= 0.0 && v <= MAX_CACHE_SIZE;
+  }
+  if (ok && !strcmp(name, "--threads")) {
+    opts->threads = (int)v;
+  } else if (ok && !strcmp(name, "--cache")) {
+    opts->cacheSize = (int)v;
+  } else if (ok && !strcmp(name, "--width")) {
+    view->width = (int)v;
+  } else if (ok && !strcmp(name, "--height")) {
+    view->height = (int)v;
+  } else if (ok && !strcmp(name, "--xmin")) {
+    view->xMin = v;
+  } else if (ok && !strcmp(name, "--xmax")) {
+    view->xMax = v;
+  } else if (ok && !strcmp(name, "--ymin")) {
+    view->yMin = v;
+  } else if (ok && !strcmp(name, "--ymax")) {
+    view->yMax = v;
+  } else {
+    ok = 0;                         /* Неизвестный параметр или не число */
+  }
+  return ok;
+}
+
+/*============================================================================
+ * Локальная функция: разбор аргументов командной строки.
+ * --lines и --braille - только для режимов с точкой на столбец.
+ * Возвращает 0, если параметры заданы неверно.
+ *===========================================================================*/
+static int parseOptions(int argc, char **argv, Options *opts) {
+  int ok = 1;
+  opts->mode = EVAL_BATCH;
+  opts->threads = 1;
+  opts->batch = 0;
+  opts->cacheSize = DEFAULT_CACHE_SIZE;
+  opts->cacheFrames = 0;
+  opts->cacheStats = 0;
+  opts->traceSummary = 0;
+  opts->traceFile = NULL;
+  opts->outputFile = NULL;
+  opts->compileFile = NULL;
+  opts->libraryFile = NULL;
+  opts->serveSocket = NULL;
+  opts->sweep.var = -1;
+  opts->precision = PRECISION_EXACT;
+  initVars(opts->vars);
+  initViewport(&opts->view);
+  for (int i = 1; ok && i < argc; i++) {
+    if (!strcmp(argv[i], "--jit")) {
+      opts->mode = EVAL_JIT;
+    } else if (!strcmp(argv[i], "--interval")) {
+      opts->mode = EVAL_INTERVAL;
+    } else if (!strcmp(argv[i], "--adaptive")) {
+      opts->mode = EVAL_ADAPTIVE;
+    } else if (!strcmp(argv[i], "--derivative")) {
+      opts->mode = EVAL_DERIVATIVE;
+    } else if (!strcmp(argv[i], "--heatmap")) {
+      opts->mode = EVAL_HEATMAP;
+    } else if (!strcmp(argv[i], "--contour")) {
+      opts->mode = EVAL_CONTOUR;
+    } else if (!strcmp(argv[i], "--batch")) {
+      opts->batch = 1;
+    } else if (!strcmp(argv[i], "--cache-frames")) {
+      opts->cacheFrames = 1;
+    } else if (!strcmp(argv[i], "--cache-stats")) {
+      opts->cacheStats = 1;
+    } else if (!strcmp(argv[i], "--autoscale")) {
+      opts->view.autoscaleY = 1;
+    } else if (!strcmp(argv[i], "--lines")) {
+      opts->view.raster = RASTER_LINES;
+    } else if (!strcmp(argv[i], "--braille")) {
+      opts->view.raster = RASTER_BRAILLE;
+    } else if (!strcmp(argv[i], "--trace-summary")) {
+      opts->traceSummary = 1;
+    } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+      opts->traceFile = argv[++i];  /* Имя файла, а не число */
+    } else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+      opts->outputFile = argv[++i];
+    } else if (!strcmp(argv[i], "--compile") && i + 1 < argc) {
+      opts->compileFile = argv[++i];
+    } else if (!strcmp(argv[i], "--param") && i + 1 < argc) {
+      ok = parseVar(argv[++i], opts->vars);  /* "a=1.5" */
+    } else if (!strcmp(argv[i], "--sweep") && i + 1 < argc) {
+      ok = parseSweep(argv[++i], &opts->sweep);  /* "a=0:1:20" */
+    } else if (!strcmp(argv[i], "--precision") && i + 1 < argc) {
+      i++;
+      ok = !strcmp(argv[i], "fast") || !strcmp(argv[i], "exact");
+      opts->precision = !strcmp(argv[i], "fast") ? PRECISION_FAST
+                                                 : PRECISION_EXACT;
+    } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+      opts->serveSocket = argv[++i];
+    } else if (!strcmp(argv[i], "--library") && i + 1 < argc) {
+      opts->libraryFile = argv[++i];
+      opts->batch = 1;              /* Библиотека - это пакет кадров */
+    } else if (i + 1 < argc) {
+      ok = parseValue(opts, argv[i], argv[i + 1]);
+      i++;                          /* Значение уже взяли */
+    } else {
+      ok = 0;
+    }
+  }
+  int pointModes = opts->mode == EVAL_BATCH || opts->mode == EVAL_JIT ||
+                   opts->mode == EVAL_DERIVATIVE;
+  return ok && opts->view.xMin < opts->view.xMax &&
+         opts->view.yMin < opts->view.yMax &&
+         (opts->view.raster == RASTER_POINTS || pointModes);
+}
+
+/*============================================================================
+ * Локальная функция: параметры пакетного режима и сервера из командной
+ * строки
+ *===========================================================================*/
+static void makeBatchConfig(const Options *opts, BatchConfig *cfg) {
+  cfg->view = opts->view;
+  cfg->mode = opts->mode;
+  cfg->cacheSize = opts->cacheSize;
+  cfg->cacheFrames = opts->cacheFrames;
+  cfg->cacheStats = opts->cacheStats;
+  cfg->library = NULL;
+  memcpy(cfg->vars, opts->vars, sizeof(cfg->vars));
+  cfg->sweep = opts->sweep;
+  cfg->precision = opts->precision;
+}
+
+/*============================================================================
+ * Локальная функция: начать очередное выражение с символа column строки
+ *===========================================================================*/
+static void startSeries(SeriesInput *in, long column) {
+  resetArena(&in->arena);           /* Прошлое выражение уже в байткоде */
+  initTokenArrayArena(&in->infix, &in->arena, 64);
+  initLexStream(&in->lex, &in->infix);
+  in->column = column;
+}
+
+/*============================================================================
+ * Локальная функция: закончить выражение - дочитать хвост лексером,
+ * разобрать токены в дерево и скомпилировать в байткод в конце in->progs
+ *===========================================================================*/
+static void finishSeries(SeriesInput *in) {
+  long bad = finishLexStream(&in->lex);
+  if (bad >= 0) {                   /* Символ пропущен, рисуем остальное */
+    fprintf(stderr, "graph: unexpected '%c' at column %ld\n",
+            in->lex.errorChar, in->column + bad + 1);
+  }
+  if (in->count == in->capacity) {
+    in->capacity = in->capacity ? 2 * in->capacity : 4;
+    in->progs = (Program *)realloc(in->progs,
+                                   sizeof(Program) * in->capacity);
+  }
+  ExprAst ast;
+  parseTokens(&in->infix, &in->arena, &ast);
+  if (ast.error != NULL) {          /* errorPos - номер токена */
+    fprintf(stderr, "graph: %s at column %ld\n", ast.error,
+            in->column + lexColumn(&in->lex, ast.errorPos) + 1);
+  }
+  freeLexStream(&in->lex);
+  countFold(&ast, in->fold);        /* Убираем константные подвыражения */
+  initProgram(&in->progs[in->count]);
+  compileAst(&ast, &in->progs[in->count]);
+  in->count++;
+}
+
+/*============================================================================
+ * Локальная функция: прочитать одну строку выражений через ';' любой
+ * длины. Строка идёт в лексер кусками, целиком в памяти она не бывает.
+ * Возвращает число выражений (0 - ввод пуст), байткод - в *progs,
+ * свёртка констант учитывается в *fold.
+ *===========================================================================*/
+static int readSeries(FILE *stream, Program **progs, FoldStats *fold) {
+  SeriesInput in;
+  char *chunk = (char *)malloc(LEX_CHUNK);
+  long pos = 0;                     /* Сколько символов строки прочитано */
+  int done = 0;
+  in.progs = NULL;
+  in.count = 0;
+  in.capacity = 0;
+  in.fold = fold;
+  initArena(&in.arena, exprArenaSize(256));  /* Дорастёт под длинные */
+  char *p = fgets(chunk, LEX_CHUNK, stream);
+  int any = (p != NULL);
+  if (any) {
+    startSeries(&in, 0);
+  }
+  while (p != NULL) {
+    size_t len = strcspn(p, ";\n");
+    feedLexStream(&in.lex, p, len);
+    pos += (long)len;
+    p += len;
+    if (*p == ';') {                /* Следующее выражение той же строки */
+      finishSeries(&in);
+      pos++;
+      p++;
+      startSeries(&in, pos);
+    } else if (*p == '\n') {
+      done = 1;
+    }
+    if (done) {
+      p = NULL;
+    } else if (*p == '\0') {        /* Кусок кончился, строка - нет */
+      p = fgets(chunk, LEX_CHUNK, stream);
+    }
+  }
+  if (any) {
+    finishSeries(&in);
+  }
+  freeArena(&in.arena);
+  free(chunk);
+  *progs = in.progs;
+  return in.count;
+}
+
+/*============================================================================
+ * Главная функция: считывает строку, строит токены, рисует график
+ *===========================================================================*/
+int main(int argc, char **argv) {
+  int retVal = 0;                   /* Будем возвращать в конце */
+  Options opts;
+  FrameSink sink;                   /* stdout или отображённый файл */
+  Program *progs = NULL;            /* Выражения строки ввода */
+  int count = 0;
+  FoldStats fold = {0, 0};          /* Свёртка констант строки ввода */
+  sink.fd = -1;                     /* Ещё не открыт */
+  if (!parseOptions(argc, argv, &opts)) {
+    fprintf(stderr,
+            "usage: graph [--batch] [--cache N] [--cache-frames] "
+            "[--cache-stats] [--jit] [--interval] [--adaptive] [--derivative] "
+            "[--heatmap] [--contour] [--param V=X] [--sweep V=A:B:N] "
+            "[--precision exact|fast] "
+            "[--threads N] [--width N] [--height N] [--xmin A] [--xmax B] "
+            "[--ymin A] [--ymax B] [--autoscale] [--lines] [--braille] "
+            "[--output FILE] [--compile LIB] [--library LIB] [--serve SOCKET] "
+            "[--trace FILE] [--trace-summary]\n");
+    retVal = 1;                     /* Неверные параметры */
+  } else if (opts.compileFile != NULL) {
+    if (compileLibrary(stdin, opts.compileFile, opts.cacheSize) < 0) {
+      fprintf(stderr, "graph: cannot write library %s\n", opts.compileFile);
+      retVal = 1;
+    }
+  } else if (opts.serveSocket != NULL) {
+    BatchConfig cfg;
+    makeBatchConfig(&opts, &cfg);
+    if (runServer(opts.serveSocket, &cfg, opts.threads) < 0) {
+      fprintf(stderr, "graph: cannot listen on %s\n", opts.serveSocket);
+      retVal = 1;
+    }
+  } else if (!openFrameSink(&sink, opts.outputFile)) {
+    fprintf(stderr, "graph: cannot open output file %s\n", opts.outputFile);
+    retVal = 1;
+  } else if (opts.batch) {
+    BatchConfig cfg;
+    makeBatchConfig(&opts, &cfg);
+    ProgramLibrary lib;
+    if (opts.libraryFile != NULL && !openProgramLibrary(&lib,
+                                                        opts.libraryFile)) {
+      fprintf(stderr, "graph: cannot load library %s\n", opts.libraryFile);
+      retVal = 1;
+    } else {
+      cfg.library = (opts.libraryFile != NULL) ? &lib : NULL;
+      ThreadPool pool;
+      initThreadPool(&pool, opts.threads);
+      retVal = (runBatch(stdin, &cfg, &pool, &sink) < 0) ? 1 : 0;
+      freeThreadPool(&pool);
+    }
+    if (cfg.library != NULL) {
+      closeProgramLibrary(&lib);
+    }
+  } else if ((count = readSeries(stdin, &progs, &fold)) == 0) {
+    retVal = 0;                     /* Ранняя проверка (EOF) */
+  } else {
+    setProgramPrecision(progs, count, opts.precision);
+    ThreadPool pool;                /* При --threads 1 рабочих потоков нет */
+    initThreadPool(&pool, opts.threads);
+    Canvas canvas;                  /* Холст нужного размера в куче */
+    initCanvas(&canvas, &opts.view);
+    int frames = (opts.sweep.var >= 0) ? opts.sweep.frames : 1;
+    unsigned int used = 0;
+    for (int s = 0; s < count; s++) {
+      used |= programVars(&progs[s]);
+    }
+    Program *bound = NULL;
+    SharedJit **jits = NULL;
+    for (int step = 0; step < frames; step++) {
+      sweepVars(&opts.sweep, step, opts.vars);
+      if (step == 0 || (used & (1u << opts.sweep.var))) {
+        releaseJits(jits, count);   /* Подстановка и JIT - на значение */
+        freeBoundPrograms(bound, count);  /* параметра, а не на кадр */
+        bound = bindPrograms(progs, count, opts.vars, opts.mode);
+        jits = (opts.mode == EVAL_JIT)
+                   ? shareJits((bound != NULL) ? bound : progs, count)
+                   : NULL;
+      }
+      canvas.view = opts.view;      /* autoscale меняет диапазон y */
+      fillCanvasPrograms(&canvas, (bound != NULL) ? bound : progs, jits,
+                         count, opts.mode, &pool);
+      writeFrame(&sink, &canvas, step > 0);  /* Весь кадр одной записью */
+    }
+    releaseJits(jits, count);
+    freeBoundPrograms(bound, count);
+    freeCanvas(&canvas);
+    freeThreadPool(&pool);
+    if (opts.cacheStats) {
+      printFoldStats(&fold);
+    }
+
+    for (int s = 0; s < count; s++) {
+      freeProgram(&progs[s]);
+    }
+    retVal = 0;                     /* Успешное завершение */
+  }
+  free(progs);
+  if (sink.fd != -1 && !closeFrameSink(&sink)) {
+    retVal = 1;                     /* Кадры записались не полностью */
+  }
+  if ((opts.traceSummary || opts.traceFile != NULL) &&
+      !traceReport(opts.traceSummary ? stderr : NULL, opts.traceFile)) {
+    retVal = 1;                     /* Не удалось записать файл трассировки */
+  }
+  return retVal;                    /* Один return */
+}
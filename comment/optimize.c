@@ -0,0 +1,174 @@
+#include "graph.h"
+
+/*============================================================================
+ * Локальная функция: является ли узел константой с заданным значением
+ *===========================================================================*/
+static int isConstValue(const ExprNode *n, double v) {
+  return (n->type == TOKEN_NUMBER && n->value == v);
+}
+
+/*============================================================================
+ * Локальная функция: значение бинарной операции над двумя константами
+ *===========================================================================*/
+static double applyBinary(TokenType t, double a, double b) {
+  double r = 0.0;
+  if (t == TOKEN_PLUS) {
+    r = a + b;
+  } else if (t == TOKEN_MINUS) {
+    r = a - b;
+  } else if (t == TOKEN_MULT) {
+    r = a * b;
+  } else {
+    r = a / b;
+  }
+  return r;
+}
+
+/*============================================================================
+ * Локальная функция: заменить узел константой (операнды остаются
+ * мёртвыми, их уберёт compactAst)
+ *===========================================================================*/
+static void replaceWithConst(ExprNode *n, double v) {
+  n->type = TOKEN_NUMBER;
+  n->left = -1;
+  n->right = -1;
+  n->value = v;
+}
+
+/*============================================================================
+ * Локальная функция: (y * c1) * c2 -> y * (c1 * c2), то же для "+".
+ * Возвращает 1, если правую константу удалось влить в левый операнд.
+ *===========================================================================*/
+static int mergeConstChain(ExprNode *nodes, int i, TokenType t) {
+  ExprNode *n = &nodes[i];
+  const ExprNode *a = &nodes[n->left];
+  const ExprNode *b = &nodes[n->right];
+  int merged = 0;
+  if (b->type == TOKEN_NUMBER && (t == TOKEN_MULT || t == TOKEN_PLUS) &&
+      a->type == t && nodes[a->right].type == TOKEN_NUMBER) {
+    ExprNode *c = &nodes[a->right];
+    c->value = applyBinary(t, c->value, b->value);
+    *n = *a;                        /* Узел становится левым операндом */
+    merged = 1;
+  }
+  return merged;
+}
+
+/*============================================================================
+ * Локальная функция: унарный минус или функция над операндом n->left
+ *===========================================================================*/
+static void foldUnary(ExprNode *nodes, int i) {
+  ExprNode *n = &nodes[i];
+  const ExprNode *a = &nodes[n->left];
+  if (a->type == TOKEN_NUMBER) {    /* f(c) и -c считаем сразу */
+    double v = (n->type == TOKEN_UMINUS) ? -a->value
+                                         : computeFunction(n->type, a->value);
+    replaceWithConst(n, v);
+  } else if (n->type == TOKEN_UMINUS && a->type == TOKEN_UMINUS) {
+    *n = nodes[a->left];            /* -(-y) -> y */
+  }
+}
+
+/*============================================================================
+ * Локальная функция: бинарная операция над операндами n->left и n->right
+ *===========================================================================*/
+static void foldBinary(ExprNode *nodes, int i) {
+  ExprNode *n = &nodes[i];
+  TokenType t = n->type;
+  ExprNode *a = &nodes[n->left];
+  ExprNode *b = &nodes[n->right];
+  if (a->type == TOKEN_NUMBER && b->type == TOKEN_NUMBER) {
+    replaceWithConst(n, applyBinary(t, a->value, b->value));
+  } else if (t == TOKEN_DIV && b->type == TOKEN_NUMBER && b->value != 0.0 &&
+             isfinite(1.0 / b->value)) {
+    b->value = 1.0 / b->value;      /* y/c -> y*(1/c) */
+    n->type = TOKEN_MULT;
+    foldBinary(nodes, i);
+  } else if ((t == TOKEN_MULT && isConstValue(b, 1.0)) ||
+             ((t == TOKEN_PLUS || t == TOKEN_MINUS) &&
+              isConstValue(b, 0.0))) {
+    *n = *a;                        /* y*1, y+0, y-0 -> y */
+  } else if ((t == TOKEN_MULT && isConstValue(a, 1.0)) ||
+             (t == TOKEN_PLUS && isConstValue(a, 0.0))) {
+    *n = *b;                        /* 1*y, 0+y -> y */
+  } else if (t == TOKEN_MINUS && isConstValue(a, 0.0)) {
+    n->type = TOKEN_UMINUS;         /* 0-y -> -y */
+    n->left = n->right;
+    n->right = -1;
+    foldUnary(nodes, i);
+  } else {
+    mergeConstChain(nodes, i, t);
+  }
+}
+
+/*============================================================================
+ * Локальная функция: убрать узлы, до которых от корня уже не дойти.
+ * Живые сдвигаются к началу с сохранением порядка (он остаётся порядком
+ * ОПН), корень снова последний.
+ *===========================================================================*/
+static void compactAst(ExprAst *ast) {
+  ExprNode *nodes = ast->nodes;
+  int *index = (int *)arenaAlloc(ast->arena, sizeof(int) * ast->size);
+  memset(index, 0, sizeof(int) * ast->size);
+  index[ast->root] = 1;             /* Сначала - метка "живой" */
+  for (int i = ast->root; i >= 0; i--) {
+    if (index[i] && nodes[i].left >= 0) {
+      index[nodes[i].left] = 1;
+    }
+    if (index[i] && nodes[i].right >= 0) {
+      index[nodes[i].right] = 1;
+    }
+  }
+  int size = 0;
+  for (int i = 0; i <= ast->root; i++) {
+    if (index[i]) {                 /* Потом - новый номер узла */
+      ExprNode n = nodes[i];
+      n.left = (n.left >= 0) ? index[n.left] : -1;
+      n.right = (n.right >= 0) ? index[n.right] : -1;
+      index[i] = size;
+      nodes[size++] = n;
+    }
+  }
+  ast->size = size;
+  ast->root = size - 1;
+}
+
+/*============================================================================
+ * Свёртка констант и алгебраические упрощения над деревом (на месте).
+ * Операнды идут раньше операций, поэтому хватает одного прохода по
+ * узлам: к узлу его операнды уже свёрнуты. Упрощённый узел принимает
+ * вид своего операнда (копией), лишние узлы потом убираются.
+ * Возвращает, сколько узлов удалось убрать.
+ *===========================================================================*/
+int foldAst(ExprAst *ast) {
+  int before = ast->size;
+  for (int i = 0; i < ast->size && ast->root >= 0; i++) {
+    TokenType t = ast->nodes[i].type;
+    if (isFunction(t) || t == TOKEN_UMINUS) {
+      foldUnary(ast->nodes, i);
+    } else if (isOperator(t)) {
+      foldBinary(ast->nodes, i);
+    }
+  }
+  if (ast->root >= 0) {
+    compactAst(ast);
+  }
+  TRACE_COUNT(COUNTER_FOLDED, before - ast->size);
+  return before - ast->size;
+}
+
+/*============================================================================
+ * Свёртка с учётом в stats: сколько узлов было и сколько убрано
+ *===========================================================================*/
+void countFold(ExprAst *ast, FoldStats *stats) {
+  stats->nodes += (unsigned long)((ast->root >= 0) ? ast->size : 0);
+  stats->folded += (unsigned long)foldAst(ast);
+}
+
+/*============================================================================
+ * Счётчики свёртки в stderr (рядом со счётчиками кэшей)
+ *===========================================================================*/
+void printFoldStats(const FoldStats *stats) {
+  fprintf(stderr, "fold: removed %lu of %lu nodes\n", stats->folded,
+          stats->nodes);
+}
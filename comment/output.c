@@ -0,0 +1,127 @@
+#include "graph.h"
+
+#include <errno.h>                       /* EINTR при прерванной записи */
+#include <fcntl.h>                       /* open */
+#include <sys/mman.h>                    /* mmap, munmap */
+#include <sys/uio.h>                     /* writev */
+#include <unistd.h>                      /* ftruncate, close, STDOUT_FILENO */
+
+/*============================================================================
+ * Локальная функция: записать все части iov, повторяя неполные записи.
+ * Возвращает 0 при ошибке.
+ *===========================================================================*/
+static int writeAll(int fd, struct iovec *iov, int count) {
+  int ok = 1;
+  while (ok && count > 0) {
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0) {
+      ok = (errno == EINTR);        /* Прервали сигналом - пробуем снова */
+    } else {
+      size_t left = (size_t)n;
+      while (count > 0 && left >= iov->iov_len) {
+        left -= iov->iov_len;       /* Эта часть ушла целиком */
+        iov++;
+        count--;
+      }
+      if (count > 0) {
+        iov->iov_base = (char *)iov->iov_base + left;
+        iov->iov_len -= left;
+      }
+    }
+  }
+  return ok;
+}
+
+/*============================================================================
+ * Локальная функция: отобразить файл (при первом вызове) или увеличить его
+ * так, чтобы поместилось ещё need байт. Файл растёт вдвое, отображение
+ * создаётся заново.
+ *===========================================================================*/
+static int growMap(FrameSink *sink, size_t need) {
+  int ok = 1;
+  if (sink->map == NULL || sink->used + need > sink->mapSize) {
+    size_t size = sink->mapSize ? sink->mapSize : FRAME_MAP_INITIAL;
+    while (size < sink->used + need) {
+      size *= 2;
+    }
+    if (sink->map != NULL) {
+      munmap(sink->map, sink->mapSize);
+      sink->map = NULL;
+    }
+    ok = (ftruncate(sink->fd, (off_t)size) == 0);
+    if (ok) {
+      void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     sink->fd, 0);
+      ok = (p != MAP_FAILED);
+      sink->map = ok ? (char *)p : NULL;
+      sink->mapSize = ok ? size : 0;
+    }
+  }
+  return ok;
+}
+
+/*============================================================================
+ * Открыть вывод кадров. path == NULL - stdout через write/writev, иначе
+ * файл path, отображённый в память. Возвращает 0, если файл не открылся.
+ *===========================================================================*/
+int openFrameSink(FrameSink *sink, const char *path) {
+  sink->fd = STDOUT_FILENO;
+  sink->map = NULL;
+  sink->mapSize = 0;
+  sink->used = 0;
+  sink->failed = 0;
+  if (path != NULL) {
+    sink->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    sink->failed = (sink->fd < 0) || !growMap(sink, 0);
+  }
+  return !sink->failed;
+}
+
+/*============================================================================
+ * Вывести кадр: строки холста уже с переводами строк, поэтому кадр (и
+ * пустая строка перед ним, если separate) уходит одним writev или одним
+ * memcpy в отображение. Возвращает 0, если вывод сломан.
+ *===========================================================================*/
+int writeFrame(FrameSink *sink, const Canvas *canvas, int separate) {
+  TRACE_BEGIN(span);
+  struct iovec iov[2];
+  int count = 0;
+  if (separate) {
+    iov[count].iov_base = "\n";
+    iov[count++].iov_len = 1;
+  }
+  iov[count].iov_base = canvas->cells;
+  iov[count++].iov_len = canvas->stride * canvas->view.height;
+  if (!sink->failed && sink->map == NULL) {
+    sink->failed = !writeAll(sink->fd, iov, count);
+  } else if (!sink->failed) {       /* После ошибки ничего не пишем */
+    sink->failed = !growMap(sink, separate + iov[count - 1].iov_len);
+    for (int i = 0; !sink->failed && i < count; i++) {
+      memcpy(sink->map + sink->used, iov[i].iov_base, iov[i].iov_len);
+      sink->used += iov[i].iov_len;
+    }
+  }
+  TRACE_END(span, STAGE_OUTPUT);
+  return !sink->failed;
+}
+
+/*============================================================================
+ * Закрыть вывод: у отображённого файла отрезается неиспользованный хвост.
+ * Возвращает 0, если хоть одна запись не удалась.
+ *===========================================================================*/
+int closeFrameSink(FrameSink *sink) {
+  if (sink->map != NULL) {
+    munmap(sink->map, sink->mapSize);
+    sink->map = NULL;
+  }
+  if (sink->fd != STDOUT_FILENO && sink->fd >= 0) {
+    if (ftruncate(sink->fd, (off_t)sink->used) != 0) {
+      sink->failed = 1;
+    }
+    if (close(sink->fd) != 0) {
+      sink->failed = 1;
+    }
+  }
+  sink->fd = -1;
+  return !sink->failed;
+}
@@ -0,0 +1,267 @@
+#include "graph.h"
+
+/* Роль токена в разборе (битовая маска) */
+#define PARSE_OPERAND 1   /* Лист: число, x, переменная */
+#define PARSE_PREFIX 2    /* Начинает операнд и ждёт его: минус, функция, ( */
+#define PARSE_INFIX 4     /* Бинарная операция после операнда */
+
+/* Роль каждого типа токена (порядок - как в TokenType) */
+static const unsigned char kTokenRoles[] = {
+    PARSE_OPERAND, PARSE_OPERAND, PARSE_INFIX, PARSE_PREFIX | PARSE_INFIX,
+    PARSE_INFIX,   PARSE_INFIX,   PARSE_PREFIX, 0,
+    PARSE_PREFIX,  PARSE_PREFIX,  PARSE_PREFIX, PARSE_PREFIX,
+    PARSE_PREFIX,  PARSE_PREFIX,  PARSE_PREFIX | PARSE_INFIX, PARSE_OPERAND};
+
+/* Сила связывания отложенной операции: + и - 2, * и / 3, унарный минус
+ * 4. Функция без скобок 1: как в прежнем toRPN, её аргумент - всё до
+ * закрывающей скобки или конца ("sin x*2" - это sin(x*2)). Функция, за
+ * которой сразу "(", получает FUNC_CALL_POWER: "sin(x)*2" - это
+ * (sin x)*2. У "(" 0 - её снимает только ")" или конец. */
+static const unsigned char kBindingPower[] = {0, 0, 2, 2, 3, 3, 0, 0,
+                                              1, 1, 1, 1, 1, 1, 4, 0};
+
+/* Сила связывания функции со скобками после имени */
+#define FUNC_CALL_POWER 4
+
+/*-----------------------------------------------------------------------------
+ * Отложенная операция на стеке разбора: префиксная (унарный минус или
+ * функция ждут операнд), инфиксная (есть левый операнд, ждёт правый)
+ * или открытая скобка
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  TokenType type;   /* Операция, функция или TOKEN_LPAREN */
+  int left;         /* Левый операнд инфиксной операции, иначе -1 */
+  int power;        /* Сила связывания (kBindingPower или FUNC_CALL_POWER) */
+  long pos;         /* Где стоит её токен (для сообщения об ошибке) */
+} ParseFrame;
+
+/*-----------------------------------------------------------------------------
+ * Состояние разбора: откуда берутся токены, текущий токен и стек
+ * отложенных операций
+ *-----------------------------------------------------------------------------*/
+typedef struct {
+  const char *str;          /* Строка или NULL, если токены из infix */
+  const TokenArray *infix;  /* Готовые токены (потоковый лексер) */
+  long next;                /* Следующий символ строки или номер токена */
+  long pos;                 /* Позиция текущего токена */
+  Token tok;                /* Текущий токен */
+  int atEnd;                /* 1 - токенов больше нет */
+  ExprAst *ast;             /* Куда складываются узлы */
+  ParseFrame *frames;       /* Стек отложенных операций */
+  int top;                  /* Его вершина (-1 - пуст) */
+} Parser;
+
+/*============================================================================
+ * Локальная функция: запомнить ошибку, если она первая
+ *===========================================================================*/
+static void parseError(ExprAst *ast, long pos, const char *error) {
+  if (ast->error == NULL) {
+    ast->error = error;
+    ast->errorPos = pos;
+  }
+}
+
+/*============================================================================
+ * Локальная функция: следующий токен в p->tok (или p->atEnd). Из строки
+ * токены читаются лексером прямо по ходу разбора, непонятные символы
+ * пропускаются с ошибкой.
+ *===========================================================================*/
+static void nextToken(Parser *p) {
+  if (p->str != NULL) {
+    int len = 0;
+    while (len == 0 && p->str[p->next] != '\0') {
+      const char *s = p->str + p->next;
+      int space = (*s == ' ' || *s == '\t');
+      len = space ? 0 : lexToken(s, &p->tok);
+      if (len == 0 && !space) {
+        parseError(p->ast, p->next, "unexpected character");
+      }
+      p->pos = p->next;
+      p->next += (len > 0) ? len : 1;
+    }
+    p->atEnd = (len == 0);
+    TRACE_COUNT(COUNTER_TOKENS, len > 0);
+  } else {
+    p->atEnd = (p->next >= p->infix->size);
+    if (!p->atEnd) {
+      p->tok = p->infix->data[p->next];
+      p->pos = p->next;
+      p->next++;
+    }
+  }
+  if (p->atEnd) {
+    p->pos = p->next;               /* Ошибка "в конце выражения" */
+  }
+}
+
+/*============================================================================
+ * Локальная функция: новый узел дерева. Места хватает всегда: каждый
+ * токен даёт не больше одного узла.
+ *===========================================================================*/
+static int addNode(ExprAst *ast, TokenType type, int left, int right,
+                   double value) {
+  ExprNode *n = &ast->nodes[ast->size];
+  n->type = type;
+  n->left = left;
+  n->right = right;
+  n->value = value;
+  return ast->size++;
+}
+
+/*============================================================================
+ * Локальная функция: положить отложенную операцию на стек
+ *===========================================================================*/
+static void pushFrame(Parser *p, TokenType type, int left) {
+  ParseFrame *f = &p->frames[++p->top];
+  f->type = type;
+  f->left = left;
+  f->power = kBindingPower[type];
+  f->pos = p->pos;
+}
+
+/*============================================================================
+ * Локальная функция: применить к операнду cur отложенные операции с
+ * силой связывания не ниже power (до открытой скобки). Равная тоже
+ * сворачивается: "a-b-c" - это "(a-b)-c". Возвращает новый операнд.
+ *===========================================================================*/
+static int reduceFrames(Parser *p, int cur, int power) {
+  while (p->top >= 0 && p->frames[p->top].power >= power) {
+    const ParseFrame *f = &p->frames[p->top--];
+    cur = (f->left >= 0) ? addNode(p->ast, f->type, f->left, cur, 0.0)
+                         : addNode(p->ast, f->type, cur, -1, 0.0);
+  }
+  return cur;
+}
+
+/*============================================================================
+ * Локальная функция: конец выражения - свернуть весь стек. Незакрытая
+ * скобка - ошибка, но выражение считается закрытым в конце.
+ *===========================================================================*/
+static int finishFrames(Parser *p, int cur) {
+  cur = reduceFrames(p, cur, 1);
+  while (p->top >= 0) {             /* Наверху - открытая скобка */
+    parseError(p->ast, p->frames[p->top].pos, "missing ')'");
+    p->top--;
+    cur = reduceFrames(p, cur, 1);
+  }
+  return cur;
+}
+
+/*============================================================================
+ * Локальная функция: разбор методом Пратта. Пока операнда нет (cur < 0),
+ * токен начинает операнд: число, x и буквы - лист, минус, функция и "("
+ * ждут своего операнда на стеке. После операнда токен продолжает
+ * выражение: бинарная операция сначала сворачивает отложенные
+ * операции, которые связывают не слабее неё. Минус унарный или
+ * бинарный по месту, а не по соседнему токену, поэтому "sin -x" - это
+ * sin(-x). Функция становится тесной, если сразу за ней идёт "(".
+ * Вместо рекурсии - явный стек: глубина вложенности ограничена только
+ * памятью.
+ * Возвращает корень или -1 при ошибке.
+ *===========================================================================*/
+static int parseLoop(Parser *p) {
+  int cur = -1;                     /* Готовый операнд или -1 */
+  int root = -1;
+  int done = 0;
+  nextToken(p);
+  done = p->atEnd;                  /* Пустое выражение - не ошибка */
+  while (!done) {
+    TokenType t = p->tok.type;
+    int role = p->atEnd ? 0 : kTokenRoles[t];
+    if (cur < 0 && !(role & (PARSE_OPERAND | PARSE_PREFIX))) {
+      parseError(p->ast, p->pos, "missing operand");
+      done = 1;
+    } else if (cur < 0 && (role & PARSE_OPERAND)) {
+      cur = addNode(p->ast, t, -1, -1, p->tok.value);
+    } else if (cur < 0) {           /* Минус, функция или "(" */
+      if (t == TOKEN_LPAREN && p->top >= 0 &&
+          isFunction(p->frames[p->top].type)) {
+        p->frames[p->top].power = FUNC_CALL_POWER;  /* "sin(" */
+      }
+      pushFrame(p, (t == TOKEN_MINUS) ? TOKEN_UMINUS : t, -1);
+    } else if (p->atEnd) {
+      root = finishFrames(p, cur);
+      done = 1;
+    } else if (t == TOKEN_RPAREN) {
+      cur = reduceFrames(p, cur, 1);
+      if (p->top < 0) {
+        parseError(p->ast, p->pos, "unmatched ')'");
+        done = 1;
+      } else {
+        p->top--;                   /* Снимаем "(" */
+      }
+    } else if (role & PARSE_INFIX) {  /* Минус после операнда - бинарный */
+      t = (t == TOKEN_UMINUS) ? TOKEN_MINUS : t;
+      pushFrame(p, t, reduceFrames(p, cur, kBindingPower[t]));
+      cur = -1;
+    } else {                        /* "2x", "2 sin(x)", "x(" */
+      parseError(p->ast, p->pos, "missing operator");
+      done = 1;
+    }
+    if (!done) {
+      nextToken(p);
+    }
+  }
+  return root;
+}
+
+/*============================================================================
+ * Локальная функция: общая часть parseExpr и parseTokens. Узлов и
+ * отложенных операций не больше, чем токенов, а токенов - чем cap.
+ *===========================================================================*/
+static int parseWith(Parser *p, Arena *arena, ExprAst *ast, long cap) {
+  TRACE_BEGIN(span);
+  ast->nodes = (ExprNode *)arenaAlloc(arena, sizeof(ExprNode) * (cap + 1));
+  ast->size = 0;
+  ast->root = -1;
+  ast->arena = arena;
+  ast->errorPos = -1;
+  ast->error = NULL;
+  p->frames = (ParseFrame *)arenaAlloc(arena, sizeof(ParseFrame) * (cap + 1));
+  p->top = -1;
+  p->next = 0;
+  p->pos = 0;
+  p->ast = ast;
+  ast->root = parseLoop(p);
+  TRACE_END(span, STAGE_PARSE);
+  return ast->root >= 0;
+}
+
+/*============================================================================
+ * Разбор строки str в дерево за один проход (лексер вызывается по ходу,
+ * массива токенов нет). Узлы - в арене. Возвращает 1, если дерево
+ * построено; ast->error и ast->errorPos (номер символа) - первая ошибка.
+ * Непонятный символ и незакрытая скобка дерево не портят.
+ *===========================================================================*/
+int parseExpr(const char *str, Arena *arena, ExprAst *ast) {
+  Parser p;
+  p.str = str;
+  p.infix = NULL;
+  return parseWith(&p, arena, ast, (long)strlen(str));
+}
+
+/*============================================================================
+ * То же из готовых токенов (потоковый лексер длинного ввода).
+ * ast->errorPos здесь - номер токена в infix (infix->size - конец
+ * выражения), а не символа; в позицию строки его переводит lexColumn.
+ *===========================================================================*/
+int parseTokens(const TokenArray *infix, Arena *arena, ExprAst *ast) {
+  Parser p;
+  p.str = NULL;
+  p.infix = infix;
+  return parseWith(&p, arena, ast, infix->size);
+}
+
+/*============================================================================
+ * Понижение дерева в ОПН для эталонных интерпретаторов (evalRPN,
+ * интервалы, дуальные числа): узлы уже идут в порядке ОПН, операнды
+ * раньше операций. Считается и глубина стека вычисления.
+ *===========================================================================*/
+void lowerAst(const ExprAst *ast, TokenArray *postfix) {
+  int count = (ast->root >= 0) ? ast->size : 0;
+  for (int i = 0; i < count; i++) {
+    pushTokenArray(postfix, makeToken(ast->nodes[i].type,
+                                      ast->nodes[i].value));
+  }
+  postfix->depth = rpnDepth(postfix);
+}
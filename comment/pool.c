@@ -0,0 +1,121 @@
+#include "graph.h"
+
+/*============================================================================
+ * Локальная функция: раздавать куски текущей задачи, пока они не кончатся.
+ * Вызывается с захваченным мьютексом, на время работы его отпускает.
+ *===========================================================================*/
+static void runChunks(ThreadPool *pool) {
+  PoolTask task = pool->task;       /* Запоминаем задачу под мьютексом */
+  void *arg = pool->arg;
+  while (pool->next < pool->total) {
+    size_t begin = pool->next;
+    size_t end = begin + pool->chunk;
+    end = (end < pool->total) ? end : pool->total;
+    pool->next = end;
+    pool->active++;
+    pthread_mutex_unlock(&pool->lock);
+    task(arg, begin, end);          /* Сама работа - без блокировки */
+    pthread_mutex_lock(&pool->lock);
+    pool->active--;
+  }
+  if (pool->active == 0) {
+    pthread_cond_broadcast(&pool->done);
+  }
+}
+
+/*============================================================================
+ * Локальная функция: цикл рабочего потока. Ждёт новую задачу
+ * (смену номера поколения) и помогает её выполнять.
+ *===========================================================================*/
+static void *poolWorker(void *p) {
+  ThreadPool *pool = (ThreadPool *)p;
+  unsigned long seen = 0;           /* Последнее выполненное поколение */
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stop) {
+    if (pool->generation == seen) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    } else {
+      seen = pool->generation;
+      runChunks(pool);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/*============================================================================
+ * Запуск пула из threads потоков (вызывающий поток считается одним из них,
+ * поэтому рабочих создаётся threads - 1). Возвращает число потоков.
+ *===========================================================================*/
+int initThreadPool(ThreadPool *pool, int threads) {
+  pool->threadCount = 0;
+  pool->threads = NULL;
+  pool->task = NULL;
+  pool->arg = NULL;
+  pool->total = 0;
+  pool->chunk = 1;
+  pool->next = 0;
+  pool->active = 0;
+  pool->generation = 0;
+  pool->stop = 0;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  if (threads > 1) {
+    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * (threads - 1));
+    for (int i = 0; i < threads - 1; i++) {
+      if (pthread_create(&pool->threads[pool->threadCount], NULL, poolWorker,
+                         pool) == 0) {
+        pool->threadCount++;        /* Не создался - обойдёмся меньшим */
+      }
+    }
+  }
+  return pool->threadCount + 1;
+}
+
+/*============================================================================
+ * Остановка рабочих потоков и освобождение пула
+ *===========================================================================*/
+void freeThreadPool(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->threadCount; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+  pool->threads = NULL;
+  pool->threadCount = 0;
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+/*============================================================================
+ * Выполнить task над диапазоном [0, total) кусками по chunk элементов.
+ * Куски разбирают рабочие потоки и сам вызывающий; возврат - когда готово всё.
+ * Без пула (NULL) вся работа делается в вызывающем потоке одним куском.
+ *===========================================================================*/
+void runThreadPool(ThreadPool *pool, PoolTask task, void *arg, size_t total,
+                   size_t chunk) {
+  if (pool == NULL || pool->threadCount == 0) {
+    if (total > 0) {
+      task(arg, 0, total);
+    }
+  } else {
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->total = total;
+    pool->chunk = (chunk > 0) ? chunk : 1;
+    pool->next = 0;
+    pool->generation++;             /* Рабочие увидят новую задачу */
+    pthread_cond_broadcast(&pool->wake);
+    runChunks(pool);
+    while (pool->active > 0) {      /* Дожидаемся чужих кусков */
+      pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
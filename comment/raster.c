@@ -0,0 +1,195 @@
+#include "graph.h"
+
+/* Точек Брайля в клетке по x и по y */
+#define BRAILLE_COLS 2
+#define BRAILLE_ROWS 4
+
+/* Сколько отсчётов растеризуется за раз (положения - на стеке) */
+#define RASTER_BLOCK 256
+
+/* Пустая клетка Брайля U+2800 в UTF-8 */
+static const char kBrailleBlank[BRAILLE_BYTES] = {'\xE2', '\xA0', '\x80'};
+
+/* Бит точки Брайля: [строка точки в клетке][столбец точки в клетке] */
+static const unsigned char kBrailleDots[BRAILLE_ROWS][BRAILLE_COLS] = {
+    {0x01, 0x08}, {0x02, 0x10}, {0x04, 0x20}, {0x40, 0x80}};
+
+/*============================================================================
+ * Сетка отсчётов холста: столбцы - точки по x, строки - по y. У Брайля
+ * в клетке 2x4 точки, у остальных способов точка - сама клетка.
+ *===========================================================================*/
+void rasterGrid(const Viewport *view, Viewport *dots) {
+  *dots = *view;
+  if (view->raster == RASTER_BRAILLE) {
+    dots->width = view->width * BRAILLE_COLS;
+    dots->height = view->height * BRAILLE_ROWS;
+  }
+}
+
+/*============================================================================
+ * Байт на клетку холста: символ или UTF-8 знака Брайля
+ *===========================================================================*/
+size_t rasterCellBytes(const Viewport *view) {
+  return (view->raster == RASTER_BRAILLE) ? BRAILLE_BYTES : 1;
+}
+
+/*============================================================================
+ * Пустой холст: точки (у Брайля - пустые знаки), переводы строк на месте.
+ * Строка Брайля собирается один раз и копируется в остальные.
+ *===========================================================================*/
+void clearRaster(Canvas *canvas) {
+  const Viewport *view = &canvas->view;
+  size_t rowBytes = canvas->stride - 1;
+  if (view->raster == RASTER_BRAILLE) {
+    for (int c = 0; c < view->width; c++) {
+      memcpy(canvas->cells + (size_t)c * BRAILLE_BYTES, kBrailleBlank,
+             BRAILLE_BYTES);
+    }
+  } else {
+    memset(canvas->cells, '.', rowBytes);
+  }
+  for (int r = 1; r < view->height; r++) {
+    memcpy(canvas->cells + (size_t)r * canvas->stride, canvas->cells,
+           rowBytes);
+  }
+}
+
+/*============================================================================
+ * Очистить столбцы [begin, end) сетки rasterGrid (у Брайля границы
+ * чётные - клетки целиком)
+ *===========================================================================*/
+void clearRasterColumns(Canvas *canvas, size_t begin, size_t end) {
+  const Viewport *view = &canvas->view;
+  int braille = (view->raster == RASTER_BRAILLE);
+  size_t from = braille ? begin / BRAILLE_COLS * BRAILLE_BYTES : begin;
+  size_t to = braille ? end / BRAILLE_COLS * BRAILLE_BYTES : end;
+  for (int r = 0; r < view->height; r++) {
+    char *row = canvas->cells + (size_t)r * canvas->stride;
+    if (braille) {
+      for (size_t i = from; i < to; i += BRAILLE_BYTES) {
+        memcpy(row + i, kBrailleBlank, BRAILLE_BYTES);
+      }
+    } else {
+      memset(row + from, '.', to - from);
+    }
+  }
+}
+
+/*============================================================================
+ * Сдвиг нарисованного кадра на shift столбцов сетки rasterGrid: новый
+ * столбец c - это старый c + shift (у Брайля shift чётный). Открывшиеся
+ * столбцы остаются с мусором - их очищает и рисует вызывающий.
+ *===========================================================================*/
+void shiftRaster(Canvas *canvas, long shift) {
+  const Viewport *view = &canvas->view;
+  size_t cell = rasterCellBytes(view);
+  size_t dots = (view->raster == RASTER_BRAILLE) ? BRAILLE_COLS : 1;
+  size_t n = (size_t)labs(shift) / dots * cell;   /* Байт сдвига */
+  size_t keep = (size_t)view->width * cell - n;
+  for (int r = 0; r < view->height; r++) {
+    char *row = canvas->cells + (size_t)r * canvas->stride;
+    if (shift > 0) {
+      memmove(row, row + n, keep);
+    } else {
+      memmove(row + n, row, keep);
+    }
+  }
+}
+
+/*============================================================================
+ * Локальная функция: положения значений ys[begin, end) в строках точек
+ * (0 - yMin, дробные). Значения вне [yMin, yMax], NaN и бесконечности
+ * дают NAN. Без ветвлений: цикл векторизуется.
+ *===========================================================================*/
+static void rasterPositions(const Viewport *dots, const double *ys,
+                            long begin, long end, double *pos) {
+  double yMin = dots->yMin;
+  double yMax = dots->yMax;
+  double rows = dots->height - 1;
+  for (long i = begin; i < end; i++) {
+    double y = ys[i];
+    double p = (y - yMin) * rows / (yMax - yMin);
+    pos[i - begin] = (y >= yMin && y <= yMax) ? p : NAN;
+  }
+}
+
+/*============================================================================
+ * Локальная функция: строка точки по положению p (не NaN) - round(p),
+ * зажатый в [0, last] без ветвлений
+ *===========================================================================*/
+static inline int rasterRow(double p, int last) {
+  int r = (int)(p + 0.5);
+  r -= ((double)r - p > 0.5);       /* p + 0.5 округлилось вверх */
+  r = (r < 0) ? 0 : r;
+  return (r > last) ? last : r;
+}
+
+/*============================================================================
+ * Локальная функция: поставить точку (c, r) сетки отсчётов на холст
+ *===========================================================================*/
+static inline void rasterDot(Canvas *canvas, size_t c, int r, char glyph) {
+  if (canvas->view.raster == RASTER_BRAILLE) {
+    unsigned char *cell = (unsigned char *)canvas->cells +
+                          (size_t)(r / BRAILLE_ROWS) * canvas->stride +
+                          c / BRAILLE_COLS * BRAILLE_BYTES;
+    unsigned int mask = ((cell[1] - 0xA0u) << 6) | (cell[2] - 0x80u);
+    mask |= kBrailleDots[r % BRAILLE_ROWS][c % BRAILLE_COLS];
+    cell[1] = (unsigned char)(0xA0u + (mask >> 6));
+    cell[2] = (unsigned char)(0x80u + (mask & 0x3Fu));
+  } else {
+    canvas->cells[(size_t)r * canvas->stride + c] = glyph;
+  }
+}
+
+/*============================================================================
+ * Растеризация ряда значений: ys - по значению на каждый столбец сетки
+ * rasterGrid, рисуются столбцы [begin, end) (соседние значения только
+ * читаются, поэтому потоки с разными столбцами не мешают друг другу;
+ * у Брайля границы должны быть чётными). RASTER_POINTS ставит точку в
+ * каждом столбце. RASTER_LINES и RASTER_BRAILLE тянут от точки
+ * вертикальный отрезок до середины пути к соседней - кривая получается
+ * сплошной и на крутых участках. Соседи вне диапазона y, NaN и
+ * бесконечности (полюса tan, ln и sqrt вне области) линию разрывают.
+ *===========================================================================*/
+void rasterSeries(Canvas *canvas, const double *ys, size_t begin, size_t end,
+                  char glyph) {
+  Viewport dots;
+  double pos[RASTER_BLOCK + 2];     /* С соседями слева и справа */
+  rasterGrid(&canvas->view, &dots);
+  long n = dots.width;
+  int last = dots.height - 1;
+  int lines = canvas->view.raster != RASTER_POINTS;
+  TRACE_LOCAL(unsigned long long off = 0;)
+  for (long b = (long)begin; b < (long)end; b += RASTER_BLOCK) {
+    long blockEnd = (b + RASTER_BLOCK < (long)end) ? b + RASTER_BLOCK
+                                                   : (long)end;
+    long from = (b > 0) ? b - 1 : 0;
+    long to = (blockEnd < n) ? blockEnd + 1 : n;
+    double *p = pos + 1;            /* p[c - b] - положение столбца c */
+    pos[0] = NAN;                   /* Левее первого столбца */
+    pos[blockEnd - b + 1] = NAN;    /* Правее последнего */
+    rasterPositions(&dots, ys, from, to, p + (from - b));
+    for (long c = b; c < blockEnd; c++) {
+      double y = p[c - b];
+      if (!isnan(y)) {
+        double lo = y;
+        double hi = y;
+        if (lines) {                /* Середины до соседей; NaN не меньше */
+          double left = 0.5 * (y + p[c - b - 1]);
+          double right = 0.5 * (y + p[c - b + 1]);
+          lo = (left < lo) ? left : lo;
+          lo = (right < lo) ? right : lo;
+          hi = (left > hi) ? left : hi;
+          hi = (right > hi) ? right : hi;
+        }
+        int r1 = rasterRow(hi, last);
+        for (int r = rasterRow(lo, last); r <= r1; r++) {
+          rasterDot(canvas, (size_t)c, r, glyph);
+        }
+      } else {
+        TRACE_LOCAL(off++;)         /* Вне диапазона y или NaN */
+      }
+    }
+  }
+  TRACE_COUNT(COUNTER_OFF_CANVAS, off);
+}
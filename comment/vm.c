@@ -0,0 +1,584 @@
+#include "graph.h"
+
+/*============================================================================
+ * Инициализация пустой программы (байткод + пул констант)
+ *===========================================================================*/
+void initProgram(Program *prog) {
+  prog->codeSize = 0;
+  prog->codeCapacity = 64;      /* Начальный размер потока кодов */
+  prog->code = (unsigned char *)malloc(prog->codeCapacity);
+  prog->constCount = 0;
+  prog->constCapacity = 8;      /* Начальный размер пула констант */
+  prog->consts = (double *)malloc(sizeof(double) * prog->constCapacity);
+  prog->slotCount = 0;
+  prog->maxDepth = 0;
+}
+
+/*============================================================================
+ * Освобождение памяти программы. Программа над чужой памятью
+ * (codeCapacity == 0, например из библиотеки) только обнуляется.
+ *===========================================================================*/
+void freeProgram(Program *prog) {
+  if (prog->codeCapacity > 0) {
+    free(prog->code);
+    free(prog->consts);
+  }
+  prog->code = NULL;            /* Чтобы не осталось висячих указателей */
+  prog->consts = NULL;
+  prog->codeSize = 0;
+  prog->codeCapacity = 0;
+  prog->constCount = 0;
+  prog->constCapacity = 0;
+  prog->slotCount = 0;
+  prog->maxDepth = 0;
+}
+
+/*============================================================================
+ * Копия программы (dst не инициализирована, освобождается freeProgram)
+ *===========================================================================*/
+void copyProgram(Program *dst, const Program *src) {
+  *dst = *src;
+  dst->codeCapacity = (src->codeSize > 0) ? src->codeSize : 1;
+  dst->constCapacity = (src->constCount > 0) ? src->constCount : 1;
+  dst->code = (unsigned char *)malloc(dst->codeCapacity);
+  dst->consts = (double *)malloc(sizeof(double) * dst->constCapacity);
+  memcpy(dst->code, src->code, src->codeSize);
+  memcpy(dst->consts, src->consts, sizeof(double) * src->constCount);
+}
+
+/*============================================================================
+ * Запись одного байта в поток кодов
+ *===========================================================================*/
+void emitProgramByte(Program *prog, unsigned char b) {
+  if (prog->codeSize == prog->codeCapacity) {   /* Если места нет */
+    prog->codeCapacity *= 2;                    /* Увеличиваем в 2 раза */
+    prog->code = (unsigned char *)realloc(prog->code, prog->codeCapacity);
+  }
+  prog->code[prog->codeSize] = b;
+  prog->codeSize++;
+}
+
+/*============================================================================
+ * Запись 4-байтового индекса сразу после OP_CONST/OP_LOAD/OP_STORE
+ *===========================================================================*/
+void emitProgramIndex(Program *prog, unsigned int idx) {
+  unsigned char bytes[sizeof(idx)];
+  memcpy(bytes, &idx, sizeof(idx));             /* Побайтно, без выравнивания */
+  for (size_t i = 0; i < sizeof(idx); i++) {
+    emitProgramByte(prog, bytes[i]);
+  }
+}
+
+/*============================================================================
+ * Добавление числа в пул констант, возвращает индекс
+ *===========================================================================*/
+unsigned int addProgramConst(Program *prog, double v) {
+  if (prog->constCount == prog->constCapacity) {
+    prog->constCapacity *= 2;
+    prog->consts = (double *)realloc(prog->consts,
+                                     sizeof(double) * prog->constCapacity);
+  }
+  prog->consts[prog->constCount] = v;
+  prog->constCount++;
+  return (unsigned int)(prog->constCount - 1);
+}
+
+/*============================================================================
+ * Компиляция ОПН в байткод через DAG: повторяющиеся подвыражения
+ * вычисляются один раз. Заодно считается максимальная глубина стека.
+ * Возвращает 1, если выражение корректно, иначе 0 (программа пустая).
+ *===========================================================================*/
+int compileRPN(const TokenArray *postfix, Program *prog) {
+  ExprDag dag;
+  initExprDag(&dag);
+  int ok = buildExprDag(postfix, &dag);
+  if (ok) {
+    compileExprDag(&dag, prog);
+  } else {                          /* Некорректное выражение */
+    prog->codeSize = 0;
+    prog->constCount = 0;
+    prog->slotCount = 0;
+    prog->maxDepth = 0;
+  }
+  freeExprDag(&dag);
+  TRACE_MAX(COUNTER_PROGRAM_DEPTH, prog->maxDepth);
+  return ok;
+}
+
+/*============================================================================
+ * То же из дерева выражения (без промежуточной ОПН)
+ *===========================================================================*/
+int compileAst(const ExprAst *ast, Program *prog) {
+  ExprDag dag;
+  initExprDag(&dag);
+  int ok = buildAstDag(ast, &dag);
+  if (ok) {
+    compileExprDag(&dag, prog);
+  } else {                          /* Дерево не построено */
+    prog->codeSize = 0;
+    prog->constCount = 0;
+    prog->slotCount = 0;
+    prog->maxDepth = 0;
+  }
+  freeExprDag(&dag);
+  TRACE_MAX(COUNTER_PROGRAM_DEPTH, prog->maxDepth);
+  return ok;
+}
+
+/*============================================================================
+ * Вычисление байткода при x = xval (один switch на операцию)
+ *===========================================================================*/
+double evalProgram(const Program *prog, double xval) {
+  double small[PROGRAM_SMALL_STACK];  /* Обычно хватает стека на кадре */
+  double *stack = small;
+  int frameSize = prog->maxDepth + prog->slotCount;
+  if (frameSize > PROGRAM_SMALL_STACK) {
+    stack = (double *)malloc(sizeof(double) * frameSize);
+  }
+  double *slots = stack + prog->maxDepth;  /* Слоты общих подвыражений */
+  const unsigned char *code = prog->code;
+  const unsigned char *end = code + prog->codeSize;
+  const double *consts = prog->consts;
+  unsigned int idx = 0;
+  int top = -1;
+  while (code < end) {
+    switch (*code++) {
+      case OP_CONST:
+        memcpy(&idx, code, sizeof(idx));  /* Индекс константы в пуле */
+        code += sizeof(idx);
+        stack[++top] = consts[idx];
+        break;
+      case OP_X:
+        stack[++top] = xval;
+        break;
+      case OP_LOAD:
+        memcpy(&idx, code, sizeof(idx));  /* Берём готовое подвыражение */
+        code += sizeof(idx);
+        stack[++top] = slots[idx];
+        break;
+      case OP_STORE:
+        memcpy(&idx, code, sizeof(idx));  /* Запоминаем, вершина остаётся */
+        code += sizeof(idx);
+        slots[idx] = stack[top];
+        break;
+      case OP_VAR:
+        code += sizeof(idx);        /* Не подставлена (bindProgram) */
+        stack[++top] = NAN;
+        break;
+      case OP_ADD:
+        top--;
+        stack[top] += stack[top + 1];
+        break;
+      case OP_SUB:
+        top--;
+        stack[top] -= stack[top + 1];
+        break;
+      case OP_MUL:
+        top--;
+        stack[top] *= stack[top + 1];
+        break;
+      case OP_DIV:
+        top--;
+        stack[top] /= stack[top + 1];
+        break;
+      case OP_NEG:
+        stack[top] = -stack[top];
+        break;
+      case OP_SIN:
+        stack[top] = sin(stack[top]);
+        break;
+      case OP_COS:
+        stack[top] = cos(stack[top]);
+        break;
+      case OP_TAN:
+        stack[top] = tan(stack[top]);
+        break;
+      case OP_CTG:
+        stack[top] = 1.0 / tan(stack[top]);
+        break;
+      case OP_SQRT:
+        stack[top] = sqrt(stack[top]);
+        break;
+      case OP_LN:
+        stack[top] = log(stack[top]);
+        break;
+      case OP_FAST_SIN:
+        stack[top] = fastSin(stack[top]);
+        break;
+      case OP_FAST_COS:
+        stack[top] = fastCos(stack[top]);
+        break;
+      case OP_FAST_TAN:
+        stack[top] = fastTan(stack[top]);
+        break;
+      case OP_FAST_CTG:
+        stack[top] = fastCtg(stack[top]);
+        break;
+      case OP_FAST_LN:
+        stack[top] = fastLog(stack[top]);
+        break;
+      default:
+        break;
+    }
+  }
+  double res = (top >= 0) ? stack[top] : NAN;  /* Пустая программа -> NAN */
+  if (stack != small) {
+    free(stack);
+  }
+  return res;
+}
+
+/* Точные функции и их быстрые замены (--precision fast), парами */
+static const unsigned char kFastOps[][2] = {
+    {OP_SIN, OP_FAST_SIN}, {OP_COS, OP_FAST_COS}, {OP_TAN, OP_FAST_TAN},
+    {OP_CTG, OP_FAST_CTG}, {OP_LN, OP_FAST_LN}};
+
+/* Токен, которому соответствует код операции байткода (быстрые функции -
+ * токены точных) */
+static const TokenType kOpTokens[] = {
+    [OP_ADD] = TOKEN_PLUS, [OP_SUB] = TOKEN_MINUS, [OP_MUL] = TOKEN_MULT,
+    [OP_DIV] = TOKEN_DIV,  [OP_SIN] = TOKEN_SIN,   [OP_COS] = TOKEN_COS,
+    [OP_TAN] = TOKEN_TAN,  [OP_CTG] = TOKEN_CTG,   [OP_SQRT] = TOKEN_SQRT,
+    [OP_LN] = TOKEN_LN,
+    [OP_FAST_SIN] = TOKEN_SIN, [OP_FAST_COS] = TOKEN_COS,
+    [OP_FAST_TAN] = TOKEN_TAN, [OP_FAST_CTG] = TOKEN_CTG,
+    [OP_FAST_LN] = TOKEN_LN};
+
+/*============================================================================
+ * Токен операции или функции для кода op: по нему эталонные вычислители
+ * (интервалы, дуальные числа) выбирают действие над своими значениями
+ *===========================================================================*/
+TokenType opToken(unsigned char op) {
+  return kOpTokens[op];
+}
+
+/*============================================================================
+ * Перевод функций count выражений на точность precision (на месте).
+ * Байт меняется, только если он другой: выражение, уже переведённое на
+ * ту же точность, не трогается. Байткод над чужой памятью (из библиотеки)
+ * сначала копируется.
+ *===========================================================================*/
+void setProgramPrecision(Program *progs, int count, MathPrecision precision) {
+  int from = (precision == PRECISION_FAST) ? 0 : 1;
+  int pairs = (int)(sizeof(kFastOps) / sizeof(kFastOps[0]));
+  for (int s = 0; s < count; s++) {
+    Program *prog = &progs[s];
+    int i = 0;
+    while (i < prog->codeSize) {
+      unsigned char op = prog->code[i];
+      int p = 0;
+      while (p < pairs && kFastOps[p][from] != op) {
+        p++;
+      }
+      if (p < pairs && prog->codeCapacity == 0) {  /* Чужая память */
+        Program view = *prog;
+        copyProgram(prog, &view);
+      }
+      if (p < pairs) {
+        prog->code[i] = kFastOps[p][1 - from];
+      }
+      i++;
+      if (op == OP_CONST || op == OP_LOAD || op == OP_STORE || op == OP_VAR) {
+        i += (int)sizeof(unsigned int);  /* Индекс за кодом */
+      }
+    }
+  }
+}
+
+/* Один "столбец" стека в пакетном режиме: по значению на каждую дорожку */
+typedef double Lanes[BATCH_LANES];
+
+/*============================================================================
+ * Локальная функция: бинарная операция над всеми дорожками сразу.
+ * Циклы фиксированной длины компилятор разворачивает в SSE/AVX.
+ *===========================================================================*/
+static void lanesBinary(unsigned char op, double *restrict a,
+                        const double *restrict b) {
+  if (op == OP_ADD) {
+    for (int l = 0; l < BATCH_LANES; l++) {
+      a[l] += b[l];
+    }
+  } else if (op == OP_SUB) {
+    for (int l = 0; l < BATCH_LANES; l++) {
+      a[l] -= b[l];
+    }
+  } else if (op == OP_MUL) {
+    for (int l = 0; l < BATCH_LANES; l++) {
+      a[l] *= b[l];
+    }
+  } else {
+    for (int l = 0; l < BATCH_LANES; l++) {
+      a[l] /= b[l];
+    }
+  }
+}
+
+/*============================================================================
+ * Локальная функция: унарная операция (минус или функция) над дорожками
+ *===========================================================================*/
+static void lanesUnary(unsigned char op, double *restrict a) {
+  switch (op) {
+    case OP_NEG:
+      for (int l = 0; l < BATCH_LANES; l++) {
+        a[l] = -a[l];
+      }
+      break;
+    case OP_SIN:
+      for (int l = 0; l < BATCH_LANES; l++) {
+        a[l] = sin(a[l]);
+      }
+      break;
+    case OP_COS:
+      for (int l = 0; l < BATCH_LANES; l++) {
+        a[l] = cos(a[l]);
+      }
+      break;
+    case OP_TAN:
+      for (int l = 0; l < BATCH_LANES; l++) {
+        a[l] = tan(a[l]);
+      }
+      break;
+    case OP_CTG:
+      for (int l = 0; l < BATCH_LANES; l++) {
+        a[l] = 1.0 / tan(a[l]);
+      }
+      break;
+    case OP_SQRT:
+      for (int l = 0; l < BATCH_LANES; l++) {
+        a[l] = sqrt(a[l]);
+      }
+      break;
+    case OP_LN:
+      for (int l = 0; l < BATCH_LANES; l++) {
+        a[l] = log(a[l]);
+      }
+      break;
+    case OP_FAST_SIN:
+      fastSinLanes(a);
+      break;
+    case OP_FAST_COS:
+      fastCosLanes(a);
+      break;
+    case OP_FAST_TAN:
+      fastTanLanes(a);
+      break;
+    case OP_FAST_CTG:
+      fastCtgLanes(a);
+      break;
+    case OP_FAST_LN:
+      fastLogLanes(a);
+      break;
+    default:
+      break;
+  }
+}
+
+/*============================================================================
+ * Локальная функция: прогон байткода для одного блока из BATCH_LANES x
+ * при одном y (остальные переменные должны быть уже подставлены).
+ * Возвращает индекс вершины стека (результат лежит в stack[top]).
+ *===========================================================================*/
+static int runBlock(const Program *prog, const double *xs, double y,
+                    Lanes *stack) {
+  Lanes *slots = stack + prog->maxDepth;
+  const unsigned char *code = prog->code;
+  const unsigned char *end = code + prog->codeSize;
+  unsigned int idx = 0;
+  int top = -1;
+  while (code < end) {
+    unsigned char op = *code++;
+    if (op == OP_CONST) {           /* Константа на все дорожки */
+      memcpy(&idx, code, sizeof(idx));
+      code += sizeof(idx);
+      top++;
+      for (int l = 0; l < BATCH_LANES; l++) {
+        stack[top][l] = prog->consts[idx];
+      }
+    } else if (op == OP_X) {        /* Столбец значений x */
+      top++;
+      memcpy(stack[top], xs, sizeof(Lanes));
+    } else if (op == OP_LOAD || op == OP_STORE) {
+      memcpy(&idx, code, sizeof(idx));
+      code += sizeof(idx);
+      if (op == OP_LOAD) {
+        top++;
+        memcpy(stack[top], slots[idx], sizeof(Lanes));
+      } else {
+        memcpy(slots[idx], stack[top], sizeof(Lanes));
+      }
+    } else if (op == OP_VAR) {      /* y на все дорожки, прочие - NAN */
+      memcpy(&idx, code, sizeof(idx));
+      code += sizeof(idx);
+      top++;
+      for (int l = 0; l < BATCH_LANES; l++) {
+        stack[top][l] = (idx == VAR_Y) ? y : NAN;
+      }
+    } else if (op >= OP_ADD && op <= OP_DIV) {
+      top--;
+      lanesBinary(op, stack[top], stack[top + 1]);
+    } else {
+      lanesUnary(op, stack[top]);
+    }
+  }
+  return top;
+}
+
+/*============================================================================
+ * Пакетное вычисление: ys[i] = f(xs[i]) для всех i < n.
+ * Стек хранится по столбцам (structure-of-arrays), блоками по BATCH_LANES.
+ *===========================================================================*/
+void evalProgramBatch(const Program *prog, const double *xs, double *ys,
+                      size_t n) {
+  _Alignas(64) Lanes small[BATCH_SMALL_DEPTH];  /* Неглубокие выражения */
+  _Alignas(64) Lanes xblock;
+  Lanes *stack = small;
+  int frameSize = prog->maxDepth + prog->slotCount;
+  if (frameSize > BATCH_SMALL_DEPTH) {
+    stack = (Lanes *)aligned_alloc(64, sizeof(Lanes) * frameSize);
+  }
+  for (size_t base = 0; base < n; base += BATCH_LANES) {
+    size_t lanes = (n - base < BATCH_LANES) ? n - base : BATCH_LANES;
+    for (size_t l = 0; l < BATCH_LANES; l++) {
+      /* Хвост последнего блока дополняем последним x */
+      xblock[l] = xs[base + (l < lanes ? l : lanes - 1)];
+    }
+    int top = runBlock(prog, xblock, NAN, stack);
+    for (size_t l = 0; l < lanes; l++) {
+      ys[base + l] = (top >= 0) ? stack[top][l] : NAN;
+    }
+  }
+  if (stack != small) {
+    free(stack);
+  }
+}
+
+/*============================================================================
+ * Вычисление на сетке: out[r * n + c] = f(xs[c], ys[r]) для rows строк.
+ * Снаружи - блоки по BATCH_LANES x, внутри - строки: блок x и стек
+ * остаются в L1, пока по ним проходят все строки.
+ *===========================================================================*/
+void evalProgramGrid(const Program *prog, const double *xs, size_t n,
+                     const double *ys, size_t rows, double *out) {
+  _Alignas(64) Lanes small[BATCH_SMALL_DEPTH];
+  _Alignas(64) Lanes xblock;
+  Lanes *stack = small;
+  int frameSize = prog->maxDepth + prog->slotCount;
+  if (frameSize > BATCH_SMALL_DEPTH) {
+    stack = (Lanes *)aligned_alloc(64, sizeof(Lanes) * frameSize);
+  }
+  for (size_t base = 0; base < n; base += BATCH_LANES) {
+    size_t lanes = (n - base < BATCH_LANES) ? n - base : BATCH_LANES;
+    for (size_t l = 0; l < BATCH_LANES; l++) {
+      xblock[l] = xs[base + (l < lanes ? l : lanes - 1)];
+    }
+    for (size_t r = 0; r < rows; r++) {
+      int top = runBlock(prog, xblock, ys[r], stack);
+      for (size_t l = 0; l < lanes; l++) {
+        out[r * n + base + l] = (top >= 0) ? stack[top][l] : NAN;
+      }
+    }
+  }
+  if (stack != small) {
+    free(stack);
+  }
+}
+
+/*============================================================================
+ * Маска переменных, которые читает байткод: бит v - буква 'a' + v
+ *===========================================================================*/
+unsigned int programVars(const Program *prog) {
+  const unsigned char *code = prog->code;
+  const unsigned char *end = code + prog->codeSize;
+  unsigned int idx = 0;
+  unsigned int mask = 0;
+  while (code < end) {
+    unsigned char op = *code++;
+    if (op == OP_CONST || op == OP_LOAD || op == OP_STORE || op == OP_VAR) {
+      memcpy(&idx, code, sizeof(idx));
+      code += sizeof(idx);
+    }
+    if (op == OP_VAR) {
+      mask |= 1u << idx;
+    }
+  }
+  return mask;
+}
+
+/*============================================================================
+ * Копия src, в которой переменные подставлены константами из vars.
+ * Переменные из маски keep остаются (y в режимах сетки). dst не
+ * инициализирована, освобождается freeProgram.
+ *===========================================================================*/
+void bindProgram(const Program *src, const double *vars, unsigned int keep,
+                 Program *dst) {
+  const unsigned char *code = src->code;
+  const unsigned char *end = code + src->codeSize;
+  unsigned int idx = 0;
+  initProgram(dst);
+  for (int i = 0; i < src->constCount; i++) {
+    addProgramConst(dst, src->consts[i]);  /* Старые индексы не меняются */
+  }
+  while (code < end) {
+    unsigned char op = *code++;
+    if (op == OP_CONST || op == OP_LOAD || op == OP_STORE || op == OP_VAR) {
+      memcpy(&idx, code, sizeof(idx));
+      code += sizeof(idx);
+      if (op == OP_VAR && !(keep & (1u << idx))) {
+        op = OP_CONST;
+        idx = addProgramConst(dst, vars[idx]);
+      }
+      emitProgramByte(dst, op);
+      emitProgramIndex(dst, idx);
+    } else {
+      emitProgramByte(dst, op);
+    }
+  }
+  dst->slotCount = src->slotCount;
+  dst->maxDepth = src->maxDepth;
+}
+
+/*============================================================================
+ * Подставить параметры vars в count выражений перед отрисовкой (в режимах
+ * сетки y остаётся переменной). Возвращает NULL, если подставлять нечего
+ * и можно рисовать сами progs, иначе новый массив для freeBoundPrograms.
+ *===========================================================================*/
+Program *bindPrograms(const Program *progs, int count, const double *vars,
+                      EvalMode mode) {
+  unsigned int keep = isGridMode(mode) ? 1u << VAR_Y : 0;
+  unsigned int used = 0;
+  Program *bound = NULL;
+  for (int s = 0; s < count; s++) {
+    used |= programVars(&progs[s]);
+  }
+  if (used & ~keep) {
+    bound = (Program *)malloc(sizeof(Program) * count);
+    for (int s = 0; s < count; s++) {
+      bindProgram(&progs[s], vars, keep, &bound[s]);
+    }
+  }
+  return bound;
+}
+
+/*============================================================================
+ * Освобождение выражений bindPrograms (NULL - ничего не подставлялось)
+ *===========================================================================*/
+void freeBoundPrograms(Program *bound, int count) {
+  if (bound != NULL) {
+    for (int s = 0; s < count; s++) {
+      freeProgram(&bound[s]);
+    }
+    free(bound);
+  }
+}
+
+/*============================================================================
+ * Пакетное вычисление прямо по ОПН (компиляция + прогон)
+ *===========================================================================*/
+void evalRPNBatch(const TokenArray *postfix, const double *xs, double *ys,
+                  size_t n) {
+  Program prog;
+  initProgram(&prog);
+  compileRPN(postfix, &prog);
+  evalProgramBatch(&prog, xs, ys, n);
+  freeProgram(&prog);
+}
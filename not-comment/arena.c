@@ -0,0 +1,58 @@
+#include "graph.h"
+
+#define ARENA_ALIGN 16
+
+#define ARENA_HEADER \
+  ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static ArenaBlock *newArenaBlock(size_t size, ArenaBlock *prev) {
+  ArenaBlock *block = (ArenaBlock *)malloc(ARENA_HEADER + size);
+  block->prev = prev;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+void initArena(Arena *arena, size_t size) {
+  arena->total = (size > 0) ? size : ARENA_ALIGN;
+  arena->block = newArenaBlock(arena->total, NULL);
+}
+
+void *arenaAlloc(Arena *arena, size_t bytes) {
+  ArenaBlock *block = arena->block;
+  bytes = (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (block->used + bytes > block->size) {
+    size_t size = 2 * block->size;
+    size = (size > bytes) ? size : bytes;
+    block = newArenaBlock(size, block);
+    arena->block = block;
+    arena->total += size;
+  }
+  void *p = (char *)block + ARENA_HEADER + block->used;
+  block->used += bytes;
+  return p;
+}
+
+void resetArena(Arena *arena) {
+  if (arena->block->prev != NULL) {
+    freeArena(arena);
+    arena->block = newArenaBlock(arena->total, NULL);
+  } else {
+    arena->block->used = 0;
+  }
+}
+
+void freeArena(Arena *arena) {
+  ArenaBlock *block = arena->block;
+  while (block != NULL) {
+    ArenaBlock *prev = block->prev;
+    free(block);
+    block = prev;
+  }
+  arena->block = NULL;
+}
+
+size_t exprArenaSize(size_t len) {
+  return (len + 16) * (sizeof(Token) + 2 * sizeof(ExprNode) + sizeof(int)) +
+         4 * ARENA_ALIGN;
+}
@@ -0,0 +1,486 @@
+#include "graph.h"
+
+#define BATCH_QUEUE_SIZE 64
+
+typedef struct {
+  char *key;
+  Program *progs;
+  int count;
+  SharedJit **jits;
+  Viewport view;
+  double vars[VAR_COUNT];
+} BatchItem;
+
+typedef struct {
+  BatchItem items[BATCH_QUEUE_SIZE];
+  int head;
+  int count;
+  int eof;
+  FILE *in;
+  const ProgramLibrary *library;
+  MathPrecision precision;
+  EvalMode mode;
+  Viewport view;
+  double vars[VAR_COUNT];
+  ExprCache programs;
+  Arena scratch;
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty;
+  pthread_cond_t notFull;
+} ExprQueue;
+
+static void compileLine(ExprCache *cache, Arena *scratch, const char *key,
+                        const long *columns, Program *prog) {
+  CacheEntry *e = findExprCache(cache, key);
+  if (e == NULL) {
+    ExprAst ast;
+    resetArena(scratch);
+    parseExpr(key, scratch, &ast);
+    if (ast.error != NULL) {
+      long column = (columns != NULL) ? columns[ast.errorPos] : ast.errorPos;
+      fprintf(stderr, "graph: %s at column %ld: %s\n", ast.error, column + 1,
+              key);
+    }
+    countFold(&ast, &cache->fold);
+    initProgram(prog);
+    compileAst(&ast, prog);
+    e = addExprCache(cache, key);
+    if (e != NULL) {
+      copyProgram(&e->prog, prog);
+      e->hasProgram = 1;
+    }
+  } else {
+    copyProgram(prog, &e->prog);
+  }
+}
+
+int compileSeries(ExprCache *cache, Arena *scratch, char *key,
+                  const long *columns, Program **progs) {
+  char *part = key;
+  int count = countSeries(key);
+  *progs = (Program *)malloc(sizeof(Program) * count);
+  for (int s = 0; s < count; s++) {
+    char *sep = strchr(part, ';');
+    if (sep != NULL) {
+      *sep = '\0';
+    }
+    compileLine(cache, scratch, part,
+                (columns != NULL) ? columns + (part - key) : NULL,
+                &(*progs)[s]);
+    if (sep != NULL) {
+      *sep = ';';
+      part = sep + 1;
+    }
+  }
+  return count;
+}
+
+SharedJit **shareSeriesJit(ExprCache *cache, char *key, const Program *progs,
+                           int count) {
+  SharedJit **jits = (SharedJit **)malloc(sizeof(SharedJit *) * count);
+  char *part = key;
+  for (int s = 0; s < count; s++) {
+    char *sep = strchr(part, ';');
+    if (sep != NULL) {
+      *sep = '\0';
+    }
+    CacheEntry *e = peekExprCache(cache, part);
+    if (e != NULL && e->jit == NULL) {
+      e->jit = shareJit(&progs[s]);
+    }
+    jits[s] = (e != NULL) ? holdJit(e->jit) : shareJit(&progs[s]);
+    if (sep != NULL) {
+      *sep = ';';
+      part = sep + 1;
+    }
+  }
+  return jits;
+}
+
+static void compileItem(ExprCache *cache, Arena *scratch, const char *line,
+                        size_t len, BatchItem *item) {
+  long *columns = (long *)malloc(sizeof(long) * (len + 1));
+  item->key = (char *)malloc(len + 1);
+  normalizeExpr(line, item->key, columns);
+  item->count = compileSeries(cache, scratch, item->key, columns,
+                              &item->progs);
+  item->jits = NULL;
+  free(columns);
+}
+
+static void freeItem(BatchItem *item) {
+  releaseJits(item->jits, item->count);
+  for (int s = 0; s < item->count; s++) {
+    freeProgram(&item->progs[s]);
+  }
+  free(item->progs);
+  free(item->key);
+}
+
+static int parseViewCommand(const char *line, Viewport *view) {
+  Viewport v = *view;
+  int n = sscanf(line, ":view %lf %lf %lf %lf", &v.xMin, &v.xMax, &v.yMin,
+                 &v.yMax);
+  if (n == 4) {
+    v.autoscaleY = 0;
+  }
+  int ok = (n == 2 || n == 4) && v.xMin < v.xMax && v.yMin < v.yMax;
+  if (ok) {
+    *view = v;
+  }
+  return ok;
+}
+
+static int parseSetCommand(const char *line, double *vars) {
+  int ok = !strncmp(line, ":set ", 5);
+  if (ok) {
+    char text[64];
+    size_t len = strcspn(line + 5, "\r\n");
+    ok = len < sizeof(text);
+    if (ok) {
+      memcpy(text, line + 5, len);
+      text[len] = '\0';
+      ok = parseVar(text, vars);
+    }
+  }
+  return ok;
+}
+
+int parseBatchCommand(const char *line, Viewport *view, double *vars) {
+  return parseViewCommand(line, view) || parseSetCommand(line, vars);
+}
+
+static void pushItem(ExprQueue *q, const BatchItem *item) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == BATCH_QUEUE_SIZE) {
+    pthread_cond_wait(&q->notFull, &q->lock);
+  }
+  q->items[(q->head + q->count) % BATCH_QUEUE_SIZE] = *item;
+  q->count++;
+  pthread_cond_signal(&q->notEmpty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void finishQueue(ExprQueue *q) {
+  freeArena(&q->scratch);
+  pthread_mutex_lock(&q->lock);
+  q->eof = 1;
+  pthread_cond_signal(&q->notEmpty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void *parseStage(void *p) {
+  ExprQueue *q = (ExprQueue *)p;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len = 0;
+  while ((len = getline(&line, &cap, q->in)) >= 0) {
+    BatchItem item;
+    if (line[0] == ':') {
+      if (parseBatchCommand(line, &q->view, q->vars)) {
+        item.key = NULL;
+        item.view = q->view;
+        memcpy(item.vars, q->vars, sizeof(item.vars));
+        pushItem(q, &item);
+      } else {
+        fprintf(stderr, "graph: bad command: %s", line);
+      }
+    } else {
+      compileItem(&q->programs, &q->scratch, line, (size_t)len, &item);
+      setProgramPrecision(item.progs, item.count, q->precision);
+      if (q->mode == EVAL_JIT) {
+        item.jits = shareSeriesJit(&q->programs, item.key, item.progs,
+                                   item.count);
+      }
+      pushItem(q, &item);
+    }
+  }
+  free(line);
+  finishQueue(q);
+  return NULL;
+}
+
+static int loadLibraryItem(const ProgramLibrary *lib, int f, BatchItem *item) {
+  const LibraryFrame *e = &lib->frames[f];
+  const char *key = libraryKey(lib, f);
+  int ok = key != NULL && e->programCount > 0 &&
+           e->firstProgram <= (uint32_t)lib->programCount &&
+           e->programCount <= lib->programCount - e->firstProgram;
+  if (ok) {
+    item->key = (char *)malloc(e->keyLength + 1);
+    memcpy(item->key, key, e->keyLength + 1);
+    item->count = (int)e->programCount;
+    item->jits = NULL;
+    item->progs = (Program *)malloc(sizeof(Program) * item->count);
+    for (int s = 0; s < item->count; s++) {
+      ok = libraryProgram(lib, (int)e->firstProgram + s, &item->progs[s]) &&
+           ok;
+    }
+    if (!ok) {
+      freeItem(item);
+    }
+  }
+  return ok;
+}
+
+static void *libraryStage(void *p) {
+  ExprQueue *q = (ExprQueue *)p;
+  for (int f = 0; f < q->library->frameCount; f++) {
+    BatchItem item;
+    if (loadLibraryItem(q->library, f, &item)) {
+      setProgramPrecision(item.progs, item.count, q->precision);
+      if (q->mode == EVAL_JIT) {
+        item.jits = shareJits(item.progs, item.count);
+      }
+      pushItem(q, &item);
+    } else {
+      fprintf(stderr, "graph: library frame %d is corrupt\n", f);
+    }
+  }
+  finishQueue(q);
+  return NULL;
+}
+
+static int popItem(ExprQueue *q, BatchItem *item) {
+  int ok = 0;
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && !q->eof) {
+    pthread_cond_wait(&q->notEmpty, &q->lock);
+  }
+  if (q->count > 0) {
+    *item = q->items[q->head];
+    q->head = (q->head + 1) % BATCH_QUEUE_SIZE;
+    q->count--;
+    pthread_cond_signal(&q->notFull);
+    ok = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ok;
+}
+
+typedef struct {
+  Viewport view;
+  double vars[VAR_COUNT];
+  BatchItem current;
+  int hasBound;
+  Program *bound;
+  SharedJit **boundJits;
+  double boundVars[VAR_COUNT];
+  SampleCache samples;
+  ExprCache frames;
+  Canvas canvas;
+} RenderState;
+
+static char *frameKey(const char *expr, const Viewport *view,
+                      const double *vars, unsigned int used) {
+  size_t size = strlen(expr) + 128 + 32 * VAR_COUNT;
+  char *key = (char *)malloc(size);
+  int n = 0;
+  if (view->autoscaleY) {
+    n = snprintf(key, size, "%s@%.17g:%.17g:auto", expr, view->xMin,
+                 view->xMax);
+  } else {
+    n = snprintf(key, size, "%s@%.17g:%.17g:%.17g:%.17g", expr, view->xMin,
+                 view->xMax, view->yMin, view->yMax);
+  }
+  for (int v = 0; v < VAR_COUNT; v++) {
+    if (used & (1u << v)) {
+      n += snprintf(key + n, size - n, ":%c=%.17g", 'a' + v, vars[v]);
+    }
+  }
+  return key;
+}
+
+static void dropBound(RenderState *st) {
+  if (st->hasBound) {
+    releaseJits(st->boundJits, st->current.count);
+    freeBoundPrograms(st->bound, st->current.count);
+  }
+  st->hasBound = 0;
+  st->bound = NULL;
+  st->boundJits = NULL;
+}
+
+static void bindCurrent(const BatchConfig *cfg, RenderState *st,
+                        unsigned int used) {
+  int same = st->hasBound;
+  for (int v = 0; same && v < VAR_COUNT; v++) {
+    same = !(used & (1u << v)) || st->boundVars[v] == st->vars[v];
+  }
+  if (!same) {
+    dropBound(st);
+    st->bound = bindPrograms(st->current.progs, st->current.count, st->vars,
+                             cfg->mode);
+    if (st->bound != NULL && cfg->mode == EVAL_JIT) {
+      st->boundJits = shareJits(st->bound, st->current.count);
+    }
+    memcpy(st->boundVars, st->vars, sizeof(st->boundVars));
+    st->hasBound = 1;
+  }
+}
+
+static void renderCurrent(const BatchConfig *cfg, RenderState *st,
+                          ThreadPool *pool) {
+  Canvas *canvas = &st->canvas;
+  size_t cells = canvas->stride * cfg->view.height;
+  const Program *progs = st->current.progs;
+  int count = st->current.count;
+  unsigned int used = 0;
+  for (int s = 0; s < count; s++) {
+    used |= programVars(&progs[s]);
+  }
+  char *key = cfg->cacheFrames
+                  ? frameKey(st->current.key, &st->view, st->vars, used)
+                  : NULL;
+  CacheEntry *e = (key != NULL) ? findExprCache(&st->frames, key) : NULL;
+  if (e != NULL) {
+    canvas->view = e->frameView;
+    memcpy(canvas->cells, e->frame, cells);
+    st->samples.cells = NULL;
+  } else {
+    SharedJit **jits = st->current.jits;
+    bindCurrent(cfg, st, used);
+    if (st->bound != NULL) {
+      progs = st->bound;
+      jits = st->boundJits;
+    }
+    canvas->view = st->view;
+    if (count == 1 && st->bound == NULL) {
+      fillCanvasSamples(canvas, progs, (jits != NULL) ? jits[0] : NULL,
+                        cfg->mode, pool, &st->samples);
+    } else {
+      resetSampleCache(&st->samples);
+      fillCanvasPrograms(canvas, progs, jits, count, cfg->mode, pool);
+    }
+    e = (key != NULL) ? addExprCache(&st->frames, key) : NULL;
+    if (e != NULL) {
+      e->frameView = canvas->view;
+      e->frame = (char *)malloc(cells);
+      memcpy(e->frame, canvas->cells, cells);
+    }
+  }
+  free(key);
+}
+
+static int applyItem(RenderState *st, const BatchItem *item) {
+  if (item->key == NULL) {
+    st->view = item->view;
+    memcpy(st->vars, item->vars, sizeof(st->vars));
+  } else {
+    if (st->current.key != NULL) {
+      dropBound(st);
+      if (strcmp(st->current.key, item->key) != 0) {
+        resetSampleCache(&st->samples);
+      }
+      freeItem(&st->current);
+    }
+    st->current = *item;
+  }
+  return st->current.key != NULL;
+}
+
+static void printCacheStats(const char *name, const ExprCache *cache) {
+  fprintf(stderr, "cache %s: hits %lu misses %lu evictions %lu\n", name,
+          cache->hits, cache->misses, cache->evictions);
+}
+
+static void printSampleStats(const SampleCache *samples) {
+  fprintf(stderr, "cache samples: reused %lu evaluated %lu\n",
+          samples->reused, samples->evaluated);
+}
+
+int runBatch(FILE *in, const BatchConfig *cfg, ThreadPool *pool,
+             FrameSink *out) {
+  ExprQueue q;
+  RenderState st;
+  pthread_t parser;
+  int frameCount = 0;
+  q.head = 0;
+  q.count = 0;
+  q.eof = 0;
+  q.in = in;
+  q.library = cfg->library;
+  q.precision = cfg->precision;
+  q.mode = cfg->mode;
+  q.view = cfg->view;
+  memcpy(q.vars, cfg->vars, sizeof(q.vars));
+  initExprCache(&q.programs, cfg->cacheSize);
+  initArena(&q.scratch, exprArenaSize(256));
+  st.view = cfg->view;
+  memcpy(st.vars, cfg->vars, sizeof(st.vars));
+  st.current.key = NULL;
+  st.hasBound = 0;
+  st.bound = NULL;
+  st.boundJits = NULL;
+  initSampleCache(&st.samples);
+  initExprCache(&st.frames, cfg->cacheFrames ? cfg->cacheSize : 0);
+  pthread_mutex_init(&q.lock, NULL);
+  pthread_cond_init(&q.notEmpty, NULL);
+  pthread_cond_init(&q.notFull, NULL);
+  if (pthread_create(&parser, NULL,
+                     (cfg->library != NULL) ? libraryStage : parseStage,
+                     &q) != 0) {
+    freeArena(&q.scratch);
+    frameCount = -1;
+  } else {
+    BatchItem item;
+    initCanvas(&st.canvas, &cfg->view);
+    int frames = (cfg->sweep.var >= 0) ? cfg->sweep.frames : 1;
+    while (popItem(&q, &item)) {
+      int draw = applyItem(&st, &item);
+      for (int step = 0; draw && step < frames; step++) {
+        sweepVars(&cfg->sweep, step, st.vars);
+        renderCurrent(cfg, &st, pool);
+        writeFrame(out, &st.canvas, frameCount > 0);
+        frameCount++;
+      }
+    }
+    pthread_join(parser, NULL);
+    freeCanvas(&st.canvas);
+    if (cfg->cacheStats) {
+      printCacheStats("programs", &q.programs);
+      printFoldStats(&q.programs.fold);
+      printCacheStats("frames", &st.frames);
+      printSampleStats(&st.samples);
+    }
+  }
+  if (st.current.key != NULL) {
+    dropBound(&st);
+    freeItem(&st.current);
+  }
+  freeSampleCache(&st.samples);
+  freeExprCache(&st.frames);
+  freeExprCache(&q.programs);
+  pthread_cond_destroy(&q.notFull);
+  pthread_cond_destroy(&q.notEmpty);
+  pthread_mutex_destroy(&q.lock);
+  return frameCount;
+}
+
+int compileLibrary(FILE *in, const char *path, int cacheSize) {
+  ExprCache programs;
+  Arena scratch;
+  LibraryWriter w;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len = 0;
+  initExprCache(&programs, cacheSize);
+  initArena(&scratch, exprArenaSize(256));
+  initLibraryWriter(&w);
+  while ((len = getline(&line, &cap, in)) >= 0) {
+    if (line[0] == ':') {
+      fprintf(stderr, "graph: command skipped in library: %s", line);
+    } else {
+      BatchItem item;
+      compileItem(&programs, &scratch, line, (size_t)len, &item);
+      addLibraryFrame(&w, item.key, item.progs, item.count);
+      freeItem(&item);
+    }
+  }
+  int frameCount = saveLibrary(&w, path) ? w.frameCount : -1;
+  free(line);
+  freeLibraryWriter(&w);
+  freeArena(&scratch);
+  freeExprCache(&programs);
+  return frameCount;
+}
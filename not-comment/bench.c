@@ -0,0 +1,831 @@
+#include "graph.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_EXPR "sin(x)*cos(2*x)+sqrt(x)/10-ln(x+1)/4"
+
+#define LONG_TERMS 200
+#define NESTED_DEPTH 200
+
+#define EVAL_POINTS 4096
+
+#define BENCH_SERIES 16
+
+#define PAN_FRAMES 64
+
+#define ACCURACY_POINTS 2000000
+#define ACCURACY_EDGE 1000.0
+
+#define JIT_CHECK_EXPRS 3000
+#define JIT_CHECK_POINTS 512
+#define JIT_CHECK_TREE_DEPTH 7
+#define JIT_CHECK_DEEP 1000
+#define JIT_CHECK_DEEP_EXPRS 20
+
+#define JIT_CHECK_REPORT 10
+
+#define DEFAULT_SAMPLES 31
+#define WARMUP_SAMPLES 3
+#define SAMPLE_TARGET_NS 2e5
+
+static unsigned long allocCount = 0;
+
+static volatile double benchSink = 0.0;
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  allocCount++;
+  return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  allocCount++;
+  return __real_realloc(p, size);
+}
+
+typedef struct {
+  const char *name;
+  char *text;
+  TokenArray infix;
+  TokenArray postfix;
+  Program prog;
+  Program fastProg;
+  JitProgram jit;
+  JitProgram fastJit;
+  Arena arena;
+  ProgramLibrary lib;
+} BenchExpr;
+
+typedef struct {
+  const char *name;
+  double (*exact)(double);
+  double (*fast)(double);
+  void (*lanes)(double *restrict a);
+} BenchFunc;
+
+typedef struct {
+  int func;
+  double lo;
+  double hi;
+  int logScale;
+} AccuracyRange;
+
+typedef struct {
+  BenchExpr *expr;
+  const BenchFunc *func;
+  int width;
+  ThreadPool *pool;
+  FILE *devnull;
+  double xs[EVAL_POINTS];
+  double ys[EVAL_POINTS];
+} BenchCtx;
+
+typedef double (*StageFn)(BenchCtx *ctx, long iters);
+
+static double libmCtg(double x) {
+  return 1.0 / tan(x);
+}
+
+static const BenchFunc kBenchFuncs[] = {
+    {"sin", sin, fastSin, fastSinLanes},
+    {"cos", cos, fastCos, fastCosLanes},
+    {"tan", tan, fastTan, fastTanLanes},
+    {"ctg", libmCtg, fastCtg, fastCtgLanes},
+    {"ln", log, fastLog, fastLogLanes}};
+
+#define FAST_TRIG_LO (FAST_TRIG_MAX - ACCURACY_EDGE)
+#define FAST_TRIG_HI (FAST_TRIG_MAX + ACCURACY_EDGE)
+
+static const AccuracyRange kAccuracyRanges[] = {
+    {0, -1000.0, 1000.0, 0},          {0, -FAST_TRIG_MAX, FAST_TRIG_MAX, 0},
+    {0, FAST_TRIG_LO, FAST_TRIG_HI, 0}, {0, -FAST_TRIG_HI, -FAST_TRIG_LO, 0},
+    {1, -1000.0, 1000.0, 0},          {1, -FAST_TRIG_MAX, FAST_TRIG_MAX, 0},
+    {1, FAST_TRIG_LO, FAST_TRIG_HI, 0}, {1, -FAST_TRIG_HI, -FAST_TRIG_LO, 0},
+    {2, -1000.0, 1000.0, 0},          {2, -FAST_TRIG_MAX, FAST_TRIG_MAX, 0},
+    {2, FAST_TRIG_LO, FAST_TRIG_HI, 0}, {2, -FAST_TRIG_HI, -FAST_TRIG_LO, 0},
+    {3, -1000.0, 1000.0, 0},          {3, -FAST_TRIG_MAX, FAST_TRIG_MAX, 0},
+    {3, FAST_TRIG_LO, FAST_TRIG_HI, 0}, {3, -FAST_TRIG_HI, -FAST_TRIG_LO, 0},
+    {4, 1e-5, 1e5, 1}};
+
+static double nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static double stageTokenize(BenchCtx *ctx, long iters) {
+  BenchExpr *e = ctx->expr;
+  int len = (int)strlen(e->text);
+  double units = 0.0;
+  for (long i = 0; i < iters; i++) {
+    TokenArray infix;
+    resetArena(&e->arena);
+    initTokenArrayArena(&infix, &e->arena, len + 1);
+    tokenize(e->text, &infix);
+    units += infix.size;
+  }
+  return units;
+}
+
+static double stageParseTokens(BenchCtx *ctx, long iters) {
+  BenchExpr *e = ctx->expr;
+  for (long i = 0; i < iters; i++) {
+    ExprAst ast;
+    resetArena(&e->arena);
+    parseTokens(&e->infix, &e->arena, &ast);
+  }
+  return (double)iters * e->infix.size;
+}
+
+static double stageParse(BenchCtx *ctx, long iters) {
+  BenchExpr *e = ctx->expr;
+  for (long i = 0; i < iters; i++) {
+    ExprAst ast;
+    resetArena(&e->arena);
+    parseExpr(e->text, &e->arena, &ast);
+    foldAst(&ast);
+  }
+  return (double)iters;
+}
+
+static double stageCompile(BenchCtx *ctx, long iters) {
+  BenchExpr *e = ctx->expr;
+  Program prog;
+  initProgram(&prog);
+  for (long i = 0; i < iters; i++) {
+    ExprAst ast;
+    resetArena(&e->arena);
+    parseExpr(e->text, &e->arena, &ast);
+    foldAst(&ast);
+    compileAst(&ast, &prog);
+  }
+  freeProgram(&prog);
+  return (double)iters;
+}
+
+static double stageLoadLibrary(BenchCtx *ctx, long iters) {
+  const ProgramLibrary *lib = &ctx->expr->lib;
+  Program prog;
+  int loaded = 0;
+  for (long i = 0; lib->programCount > 0 && i < iters; i++) {
+    loaded += libraryProgram(lib, 0, &prog);
+  }
+  benchSink = loaded;
+  return (double)loaded;
+}
+
+static double stageEvalRPN(BenchCtx *ctx, long iters) {
+  double sum = 0.0;
+  for (long i = 0; i < iters; i++) {
+    for (int k = 0; k < EVAL_POINTS; k++) {
+      sum += evalRPN(&ctx->expr->postfix, ctx->xs[k]);
+    }
+  }
+  benchSink = sum;
+  return (double)iters * EVAL_POINTS;
+}
+
+static double stageEvalBatch(BenchCtx *ctx, long iters) {
+  for (long i = 0; i < iters; i++) {
+    evalProgramBatch(&ctx->expr->prog, ctx->xs, ctx->ys, EVAL_POINTS);
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+static double stageEvalJit(BenchCtx *ctx, long iters) {
+  for (long i = 0; i < iters; i++) {
+    evalJitBatch(&ctx->expr->jit, ctx->xs, ctx->ys, EVAL_POINTS);
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+static double stageEvalFast(BenchCtx *ctx, long iters) {
+  for (long i = 0; i < iters; i++) {
+    evalProgramBatch(&ctx->expr->fastProg, ctx->xs, ctx->ys, EVAL_POINTS);
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+static double stageEvalJitFast(BenchCtx *ctx, long iters) {
+  for (long i = 0; i < iters; i++) {
+    evalJitBatch(&ctx->expr->fastJit, ctx->xs, ctx->ys, EVAL_POINTS);
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+static double stageFnLibm(BenchCtx *ctx, long iters) {
+  double (*fn)(double) = ctx->func->exact;
+  for (long i = 0; i < iters; i++) {
+    for (int k = 0; k < EVAL_POINTS; k++) {
+      ctx->ys[k] = fn(ctx->xs[k]);
+    }
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+static double stageFnFast(BenchCtx *ctx, long iters) {
+  double (*fn)(double) = ctx->func->fast;
+  for (long i = 0; i < iters; i++) {
+    for (int k = 0; k < EVAL_POINTS; k++) {
+      ctx->ys[k] = fn(ctx->xs[k]);
+    }
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+static double stageFnLanes(BenchCtx *ctx, long iters) {
+  for (long i = 0; i < iters; i++) {
+    memcpy(ctx->ys, ctx->xs, sizeof(ctx->ys));
+    for (int k = 0; k < EVAL_POINTS; k += BATCH_LANES) {
+      ctx->func->lanes(ctx->ys + k);
+    }
+  }
+  benchSink = ctx->ys[EVAL_POINTS - 1];
+  return (double)iters * EVAL_POINTS;
+}
+
+static double stageCanvas(BenchCtx *ctx, long iters, EvalMode mode,
+                          ThreadPool *pool, int frame) {
+  Viewport view;
+  Canvas canvas;
+  FrameSink sink = {fileno(ctx->devnull), NULL, 0, 0, 0};
+  initViewport(&view);
+  view.width = ctx->width;
+  initCanvas(&canvas, &view);
+  for (long i = 0; i < iters; i++) {
+    fillCanvas(&canvas, &ctx->expr->postfix, mode, pool);
+    if (frame) {
+      writeFrame(&sink, &canvas, 0);
+    }
+  }
+  freeCanvas(&canvas);
+  return frame ? (double)iters : (double)iters * ctx->width;
+}
+
+static double stageFrame(BenchCtx *ctx, long iters) {
+  return stageCanvas(ctx, iters, EVAL_BATCH, NULL, 1);
+}
+
+static double stageFillBatch(BenchCtx *ctx, long iters) {
+  return stageCanvas(ctx, iters, EVAL_BATCH, NULL, 0);
+}
+
+static double stageFillJit(BenchCtx *ctx, long iters) {
+  return stageCanvas(ctx, iters, EVAL_JIT, NULL, 0);
+}
+
+static double stageFillPool(BenchCtx *ctx, long iters) {
+  return stageCanvas(ctx, iters, EVAL_JIT, ctx->pool, 0);
+}
+
+static double stageFillInterval(BenchCtx *ctx, long iters) {
+  return stageCanvas(ctx, iters, EVAL_INTERVAL, NULL, 0);
+}
+
+static double stageFillAdaptive(BenchCtx *ctx, long iters) {
+  return stageCanvas(ctx, iters, EVAL_ADAPTIVE, NULL, 0);
+}
+
+static void countEvaluations(BenchCtx *ctx, const char *stage, EvalMode mode,
+                             int tsv) {
+  Viewport view;
+  Canvas canvas;
+  initViewport(&view);
+  view.width = ctx->width;
+  initCanvas(&canvas, &view);
+  fillCanvasProgram(&canvas, &ctx->expr->prog, mode, NULL);
+  double perCol = (double)canvas.evaluations / ctx->width;
+  freeCanvas(&canvas);
+  printf(tsv ? "%s\t%s\t%d\t%s\t%.4g\t%.4g\t%.4g\t%.4g\t%.2f\n"
+             : "%-14s %-7s %7d %-10s %10.4g %10.4g %10.4g %10.4g %7.2f\n",
+         stage, ctx->expr->name, ctx->width, "evals/col", perCol, perCol,
+         perCol, perCol, 0.0);
+}
+
+static double stageFillHeatmap(BenchCtx *ctx, long iters) {
+  Viewport view;
+  Canvas canvas;
+  initViewport(&view);
+  view.width = ctx->width;
+  initCanvas(&canvas, &view);
+  for (long i = 0; i < iters; i++) {
+    fillCanvasProgram(&canvas, &ctx->expr->prog, EVAL_HEATMAP, ctx->pool);
+  }
+  freeCanvas(&canvas);
+  return (double)iters * ctx->width * view.height;
+}
+
+static double stageFillSeries(BenchCtx *ctx, long iters) {
+  Program progs[BENCH_SERIES];
+  Viewport view;
+  Canvas canvas;
+  for (int s = 0; s < BENCH_SERIES; s++) {
+    progs[s] = ctx->expr->prog;
+  }
+  initViewport(&view);
+  view.width = ctx->width;
+  initCanvas(&canvas, &view);
+  for (long i = 0; i < iters; i++) {
+    fillCanvasPrograms(&canvas, progs, NULL, BENCH_SERIES, EVAL_BATCH, NULL);
+  }
+  freeCanvas(&canvas);
+  return (double)iters * ctx->width * BENCH_SERIES;
+}
+
+static double stageRaster(BenchCtx *ctx, long iters, RasterStyle raster) {
+  Viewport view;
+  Viewport dots;
+  Canvas canvas;
+  initViewport(&view);
+  view.width = ctx->width;
+  view.raster = raster;
+  rasterGrid(&view, &dots);
+  double *ys = (double *)malloc(sizeof(double) * dots.width);
+  for (int c = 0; c < dots.width; c++) {
+    double x = columnX(&dots, c);
+    ys[c] = sin(x) * x / 5;
+  }
+  initCanvas(&canvas, &view);
+  for (long i = 0; i < iters; i++) {
+    clearRaster(&canvas);
+    rasterSeries(&canvas, ys, 0, (size_t)dots.width, '*');
+  }
+  freeCanvas(&canvas);
+  free(ys);
+  return (double)iters * ctx->width;
+}
+
+static double stageRasterPoints(BenchCtx *ctx, long iters) {
+  return stageRaster(ctx, iters, RASTER_POINTS);
+}
+
+static double stageRasterLines(BenchCtx *ctx, long iters) {
+  return stageRaster(ctx, iters, RASTER_LINES);
+}
+
+static double stageRasterBraille(BenchCtx *ctx, long iters) {
+  return stageRaster(ctx, iters, RASTER_BRAILLE);
+}
+
+static double stagePan(BenchCtx *ctx, long iters) {
+  Viewport view;
+  Canvas canvas;
+  SampleCache samples;
+  initViewport(&view);
+  view.width = ctx->width;
+  double step = (view.xMax - view.xMin) / (view.width - 1);
+  initCanvas(&canvas, &view);
+  initSampleCache(&samples);
+  fillCanvasSamples(&canvas, &ctx->expr->prog, NULL, EVAL_BATCH, NULL,
+                    &samples);
+  for (long i = 0; i < iters * PAN_FRAMES; i++) {
+    double shift = (i % 2 == 0) ? step : -step;
+    view.xMin += shift;
+    view.xMax += shift;
+    canvas.view = view;
+    fillCanvasSamples(&canvas, &ctx->expr->prog, NULL, EVAL_BATCH, NULL,
+                    &samples);
+  }
+  freeSampleCache(&samples);
+  freeCanvas(&canvas);
+  return (double)iters * PAN_FRAMES;
+}
+
+static int compareDouble(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+  int idx = (int)ceil(p / 100.0 * n) - 1;
+  idx = (idx < 0) ? 0 : idx;
+  return sorted[idx];
+}
+
+static void runStage(BenchCtx *ctx, const char *stage, const char *unit,
+                     double scale, StageFn fn, int samples, int tsv) {
+  long iters = 1;
+  while (iters < (1L << 30)) {
+    double start = nowNs();
+    fn(ctx, iters);
+    if (nowNs() - start >= SAMPLE_TARGET_NS) {
+      break;
+    }
+    iters *= 2;
+  }
+  for (int i = 0; i < WARMUP_SAMPLES; i++) {
+    fn(ctx, iters);
+  }
+  double *perUnit = (double *)malloc(sizeof(double) * samples);
+  unsigned long allocsBefore = allocCount;
+  for (int i = 0; i < samples; i++) {
+    double start = nowNs();
+    double units = fn(ctx, iters);
+    perUnit[i] = (nowNs() - start) * scale / (units > 0 ? units : 1.0);
+  }
+  double allocs = (double)(allocCount - allocsBefore) / samples / iters;
+  qsort(perUnit, samples, sizeof(double), compareDouble);
+  printf(tsv ? "%s\t%s\t%d\t%s\t%.4g\t%.4g\t%.4g\t%.4g\t%.2f\n"
+             : "%-14s %-7s %7d %-10s %10.4g %10.4g %10.4g %10.4g %7.2f\n",
+         stage, (ctx->func != NULL) ? ctx->func->name : ctx->expr->name,
+         ctx->width, unit, perUnit[0],
+         percentile(perUnit, samples, 50), percentile(perUnit, samples, 90),
+         percentile(perUnit, samples, 99), allocs);
+  fflush(stdout);
+  free(perUnit);
+}
+
+static void initBenchExpr(BenchExpr *e, const char *name, char *text) {
+  e->name = name;
+  e->text = text;
+  ExprAst ast;
+  initArena(&e->arena, exprArenaSize(strlen(text)));
+  initTokenArray(&e->infix);
+  initTokenArray(&e->postfix);
+  tokenize(text, &e->infix);
+  parseExpr(text, &e->arena, &ast);
+  foldAst(&ast);
+  lowerAst(&ast, &e->postfix);
+  initProgram(&e->prog);
+  compileAst(&ast, &e->prog);
+  compileJit(&e->prog, &e->jit);
+  copyProgram(&e->fastProg, &e->prog);
+  setProgramPrecision(&e->fastProg, 1, PRECISION_FAST);
+  compileJit(&e->fastProg, &e->fastJit);
+  char path[] = "/tmp/graph-bench-XXXXXX";
+  int fd = mkstemp(path);
+  LibraryWriter w;
+  initLibraryWriter(&w);
+  addLibraryFrame(&w, text, &e->prog, 1);
+  if (fd < 0 || !saveLibrary(&w, path) ||
+      !openProgramLibrary(&e->lib, path)) {
+    e->lib.programCount = 0;
+  }
+  if (fd >= 0) {
+    close(fd);
+    unlink(path);
+  }
+  freeLibraryWriter(&w);
+}
+
+static void freeBenchExpr(BenchExpr *e) {
+  freeJit(&e->jit);
+  freeJit(&e->fastJit);
+  if (e->lib.programCount > 0) {
+    closeProgramLibrary(&e->lib);
+  }
+  freeProgram(&e->prog);
+  freeProgram(&e->fastProg);
+  freeTokenArray(&e->infix);
+  freeTokenArray(&e->postfix);
+  freeArena(&e->arena);
+  free(e->text);
+}
+
+static char *copyText(const char *text) {
+  size_t len = strlen(text);
+  char *s = (char *)malloc(len + 1);
+  memcpy(s, text, len + 1);
+  return s;
+}
+
+static char *makeLongExpr(int n) {
+  char *s = (char *)malloc((size_t)n * 24 + 1);
+  size_t len = 0;
+  for (int i = 0; i < n; i++) {
+    len += (size_t)sprintf(s + len, "%s%s(x*%d)", (i > 0) ? "+" : "",
+                           (i % 2) ? "cos" : "sin", i + 1);
+  }
+  return s;
+}
+
+static char *makeNestedExpr(int depth) {
+  char *s = (char *)malloc((size_t)depth * 5 + 2);
+  size_t len = 0;
+  for (int i = 0; i < depth; i++) {
+    memcpy(s + len, "(x+", 3);
+    len += 3;
+  }
+  s[len++] = 'x';
+  memset(s + len, ')', depth);
+  len += depth;
+  s[len] = '\0';
+  return s;
+}
+
+static int checkAccuracy(void) {
+  int ok = 1;
+  printf("%-5s %10s %10s %12s %12s %8s\n", "func", "from", "to", "max error",
+         "at x", "lanes");
+  size_t count = sizeof(kAccuracyRanges) / sizeof(kAccuracyRanges[0]);
+  for (size_t r = 0; r < count; r++) {
+    const AccuracyRange *range = &kAccuracyRanges[r];
+    const BenchFunc *fn = &kBenchFuncs[range->func];
+    double worst = 0.0;
+    double worstX = range->lo;
+    int lanesOk = 1;
+    double a[BATCH_LANES];
+    for (int i = 0; i < ACCURACY_POINTS; i += BATCH_LANES) {
+      for (int l = 0; l < BATCH_LANES; l++) {
+        double t = (double)(i + l) / (ACCURACY_POINTS - 1);
+        a[l] = range->logScale
+                   ? range->lo * pow(range->hi / range->lo, t)
+                   : range->lo + (range->hi - range->lo) * t;
+      }
+      double x[BATCH_LANES];
+      memcpy(x, a, sizeof(x));
+      fn->lanes(a);
+      for (int l = 0; l < BATCH_LANES; l++) {
+        double exact = fn->exact(x[l]);
+        double fast = fn->fast(x[l]);
+        double err = fabs(fast - exact) / fmax(1.0, fabs(exact));
+        if (err > worst) {
+          worst = err;
+          worstX = x[l];
+        }
+        lanesOk = lanesOk && (a[l] == fast || (isnan(a[l]) && isnan(fast)));
+      }
+    }
+    printf("%-5s %10.4g %10.4g %12.3g %12.6g %8s\n", fn->name, range->lo,
+           range->hi, worst, worstX, lanesOk ? "same" : "DIFFER");
+    ok = ok && lanesOk && worst < 1e-10;
+  }
+  return ok;
+}
+
+typedef struct {
+  unsigned long long state;
+  char *text;
+  size_t len;
+  size_t capacity;
+} ExprGen;
+
+static unsigned long long nextRandom(ExprGen *g) {
+  g->state ^= g->state << 13;
+  g->state ^= g->state >> 7;
+  g->state ^= g->state << 17;
+  return g->state;
+}
+
+static void genAppend(ExprGen *g, const char *s) {
+  size_t n = strlen(s);
+  if (g->len + n + 1 > g->capacity) {
+    g->capacity = (g->len + n + 1) * 2;
+    g->text = (char *)realloc(g->text, g->capacity);
+  }
+  memcpy(g->text + g->len, s, n + 1);
+  g->len += n;
+}
+
+static void genLeaf(ExprGen *g) {
+  static const char *const kLeaves[] = {
+      "x", "x", "x", "0", "1", "2", "0.5", "3.25", "1000000", "0.000001",
+      "100000000000000000000000000000000000000000000000000000000000"};
+  genAppend(g, kLeaves[nextRandom(g) % (sizeof(kLeaves) /
+                                        sizeof(kLeaves[0]))]);
+}
+
+static void genExpr(ExprGen *g, int depth) {
+  static const char *const kFuncs[] = {"sin(", "cos(", "tan(", "ctg(",
+                                       "sqrt(", "ln("};
+  static const char *const kOps[] = {"+", "-", "*", "/"};
+  unsigned long long r = nextRandom(g);
+  if (depth == 0 || r % 8 == 0) {
+    genLeaf(g);
+  } else if (r % 8 < 3) {
+    genAppend(g, kFuncs[(r >> 8) % 6]);
+    genExpr(g, depth - 1);
+    genAppend(g, ")");
+  } else if (r % 8 == 3) {
+    genAppend(g, "-(");
+    genExpr(g, depth - 1);
+    genAppend(g, ")");
+  } else {
+    genAppend(g, "(");
+    genExpr(g, depth - 1);
+    genAppend(g, kOps[(r >> 8) % 4]);
+    genExpr(g, depth - 1);
+    genAppend(g, ")");
+  }
+}
+
+static void genDeepExpr(ExprGen *g) {
+  static const char *const kOps[] = {"+(", "-(", "*(", "/(", "+sin(",
+                                     "*cos(", "-sqrt(", "/ln("};
+  for (int i = 0; i < JIT_CHECK_DEEP; i++) {
+    genLeaf(g);
+    genAppend(g, kOps[nextRandom(g) % 8]);
+  }
+  genAppend(g, "x");
+  for (int i = 0; i < JIT_CHECK_DEEP; i++) {
+    genAppend(g, ")");
+  }
+}
+
+static int sameBits(double a, double b) {
+  return (isnan(a) && isnan(b)) || memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+static long checkJitProgram(const char *text, const Program *prog,
+                            const double *xs, double *ys, int n,
+                            long reported) {
+  JitProgram jit;
+  long bad = 0;
+  compileJit(prog, &jit);
+  evalJitBatch(&jit, xs, ys, (size_t)n);
+  for (int i = 0; i < n; i++) {
+    double want = evalProgram(prog, xs[i]);
+    double one = evalJit(&jit, xs[i]);
+    if (!sameBits(want, one) || !sameBits(want, ys[i])) {
+      if (bad == 0 && reported < JIT_CHECK_REPORT) {
+        printf("MISMATCH %.60s%s at x = %.17g: evalProgram %.17g, "
+               "evalJit %.17g, evalJitBatch %.17g\n", text,
+               (strlen(text) > 60) ? "..." : "", xs[i], want, one, ys[i]);
+      }
+      bad++;
+    }
+  }
+  freeJit(&jit);
+  return bad;
+}
+
+static void fillCheckPoints(ExprGen *g, double *xs, int n) {
+  static const double kSpecial[] = {
+      0.0, -0.0, 1.0, -1.0, 0.5, M_PI / 2, -M_PI, 1e-310, -1e-310,
+      1e308, -1e308, 1.7976931348623157e308, 4.9e-324, INFINITY, -INFINITY,
+      NAN, -NAN, 1e6, -1e6, 1e20};
+  int special = (int)(sizeof(kSpecial) / sizeof(kSpecial[0]));
+  for (int i = 0; i < n; i++) {
+    unsigned long long r = nextRandom(g);
+    if (i < special) {
+      xs[i] = kSpecial[i];
+    } else if (i % 2) {
+      xs[i] = -20.0 + 40.0 * (double)(r >> 11) / 9007199254740992.0;
+    } else {
+      memcpy(&xs[i], &r, sizeof(xs[i]));
+    }
+  }
+}
+
+static int checkJit(void) {
+  ExprGen g = {0x9E3779B97F4A7C15ull, NULL, 0, 0};
+  double *xs = (double *)malloc(sizeof(double) * JIT_CHECK_POINTS);
+  double *ys = (double *)malloc(sizeof(double) * JIT_CHECK_POINTS);
+  long bad = 0;
+  long points = 0;
+  int compiled = 0;
+  int total = JIT_CHECK_EXPRS + JIT_CHECK_DEEP_EXPRS;
+  fillCheckPoints(&g, xs, JIT_CHECK_POINTS);
+  for (int e = 0; e < total; e++) {
+    g.len = 0;
+    genAppend(&g, "");
+    if (e < JIT_CHECK_EXPRS) {
+      genExpr(&g, 1 + (int)(nextRandom(&g) % JIT_CHECK_TREE_DEPTH));
+    } else {
+      genDeepExpr(&g);
+    }
+    Arena arena;
+    ExprAst ast;
+    Program prog;
+    Program fastProg;
+    initArena(&arena, exprArenaSize(g.len));
+    parseExpr(g.text, &arena, &ast);
+    foldAst(&ast);
+    initProgram(&prog);
+    compileAst(&ast, &prog);
+    copyProgram(&fastProg, &prog);
+    setProgramPrecision(&fastProg, 1, PRECISION_FAST);
+    JitProgram probe;
+    compiled += compileJit(&prog, &probe);
+    freeJit(&probe);
+    bad += checkJitProgram(g.text, &prog, xs, ys, JIT_CHECK_POINTS, bad);
+    bad += checkJitProgram(g.text, &fastProg, xs, ys, JIT_CHECK_POINTS, bad);
+    points += 2 * JIT_CHECK_POINTS;
+    freeProgram(&prog);
+    freeProgram(&fastProg);
+    freeArena(&arena);
+  }
+  printf("jit-check: %d expressions (%d compiled to machine code), "
+         "%ld points, %ld mismatches\n", total, compiled, points, bad);
+  free(g.text);
+  free(xs);
+  free(ys);
+  return bad == 0;
+}
+
+int main(int argc, char **argv) {
+  static const int widths[] = {80, 1000, 10000, 100000};
+  int tsv = 0;
+  int samples = DEFAULT_SAMPLES;
+  int accuracy = 0;
+  int jitCheck = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--tsv")) {
+      tsv = 1;
+    } else if (!strcmp(argv[i], "--accuracy")) {
+      accuracy = 1;
+    } else if (!strcmp(argv[i], "--jit-check")) {
+      jitCheck = 1;
+    } else if (!strcmp(argv[i], "--samples") && i + 1 < argc) {
+      samples = atoi(argv[++i]);
+      samples = (samples > 0) ? samples : 1;
+    }
+  }
+  if (accuracy) {
+    return checkAccuracy() ? 0 : 1;
+  }
+  if (jitCheck) {
+    return checkJit() ? 0 : 1;
+  }
+  BenchExpr exprs[4];
+  initBenchExpr(&exprs[0], "short", copyText("sin(x)"));
+  initBenchExpr(&exprs[1], "medium", copyText(BENCH_EXPR));
+  initBenchExpr(&exprs[2], "long", makeLongExpr(LONG_TERMS));
+  initBenchExpr(&exprs[3], "nested", makeNestedExpr(NESTED_DEPTH));
+  BenchCtx *ctx = (BenchCtx *)malloc(sizeof(BenchCtx));
+  ThreadPool pool;
+  int threads = initThreadPool(&pool, (int)sysconf(_SC_NPROCESSORS_ONLN));
+  ctx->pool = &pool;
+  ctx->func = NULL;
+  ctx->devnull = fopen("/dev/null", "w");
+  for (int k = 0; k < EVAL_POINTS; k++) {
+    ctx->xs[k] = 4.0 * M_PI * k / EVAL_POINTS;
+  }
+  if (!tsv) {
+    printf("threads: %d, samples: %d\n", threads, samples);
+    printf("medium: %s\n", BENCH_EXPR);
+    printf("%-14s %-7s %7s %-10s %10s %10s %10s %10s %7s\n", "stage", "expr",
+           "width", "unit", "min", "p50", "p90", "p99", "allocs");
+  } else {
+    printf("stage\texpr\twidth\tunit\tmin\tp50\tp90\tp99\tallocs\n");
+  }
+  for (int i = 0; i < 4; i++) {
+    ctx->expr = &exprs[i];
+    ctx->width = 80;
+    runStage(ctx, "tokenize", "ns/token", 1.0, stageTokenize, samples, tsv);
+    runStage(ctx, "parse-tokens", "ns/token", 1.0, stageParseTokens, samples,
+             tsv);
+    runStage(ctx, "parse", "ns/expr", 1.0, stageParse, samples, tsv);
+    runStage(ctx, "compile", "ns/expr", 1.0, stageCompile, samples, tsv);
+    runStage(ctx, "load-library", "ns/expr", 1.0, stageLoadLibrary, samples,
+             tsv);
+    runStage(ctx, "evalRPN", "ns/sample", 1.0, stageEvalRPN, samples, tsv);
+    runStage(ctx, "eval-batch", "ns/sample", 1.0, stageEvalBatch, samples,
+             tsv);
+    runStage(ctx, "eval-jit", "ns/sample", 1.0, stageEvalJit, samples, tsv);
+    runStage(ctx, "eval-fast", "ns/sample", 1.0, stageEvalFast, samples,
+             tsv);
+    runStage(ctx, "eval-jit-fast", "ns/sample", 1.0, stageEvalJitFast,
+             samples, tsv);
+    runStage(ctx, "frame", "ms/frame", 1e-6, stageFrame, samples, tsv);
+  }
+  ctx->width = 80;
+  for (size_t f = 0; f < sizeof(kBenchFuncs) / sizeof(kBenchFuncs[0]); f++) {
+    ctx->func = &kBenchFuncs[f];
+    runStage(ctx, "fn-libm", "ns/sample", 1.0, stageFnLibm, samples, tsv);
+    runStage(ctx, "fn-fast", "ns/sample", 1.0, stageFnFast, samples, tsv);
+    runStage(ctx, "fn-lanes", "ns/sample", 1.0, stageFnLanes, samples, tsv);
+  }
+  ctx->func = NULL;
+  ctx->expr = &exprs[1];
+  for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+    ctx->width = widths[i];
+    runStage(ctx, "fill-batch", "ns/col", 1.0, stageFillBatch, samples, tsv);
+    runStage(ctx, "fill-jit", "ns/col", 1.0, stageFillJit, samples, tsv);
+    runStage(ctx, "fill-pool", "ns/col", 1.0, stageFillPool, samples, tsv);
+    runStage(ctx, "fill-interval", "ns/col", 1.0, stageFillInterval, samples,
+             tsv);
+    runStage(ctx, "fill-adaptive", "ns/col", 1.0, stageFillAdaptive, samples,
+             tsv);
+    countEvaluations(ctx, "evals-dense", EVAL_BATCH, tsv);
+    countEvaluations(ctx, "evals-adaptive", EVAL_ADAPTIVE, tsv);
+    runStage(ctx, "fill-series", "ns/col", 1.0, stageFillSeries, samples,
+             tsv);
+    runStage(ctx, "fill-heatmap", "ns/cell", 1.0, stageFillHeatmap, samples,
+             tsv);
+    runStage(ctx, "raster-points", "ns/col", 1.0, stageRasterPoints,
+             samples, tsv);
+    runStage(ctx, "raster-lines", "ns/col", 1.0, stageRasterLines, samples,
+             tsv);
+    runStage(ctx, "raster-braille", "ns/col", 1.0, stageRasterBraille,
+             samples, tsv);
+    runStage(ctx, "pan", "us/frame", 1e-3, stagePan, samples, tsv);
+  }
+  fclose(ctx->devnull);
+  freeThreadPool(&pool);
+  free(ctx);
+  for (int i = 0; i < 4; i++) {
+    freeBenchExpr(&exprs[i]);
+  }
+  return 0;
+}
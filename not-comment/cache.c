@@ -0,0 +1,199 @@
+#include "graph.h"
+
+static int isWordChar(char ch) {
+  return (ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z') ||
+         (ch >= 'A' && ch <= 'Z') || ch == '.';
+}
+
+size_t normalizeExpr(const char *src, char *dst, long *columns) {
+  size_t n = 0;
+  size_t i = 0;
+  int gap = 0;
+  for (; src[i] != '\0'; i++) {
+    char ch = src[i];
+    if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n') {
+      gap = 1;
+    } else {
+      if (gap && n > 0 && isWordChar(dst[n - 1]) && isWordChar(ch)) {
+        if (columns != NULL) {
+          columns[n] = (long)i;
+        }
+        dst[n++] = ' ';
+      }
+      if (columns != NULL) {
+        columns[n] = (long)i;
+      }
+      dst[n++] = ch;
+      gap = 0;
+    }
+  }
+  dst[n] = '\0';
+  if (columns != NULL) {
+    while (i > 0 && (src[i - 1] == '\n' || src[i - 1] == '\r')) {
+      i--;
+    }
+    columns[n] = (long)i;
+  }
+  return n;
+}
+
+static unsigned int hashKey(const char *key) {
+  unsigned int h = 2166136261u;
+  for (size_t i = 0; key[i] != '\0'; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+void initExprCache(ExprCache *cache, int capacity) {
+  cache->capacity = (capacity > 0) ? capacity : 0;
+  cache->size = 0;
+  cache->entries = NULL;
+  cache->buckets = NULL;
+  cache->bucketCount = 0;
+  cache->newest = -1;
+  cache->oldest = -1;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->evictions = 0;
+  cache->fold.nodes = 0;
+  cache->fold.folded = 0;
+  if (cache->capacity > 0) {
+    cache->entries = (CacheEntry *)malloc(sizeof(CacheEntry) *
+                                          cache->capacity);
+    cache->bucketCount = 16;
+    while (cache->bucketCount < 2 * cache->capacity) {
+      cache->bucketCount *= 2;
+    }
+    cache->buckets = (int *)malloc(sizeof(int) * cache->bucketCount);
+    for (int i = 0; i < cache->bucketCount; i++) {
+      cache->buckets[i] = -1;
+    }
+  }
+}
+
+static void clearEntry(CacheEntry *e) {
+  free(e->key);
+  free(e->frame);
+  if (e->hasProgram) {
+    freeProgram(&e->prog);
+  }
+  releaseJit(e->jit);
+  e->key = NULL;
+  e->frame = NULL;
+  e->hasProgram = 0;
+  e->jit = NULL;
+}
+
+void freeExprCache(ExprCache *cache) {
+  for (int i = 0; i < cache->size; i++) {
+    clearEntry(&cache->entries[i]);
+  }
+  free(cache->entries);
+  free(cache->buckets);
+  cache->entries = NULL;
+  cache->buckets = NULL;
+  cache->size = 0;
+  cache->capacity = 0;
+  cache->bucketCount = 0;
+  cache->newest = -1;
+  cache->oldest = -1;
+}
+
+static void unlinkLru(ExprCache *cache, int idx) {
+  CacheEntry *e = &cache->entries[idx];
+  if (e->newer >= 0) {
+    cache->entries[e->newer].older = e->older;
+  } else {
+    cache->newest = e->older;
+  }
+  if (e->older >= 0) {
+    cache->entries[e->older].newer = e->newer;
+  } else {
+    cache->oldest = e->newer;
+  }
+}
+
+static void pushNewest(ExprCache *cache, int idx) {
+  CacheEntry *e = &cache->entries[idx];
+  e->newer = -1;
+  e->older = cache->newest;
+  if (cache->newest >= 0) {
+    cache->entries[cache->newest].newer = idx;
+  }
+  cache->newest = idx;
+  if (cache->oldest < 0) {
+    cache->oldest = idx;
+  }
+}
+
+static int lookupEntry(const ExprCache *cache, const char *key) {
+  int found = -1;
+  if (cache->capacity > 0) {
+    unsigned int h = hashKey(key);
+    int idx = cache->buckets[h & (cache->bucketCount - 1)];
+    while (idx >= 0 && found < 0) {
+      const CacheEntry *e = &cache->entries[idx];
+      if (e->hash == h && !strcmp(e->key, key)) {
+        found = idx;
+      }
+      idx = e->chain;
+    }
+  }
+  return found;
+}
+
+CacheEntry *findExprCache(ExprCache *cache, const char *key) {
+  CacheEntry *found = NULL;
+  int idx = lookupEntry(cache, key);
+  if (idx >= 0) {
+    found = &cache->entries[idx];
+    unlinkLru(cache, idx);
+    pushNewest(cache, idx);
+    cache->hits++;
+  } else {
+    cache->misses++;
+  }
+  return found;
+}
+
+CacheEntry *peekExprCache(ExprCache *cache, const char *key) {
+  int idx = lookupEntry(cache, key);
+  return (idx >= 0) ? &cache->entries[idx] : NULL;
+}
+
+static int evictOldest(ExprCache *cache) {
+  int idx = cache->oldest;
+  CacheEntry *e = &cache->entries[idx];
+  int *link = &cache->buckets[e->hash & (cache->bucketCount - 1)];
+  while (*link != idx) {
+    link = &cache->entries[*link].chain;
+  }
+  *link = e->chain;
+  unlinkLru(cache, idx);
+  clearEntry(e);
+  cache->evictions++;
+  return idx;
+}
+
+CacheEntry *addExprCache(ExprCache *cache, const char *key) {
+  CacheEntry *e = NULL;
+  if (cache->capacity > 0) {
+    int idx = (cache->size < cache->capacity) ? cache->size++
+                                              : evictOldest(cache);
+    size_t len = strlen(key);
+    e = &cache->entries[idx];
+    e->key = (char *)malloc(len + 1);
+    memcpy(e->key, key, len + 1);
+    e->hash = hashKey(key);
+    e->hasProgram = 0;
+    e->jit = NULL;
+    e->frame = NULL;
+    int bucket = (int)(e->hash & (cache->bucketCount - 1));
+    e->chain = cache->buckets[bucket];
+    cache->buckets[bucket] = idx;
+    pushNewest(cache, idx);
+  }
+  return e;
+}
@@ -0,0 +1,230 @@
+#include "graph.h"
+
+static const unsigned char kTokenOps[] = {
+    OP_CONST, OP_X,   OP_ADD, OP_SUB, OP_MUL,  OP_DIV, OP_CONST, OP_CONST,
+    OP_SIN,   OP_COS, OP_TAN, OP_CTG, OP_SQRT, OP_LN,  OP_NEG, OP_VAR};
+
+typedef struct {
+  int node;
+  int phase;
+} DagFrame;
+
+void initExprDag(ExprDag *dag) {
+  dag->size = 0;
+  dag->capacity = 16;
+  dag->nodes = (DagNode *)malloc(sizeof(DagNode) * dag->capacity);
+  dag->buckets = NULL;
+  dag->bucketCount = 0;
+  dag->root = -1;
+}
+
+void freeExprDag(ExprDag *dag) {
+  free(dag->nodes);
+  free(dag->buckets);
+  dag->nodes = NULL;
+  dag->buckets = NULL;
+  dag->size = 0;
+  dag->capacity = 0;
+  dag->bucketCount = 0;
+  dag->root = -1;
+}
+
+static unsigned int hashNode(unsigned char op, int a, int b, double value) {
+  unsigned long long bits = 0;
+  memcpy(&bits, &value, sizeof(bits));
+  unsigned long long h = bits ^ ((unsigned long long)op << 56);
+  h ^= (unsigned long long)(unsigned int)a * 0x9E3779B97F4A7C15ULL;
+  h ^= (unsigned long long)(unsigned int)b * 0xC2B2AE3D27D4EB4FULL;
+  h ^= h >> 29;
+  return (unsigned int)(h ^ (h >> 32));
+}
+
+static int sameNode(const DagNode *n, unsigned char op, int a, int b,
+                    double value) {
+  return (n->op == op && n->a == a && n->b == b &&
+          !memcmp(&n->value, &value, sizeof(value)));
+}
+
+static int internNode(ExprDag *dag, unsigned char op, int a, int b,
+                      double value) {
+  if ((op == OP_ADD || op == OP_MUL) && a > b) {
+    int tmp = a;
+    a = b;
+    b = tmp;
+  }
+  unsigned int slot = hashNode(op, a, b, value) & (dag->bucketCount - 1);
+  int found = dag->buckets[slot];
+  while (found >= 0 && !sameNode(&dag->nodes[found], op, a, b, value)) {
+    found = dag->nodes[found].next;
+  }
+  if (found < 0) {
+    if (dag->size == dag->capacity) {
+      dag->capacity *= 2;
+      dag->nodes = (DagNode *)realloc(dag->nodes,
+                                      sizeof(DagNode) * dag->capacity);
+    }
+    found = dag->size;
+    dag->size++;
+    DagNode *n = &dag->nodes[found];
+    n->op = op;
+    n->a = a;
+    n->b = b;
+    n->value = value;
+    n->uses = 0;
+    n->next = dag->buckets[slot];
+    dag->buckets[slot] = found;
+  }
+  return found;
+}
+
+static void resetExprDag(ExprDag *dag, int count) {
+  dag->bucketCount = 16;
+  while (dag->bucketCount < 2 * count) {
+    dag->bucketCount *= 2;
+  }
+  free(dag->buckets);
+  dag->buckets = (int *)malloc(sizeof(int) * dag->bucketCount);
+  memset(dag->buckets, 0xFF, sizeof(int) * dag->bucketCount);
+  dag->size = 0;
+}
+
+int buildExprDag(const TokenArray *postfix, ExprDag *dag) {
+  int ok = 1;
+  int top = -1;
+  int *operands = (int *)malloc(sizeof(int) * (postfix->size + 1));
+  resetExprDag(dag, postfix->size);
+  for (int i = 0; ok && i < postfix->size; i++) {
+    Token t = postfix->data[i];
+    if (isOperand(t.type)) {
+      operands[++top] = internNode(dag, kTokenOps[t.type], -1, -1,
+                                   t.type != TOKEN_X ? t.value : 0.0);
+    } else if (isFunction(t.type) || t.type == TOKEN_UMINUS) {
+      ok = (top >= 0);
+      if (ok) {
+        operands[top] =
+            internNode(dag, kTokenOps[t.type], operands[top], -1, 0.0);
+      }
+    } else if (isOperator(t.type)) {
+      ok = (top >= 1);
+      if (ok) {
+        top--;
+        operands[top] = internNode(dag, kTokenOps[t.type], operands[top],
+                                   operands[top + 1], 0.0);
+      }
+    }
+  }
+  ok = ok && (top >= 0);
+  dag->root = ok ? operands[top] : -1;
+  free(operands);
+  return ok;
+}
+
+int buildAstDag(const ExprAst *ast, ExprDag *dag) {
+  int count = (ast->root >= 0) ? ast->size : 0;
+  int *ids = (int *)malloc(sizeof(int) * (count + 1));
+  resetExprDag(dag, count);
+  for (int i = 0; i < count; i++) {
+    const ExprNode *n = &ast->nodes[i];
+    int a = (n->left >= 0) ? ids[n->left] : -1;
+    int b = (n->right >= 0) ? ids[n->right] : -1;
+    ids[i] = internNode(dag, kTokenOps[n->type], a, b,
+                        (n->type == TOKEN_NUMBER || n->type == TOKEN_VAR)
+                            ? n->value : 0.0);
+  }
+  dag->root = (count > 0) ? ids[ast->root] : -1;
+  free(ids);
+  return count > 0;
+}
+
+static void countUses(ExprDag *dag, char *live) {
+  memset(live, 0, dag->size);
+  for (int i = 0; i < dag->size; i++) {
+    dag->nodes[i].uses = 0;
+  }
+  live[dag->root] = 1;
+  for (int i = dag->size - 1; i >= 0; i--) {
+    if (live[i]) {
+      const DagNode *n = &dag->nodes[i];
+      if (n->a >= 0) {
+        dag->nodes[n->a].uses++;
+        live[n->a] = 1;
+      }
+      if (n->b >= 0) {
+        dag->nodes[n->b].uses++;
+        live[n->b] = 1;
+      }
+    }
+  }
+}
+
+static void emitIndexed(Program *prog, unsigned char op, unsigned int idx) {
+  emitProgramByte(prog, op);
+  emitProgramIndex(prog, idx);
+}
+
+static void trackDepth(Program *prog, int *depth, int delta) {
+  *depth += delta;
+  if (*depth > prog->maxDepth) {
+    prog->maxDepth = *depth;
+  }
+}
+
+static void emitNode(const ExprDag *dag, int node, int *slots, Program *prog,
+                     int *depth) {
+  const DagNode *n = &dag->nodes[node];
+  if (n->op == OP_CONST) {
+    emitIndexed(prog, OP_CONST, addProgramConst(prog, n->value));
+    trackDepth(prog, depth, 1);
+  } else if (n->op == OP_X) {
+    emitProgramByte(prog, OP_X);
+    trackDepth(prog, depth, 1);
+  } else if (n->op == OP_VAR) {
+    emitIndexed(prog, OP_VAR, (unsigned int)n->value);
+    trackDepth(prog, depth, 1);
+  } else {
+    emitProgramByte(prog, n->op);
+    trackDepth(prog, depth, (n->b >= 0) ? -1 : 0);
+    if (n->uses > 1) {
+      slots[node] = prog->slotCount;
+      prog->slotCount++;
+      emitIndexed(prog, OP_STORE, (unsigned int)slots[node]);
+    }
+  }
+}
+
+void compileExprDag(ExprDag *dag, Program *prog) {
+  char *live = (char *)malloc(dag->size + 1);
+  int *slots = (int *)malloc(sizeof(int) * (dag->size + 1));
+  DagFrame *frames = (DagFrame *)malloc(sizeof(DagFrame) * (dag->size + 1));
+  int top = 0;
+  int depth = 0;
+  prog->codeSize = 0;
+  prog->constCount = 0;
+  prog->slotCount = 0;
+  prog->maxDepth = 0;
+  countUses(dag, live);
+  memset(slots, 0xFF, sizeof(int) * (dag->size + 1));
+  frames[0].node = dag->root;
+  frames[0].phase = 0;
+  while (top >= 0) {
+    DagFrame *f = &frames[top];
+    const DagNode *n = &dag->nodes[f->node];
+    if (slots[f->node] >= 0 && f->phase == 0) {
+      emitIndexed(prog, OP_LOAD, (unsigned int)slots[f->node]);
+      trackDepth(prog, &depth, 1);
+      top--;
+    } else if (f->phase == 0 && n->a >= 0) {
+      f->phase = 1;
+      frames[++top] = (DagFrame){n->a, 0};
+    } else if (f->phase <= 1 && n->b >= 0) {
+      f->phase = 2;
+      frames[++top] = (DagFrame){n->b, 0};
+    } else {
+      emitNode(dag, f->node, slots, prog, &depth);
+      top--;
+    }
+  }
+  free(frames);
+  free(slots);
+  free(live);
+}
@@ -0,0 +1,122 @@
+#include "graph.h"
+
+static Dual makeDual(double v, double d) {
+  Dual r = {v, d};
+  return r;
+}
+
+Dual computeOperatorDual(TokenType t, Dual a, Dual b) {
+  Dual r;
+  if (t == TOKEN_PLUS) {
+    r = makeDual(a.v + b.v, a.d + b.d);
+  } else if (t == TOKEN_MINUS) {
+    r = makeDual(a.v - b.v, a.d - b.d);
+  } else if (t == TOKEN_MULT) {
+    r = makeDual(a.v * b.v, a.d * b.v + a.v * b.d);
+  } else {
+    double q = a.v / b.v;
+    r = makeDual(q, (a.d - q * b.d) / b.v);
+  }
+  return r;
+}
+
+Dual computeFunctionDual(TokenType t, Dual a) {
+  Dual r = makeDual(0.0, 0.0);
+  if (t == TOKEN_SIN) {
+    r = makeDual(sin(a.v), cos(a.v) * a.d);
+  } else if (t == TOKEN_COS) {
+    r = makeDual(cos(a.v), -sin(a.v) * a.d);
+  } else if (t == TOKEN_TAN) {
+    double v = tan(a.v);
+    r = makeDual(v, (1.0 + v * v) * a.d);
+  } else if (t == TOKEN_CTG) {
+    double v = 1.0 / tan(a.v);
+    r = makeDual(v, -(1.0 + v * v) * a.d);
+  } else if (t == TOKEN_SQRT) {
+    double v = sqrt(a.v);
+    r = makeDual(v, a.d / (2.0 * v));
+  } else if (t == TOKEN_LN) {
+    r = makeDual(log(a.v), a.d / a.v);
+  }
+  return r;
+}
+
+Dual evalRPNDual(const TokenArray *postfix, double xval) {
+  Dual small[RPN_STACK_SIZE];
+  Dual *stack = small;
+  if (postfix->depth > RPN_STACK_SIZE) {
+    stack = (Dual *)malloc(sizeof(Dual) * postfix->depth);
+  }
+  int top = -1;
+  int count = (postfix->depth > 0) ? postfix->size : 0;
+  for (int i = 0; i < count; i++) {
+    Token t = postfix->data[i];
+    if (t.type == TOKEN_NUMBER) {
+      stack[++top] = makeDual(t.value, 0.0);
+    } else if (t.type == TOKEN_X) {
+      stack[++top] = makeDual(xval, 1.0);
+    } else if (t.type == TOKEN_VAR) {
+      stack[++top] = makeDual(NAN, NAN);
+    } else if (t.type == TOKEN_UMINUS) {
+      stack[top] = makeDual(-stack[top].v, -stack[top].d);
+    } else if (isFunction(t.type)) {
+      stack[top] = computeFunctionDual(t.type, stack[top]);
+    } else if (isOperator(t.type)) {
+      top--;
+      stack[top] = computeOperatorDual(t.type, stack[top], stack[top + 1]);
+    }
+  }
+  Dual res = (top >= 0) ? stack[top] : makeDual(NAN, NAN);
+  if (stack != small) {
+    free(stack);
+  }
+  return res;
+}
+
+Dual evalProgramDual(const Program *prog, double xval) {
+  Dual small[PROGRAM_SMALL_STACK];
+  Dual *stack = small;
+  int frameSize = prog->maxDepth + prog->slotCount;
+  if (frameSize > PROGRAM_SMALL_STACK) {
+    stack = (Dual *)malloc(sizeof(Dual) * frameSize);
+  }
+  Dual *slots = stack + prog->maxDepth;
+  const unsigned char *code = prog->code;
+  const unsigned char *end = code + prog->codeSize;
+  unsigned int idx = 0;
+  int top = -1;
+  while (code < end) {
+    unsigned char op = *code++;
+    if (op == OP_CONST) {
+      memcpy(&idx, code, sizeof(idx));
+      code += sizeof(idx);
+      stack[++top] = makeDual(prog->consts[idx], 0.0);
+    } else if (op == OP_X) {
+      stack[++top] = makeDual(xval, 1.0);
+    } else if (op == OP_LOAD) {
+      memcpy(&idx, code, sizeof(idx));
+      code += sizeof(idx);
+      stack[++top] = slots[idx];
+    } else if (op == OP_STORE) {
+      memcpy(&idx, code, sizeof(idx));
+      code += sizeof(idx);
+      slots[idx] = stack[top];
+    } else if (op == OP_VAR) {
+      code += sizeof(idx);
+      stack[++top] = makeDual(NAN, NAN);
+    } else if (op == OP_NEG) {
+      stack[top] = makeDual(-stack[top].v, -stack[top].d);
+    } else if (op >= OP_ADD && op <= OP_DIV) {
+      top--;
+      stack[top] = computeOperatorDual(opToken(op), stack[top],
+                                       stack[top + 1]);
+    } else {
+      stack[top] = computeFunctionDual(opToken(op), stack[top]);
+    }
+  }
+  Dual res = (top >= 0) ? stack[top] : makeDual(NAN, NAN);
+  if (stack != small) {
+    free(stack);
+  }
+  return res;
+}
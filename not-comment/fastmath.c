@@ -0,0 +1,191 @@
+#include "graph.h"
+
+#include <float.h>
+
+#define ROUND_MAGIC 6755399441055744.0
+
+#define TWO_OVER_PI 6.36619772367581382433e-01
+#define PIO2_1 1.57079632673412561417e+00
+#define PIO2_2 6.07710050630396597660e-11
+#define PIO2_3 2.02226624879595063154e-21
+
+#define SIN_1 -0.16666666627999049
+#define SIN_2 0.0083333282387153366
+#define SIN_3 -0.00019839043770329736
+#define SIN_4 2.7160140157145634e-06
+#define COS_1 0.041666666622827225
+#define COS_2 -0.0013888883753335099
+#define COS_3 2.4799519990221825e-05
+#define COS_4 -2.7210236378867672e-07
+
+#define LOG_1 0.66666665085294752
+#define LOG_2 0.40000433871016577
+#define LOG_3 0.28532066962387914
+#define LOG_4 0.23668787274500433
+
+#define LOG_OFFSET 0x3fe6a09e667f3bcdULL
+
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+
+static inline double reduceQuarter(double x, double shift, double *odd,
+                                   double *half) {
+  double k = (x * TWO_OVER_PI + ROUND_MAGIC) - ROUND_MAGIC;
+  double t = k + shift;
+  t -= 4.0 * (((t * 0.25 - 0.375) + ROUND_MAGIC) - ROUND_MAGIC);
+  *half = ((t * 0.5 - 0.25) + ROUND_MAGIC) - ROUND_MAGIC;
+  *odd = t - 2.0 * *half;
+  return ((x - k * PIO2_1) - k * PIO2_2) - k * PIO2_3;
+}
+
+static inline double sinPoly(double r) {
+  double r2 = r * r;
+  return r + r * r2 * (SIN_1 + r2 * (SIN_2 + r2 * (SIN_3 + r2 * SIN_4)));
+}
+
+static inline double cosPoly(double r) {
+  double r2 = r * r;
+  return 1.0 - 0.5 * r2 +
+         r2 * r2 * (COS_1 + r2 * (COS_2 + r2 * (COS_3 + r2 * COS_4)));
+}
+
+static inline double sinKernel(double x) {
+  double odd = 0.0;
+  double half = 0.0;
+  double r = reduceQuarter(x, 0.0, &odd, &half);
+  return (1.0 - 2.0 * half) * (odd * cosPoly(r) + (1.0 - odd) * sinPoly(r));
+}
+
+static inline double cosKernel(double x) {
+  double odd = 0.0;
+  double half = 0.0;
+  double r = reduceQuarter(x, 1.0, &odd, &half);
+  return (1.0 - 2.0 * half) * (odd * cosPoly(r) + (1.0 - odd) * sinPoly(r));
+}
+
+static inline double tanKernel(double x) {
+  double odd = 0.0;
+  double half = 0.0;
+  double r = reduceQuarter(x, 0.0, &odd, &half);
+  double s = sinPoly(r);
+  double c = cosPoly(r);
+  return ((1.0 - odd) * s - odd * c) / ((1.0 - odd) * c + odd * s);
+}
+
+static inline double ctgKernel(double x) {
+  double odd = 0.0;
+  double half = 0.0;
+  double r = reduceQuarter(x, 0.0, &odd, &half);
+  double s = sinPoly(r);
+  double c = cosPoly(r);
+  return ((1.0 - odd) * c - odd * s) / ((1.0 - odd) * s + odd * c);
+}
+
+static inline double trigScalar(double x, double shift) {
+  double odd = 0.0;
+  double half = 0.0;
+  double r = reduceQuarter(x, shift, &odd, &half);
+  double v = (odd != 0.0) ? cosPoly(r) : sinPoly(r);
+  return (half != 0.0) ? -v : v;
+}
+
+static inline double logKernel(double x) {
+  uint64_t bits = 0;
+  memcpy(&bits, &x, sizeof(bits));
+  uint64_t tmp = bits - LOG_OFFSET;
+  uint64_t k = ((tmp >> 52) ^ 0x800) - 0x800;
+  uint64_t mBits = bits - (k << 52);
+  uint64_t kBits = k + 0x4338000000000000ULL;
+  double m = 0.0;
+  double kd = 0.0;
+  memcpy(&m, &mBits, sizeof(m));
+  memcpy(&kd, &kBits, sizeof(kd));
+  kd -= ROUND_MAGIC;
+  double f = m - 1.0;
+  double s = f / (2.0 + f);
+  double s2 = s * s;
+  double lnm = 2.0 * s +
+               s * s2 * (LOG_1 + s2 * (LOG_2 + s2 * (LOG_3 + s2 * LOG_4)));
+  return kd * LN2_HI + (lnm + kd * LN2_LO);
+}
+
+static double exactCtg(double x) {
+  return 1.0 / tan(x);
+}
+
+static void fixFarTrig(double *a, const double *x, double (*exact)(double)) {
+  for (int l = 0; l < BATCH_LANES; l++) {
+    if (!(fabs(x[l]) <= FAST_TRIG_MAX)) {
+      a[l] = exact(x[l]);
+    }
+  }
+}
+
+double fastSin(double x) {
+  return (fabs(x) <= FAST_TRIG_MAX) ? trigScalar(x, 0.0) : sin(x);
+}
+
+double fastCos(double x) {
+  return (fabs(x) <= FAST_TRIG_MAX) ? trigScalar(x, 1.0) : cos(x);
+}
+
+double fastTan(double x) {
+  return (fabs(x) <= FAST_TRIG_MAX) ? tanKernel(x) : tan(x);
+}
+
+double fastCtg(double x) {
+  return (fabs(x) <= FAST_TRIG_MAX) ? ctgKernel(x) : exactCtg(x);
+}
+
+double fastLog(double x) {
+  return (x >= DBL_MIN && x <= DBL_MAX) ? logKernel(x) : log(x);
+}
+
+void fastSinLanes(double *restrict a) {
+  double x[BATCH_LANES];
+  memcpy(x, a, sizeof(x));
+  for (int l = 0; l < BATCH_LANES; l++) {
+    a[l] = sinKernel(x[l]);
+  }
+  fixFarTrig(a, x, sin);
+}
+
+void fastCosLanes(double *restrict a) {
+  double x[BATCH_LANES];
+  memcpy(x, a, sizeof(x));
+  for (int l = 0; l < BATCH_LANES; l++) {
+    a[l] = cosKernel(x[l]);
+  }
+  fixFarTrig(a, x, cos);
+}
+
+void fastTanLanes(double *restrict a) {
+  double x[BATCH_LANES];
+  memcpy(x, a, sizeof(x));
+  for (int l = 0; l < BATCH_LANES; l++) {
+    a[l] = tanKernel(x[l]);
+  }
+  fixFarTrig(a, x, tan);
+}
+
+void fastCtgLanes(double *restrict a) {
+  double x[BATCH_LANES];
+  memcpy(x, a, sizeof(x));
+  for (int l = 0; l < BATCH_LANES; l++) {
+    a[l] = ctgKernel(x[l]);
+  }
+  fixFarTrig(a, x, exactCtg);
+}
+
+void fastLogLanes(double *restrict a) {
+  double x[BATCH_LANES];
+  memcpy(x, a, sizeof(x));
+  for (int l = 0; l < BATCH_LANES; l++) {
+    a[l] = logKernel(x[l]);
+  }
+  for (int l = 0; l < BATCH_LANES; l++) {
+    if (!(x[l] >= DBL_MIN && x[l] <= DBL_MAX)) {
+      a[l] = log(x[l]);
+    }
+  }
+}
@@ -1,13 +1,31 @@
 #include "graph.h"
 
+#include <stdatomic.h>
+
 void initTokenArray(TokenArray *arr) {
   arr->size = 0;
   arr->capacity = 16;
   arr->data = (Token *)malloc(sizeof(Token) * arr->capacity);
+  arr->arena = NULL;
+  arr->depth = 0;
+}
+
+void initTokenArrayArena(TokenArray *arr, Arena *arena, int cap) {
+  arr->size = 0;
+  arr->capacity = (cap > 0) ? cap : 1;
+  arr->data = (Token *)arenaAlloc(arena, sizeof(Token) * arr->capacity);
+  arr->arena = arena;
+  arr->depth = 0;
 }
 
 void pushTokenArray(TokenArray *arr, Token t) {
-  if (arr->size == arr->capacity) {
+  if (arr->size == arr->capacity && arr->arena != NULL) {
+    Token *grown = (Token *)arenaAlloc(arr->arena,
+                                       sizeof(Token) * 2 * arr->capacity);
+    memcpy(grown, arr->data, sizeof(Token) * arr->size);
+    arr->data = grown;
+    arr->capacity *= 2;
+  } else if (arr->size == arr->capacity) {
     arr->capacity *= 2;
     arr->data = (Token *)realloc(arr->data, sizeof(Token) * arr->capacity);
   }
@@ -16,57 +34,14 @@ void pushTokenArray(TokenArray *arr, Token t) {
 }
 
 void freeTokenArray(TokenArray *arr) {
-  free(arr->data);
+  if (arr->arena == NULL) {
+    free(arr->data);
+  }
   arr->data = NULL;
   arr->size = 0;
   arr->capacity = 0;
 }
 
-void initTokenStack(TokenStack *st, int cap) {
-  st->data = (Token *)malloc(sizeof(Token) * cap);
-  st->top = -1;
-  st->capacity = cap;
-}
-
-void pushTokenStack(TokenStack *st, Token t) {
-  if (st->top < st->capacity - 1) {
-    st->top++;
-    st->data[st->top] = t;
-  }
-}
-
-Token popTokenStack(TokenStack *st) {
-  Token tmp;
-  tmp.type = TOKEN_PLUS;
-  tmp.value = 0.0;
-  if (st->top >= 0) {
-    tmp = st->data[st->top];
-    st->top--;
-  }
-  return tmp;
-}
-
-Token peekTokenStack(const TokenStack *st) {
-  Token tmp;
-  tmp.type = TOKEN_PLUS;
-  tmp.value = 0.0;
-  if (st->top >= 0) {
-    tmp = st->data[st->top];
-  }
-  return tmp;
-}
-
-int isStackEmpty(const TokenStack *st) {
-  return (st->top < 0);
-}
-
-void freeTokenStack(TokenStack *st) {
-  free(st->data);
-  st->data = NULL;
-  st->top = -1;
-  st->capacity = 0;
-}
-
 int precedence(TokenType t) {
   int res = 3;
   if (t == TOKEN_PLUS || t == TOKEN_MINUS) {
@@ -97,6 +72,10 @@ int isOperator(TokenType t) {
   return r;
 }
 
+int isOperand(TokenType t) {
+  return (t == TOKEN_NUMBER || t == TOKEN_X || t == TOKEN_VAR);
+}
+
 Token makeToken(TokenType type, double val) {
   Token tmp;
   tmp.type = type;
@@ -104,122 +83,345 @@ Token makeToken(TokenType type, double val) {
   return tmp;
 }
 
-static void readNumber(const char *str, int *i, TokenArray *arr) {
-  char buf[64];
-  int j = 0;
-  while ((str[*i] >= '0' && str[*i] <= '9') || str[*i] == '.') {
-    buf[j] = str[*i];
-    j++;
-    (*i)++;
-  }
-  buf[j] = '\0';
-  pushTokenArray(arr, makeToken(TOKEN_NUMBER, atof(buf)));
-}
-
-static void addFunctionToken(const char *str, int *i, TokenArray *arr) {
-  if (!strncmp(&str[*i], "sin", 3)) {
-    pushTokenArray(arr, makeToken(TOKEN_SIN, 0.0));
-    (*i) += 3;
-  } else if (!strncmp(&str[*i], "cos", 3)) {
-    pushTokenArray(arr, makeToken(TOKEN_COS, 0.0));
-    (*i) += 3;
-  } else if (!strncmp(&str[*i], "tan", 3)) {
-    pushTokenArray(arr, makeToken(TOKEN_TAN, 0.0));
-    (*i) += 3;
-  } else if (!strncmp(&str[*i], "ctg", 3)) {
-    pushTokenArray(arr, makeToken(TOKEN_CTG, 0.0));
-    (*i) += 3;
-  } else if (!strncmp(&str[*i], "sqrt", 4)) {
-    pushTokenArray(arr, makeToken(TOKEN_SQRT, 0.0));
-    (*i) += 4;
-  } else if (!strncmp(&str[*i], "ln", 2)) {
-    pushTokenArray(arr, makeToken(TOKEN_LN, 0.0));
-    (*i) += 2;
-  }
-}
-
-void tokenize(const char *str, TokenArray *arr) {
-  int i = 0;
-  while (str[i] != '\0') {
-    if (str[i] == ' ' || str[i] == '\t') {
-      i++;
-    } else if ((str[i] >= '0' && str[i] <= '9') || str[i] == '.') {
-      readNumber(str, &i, arr);
-    } else if (!strncmp(&str[i], "sin", 3) ||
-               !strncmp(&str[i], "cos", 3) ||
-               !strncmp(&str[i], "tan", 3) ||
-               !strncmp(&str[i], "ctg", 3) ||
-               !strncmp(&str[i], "sqrt", 4) ||
-               !strncmp(&str[i], "ln", 2)) {
-      addFunctionToken(str, &i, arr);
-    } else if (str[i] == 'x') {
-      pushTokenArray(arr, makeToken(TOKEN_X, 0.0));
-      i++;
-    } else if (str[i] == '+') {
-      pushTokenArray(arr, makeToken(TOKEN_PLUS, 0.0));
-      i++;
-    } else if (str[i] == '-') {
-      if (i == 0 || isOperator(arr->data[arr->size - 1].type) ||
-          arr->data[arr->size - 1].type == TOKEN_LPAREN) {
-        pushTokenArray(arr, makeToken(TOKEN_UMINUS, 0.0));
-      } else {
-        pushTokenArray(arr, makeToken(TOKEN_MINUS, 0.0));
-      }
-      i++;
-    } else if (str[i] == '*') {
-      pushTokenArray(arr, makeToken(TOKEN_MULT, 0.0));
-      i++;
-    } else if (str[i] == '/') {
-      pushTokenArray(arr, makeToken(TOKEN_DIV, 0.0));
-      i++;
-    } else if (str[i] == '(') {
-      pushTokenArray(arr, makeToken(TOKEN_LPAREN, 0.0));
-      i++;
-    } else if (str[i] == ')') {
-      pushTokenArray(arr, makeToken(TOKEN_RPAREN, 0.0));
-      i++;
+static const double kPow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static int readNumber(const char *s, double *value) {
+  unsigned long long mant = 0;
+  int digits = 0;
+  int exp10 = 0;
+  int n = 0;
+  for (; s[n] >= '0' && s[n] <= '9'; n++) {
+    if (digits < 19) {
+      mant = mant * 10 + (unsigned)(s[n] - '0');
+      digits += (mant > 0);
     } else {
-      i++;
+      exp10++;
+    }
+  }
+  if (s[n] == '.') {
+    for (n++; s[n] >= '0' && s[n] <= '9'; n++) {
+      if (digits < 19) {
+        mant = mant * 10 + (unsigned)(s[n] - '0');
+        digits += (mant > 0);
+        exp10--;
+      }
     }
   }
+  int expLen = 0;
+  if (s[n] == 'e' || s[n] == 'E') {
+    int k = n + 1;
+    int sign = 1;
+    if (s[k] == '+' || s[k] == '-') {
+      sign = (s[k] == '-') ? -1 : 1;
+      k++;
+    }
+    int e = 0;
+    for (; s[k] >= '0' && s[k] <= '9'; k++) {
+      e = (e < 10000) ? e * 10 + (s[k] - '0') : e;
+    }
+    if (s[k - 1] >= '0' && s[k - 1] <= '9') {
+      expLen = k - n;
+      exp10 += sign * e;
+    }
+  }
+  if (mant == 0) {
+    *value = 0.0;
+  } else if (mant <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+    *value = (exp10 >= 0) ? (double)mant * kPow10[exp10]
+                          : (double)mant / kPow10[-exp10];
+  } else {
+    *value = strtod(s, NULL);
+  }
+  return n + expLen;
 }
 
-void toRPN(const TokenArray *infix, TokenArray *postfix) {
-  TokenStack stack;
-  initTokenStack(&stack, infix->size + 10);
-  for (int i = 0; i < infix->size; i++) {
-    Token t = infix->data[i];
-    if (t.type == TOKEN_NUMBER || t.type == TOKEN_X) {
-      pushTokenArray(postfix, t);
-    } else if (isFunction(t.type) || t.type == TOKEN_UMINUS) {
-      pushTokenStack(&stack, t);
-    } else if (isOperator(t.type)) {
-      while (!isStackEmpty(&stack) &&
-             isOperator(peekTokenStack(&stack).type) &&
-             precedence(peekTokenStack(&stack).type) >= precedence(t.type)) {
-        pushTokenArray(postfix, popTokenStack(&stack));
+static int readFunction(const char *s, TokenType *type) {
+  int len = 0;
+  switch (s[0]) {
+    case 's':
+      if (s[1] == 'i' && s[2] == 'n') {
+        *type = TOKEN_SIN;
+        len = 3;
+      } else if (s[1] == 'q' && s[2] == 'r' && s[3] == 't') {
+        *type = TOKEN_SQRT;
+        len = 4;
+      }
+      break;
+    case 'c':
+      if (s[1] == 'o' && s[2] == 's') {
+        *type = TOKEN_COS;
+        len = 3;
+      } else if (s[1] == 't' && s[2] == 'g') {
+        *type = TOKEN_CTG;
+        len = 3;
       }
-      pushTokenStack(&stack, t);
-    } else if (t.type == TOKEN_LPAREN) {
-      pushTokenStack(&stack, t);
-    } else if (t.type == TOKEN_RPAREN) {
-      while (!isStackEmpty(&stack) &&
-             peekTokenStack(&stack).type != TOKEN_LPAREN) {
-        pushTokenArray(postfix, popTokenStack(&stack));
+      break;
+    case 't':
+      if (s[1] == 'a' && s[2] == 'n') {
+        *type = TOKEN_TAN;
+        len = 3;
       }
-      if (!isStackEmpty(&stack) &&
-          peekTokenStack(&stack).type == TOKEN_LPAREN) {
-        popTokenStack(&stack);
+      break;
+    case 'l':
+      if (s[1] == 'n') {
+        *type = TOKEN_LN;
+        len = 2;
       }
-      if (!isStackEmpty(&stack) && isFunction(peekTokenStack(&stack).type)) {
-        pushTokenArray(postfix, popTokenStack(&stack));
+      break;
+    default:
+      break;
+  }
+  return len;
+}
+
+static int readToken(const char *s, const Token *prev, Token *t) {
+  int len = 1;
+  t->value = 0.0;
+  switch (s[0]) {
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9': case '.':
+      t->type = TOKEN_NUMBER;
+      len = readNumber(s, &t->value);
+      break;
+    case 'x':
+      t->type = TOKEN_X;
+      break;
+    case '+':
+      t->type = TOKEN_PLUS;
+      break;
+    case '-':
+      t->type = (prev == NULL || isOperator(prev->type) ||
+                 prev->type == TOKEN_LPAREN) ? TOKEN_UMINUS : TOKEN_MINUS;
+      break;
+    case '*':
+      t->type = TOKEN_MULT;
+      break;
+    case '/':
+      t->type = TOKEN_DIV;
+      break;
+    case '(':
+      t->type = TOKEN_LPAREN;
+      break;
+    case ')':
+      t->type = TOKEN_RPAREN;
+      break;
+    default:
+      len = readFunction(s, &t->type);
+      if (len == 0 && s[0] >= 'a' && s[0] <= 'z') {
+        t->type = TOKEN_VAR;
+        t->value = (double)(s[0] - 'a');
+        len = 1;
+      }
+      break;
+  }
+  return len;
+}
+
+int lexToken(const char *s, Token *t) {
+  return readToken(s, NULL, t);
+}
+
+static void recordColumn(LexStream *ls, long column) {
+  int i = ls->arr->size - 1 - ls->first;
+  if (i >= ls->columnsCap) {
+    ls->columnsCap = ls->columnsCap ? 2 * ls->columnsCap : 64;
+    ls->columns = (long *)realloc(ls->columns,
+                                  sizeof(long) * ls->columnsCap);
+  }
+  ls->columns[i] = column;
+}
+
+static int lexSpan(const char *str, TokenArray *arr, int first,
+                   LexStream *ls) {
+  TRACE_BEGIN(span);
+  TRACE_LOCAL(int startSize = arr->size;)
+  int errorPos = -1;
+  int i = 0;
+  while (str[i] != '\0') {
+    int len = 1;
+    if (str[i] != ' ' && str[i] != '\t') {
+      const Token *prev =
+          (arr->size > first) ? &arr->data[arr->size - 1] : NULL;
+      Token t;
+      int n = readToken(&str[i], prev, &t);
+      if (n > 0) {
+        pushTokenArray(arr, t);
+        if (ls != NULL) {
+          recordColumn(ls, ls->offset + i);
+        }
+        len = n;
+      } else if (errorPos < 0) {
+        errorPos = i;
       }
     }
+    i += len;
+  }
+  TRACE_COUNT(COUNTER_TOKENS, arr->size - startSize);
+  TRACE_END(span, STAGE_LEX);
+  return errorPos;
+}
+
+int tokenize(const char *str, TokenArray *arr) {
+  return lexSpan(str, arr, arr->size, NULL);
+}
+
+void initLexStream(LexStream *ls, TokenArray *arr) {
+  ls->arr = arr;
+  ls->first = arr->size;
+  ls->tail = NULL;
+  ls->tailLen = 0;
+  ls->tailCap = 0;
+  ls->offset = 0;
+  ls->errorPos = -1;
+  ls->errorChar = '\0';
+  ls->columns = NULL;
+  ls->columnsCap = 0;
+}
+
+static void lexTail(LexStream *ls, size_t n) {
+  char saved = ls->tail[n];
+  ls->tail[n] = '\0';
+  int bad = lexSpan(ls->tail, ls->arr, ls->first, ls);
+  ls->tail[n] = saved;
+  if (bad >= 0 && ls->errorPos < 0) {
+    ls->errorPos = ls->offset + bad;
+    ls->errorChar = ls->tail[bad];
+  }
+  memmove(ls->tail, ls->tail + n, ls->tailLen - n);
+  ls->tailLen -= n;
+  ls->offset += (long)n;
+}
+
+static int isLexBoundary(const char *s, size_t k) {
+  char c = s[k];
+  int ok = (c == '(' || c == ')' || c == '*' || c == '/' || c == 'x' ||
+            c == ' ' || c == '\t');
+  if (c == '+' || c == '-') {
+    ok = (k == 0 || (s[k - 1] != 'e' && s[k - 1] != 'E'));
+  }
+  return ok;
+}
+
+void feedLexStream(LexStream *ls, const char *data, size_t n) {
+  if (ls->tailLen + n + 1 > ls->tailCap) {
+    ls->tailCap = ls->tailCap ? ls->tailCap : 256;
+    while (ls->tailLen + n + 1 > ls->tailCap) {
+      ls->tailCap *= 2;
+    }
+    ls->tail = (char *)realloc(ls->tail, ls->tailCap);
+  }
+  memcpy(ls->tail + ls->tailLen, data, n);
+  ls->tailLen += n;
+  size_t cut = ls->tailLen;
+  while (cut > 0 && !isLexBoundary(ls->tail, cut - 1)) {
+    cut--;
   }
-  while (!isStackEmpty(&stack)) {
-    pushTokenArray(postfix, popTokenStack(&stack));
+  if (cut > 0) {
+    lexTail(ls, cut);
+  }
+}
+
+long finishLexStream(LexStream *ls) {
+  if (ls->tailLen > 0) {
+    lexTail(ls, ls->tailLen);
+  }
+  free(ls->tail);
+  ls->tail = NULL;
+  ls->tailCap = 0;
+  return ls->errorPos;
+}
+
+long lexColumn(const LexStream *ls, long token) {
+  long i = token - ls->first;
+  return (i >= 0 && i < ls->arr->size - ls->first) ? ls->columns[i]
+                                                   : ls->offset;
+}
+
+void freeLexStream(LexStream *ls) {
+  free(ls->columns);
+  ls->columns = NULL;
+  ls->columnsCap = 0;
+}
+
+static void trackRPN(TokenType type, int *top, int *depth) {
+  if (*top < 0) {
+    *top = -1;
+  } else if (isOperand(type)) {
+    (*top)++;
+    *depth = (*top > *depth) ? *top : *depth;
+  } else if (isFunction(type) || type == TOKEN_UMINUS) {
+    *top = (*top >= 1) ? *top : -1;
+  } else if (isOperator(type)) {
+    *top = (*top >= 2) ? *top - 1 : -1;
+  }
+}
+
+int rpnDepth(const TokenArray *postfix) {
+  int top = 0;
+  int depth = 0;
+  for (int i = 0; i < postfix->size; i++) {
+    trackRPN(postfix->data[i].type, &top, &depth);
+  }
+  return (top > 0) ? depth : 0;
+}
+
+int countSeries(const char *text) {
+  int count = 1;
+  for (const char *p = strchr(text, ';'); p != NULL; p = strchr(p + 1, ';')) {
+    count++;
+  }
+  return count;
+}
+
+void initVars(double *vars) {
+  for (int v = 0; v < VAR_COUNT; v++) {
+    vars[v] = NAN;
+  }
+}
+
+static int varIndex(const char *name, size_t len) {
+  int v = -1;
+  if (len == 1 && name[0] >= 'a' && name[0] <= 'z' && name[0] != 'x') {
+    v = name[0] - 'a';
+  }
+  return v;
+}
+
+int parseVar(const char *text, double *vars) {
+  const char *eq = strchr(text, '=');
+  int v = (eq != NULL) ? varIndex(text, (size_t)(eq - text)) : -1;
+  char *end = NULL;
+  double value = (v >= 0) ? strtod(eq + 1, &end) : 0.0;
+  int ok = (v >= 0 && end != eq + 1 && *end == '\0');
+  if (ok) {
+    vars[v] = value;
+  }
+  return ok;
+}
+
+int parseSweep(const char *text, ParamSweep *sweep) {
+  const char *eq = strchr(text, '=');
+  int v = (eq != NULL) ? varIndex(text, (size_t)(eq - text)) : -1;
+  ParamSweep s;
+  int used = 0;
+  int ok = v >= 0 && sscanf(eq + 1, "%lf:%lf:%d%n", &s.from, &s.to,
+                            &s.frames, &used) == 3 &&
+           eq[1 + used] == '\0' && s.frames >= 1;
+  if (ok) {
+    s.var = v;
+    *sweep = s;
+  }
+  return ok;
+}
+
+void sweepVars(const ParamSweep *sweep, int step, double *vars) {
+  if (sweep->var >= 0) {
+    double t = (sweep->frames > 1)
+                   ? (double)step / (double)(sweep->frames - 1) : 0.0;
+    vars[sweep->var] = sweep->from + (sweep->to - sweep->from) * t;
   }
-  freeTokenStack(&stack);
 }
 
 double computeFunction(TokenType t, double val) {
@@ -234,9 +436,14 @@ double computeFunction(TokenType t, double val) {
 }
 
 double evalRPN(const TokenArray *postfix, double xval) {
-  double stack[256];
+  double small[RPN_STACK_SIZE];
+  double *stack = small;
+  if (postfix->depth > RPN_STACK_SIZE) {
+    stack = (double *)malloc(sizeof(double) * postfix->depth);
+  }
   int top = -1;
-  int count = postfix->size;
+  int count = (postfix->depth > 0) ? postfix->size : 0;
+  TRACE_LOCAL(int highWater = -1;)
   for (int i = 0; i < count; i++) {
     Token t = postfix->data[i];
     if (t.type == TOKEN_NUMBER) {
@@ -245,6 +452,9 @@ double evalRPN(const TokenArray *postfix, double xval) {
     } else if (t.type == TOKEN_X) {
       top++;
       stack[top] = xval;
+    } else if (t.type == TOKEN_VAR) {
+      top++;
+      stack[top] = NAN;
     } else if (t.type == TOKEN_UMINUS) {
       stack[top] = -stack[top];
     } else if (isOperator(t.type) && t.type != TOKEN_UMINUS) {
@@ -259,60 +469,588 @@ double evalRPN(const TokenArray *postfix, double xval) {
     } else if (isFunction(t.type)) {
       stack[top] = computeFunction(t.type, stack[top]);
     }
+    TRACE_LOCAL(highWater = (top > highWater) ? top : highWater;)
   }
-  return stack[top];
+  TRACE_MAX(COUNTER_RPN_STACK, highWater + 1);
+  double res = (top >= 0) ? stack[top] : NAN;
+  if (stack != small) {
+    free(stack);
+  }
+  return res;
+}
+
+typedef struct {
+  Canvas *canvas;
+  const Program *prog;
+  const JitProgram *jit;
+  int count;
+  EvalMode mode;
+  double *xs;
+  double *ys;
+  double *dys;
+  size_t stride;
+  double dx;
+  double rowScale;
+  atomic_long *evaluations;
+} FillJob;
+
+static const char kSeriesGlyphs[] = "*+ox#@%&=~";
+
+char seriesGlyph(int s) {
+  return kSeriesGlyphs[s % (int)(sizeof(kSeriesGlyphs) - 1)];
 }
 
-void fillCanvas(char canvas[25][80], const TokenArray *postfix) {
-  for (int r = 0; r < 25; r++) {
-    for (int c = 0; c < 80; c++) {
-      canvas[r][c] = '.';
+static void evalDualSamples(FillJob *job, int s, size_t begin, size_t end) {
+  double *ys = job->ys + (size_t)s * job->stride;
+  for (size_t c = begin; c < end; c++) {
+    Dual r = evalProgramDual(&job->prog[s], job->xs[c]);
+    ys[c] = (job->mode == EVAL_DERIVATIVE) ? r.d : r.v;
+    if (job->dys != NULL) {
+      job->dys[(size_t)s * job->stride + c] = r.d;
     }
   }
-  for (int c = 0; c < 80; c++) {
-    double x = 4.0 * M_PI * (double)c / 79.0;
-    double yVal = evalRPN(postfix, x);
-    if (yVal >= -1.0 && yVal <= 1.0) {
-      double scaled = 12.0 + yVal * 12.0;
-      int row = (int)round(scaled);
-      if (row >= 0 && row < 25) {
-        canvas[row][c] = '*';
+}
+
+static void evalSamples(void *arg, size_t begin, size_t end) {
+  FillJob *job = (FillJob *)arg;
+  for (int s = 0; s < job->count; s++) {
+    double *ys = job->ys + (size_t)s * job->stride;
+    if (job->mode == EVAL_ADAPTIVE || job->mode == EVAL_DERIVATIVE) {
+      evalDualSamples(job, s, begin, end);
+    } else if (job->jit != NULL) {
+      evalJitBatch(&job->jit[s], job->xs + begin, ys + begin, end - begin);
+    } else {
+      evalProgramBatch(&job->prog[s], job->xs + begin, ys + begin,
+                       end - begin);
+    }
+  }
+}
+
+static void sampleColumns(void *arg, size_t begin, size_t end) {
+  FillJob *job = (FillJob *)arg;
+  Viewport dots;
+  rasterGrid(&job->canvas->view, &dots);
+  for (size_t c = begin; c < end; c++) {
+    job->xs[c] = columnX(&dots, (int)c);
+  }
+  for (size_t b = begin; b < end; b += SERIES_BLOCK_COLUMNS) {
+    size_t blockEnd = b + SERIES_BLOCK_COLUMNS;
+    evalSamples(arg, b, (blockEnd < end) ? blockEnd : end);
+  }
+  if (job->evaluations != NULL) {
+    atomic_fetch_add(job->evaluations, (long)(end - begin) * job->count);
+  }
+}
+
+static Dual sampleColumnDual(FillJob *job, int s, const Viewport *dots,
+                             size_t c, int store) {
+  Dual r = evalProgramDual(&job->prog[s], columnX(dots, (int)c));
+  if (store) {
+    job->ys[(size_t)s * job->stride + c] = r.v;
+    job->dys[(size_t)s * job->stride + c] = r.d;
+  }
+  return r;
+}
+
+static void interpolateSpan(FillJob *job, int s, size_t c0, Dual f0,
+                            size_t c1, Dual f1) {
+  double *ys = job->ys + (size_t)s * job->stride;
+  double *dys = job->dys + (size_t)s * job->stride;
+  double h = job->dx * (double)(c1 - c0);
+  for (size_t c = c0 + 1; c < c1; c++) {
+    double t = (double)(c - c0) / (double)(c1 - c0);
+    double t2 = t * t;
+    double t3 = t2 * t;
+    ys[c] = (2.0 * t3 - 3.0 * t2 + 1.0) * f0.v + (t3 - 2.0 * t2 + t) * h * f0.d +
+            (3.0 * t2 - 2.0 * t3) * f1.v + (t3 - t2) * h * f1.d;
+    dys[c] = f0.d + (f1.d - f0.d) * t;
+  }
+}
+
+static long refineSpan(FillJob *job, int s, const Viewport *dots, size_t c0,
+                       Dual f0, size_t c1, Dual f1) {
+  long evals = 0;
+  if (c1 - c0 >= 2) {
+    double slope = fmax(fabs(f0.d), fabs(f1.d)) * job->dx * (double)(c1 - c0);
+    double rows = fmax(slope, fabs(f1.v - f0.v)) * job->rowScale;
+    if (rows <= 1.0) {
+      interpolateSpan(job, s, c0, f0, c1, f1);
+    } else {
+      size_t m = c0 + (c1 - c0) / 2;
+      Dual fm = sampleColumnDual(job, s, dots, m, 1);
+      evals = 1 + refineSpan(job, s, dots, c0, f0, m, fm) +
+              refineSpan(job, s, dots, m, fm, c1, f1);
+    }
+  }
+  return evals;
+}
+
+static void sampleAdaptive(void *arg, size_t begin, size_t end) {
+  FillJob *job = (FillJob *)arg;
+  Viewport dots;
+  rasterGrid(&job->canvas->view, &dots);
+  size_t last = (end < (size_t)dots.width) ? end : (size_t)dots.width - 1;
+  long evals = 0;
+  for (size_t c = begin; c < end; c++) {
+    job->xs[c] = columnX(&dots, (int)c);
+  }
+  for (int s = 0; s < job->count; s++) {
+    Dual left = sampleColumnDual(job, s, &dots, begin, 1);
+    evals++;
+    for (size_t c0 = begin; c0 < last;) {
+      size_t c1 = (last - c0 > ADAPTIVE_SPAN) ? c0 + ADAPTIVE_SPAN : last;
+      Dual right = sampleColumnDual(job, s, &dots, c1, c1 < end);
+      evals += 1 + refineSpan(job, s, &dots, c0, left, c1, right);
+      left = right;
+      c0 = c1;
+    }
+  }
+  atomic_fetch_add(job->evaluations, evals);
+}
+
+void initViewport(Viewport *view) {
+  view->width = 80;
+  view->height = 25;
+  view->xMin = 0.0;
+  view->xMax = 4.0 * M_PI;
+  view->yMin = -1.0;
+  view->yMax = 1.0;
+  view->autoscaleY = 0;
+  view->raster = RASTER_POINTS;
+}
+
+void initCanvas(Canvas *canvas, const Viewport *view) {
+  canvas->view = *view;
+  canvas->stride = (size_t)view->width * rasterCellBytes(view) + 1;
+  canvas->evaluations = 0;
+  canvas->cells = (char *)malloc(canvas->stride * view->height);
+  for (int r = 0; r < view->height; r++) {
+    canvas->cells[(size_t)(r + 1) * canvas->stride - 1] = '\n';
+  }
+}
+
+void freeCanvas(Canvas *canvas) {
+  free(canvas->cells);
+  canvas->cells = NULL;
+}
+
+double columnX(const Viewport *view, int c) {
+  double x = view->xMin;
+  if (view->width > 1) {
+    x += (view->xMax - view->xMin) * (double)c / (double)(view->width - 1);
+  }
+  return x;
+}
+
+double rowY(const Viewport *view, int r) {
+  double y = view->yMin;
+  if (view->height > 1) {
+    y += (view->yMax - view->yMin) * (double)r / (double)(view->height - 1);
+  }
+  return y;
+}
+
+static void autoscaleRange(Viewport *view, const double *ys, size_t n) {
+  double lo = INFINITY;
+  double hi = -INFINITY;
+  for (size_t i = 0; i < n; i++) {
+    if (isfinite(ys[i])) {
+      lo = (ys[i] < lo) ? ys[i] : lo;
+      hi = (ys[i] > hi) ? ys[i] : hi;
+    }
+  }
+  if (lo < hi) {
+    view->yMin = lo;
+    view->yMax = hi;
+  } else if (lo == hi) {
+    view->yMin = lo - 1.0;
+    view->yMax = hi + 1.0;
+  }
+}
+
+static double rowsPerUnit(const Viewport *view) {
+  return (view->yMax > view->yMin)
+             ? (view->height - 1) / (view->yMax - view->yMin)
+             : 0.0;
+}
+
+static void plotPoint(Canvas *canvas, int c, double y, char glyph) {
+  const Viewport *view = &canvas->view;
+  if (y >= view->yMin && y <= view->yMax) {
+    double scaled = (y - view->yMin) * (view->height - 1) /
+                    (view->yMax - view->yMin);
+    int row = (int)round(scaled);
+    if (row >= 0 && row < view->height) {
+      canvas->cells[(size_t)row * canvas->stride + c] = glyph;
+    }
+  } else {
+    TRACE_COUNT(COUNTER_OFF_CANVAS, 1);
+  }
+}
+
+static long plotAdaptive(const FillJob *job, int s, size_t c, char glyph) {
+  size_t i = (size_t)s * job->stride + c;
+  double rows = fabs(job->dys[i]) * job->dx * job->rowScale;
+  long evals = 0;
+  plotPoint(job->canvas, (int)c, job->ys[i], glyph);
+  if (rows > 1.0) {
+    int n = (rows < ADAPTIVE_MAX_SAMPLES) ? (int)ceil(rows)
+                                          : ADAPTIVE_MAX_SAMPLES;
+    double x0 = job->xs[c] - 0.5 * job->dx;
+    for (int k = 0; k <= n; k++) {
+      double y = evalProgram(&job->prog[s], x0 + job->dx * k / n);
+      plotPoint(job->canvas, (int)c, y, glyph);
+    }
+    TRACE_COUNT(COUNTER_SAMPLES, n + 1);
+    evals = n + 1;
+  }
+  return evals;
+}
+
+static void plotColumns(void *arg, size_t begin, size_t end) {
+  FillJob *job = (FillJob *)arg;
+  long evals = 0;
+  for (size_t b = begin; b < end; b += SERIES_BLOCK_COLUMNS) {
+    size_t blockEnd = b + SERIES_BLOCK_COLUMNS;
+    blockEnd = (blockEnd < end) ? blockEnd : end;
+    for (int s = 0; s < job->count; s++) {
+      const double *ys = job->ys + (size_t)s * job->stride;
+      char glyph = seriesGlyph(s);
+      if (job->dys != NULL) {
+        for (size_t c = b; c < blockEnd; c++) {
+          evals += plotAdaptive(job, s, c, glyph);
+        }
+      } else {
+        rasterSeries(job->canvas, ys, b, blockEnd, glyph);
       }
     }
   }
+  if (evals > 0) {
+    atomic_fetch_add(job->evaluations, evals);
+  }
+}
+
+static void intervalColumns(void *arg, size_t begin, size_t end) {
+  FillJob *job = (FillJob *)arg;
+  for (size_t c = begin; c < end; c++) {
+    for (int s = 0; s < job->count; s++) {
+      plotIntervalColumn(job->canvas, &job->prog[s], (int)c, seriesGlyph(s));
+    }
+  }
+}
+
+static void fillCanvasColumns(Canvas *canvas, const Program *progs,
+                              SharedJit *const *shared, int count,
+                              EvalMode mode, ThreadPool *pool) {
+  Viewport *view = &canvas->view;
+  Viewport dots;
+  rasterGrid(view, &dots);
+  size_t width = (size_t)dots.width;
+  JitProgram single;
+  JitProgram *jits = NULL;
+  atomic_long evaluations = 0;
+  FillJob job;
+  job.canvas = canvas;
+  job.prog = progs;
+  job.jit = NULL;
+  job.count = count;
+  job.mode = mode;
+  job.dys = NULL;
+  job.stride = width;
+  job.dx = (width > 1) ? (dots.xMax - dots.xMin) / (double)(width - 1) : 0.0;
+  job.rowScale = rowsPerUnit(view);
+  job.evaluations = &evaluations;
+  if (mode == EVAL_JIT) {
+    jits = (count == 1) ? &single
+                        : (JitProgram *)malloc(sizeof(JitProgram) * count);
+    for (int s = 0; s < count; s++) {
+      if (shared != NULL) {
+        jits[s] = shared[s]->jit;
+      } else {
+        compileJit(&progs[s], &jits[s]);
+      }
+    }
+    job.jit = jits;
+  }
+  job.xs = (double *)malloc(sizeof(double) * width);
+  job.ys = (double *)malloc(sizeof(double) * width * count);
+  if (mode == EVAL_ADAPTIVE) {
+    job.dys = (double *)malloc(sizeof(double) * width * count);
+  }
+  clearRaster(canvas);
+  if (mode != EVAL_INTERVAL || view->autoscaleY) {
+    int adaptive = (mode == EVAL_ADAPTIVE && !view->autoscaleY);
+    TRACE_BEGIN(evalSpan);
+    runThreadPool(pool, adaptive ? sampleAdaptive : sampleColumns, &job,
+                  width, POOL_CHUNK_COLUMNS);
+    TRACE_SAMPLES(job.ys, width * count);
+    TRACE_END(evalSpan, STAGE_EVAL);
+  }
+  TRACE_BEGIN(renderSpan);
+  if (view->autoscaleY) {
+    autoscaleRange(view, job.ys, width * count);
+    job.rowScale = rowsPerUnit(view);
+  }
+  runThreadPool(pool, (mode == EVAL_INTERVAL) ? intervalColumns : plotColumns,
+                &job, width, POOL_CHUNK_COLUMNS);
+  TRACE_END(renderSpan, STAGE_RENDER);
+  if (jits != NULL) {
+    for (int s = 0; shared == NULL && s < count; s++) {
+      freeJit(&jits[s]);
+    }
+    if (jits != &single) {
+      free(jits);
+    }
+  }
+  free(job.xs);
+  free(job.ys);
+  free(job.dys);
+  canvas->evaluations = atomic_load(&evaluations);
+}
+
+void fillCanvasPrograms(Canvas *canvas, const Program *progs,
+                        SharedJit *const *jits, int count, EvalMode mode,
+                        ThreadPool *pool) {
+  if (isGridMode(mode)) {
+    fillCanvasGrid(canvas, progs, count, mode, pool);
+  } else {
+    fillCanvasColumns(canvas, progs, jits, count, mode, pool);
+  }
+}
+
+void fillCanvasProgram(Canvas *canvas, const Program *prog, EvalMode mode,
+                       ThreadPool *pool) {
+  fillCanvasPrograms(canvas, prog, NULL, 1, mode, pool);
+}
+
+void fillCanvas(Canvas *canvas, const TokenArray *postfix, EvalMode mode,
+                ThreadPool *pool) {
+  Program prog;
+  initProgram(&prog);
+  compileRPN(postfix, &prog);
+  fillCanvasProgram(canvas, &prog, mode, pool);
+  freeProgram(&prog);
+}
+
+void initSampleCache(SampleCache *samples) {
+  samples->cur = NULL;
+  samples->next = NULL;
+  samples->miss = NULL;
+  samples->missCols = NULL;
+  samples->capacity = 0;
+  samples->count = 0;
+  samples->x0 = 0.0;
+  samples->step = 0.0;
+  samples->cells = NULL;
+  samples->reused = 0;
+  samples->evaluated = 0;
+}
+
+void resetSampleCache(SampleCache *samples) {
+  samples->count = 0;
+}
+
+void freeSampleCache(SampleCache *samples) {
+  free(samples->cur);
+  free(samples->next);
+  free(samples->miss);
+  free(samples->missCols);
+  initSampleCache(samples);
+}
+
+static void reserveSamples(SampleCache *samples, int width) {
+  if (width > samples->capacity) {
+    size_t cap = (size_t)width;
+    double *cur = (double *)malloc(sizeof(double) * 2 * cap);
+    if (samples->count > 0) {
+      memcpy(cur, samples->cur, sizeof(double) * samples->count);
+      memcpy(cur + cap, samples->cur + samples->capacity,
+             sizeof(double) * samples->count);
+    }
+    free(samples->cur);
+    free(samples->next);
+    free(samples->miss);
+    free(samples->missCols);
+    samples->cur = cur;
+    samples->next = (double *)malloc(sizeof(double) * 2 * cap);
+    samples->miss = (double *)malloc(sizeof(double) * 2 * cap);
+    samples->missCols = (size_t *)malloc(sizeof(size_t) * cap);
+    samples->capacity = width;
+  }
 }
 
-void printCanvas(char canvas[25][80]) {
-  for (int r = 0; r < 25; r++) {
-    for (int c = 0; c < 80; c++) {
-      putchar(canvas[r][c]);
+static int findSample(const SampleCache *samples, double invStep, double x,
+                      double *y) {
+  int found = 0;
+  double t = (x - samples->x0) * invStep + 0.5;
+  if (t >= 0.0 && t < (double)samples->count) {
+    size_t k = (size_t)t;
+    const double *xs = samples->cur;
+    if (fabs(xs[k] - x) * invStep <= SAMPLE_MATCH_EPS) {
+      *y = xs[samples->capacity + k];
+      found = 1;
     }
-    putchar('\n');
   }
+  return found;
 }
 
-int main(void) {
-  int retVal = 0;
-  char input[256];
-  if (!fgets(input, sizeof(input), stdin)) {
-    retVal = 0;
+static long panShift(const SampleCache *samples, const Canvas *canvas,
+                     const Viewport *dots) {
+  const Viewport *view = &canvas->view;
+  const Viewport *last = &samples->view;
+  long shift = 0;
+  long cell = dots->width / view->width;
+  if (samples->cells == canvas->cells && samples->count == dots->width &&
+      dots->width > 1 && !view->autoscaleY && !last->autoscaleY &&
+      view->width == last->width && view->height == last->height &&
+      view->raster == last->raster && view->yMin == last->yMin &&
+      view->yMax == last->yMax) {
+    double step = (view->xMax - view->xMin) / (double)(dots->width - 1);
+    double t = (view->xMin - samples->x0) / samples->step;
+    long k = lround(t);
+    if (fabs(step - samples->step) <= SAMPLE_MATCH_EPS * samples->step &&
+        fabs(t - (double)k) <= SAMPLE_MATCH_EPS && k % cell == 0 &&
+        labs(k) + 2 * cell <= dots->width) {
+      shift = k;
+    }
+  }
+  return shift;
+}
+
+static void panSamples(Canvas *canvas, const Program *prog, SharedJit *shared,
+                       EvalMode mode, ThreadPool *pool, SampleCache *samples,
+                       long shift) {
+  Viewport dots;
+  rasterGrid(&canvas->view, &dots);
+  size_t width = (size_t)dots.width;
+  size_t cap = (size_t)samples->capacity;
+  size_t cell = width / (size_t)canvas->view.width;
+  size_t n = (size_t)labs(shift);
+  size_t keep = width - n;
+  size_t fresh = (shift > 0) ? keep : 0;
+  size_t from = (shift > 0) ? n : 0;
+  size_t to = (shift > 0) ? 0 : n;
+  double *xs = samples->cur;
+  double *ys = samples->cur + cap;
+  memmove(xs + to, xs + from, sizeof(double) * keep);
+  memmove(ys + to, ys + from, sizeof(double) * keep);
+  JitProgram jit;
+  FillJob job;
+  job.canvas = canvas;
+  job.prog = prog;
+  job.jit = NULL;
+  job.count = 1;
+  job.mode = mode;
+  job.dys = NULL;
+  job.stride = cap;
+  job.evaluations = NULL;
+  job.xs = xs + fresh;
+  job.ys = ys + fresh;
+  for (size_t i = 0; i < n; i++) {
+    job.xs[i] = columnX(&dots, (int)(fresh + i));
+  }
+  if (mode == EVAL_JIT && shared != NULL) {
+    job.jit = &shared->jit;
+  } else if (mode == EVAL_JIT) {
+    compileJit(prog, &jit);
+    job.jit = &jit;
+  }
+  TRACE_BEGIN(evalSpan);
+  runThreadPool(pool, evalSamples, &job, n, POOL_CHUNK_COLUMNS);
+  TRACE_SAMPLES(job.ys, n);
+  TRACE_END(evalSpan, STAGE_EVAL);
+  samples->reused += keep;
+  samples->evaluated += n;
+  canvas->evaluations = (long)n;
+  TRACE_BEGIN(renderSpan);
+  size_t left = (shift > 0) ? cell : n + cell;
+  size_t right = (shift > 0) ? keep - cell : width - cell;
+  shiftRaster(canvas, shift);
+  clearRasterColumns(canvas, 0, left);
+  clearRasterColumns(canvas, right, width);
+  rasterSeries(canvas, ys, 0, left, seriesGlyph(0));
+  rasterSeries(canvas, ys, right, width, seriesGlyph(0));
+  TRACE_END(renderSpan, STAGE_RENDER);
+  samples->x0 = canvas->view.xMin;
+  if (job.jit == &jit) {
+    freeJit(&jit);
+  }
+}
+
+void fillCanvasSamples(Canvas *canvas, const Program *prog, SharedJit *shared,
+                       EvalMode mode, ThreadPool *pool, SampleCache *samples) {
+  Viewport *view = &canvas->view;
+  Viewport dots;
+  rasterGrid(view, &dots);
+  size_t width = (size_t)dots.width;
+  long shift = 0;
+  if (mode != EVAL_BATCH && mode != EVAL_JIT) {
+    resetSampleCache(samples);
+    fillCanvasProgram(canvas, prog, mode, pool);
+  } else if ((shift = panShift(samples, canvas, &dots)) != 0) {
+    panSamples(canvas, prog, shared, mode, pool, samples, shift);
   } else {
-    size_t len = strlen(input);
-    if (len > 0 && input[len - 1] == '\n') {
-      input[len - 1] = '\0';
+    JitProgram jit;
+    FillJob job;
+    FillJob miss;
+    size_t missCount = 0;
+    reserveSamples(samples, dots.width);
+    size_t cap = (size_t)samples->capacity;
+    job.canvas = canvas;
+    job.prog = prog;
+    job.jit = NULL;
+    job.count = 1;
+    job.mode = mode;
+    job.dys = NULL;
+    job.stride = cap;
+    job.evaluations = NULL;
+    job.xs = samples->next;
+    job.ys = samples->next + cap;
+    miss = job;
+    miss.xs = samples->miss;
+    miss.ys = samples->miss + cap;
+    double invStep = (samples->step > 0.0) ? 1.0 / samples->step : 1.0;
+    for (size_t c = 0; c < width; c++) {
+      job.xs[c] = columnX(&dots, (int)c);
+      if (!findSample(samples, invStep, job.xs[c], &job.ys[c])) {
+        miss.xs[missCount] = job.xs[c];
+        samples->missCols[missCount++] = c;
+      }
+    }
+    if (missCount > 0 && mode == EVAL_JIT && shared != NULL) {
+      miss.jit = &shared->jit;
+    } else if (missCount > 0 && mode == EVAL_JIT) {
+      compileJit(prog, &jit);
+      miss.jit = &jit;
+    }
+    TRACE_BEGIN(evalSpan);
+    runThreadPool(pool, evalSamples, &miss, missCount, POOL_CHUNK_COLUMNS);
+    TRACE_SAMPLES(miss.ys, missCount);
+    TRACE_END(evalSpan, STAGE_EVAL);
+    for (size_t i = 0; i < missCount; i++) {
+      job.ys[samples->missCols[i]] = miss.ys[i];
     }
-    TokenArray infix;
-    TokenArray postfix;
-    initTokenArray(&infix);
-    initTokenArray(&postfix);
-    tokenize(input, &infix);
-    toRPN(&infix, &postfix);
-    char canvas[25][80];
-    fillCanvas(canvas, &postfix);
-    printCanvas(canvas);
-    freeTokenArray(&infix);
-    freeTokenArray(&postfix);
-    retVal = 0;
-  }
-  return retVal;
+    samples->reused += width - missCount;
+    samples->evaluated += missCount;
+    canvas->evaluations = (long)missCount;
+    TRACE_BEGIN(renderSpan);
+    clearRaster(canvas);
+    if (view->autoscaleY) {
+      autoscaleRange(view, job.ys, width);
+    }
+    runThreadPool(pool, plotColumns, &job, width, POOL_CHUNK_COLUMNS);
+    TRACE_END(renderSpan, STAGE_RENDER);
+    samples->next = samples->cur;
+    samples->cur = job.xs;
+    samples->count = dots.width;
+    samples->x0 = view->xMin;
+    samples->step = (dots.width > 1) ? (view->xMax - view->xMin) /
+                                           (double)(dots.width - 1)
+                                     : 0.0;
+    samples->view = *view;
+    samples->cells = canvas->cells;
+    if (miss.jit == &jit) {
+      freeJit(&jit);
+    }
+  }
 }
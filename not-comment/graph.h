@@ -1,10 +1,15 @@
 #ifndef GRAPH_H
 #define GRAPH_H
 
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 typedef enum {
   TOKEN_NUMBER,
@@ -21,7 +26,8 @@ typedef enum {
   TOKEN_CTG,
   TOKEN_SQRT,
   TOKEN_LN,
-  TOKEN_UMINUS
+  TOKEN_UMINUS,
+  TOKEN_VAR
 } TokenType;
 
 typedef struct {
@@ -29,39 +35,565 @@ typedef struct {
   double value;
 } Token;
 
+typedef struct ArenaBlock {
+  struct ArenaBlock *prev;
+  size_t size;
+  size_t used;
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock *block;
+  size_t total;
+} Arena;
+
 typedef struct {
   Token *data;
   int size;
   int capacity;
+  Arena *arena;
+  int depth;
 } TokenArray;
 
 typedef struct {
-  Token *data;
-  int top;
+  TokenArray *arr;
+  int first;
+  char *tail;
+  size_t tailLen;
+  size_t tailCap;
+  long offset;
+  long errorPos;
+  char errorChar;
+  long *columns;
+  int columnsCap;
+} LexStream;
+
+typedef struct {
+  TokenType type;
+  int left;
+  int right;
+  double value;
+} ExprNode;
+
+typedef struct {
+  ExprNode *nodes;
+  int size;
+  int root;
+  Arena *arena;
+  long errorPos;
+  const char *error;
+} ExprAst;
+
+typedef enum {
+  OP_CONST,
+  OP_X,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_NEG,
+  OP_SIN,
+  OP_COS,
+  OP_TAN,
+  OP_CTG,
+  OP_SQRT,
+  OP_LN,
+  OP_LOAD,
+  OP_STORE,
+  OP_VAR,
+  OP_FAST_SIN,
+  OP_FAST_COS,
+  OP_FAST_TAN,
+  OP_FAST_CTG,
+  OP_FAST_LN
+} OpCode;
+
+#define VAR_COUNT 26
+#define VAR_Y ('y' - 'a')
+#define RPN_STACK_SIZE 256
+#define LEX_CHUNK 65536
+#define PROGRAM_SMALL_STACK 256
+#define BATCH_LANES 64
+#define BATCH_SMALL_DEPTH 32
+#define FAST_TRIG_MAX 1e6
+#define GRID_TILE_ROWS 8
+#define HEATMAP_RAMP " .:-=+*#%@"
+#define CONTOUR_LEVELS 8
+
+typedef struct {
+  unsigned char *code;
+  int codeSize;
+  int codeCapacity;
+  double *consts;
+  int constCount;
+  int constCapacity;
+  int slotCount;
+  int maxDepth;
+} Program;
+
+typedef void (*JitFn)(const double *xs, double *ys, long n, double *frame);
+
+typedef struct {
+  const Program *source;
+  JitFn fn;
+  void *mem;
+  size_t memSize;
+} JitProgram;
+
+typedef struct {
+  Program prog;
+  JitProgram jit;
+  atomic_int refs;
+} SharedJit;
+
+#define LIBRARY_MAGIC "GRAPHLIB"
+#define LIBRARY_VERSION 1
+#define LIBRARY_BYTE_ORDER 0x01020304u
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint64_t frameCount;
+  uint64_t programCount;
+  uint64_t framesOffset;
+  uint64_t programsOffset;
+} LibraryHeader;
+
+typedef struct {
+  uint64_t keyOffset;
+  uint32_t keyLength;
+  uint32_t firstProgram;
+  uint32_t programCount;
+  uint32_t reserved;
+} LibraryFrame;
+
+typedef struct {
+  uint64_t codeOffset;
+  uint64_t constOffset;
+  uint32_t codeSize;
+  uint32_t constCount;
+  uint32_t slotCount;
+  uint32_t maxDepth;
+} LibraryProgram;
+
+typedef struct {
+  const unsigned char *map;
+  size_t size;
+  const LibraryFrame *frames;
+  const LibraryProgram *programs;
+  int frameCount;
+  int programCount;
+} ProgramLibrary;
+
+typedef struct {
+  LibraryFrame *frames;
+  int frameCount;
+  int frameCapacity;
+  LibraryProgram *programs;
+  int programCount;
+  int programCapacity;
+  unsigned char *data;
+  size_t dataSize;
+  size_t dataCapacity;
+} LibraryWriter;
+
+typedef enum {
+  EVAL_BATCH,
+  EVAL_JIT,
+  EVAL_INTERVAL,
+  EVAL_ADAPTIVE,
+  EVAL_DERIVATIVE,
+  EVAL_HEATMAP,
+  EVAL_CONTOUR
+} EvalMode;
+
+typedef enum {
+  PRECISION_EXACT,
+  PRECISION_FAST
+} MathPrecision;
+
+typedef struct {
+  int var;
+  double from;
+  double to;
+  int frames;
+} ParamSweep;
+
+typedef struct {
+  double lo;
+  double hi;
+} Interval;
+
+#define INTERVAL_MAX_DEPTH 10
+
+typedef struct {
+  double v;
+  double d;
+} Dual;
+
+#define ADAPTIVE_MAX_SAMPLES 32
+
+#define ADAPTIVE_SPAN 16
+
+typedef enum {
+  RASTER_POINTS,
+  RASTER_LINES,
+  RASTER_BRAILLE
+} RasterStyle;
+
+#define BRAILLE_BYTES 3
+
+typedef struct {
+  int width;
+  int height;
+  double xMin;
+  double xMax;
+  double yMin;
+  double yMax;
+  int autoscaleY;
+  RasterStyle raster;
+} Viewport;
+
+typedef struct {
+  Viewport view;
+  char *cells;
+  size_t stride;
+  long evaluations;
+} Canvas;
+
+typedef struct {
+  int fd;
+  char *map;
+  size_t mapSize;
+  size_t used;
+  int failed;
+} FrameSink;
+
+#define FRAME_MAP_INITIAL (1 << 20)
+
+#define SAMPLE_MATCH_EPS 1e-9
+
+typedef struct {
+  double *cur;
+  double *next;
+  double *miss;
+  size_t *missCols;
+  int capacity;
+  int count;
+  double x0;
+  double step;
+  Viewport view;
+  const char *cells;
+  unsigned long reused;
+  unsigned long evaluated;
+} SampleCache;
+
+#define POOL_CHUNK_COLUMNS 1024
+
+#define SERIES_BLOCK_COLUMNS 256
+
+typedef void (*PoolTask)(void *arg, size_t begin, size_t end);
+
+typedef struct {
+  pthread_t *threads;
+  int threadCount;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  PoolTask task;
+  void *arg;
+  size_t total;
+  size_t chunk;
+  size_t next;
+  int active;
+  unsigned long generation;
+  int stop;
+} ThreadPool;
+
+typedef struct {
+  unsigned long nodes;
+  unsigned long folded;
+} FoldStats;
+
+typedef struct {
+  char *key;
+  unsigned int hash;
+  Program prog;
+  int hasProgram;
+  SharedJit *jit;
+  char *frame;
+  Viewport frameView;
+  int chain;
+  int newer;
+  int older;
+} CacheEntry;
+
+typedef struct {
+  CacheEntry *entries;
+  int size;
   int capacity;
-} TokenStack;
+  int *buckets;
+  int bucketCount;
+  int newest;
+  int oldest;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  FoldStats fold;
+} ExprCache;
+
+typedef struct {
+  Viewport view;
+  EvalMode mode;
+  int cacheSize;
+  int cacheFrames;
+  int cacheStats;
+  const ProgramLibrary *library;
+  double vars[VAR_COUNT];
+  ParamSweep sweep;
+  MathPrecision precision;
+} BatchConfig;
+
+typedef struct {
+  unsigned char op;
+  int a;
+  int b;
+  double value;
+  int uses;
+  int next;
+} DagNode;
+
+typedef struct {
+  DagNode *nodes;
+  int size;
+  int capacity;
+  int *buckets;
+  int bucketCount;
+  int root;
+} ExprDag;
+
+typedef enum {
+  STAGE_LEX,
+  STAGE_PARSE,
+  STAGE_EVAL,
+  STAGE_RENDER,
+  STAGE_OUTPUT,
+  STAGE_COUNT
+} TraceStage;
+
+typedef enum {
+  COUNTER_TOKENS,
+  COUNTER_FOLDED,
+  COUNTER_RPN_STACK,
+  COUNTER_PROGRAM_DEPTH,
+  COUNTER_SAMPLES,
+  COUNTER_NAN,
+  COUNTER_INF,
+  COUNTER_OFF_CANVAS,
+  COUNTER_COUNT
+} TraceCounter;
+
+typedef struct {
+  double ns;
+  unsigned long long cycles;
+} TraceSpan;
+
+#ifdef GRAPH_TRACE
+#define TRACE_LOCAL(code) code
+#define TRACE_BEGIN(span) TraceSpan span; traceBegin(&span)
+#define TRACE_END(span, stage) traceEnd(&span, stage)
+#define TRACE_COUNT(counter, n) traceCount(counter, n)
+#define TRACE_MAX(counter, v) traceMax(counter, v)
+#define TRACE_SAMPLES(ys, n) traceSamples(ys, n)
+#else
+#define TRACE_LOCAL(code)
+#define TRACE_BEGIN(span)
+#define TRACE_END(span, stage) ((void)0)
+#define TRACE_COUNT(counter, n) ((void)0)
+#define TRACE_MAX(counter, v) ((void)0)
+#define TRACE_SAMPLES(ys, n) ((void)0)
+#ifdef GRAPH_TRACE
+void traceBegin(TraceSpan *span);
+void traceEnd(const TraceSpan *span, TraceStage stage);
+void traceCount(TraceCounter counter, unsigned long long n);
+void traceMax(TraceCounter counter, unsigned long long v);
+void traceSamples(const double *ys, size_t n);
+#endif
+int traceReport(FILE *summary, const char *jsonPath);
+
+#endif
+
+void initArena(Arena *arena, size_t size);
+void *arenaAlloc(Arena *arena, size_t bytes);
+void resetArena(Arena *arena);
+void freeArena(Arena *arena);
+size_t exprArenaSize(size_t len);
 
 void initTokenArray(TokenArray *arr);
+void initTokenArrayArena(TokenArray *arr, Arena *arena, int cap);
 void pushTokenArray(TokenArray *arr, Token t);
 void freeTokenArray(TokenArray *arr);
 
-void initTokenStack(TokenStack *st, int cap);
-void pushTokenStack(TokenStack *st, Token t);
-Token popTokenStack(TokenStack *st);
-Token peekTokenStack(const TokenStack *st);
-int isStackEmpty(const TokenStack *st);
-void freeTokenStack(TokenStack *st);
-
 int precedence(TokenType t);
 int isFunction(TokenType t);
 int isOperator(TokenType t);
+int isOperand(TokenType t);
 Token makeToken(TokenType type, double val);
 
-void tokenize(const char *str, TokenArray *arr);
-void toRPN(const TokenArray *infix, TokenArray *postfix);
+int tokenize(const char *str, TokenArray *arr);
+int lexToken(const char *s, Token *t);
+void initLexStream(LexStream *ls, TokenArray *arr);
+void feedLexStream(LexStream *ls, const char *data, size_t n);
+long finishLexStream(LexStream *ls);
+long lexColumn(const LexStream *ls, long token);
+void freeLexStream(LexStream *ls);
+int parseExpr(const char *str, Arena *arena, ExprAst *ast);
+int parseTokens(const TokenArray *infix, Arena *arena, ExprAst *ast);
+int foldAst(ExprAst *ast);
+void countFold(ExprAst *ast, FoldStats *stats);
+void printFoldStats(const FoldStats *stats);
+void lowerAst(const ExprAst *ast, TokenArray *postfix);
+int rpnDepth(const TokenArray *postfix);
 double computeFunction(TokenType t, double val);
 double evalRPN(const TokenArray *postfix, double xval);
-void fillCanvas(char canvas[25][80], const TokenArray *postfix);
-void printCanvas(char canvas[25][80]);
+void initViewport(Viewport *view);
+void initCanvas(Canvas *canvas, const Viewport *view);
+void freeCanvas(Canvas *canvas);
+double columnX(const Viewport *view, int c);
+double rowY(const Viewport *view, int r);
+char seriesGlyph(int s);
+void fillCanvas(Canvas *canvas, const TokenArray *postfix, EvalMode mode,
+                ThreadPool *pool);
+void fillCanvasProgram(Canvas *canvas, const Program *prog, EvalMode mode,
+                       ThreadPool *pool);
+void fillCanvasPrograms(Canvas *canvas, const Program *progs,
+                        SharedJit *const *jits, int count, EvalMode mode,
+                        ThreadPool *pool);
+int countSeries(const char *text);
+void rasterGrid(const Viewport *view, Viewport *dots);
+size_t rasterCellBytes(const Viewport *view);
+void clearRaster(Canvas *canvas);
+void clearRasterColumns(Canvas *canvas, size_t begin, size_t end);
+void shiftRaster(Canvas *canvas, long shift);
+void rasterSeries(Canvas *canvas, const double *ys, size_t begin, size_t end,
+                  char glyph);
+void initVars(double *vars);
+int parseVar(const char *text, double *vars);
+int parseSweep(const char *text, ParamSweep *sweep);
+void sweepVars(const ParamSweep *sweep, int step, double *vars);
+int isGridMode(EvalMode mode);
+void fillCanvasGrid(Canvas *canvas, const Program *progs, int count,
+                    EvalMode mode, ThreadPool *pool);
+void initSampleCache(SampleCache *samples);
+void resetSampleCache(SampleCache *samples);
+void freeSampleCache(SampleCache *samples);
+void fillCanvasSamples(Canvas *canvas, const Program *prog, SharedJit *jit,
+                       EvalMode mode, ThreadPool *pool, SampleCache *samples);
+int openFrameSink(FrameSink *sink, const char *path);
+int writeFrame(FrameSink *sink, const Canvas *canvas, int separate);
+int closeFrameSink(FrameSink *sink);
+int runBatch(FILE *in, const BatchConfig *cfg, ThreadPool *pool,
+             FrameSink *out);
+int compileLibrary(FILE *in, const char *path, int cacheSize);
+int compileSeries(ExprCache *cache, Arena *scratch, char *key,
+                  const long *columns, Program **progs);
+SharedJit **shareSeriesJit(ExprCache *cache, char *key, const Program *progs,
+                           int count);
+int parseBatchCommand(const char *line, Viewport *view, double *vars);
+int runServer(const char *path, const BatchConfig *cfg, int workers);
+
+void initProgram(Program *prog);
+void freeProgram(Program *prog);
+void copyProgram(Program *dst, const Program *src);
+void emitProgramByte(Program *prog, unsigned char b);
+void emitProgramIndex(Program *prog, unsigned int idx);
+unsigned int addProgramConst(Program *prog, double v);
+int compileRPN(const TokenArray *postfix, Program *prog);
+int compileAst(const ExprAst *ast, Program *prog);
+double evalProgram(const Program *prog, double xval);
+void setProgramPrecision(Program *progs, int count, MathPrecision precision);
+TokenType opToken(unsigned char op);
+double fastSin(double x);
+double fastCos(double x);
+double fastTan(double x);
+double fastCtg(double x);
+double fastLog(double x);
+void fastSinLanes(double *restrict a);
+void fastCosLanes(double *restrict a);
+void fastTanLanes(double *restrict a);
+void fastCtgLanes(double *restrict a);
+void fastLogLanes(double *restrict a);
+unsigned int programVars(const Program *prog);
+void bindProgram(const Program *src, const double *vars, unsigned int keep,
+                 Program *dst);
+Program *bindPrograms(const Program *progs, int count, const double *vars,
+                      EvalMode mode);
+void freeBoundPrograms(Program *bound, int count);
+void initLibraryWriter(LibraryWriter *w);
+void freeLibraryWriter(LibraryWriter *w);
+void addLibraryFrame(LibraryWriter *w, const char *key, const Program *progs,
+                     int count);
+int saveLibrary(const LibraryWriter *w, const char *path);
+int openProgramLibrary(ProgramLibrary *lib, const char *path);
+void closeProgramLibrary(ProgramLibrary *lib);
+const char *libraryKey(const ProgramLibrary *lib, int f);
+int libraryProgram(const ProgramLibrary *lib, int p, Program *prog);
+void evalProgramBatch(const Program *prog, const double *xs, double *ys,
+                      size_t n);
+void evalRPNBatch(const TokenArray *postfix, const double *xs, double *ys,
+                  size_t n);
+void evalProgramGrid(const Program *prog, const double *xs, size_t n,
+                     const double *ys, size_t rows, double *out);
+
+void initExprDag(ExprDag *dag);
+void freeExprDag(ExprDag *dag);
+int buildExprDag(const TokenArray *postfix, ExprDag *dag);
+int buildAstDag(const ExprAst *ast, ExprDag *dag);
+void compileExprDag(ExprDag *dag, Program *prog);
+
+int compileJit(const Program *prog, JitProgram *jit);
+void freeJit(JitProgram *jit);
+void evalJitBatch(const JitProgram *jit, const double *xs, double *ys,
+                  size_t n);
+double evalJit(const JitProgram *jit, double xval);
+SharedJit *shareJit(const Program *prog);
+SharedJit *holdJit(SharedJit *shared);
+void releaseJit(SharedJit *shared);
+SharedJit **shareJits(const Program *progs, int count);
+void releaseJits(SharedJit **jits, int count);
+
+int intervalEmpty(Interval v);
+Interval computeOperatorInterval(TokenType t, Interval a, Interval b);
+Interval computeFunctionInterval(TokenType t, Interval v);
+Interval evalRPNInterval(const TokenArray *postfix, Interval x);
+Interval evalProgramInterval(const Program *prog, Interval x);
+void plotIntervalColumn(Canvas *canvas, const Program *prog, int c,
+                        char glyph);
+
+Dual computeOperatorDual(TokenType t, Dual a, Dual b);
+Dual computeFunctionDual(TokenType t, Dual a);
+Dual evalRPNDual(const TokenArray *postfix, double xval);
+Dual evalProgramDual(const Program *prog, double xval);
+
+size_t normalizeExpr(const char *src, char *dst, long *columns);
+void initExprCache(ExprCache *cache, int capacity);
+void freeExprCache(ExprCache *cache);
+CacheEntry *findExprCache(ExprCache *cache, const char *key);
+CacheEntry *peekExprCache(ExprCache *cache, const char *key);
+CacheEntry *addExprCache(ExprCache *cache, const char *key);
+
+int initThreadPool(ThreadPool *pool, int threads);
+void freeThreadPool(ThreadPool *pool);
+void runThreadPool(ThreadPool *pool, PoolTask task, void *arg, size_t total,
+                   size_t chunk);
+
+#ifdef GRAPH_TRACE
+void traceBegin(TraceSpan *span);
+void traceEnd(const TraceSpan *span, TraceStage stage);
+void traceCount(TraceCounter counter, unsigned long long n);
+void traceMax(TraceCounter counter, unsigned long long v);
+void traceSamples(const double *ys, size_t n);
+#endif
+int traceReport(FILE *summary, const char *jsonPath);
 
 #endif
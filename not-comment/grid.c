@@ -0,0 +1,139 @@
+#include "graph.h"
+
+typedef struct {
+  Canvas *canvas;
+  const Program *prog;
+  int count;
+  EvalMode mode;
+  double *xs;
+  double *ys;
+  double *values;
+  double *lo;
+  double *hi;
+} GridJob;
+
+int isGridMode(EvalMode mode) {
+  return (mode == EVAL_HEATMAP || mode == EVAL_CONTOUR);
+}
+
+static void evalTiles(void *arg, size_t begin, size_t end) {
+  GridJob *job = (GridJob *)arg;
+  size_t width = (size_t)job->canvas->view.width;
+  size_t cells = width * (size_t)job->canvas->view.height;
+  for (int s = 0; s < job->count; s++) {
+    evalProgramGrid(&job->prog[s], job->xs, width, job->ys + begin,
+                    end - begin, job->values + s * cells + begin * width);
+  }
+}
+
+static void valueRange(const double *vs, size_t n, double *lo, double *hi) {
+  *lo = INFINITY;
+  *hi = -INFINITY;
+  for (size_t i = 0; i < n; i++) {
+    if (isfinite(vs[i])) {
+      *lo = (vs[i] < *lo) ? vs[i] : *lo;
+      *hi = (vs[i] > *hi) ? vs[i] : *hi;
+    }
+  }
+}
+
+static double valueShare(double v, double lo, double hi) {
+  return (hi > lo) ? (v - lo) / (hi - lo) : 0.5;
+}
+
+static char heatGlyph(double v, double lo, double hi) {
+  int last = (int)sizeof(HEATMAP_RAMP) - 2;
+  int k = 0;
+  if (isfinite(v)) {
+    k = (int)(valueShare(v, lo, hi) * last + 0.5);
+    k = (k < 0) ? 0 : (k > last ? last : k);
+  }
+  return HEATMAP_RAMP[k];
+}
+
+static int contourBand(double v, double lo, double hi) {
+  int band = -1;
+  if (isfinite(v)) {
+    band = (int)floor(valueShare(v, lo, hi) * CONTOUR_LEVELS);
+    band = (band < 0) ? 0 : (band >= CONTOUR_LEVELS ? CONTOUR_LEVELS - 1
+                                                    : band);
+  }
+  return band;
+}
+
+static int crossesLevel(double a, double b, double lo, double hi) {
+  int ba = contourBand(a, lo, hi);
+  int bb = contourBand(b, lo, hi);
+  return ba >= 0 && bb >= 0 && ba != bb;
+}
+
+static void renderRows(void *arg, size_t begin, size_t end) {
+  GridJob *job = (GridJob *)arg;
+  Canvas *canvas = job->canvas;
+  size_t width = (size_t)canvas->view.width;
+  size_t height = (size_t)canvas->view.height;
+  for (size_t r = begin; r < end; r++) {
+    char *row = canvas->cells + r * canvas->stride;
+    const double *vs = job->values + r * width;
+    if (job->mode == EVAL_HEATMAP) {
+      for (size_t c = 0; c < width; c++) {
+        row[c] = heatGlyph(vs[c], job->lo[0], job->hi[0]);
+      }
+    } else {
+      memset(row, '.', width);
+      for (int s = 0; s < job->count; s++) {
+        const double *v = vs + (size_t)s * width * height;
+        for (size_t c = 0; c < width; c++) {
+          if ((c + 1 < width &&
+               crossesLevel(v[c], v[c + 1], job->lo[s], job->hi[s])) ||
+              (r + 1 < height &&
+               crossesLevel(v[c], v[c + width], job->lo[s], job->hi[s]))) {
+            row[c] = seriesGlyph(s);
+          }
+        }
+      }
+    }
+  }
+}
+
+void fillCanvasGrid(Canvas *canvas, const Program *progs, int count,
+                    EvalMode mode, ThreadPool *pool) {
+  const Viewport *view = &canvas->view;
+  size_t width = (size_t)view->width;
+  size_t height = (size_t)view->height;
+  size_t cells = width * height;
+  if (mode == EVAL_HEATMAP) {
+    count = 1;
+  }
+  GridJob job;
+  job.canvas = canvas;
+  job.prog = progs;
+  job.count = count;
+  job.mode = mode;
+  job.xs = (double *)malloc(sizeof(double) * width);
+  job.ys = (double *)malloc(sizeof(double) * height);
+  job.values = (double *)malloc(sizeof(double) * cells * count);
+  job.lo = (double *)malloc(sizeof(double) * count);
+  job.hi = (double *)malloc(sizeof(double) * count);
+  for (size_t c = 0; c < width; c++) {
+    job.xs[c] = columnX(view, (int)c);
+  }
+  for (size_t r = 0; r < height; r++) {
+    job.ys[r] = rowY(view, (int)r);
+  }
+  TRACE_BEGIN(evalSpan);
+  runThreadPool(pool, evalTiles, &job, height, GRID_TILE_ROWS);
+  TRACE_SAMPLES(job.values, cells * count);
+  TRACE_END(evalSpan, STAGE_EVAL);
+  TRACE_BEGIN(renderSpan);
+  for (int s = 0; s < count; s++) {
+    valueRange(job.values + s * cells, cells, &job.lo[s], &job.hi[s]);
+  }
+  runThreadPool(pool, renderRows, &job, height, GRID_TILE_ROWS);
+  TRACE_END(renderSpan, STAGE_RENDER);
+  free(job.xs);
+  free(job.ys);
+  free(job.values);
+  free(job.lo);
+  free(job.hi);
+}
@@ -0,0 +1,330 @@
+#include "graph.h"
+
+#include <sys/mman.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)
+
+typedef struct {
+  unsigned char *bytes;
+  int size;
+  int capacity;
+  int *fixups;
+  int *fixupConsts;
+  int fixupCount;
+  int fixupCapacity;
+} CodeBuf;
+
+#define JIT_ONE(prog) ((prog)->constCount)
+
+static void emitBytes(CodeBuf *buf, const unsigned char *src, int n) {
+  while (buf->size + n > buf->capacity) {
+    buf->capacity *= 2;
+    buf->bytes = (unsigned char *)realloc(buf->bytes, buf->capacity);
+  }
+  memcpy(buf->bytes + buf->size, src, n);
+  buf->size += n;
+}
+
+static void emitInt32(CodeBuf *buf, int v) {
+  unsigned char bytes[4];
+  memcpy(bytes, &v, sizeof(bytes));
+  emitBytes(buf, bytes, 4);
+}
+
+static void emitFrameAccess(CodeBuf *buf, unsigned char opcode, int cell) {
+  unsigned char ins[] = {0xF2, 0x0F, opcode, 0x83};
+  emitBytes(buf, ins, sizeof(ins));
+  emitInt32(buf, 8 * cell);
+}
+
+static void emitConstLoad(CodeBuf *buf, int constIdx) {
+  static const unsigned char ins[] = {0xF2, 0x0F, 0x10, 0x05};
+  emitBytes(buf, ins, sizeof(ins));
+  if (buf->fixupCount == buf->fixupCapacity) {
+    buf->fixupCapacity *= 2;
+    buf->fixups = (int *)realloc(buf->fixups,
+                                 sizeof(int) * buf->fixupCapacity);
+    buf->fixupConsts = (int *)realloc(buf->fixupConsts,
+                                      sizeof(int) * buf->fixupCapacity);
+  }
+  buf->fixups[buf->fixupCount] = buf->size;
+  buf->fixupConsts[buf->fixupCount] = constIdx;
+  buf->fixupCount++;
+  emitInt32(buf, 0);
+}
+
+static void emitCall(CodeBuf *buf, double (*fn)(double)) {
+  static const unsigned char movRax[] = {0x48, 0xB8};
+  static const unsigned char callRax[] = {0xFF, 0xD0};
+  uint64_t addr = (uint64_t)(uintptr_t)fn;
+  unsigned char imm[8];
+  memcpy(imm, &addr, sizeof(imm));
+  emitBytes(buf, movRax, sizeof(movRax));
+  emitBytes(buf, imm, sizeof(imm));
+  emitBytes(buf, callRax, sizeof(callRax));
+}
+
+static void emitBinary(CodeBuf *buf, unsigned char op, int cell) {
+  static const unsigned char movapd[] = {0x66, 0x0F, 0x28, 0xC8};
+  unsigned char arith[] = {0xF2, 0x0F, 0x58, 0xC1};
+  if (op == OP_SUB) {
+    arith[2] = 0x5C;
+  } else if (op == OP_MUL) {
+    arith[2] = 0x59;
+  } else if (op == OP_DIV) {
+    arith[2] = 0x5E;
+  }
+  emitBytes(buf, movapd, sizeof(movapd));
+  emitFrameAccess(buf, 0x10, cell);
+  emitBytes(buf, arith, sizeof(arith));
+}
+
+static void emitUnary(CodeBuf *buf, const Program *prog, unsigned char op) {
+  static const unsigned char neg[] = {
+      0x66, 0x48, 0x0F, 0x7E, 0xC0,
+      0x48, 0x0F, 0xBA, 0xF8, 0x3F,
+      0x66, 0x48, 0x0F, 0x6E, 0xC0};
+  static const unsigned char sqrtsd[] = {0xF2, 0x0F, 0x51, 0xC0};
+  static const unsigned char movapd[] = {0x66, 0x0F, 0x28, 0xC8};
+  static const unsigned char divsd[] = {0xF2, 0x0F, 0x5E, 0xC1};
+  if (op == OP_NEG) {
+    emitBytes(buf, neg, sizeof(neg));
+  } else if (op == OP_SQRT) {
+    emitBytes(buf, sqrtsd, sizeof(sqrtsd));
+  } else if (op == OP_SIN) {
+    emitCall(buf, sin);
+  } else if (op == OP_COS) {
+    emitCall(buf, cos);
+  } else if (op == OP_LN) {
+    emitCall(buf, log);
+  } else if (op == OP_FAST_SIN) {
+    emitCall(buf, fastSin);
+  } else if (op == OP_FAST_COS) {
+    emitCall(buf, fastCos);
+  } else if (op == OP_FAST_TAN) {
+    emitCall(buf, fastTan);
+  } else if (op == OP_FAST_CTG) {
+    emitCall(buf, fastCtg);
+  } else if (op == OP_FAST_LN) {
+    emitCall(buf, fastLog);
+  } else {
+    emitCall(buf, tan);
+    if (op == OP_CTG) {
+      emitBytes(buf, movapd, sizeof(movapd));
+      emitConstLoad(buf, JIT_ONE(prog));
+      emitBytes(buf, divsd, sizeof(divsd));
+    }
+  }
+}
+
+static void emitBody(CodeBuf *buf, const Program *prog) {
+  const unsigned char *code = prog->code;
+  const unsigned char *end = code + prog->codeSize;
+  int slotBase = 1 + prog->maxDepth;
+  unsigned int idx = 0;
+  int depth = 0;
+  while (code < end) {
+    unsigned char op = *code++;
+    if (op == OP_CONST || op == OP_X || op == OP_LOAD) {
+      if (depth > 0) {
+        emitFrameAccess(buf, 0x11, depth);
+      }
+      depth++;
+    }
+    if (op == OP_CONST || op == OP_LOAD || op == OP_STORE) {
+      memcpy(&idx, code, sizeof(idx));
+      code += sizeof(idx);
+    }
+    if (op == OP_CONST) {
+      emitConstLoad(buf, (int)idx);
+    } else if (op == OP_X) {
+      emitFrameAccess(buf, 0x10, 0);
+    } else if (op == OP_LOAD) {
+      emitFrameAccess(buf, 0x10, slotBase + (int)idx);
+    } else if (op == OP_STORE) {
+      emitFrameAccess(buf, 0x11, slotBase + (int)idx);
+    } else if (op >= OP_ADD && op <= OP_DIV) {
+      depth--;
+      emitBinary(buf, op, depth);
+    } else {
+      emitUnary(buf, prog, op);
+    }
+  }
+}
+
+static void emitFunction(CodeBuf *buf, const Program *prog) {
+  static const unsigned char prologue[] = {
+      0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56,
+      0x48, 0x83, 0xEC, 0x08,
+      0x48, 0x89, 0xCB,
+      0x49, 0x89, 0xFC,
+      0x49, 0x89, 0xF5,
+      0x49, 0x89, 0xD6,
+      0x4D, 0x85, 0xF6,
+      0x0F, 0x8E};
+  static const unsigned char loadX[] = {
+      0xF2, 0x41, 0x0F, 0x10, 0x04, 0x24};
+  static const unsigned char next[] = {
+      0xF2, 0x41, 0x0F, 0x11, 0x45, 0x00,
+      0x49, 0x83, 0xC4, 0x08,
+      0x49, 0x83, 0xC5, 0x08,
+      0x49, 0xFF, 0xCE,
+      0x0F, 0x85};
+  static const unsigned char epilogue[] = {
+      0x48, 0x83, 0xC4, 0x08,
+      0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B,
+      0xC3};
+  emitBytes(buf, prologue, sizeof(prologue));
+  int skipAt = buf->size;
+  emitInt32(buf, 0);
+  int loopAt = buf->size;
+  emitBytes(buf, loadX, sizeof(loadX));
+  emitFrameAccess(buf, 0x11, 0);
+  emitBody(buf, prog);
+  emitBytes(buf, next, sizeof(next));
+  emitInt32(buf, loopAt - (buf->size + 4));
+  int skip = buf->size - (skipAt + 4);
+  memcpy(buf->bytes + skipAt, &skip, sizeof(skip));
+  emitBytes(buf, epilogue, sizeof(epilogue));
+}
+
+static int jitLink(const CodeBuf *buf, const Program *prog, JitProgram *jit) {
+  size_t dataAt = ((size_t)buf->size + 15) & ~(size_t)15;
+  size_t total = dataAt + sizeof(double) * (prog->constCount + 1);
+  unsigned char *mem = (unsigned char *)mmap(NULL, total,
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS,
+                                             -1, 0);
+  int ok = (mem != MAP_FAILED);
+  if (ok) {
+    double one = 1.0;
+    memcpy(mem, buf->bytes, buf->size);
+    memcpy(mem + dataAt, prog->consts, sizeof(double) * prog->constCount);
+    memcpy(mem + dataAt + sizeof(double) * prog->constCount, &one,
+           sizeof(one));
+    for (int i = 0; i < buf->fixupCount; i++) {
+      int rel = (int)(dataAt + sizeof(double) * buf->fixupConsts[i]) -
+                (buf->fixups[i] + 4);
+      memcpy(mem + buf->fixups[i], &rel, sizeof(rel));
+    }
+    ok = (mprotect(mem, total, PROT_READ | PROT_EXEC) == 0);
+    if (ok) {
+      jit->mem = mem;
+      jit->memSize = total;
+      jit->fn = (JitFn)mem;
+    } else {
+      munmap(mem, total);
+    }
+  }
+  return ok;
+}
+
+int compileJit(const Program *prog, JitProgram *jit) {
+  int ok = 0;
+  jit->source = prog;
+  jit->fn = NULL;
+  jit->mem = NULL;
+  jit->memSize = 0;
+  if (prog->codeSize > 0 &&
+      programVars(prog) == 0) {
+    CodeBuf buf;
+    buf.size = 0;
+    buf.capacity = 256;
+    buf.bytes = (unsigned char *)malloc(buf.capacity);
+    buf.fixupCount = 0;
+    buf.fixupCapacity = 16;
+    buf.fixups = (int *)malloc(sizeof(int) * buf.fixupCapacity);
+    buf.fixupConsts = (int *)malloc(sizeof(int) * buf.fixupCapacity);
+    emitFunction(&buf, prog);
+    ok = jitLink(&buf, prog, jit);
+    free(buf.bytes);
+    free(buf.fixups);
+    free(buf.fixupConsts);
+  }
+  return ok;
+}
+
+#else
+
+int compileJit(const Program *prog, JitProgram *jit) {
+  jit->source = prog;
+  jit->fn = NULL;
+  jit->mem = NULL;
+  jit->memSize = 0;
+  return 0;
+}
+
+#endif
+
+void freeJit(JitProgram *jit) {
+  if (jit->mem != NULL) {
+    munmap(jit->mem, jit->memSize);
+  }
+  jit->mem = NULL;
+  jit->memSize = 0;
+  jit->fn = NULL;
+}
+
+void evalJitBatch(const JitProgram *jit, const double *xs, double *ys,
+                  size_t n) {
+  if (jit->fn != NULL) {
+    const Program *prog = jit->source;
+    double small[PROGRAM_SMALL_STACK];
+    double *frame = small;
+    int frameSize = 1 + prog->maxDepth + prog->slotCount;
+    if (frameSize > PROGRAM_SMALL_STACK) {
+      frame = (double *)malloc(sizeof(double) * frameSize);
+    }
+    jit->fn(xs, ys, (long)n, frame);
+    if (frame != small) {
+      free(frame);
+    }
+  } else {
+    evalProgramBatch(jit->source, xs, ys, n);
+  }
+}
+
+double evalJit(const JitProgram *jit, double xval) {
+  double res = 0.0;
+  evalJitBatch(jit, &xval, &res, 1);
+  return res;
+}
+
+SharedJit *shareJit(const Program *prog) {
+  SharedJit *shared = (SharedJit *)malloc(sizeof(SharedJit));
+  copyProgram(&shared->prog, prog);
+  compileJit(&shared->prog, &shared->jit);
+  atomic_init(&shared->refs, 1);
+  return shared;
+}
+
+SharedJit *holdJit(SharedJit *shared) {
+  atomic_fetch_add(&shared->refs, 1);
+  return shared;
+}
+
+void releaseJit(SharedJit *shared) {
+  if (shared != NULL && atomic_fetch_sub(&shared->refs, 1) == 1) {
+    freeJit(&shared->jit);
+    freeProgram(&shared->prog);
+    free(shared);
+  }
+}
+
+SharedJit **shareJits(const Program *progs, int count) {
+  SharedJit **jits = (SharedJit **)malloc(sizeof(SharedJit *) * count);
+  for (int s = 0; s < count; s++) {
+    jits[s] = shareJit(&progs[s]);
+  }
+  return jits;
+}
+
+void releaseJits(SharedJit **jits, int count) {
+  if (jits != NULL) {
+    for (int s = 0; s < count; s++) {
+      releaseJit(jits[s]);
+    }
+    free(jits);
+  }
+}
@@ -0,0 +1,242 @@
+#include "graph.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void initLibraryWriter(LibraryWriter *w) {
+  w->frames = NULL;
+  w->frameCount = 0;
+  w->frameCapacity = 0;
+  w->programs = NULL;
+  w->programCount = 0;
+  w->programCapacity = 0;
+  w->data = NULL;
+  w->dataSize = 0;
+  w->dataCapacity = 0;
+}
+
+void freeLibraryWriter(LibraryWriter *w) {
+  free(w->frames);
+  free(w->programs);
+  free(w->data);
+  initLibraryWriter(w);
+}
+
+static uint64_t appendData(LibraryWriter *w, const void *src, size_t n,
+                           size_t align) {
+  size_t start = (w->dataSize + align - 1) / align * align;
+  if (start + n > w->dataCapacity) {
+    w->dataCapacity = w->dataCapacity ? 2 * w->dataCapacity : 4096;
+    while (start + n > w->dataCapacity) {
+      w->dataCapacity *= 2;
+    }
+    w->data = (unsigned char *)realloc(w->data, w->dataCapacity);
+  }
+  memset(w->data + w->dataSize, 0, start - w->dataSize);
+  memcpy(w->data + start, src, n);
+  w->dataSize = start + n;
+  return (uint64_t)start;
+}
+
+void addLibraryFrame(LibraryWriter *w, const char *key, const Program *progs,
+                     int count) {
+  if (w->frameCount == w->frameCapacity) {
+    w->frameCapacity = w->frameCapacity ? 2 * w->frameCapacity : 64;
+    w->frames = (LibraryFrame *)realloc(
+        w->frames, sizeof(LibraryFrame) * w->frameCapacity);
+  }
+  LibraryFrame *f = &w->frames[w->frameCount++];
+  f->keyLength = (uint32_t)strlen(key);
+  f->keyOffset = appendData(w, key, f->keyLength + 1, 1);
+  f->firstProgram = (uint32_t)w->programCount;
+  f->programCount = (uint32_t)count;
+  f->reserved = 0;
+  for (int s = 0; s < count; s++) {
+    if (w->programCount == w->programCapacity) {
+      w->programCapacity = w->programCapacity ? 2 * w->programCapacity : 64;
+      w->programs = (LibraryProgram *)realloc(
+          w->programs, sizeof(LibraryProgram) * w->programCapacity);
+    }
+    LibraryProgram *p = &w->programs[w->programCount++];
+    p->constOffset = appendData(w, progs[s].consts,
+                                sizeof(double) * progs[s].constCount,
+                                sizeof(double));
+    p->codeOffset = appendData(w, progs[s].code, progs[s].codeSize, 1);
+    p->codeSize = (uint32_t)progs[s].codeSize;
+    p->constCount = (uint32_t)progs[s].constCount;
+    p->slotCount = (uint32_t)progs[s].slotCount;
+    p->maxDepth = (uint32_t)progs[s].maxDepth;
+  }
+}
+
+int saveLibrary(const LibraryWriter *w, const char *path) {
+  LibraryHeader h;
+  memcpy(h.magic, LIBRARY_MAGIC, sizeof(h.magic));
+  h.version = LIBRARY_VERSION;
+  h.byteOrder = LIBRARY_BYTE_ORDER;
+  h.frameCount = (uint64_t)w->frameCount;
+  h.programCount = (uint64_t)w->programCount;
+  h.framesOffset = sizeof(LibraryHeader);
+  h.programsOffset = h.framesOffset + sizeof(LibraryFrame) * h.frameCount;
+  uint64_t base = h.programsOffset + sizeof(LibraryProgram) * h.programCount;
+  FILE *out = fopen(path, "wb");
+  int ok = (out != NULL);
+  if (ok) {
+    ok = fwrite(&h, sizeof(h), 1, out) == 1;
+    for (int i = 0; ok && i < w->frameCount; i++) {
+      LibraryFrame f = w->frames[i];
+      f.keyOffset += base;
+      ok = fwrite(&f, sizeof(f), 1, out) == 1;
+    }
+    for (int i = 0; ok && i < w->programCount; i++) {
+      LibraryProgram p = w->programs[i];
+      p.codeOffset += base;
+      p.constOffset += base;
+      ok = fwrite(&p, sizeof(p), 1, out) == 1;
+    }
+    ok = ok && fwrite(w->data, 1, w->dataSize, out) == w->dataSize;
+    ok = (fclose(out) == 0) && ok;
+  }
+  return ok;
+}
+
+static int libraryHas(const ProgramLibrary *lib, uint64_t offset,
+                      uint64_t count, size_t size) {
+  return offset <= lib->size && count <= (lib->size - offset) / size;
+}
+
+int openProgramLibrary(ProgramLibrary *lib, const char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  int ok = (fd >= 0) && fstat(fd, &st) == 0 &&
+           (size_t)st.st_size >= sizeof(LibraryHeader);
+  lib->map = NULL;
+  lib->size = 0;
+  lib->frames = NULL;
+  lib->programs = NULL;
+  lib->frameCount = 0;
+  lib->programCount = 0;
+  if (ok) {
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ok = (p != MAP_FAILED);
+    lib->map = ok ? (const unsigned char *)p : NULL;
+    lib->size = ok ? (size_t)st.st_size : 0;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (ok) {
+    const LibraryHeader *h = (const LibraryHeader *)lib->map;
+    ok = memcmp(h->magic, LIBRARY_MAGIC, sizeof(h->magic)) == 0 &&
+         h->version == LIBRARY_VERSION &&
+         h->byteOrder == LIBRARY_BYTE_ORDER &&
+         h->frameCount <= INT_MAX && h->programCount <= INT_MAX &&
+         h->framesOffset % 8 == 0 && h->programsOffset % 8 == 0 &&
+         libraryHas(lib, h->framesOffset, h->frameCount,
+                    sizeof(LibraryFrame)) &&
+         libraryHas(lib, h->programsOffset, h->programCount,
+                    sizeof(LibraryProgram));
+    if (ok) {
+      lib->frames = (const LibraryFrame *)(lib->map + h->framesOffset);
+      lib->programs = (const LibraryProgram *)(lib->map + h->programsOffset);
+      lib->frameCount = (int)h->frameCount;
+      lib->programCount = (int)h->programCount;
+    } else {
+      closeProgramLibrary(lib);
+    }
+  }
+  return ok;
+}
+
+void closeProgramLibrary(ProgramLibrary *lib) {
+  if (lib->map != NULL) {
+    munmap((void *)lib->map, lib->size);
+  }
+  lib->map = NULL;
+  lib->size = 0;
+  lib->frames = NULL;
+  lib->programs = NULL;
+  lib->frameCount = 0;
+  lib->programCount = 0;
+}
+
+const char *libraryKey(const ProgramLibrary *lib, int f) {
+  const LibraryFrame *e = &lib->frames[f];
+  const char *key = NULL;
+  if (e->keyOffset < lib->size &&
+      e->keyLength < lib->size - e->keyOffset &&
+      lib->map[e->keyOffset + e->keyLength] == '\0') {
+    key = (const char *)(lib->map + e->keyOffset);
+  }
+  return key;
+}
+
+static int verifyProgram(const Program *prog) {
+  const unsigned char *code = prog->code;
+  const unsigned char *end = code + prog->codeSize;
+  unsigned int idx = 0;
+  int depth = 0;
+  int ok = 1;
+  while (ok && code < end) {
+    unsigned char op = *code++;
+    if (op == OP_CONST || op == OP_LOAD || op == OP_STORE || op == OP_VAR) {
+      ok = (end - code) >= (long)sizeof(idx);
+      if (ok) {
+        memcpy(&idx, code, sizeof(idx));
+        code += sizeof(idx);
+        ok = (op == OP_CONST) ? idx < (unsigned int)prog->constCount
+             : (op == OP_VAR) ? idx < VAR_COUNT
+                              : idx < (unsigned int)prog->slotCount;
+      }
+    }
+    if (op == OP_CONST || op == OP_X || op == OP_LOAD || op == OP_VAR) {
+      depth++;
+    } else if (op >= OP_ADD && op <= OP_DIV) {
+      ok = ok && depth >= 2;
+      depth--;
+    } else if (op <= OP_STORE) {
+      ok = ok && depth >= 1;
+    } else {
+      ok = 0;
+    }
+    ok = ok && depth <= prog->maxDepth;
+  }
+  return ok && (depth == 1 || prog->codeSize == 0);
+}
+
+static void clearProgramView(Program *prog) {
+  prog->code = NULL;
+  prog->codeSize = 0;
+  prog->codeCapacity = 0;
+  prog->consts = NULL;
+  prog->constCount = 0;
+  prog->constCapacity = 0;
+  prog->slotCount = 0;
+  prog->maxDepth = 0;
+}
+
+int libraryProgram(const ProgramLibrary *lib, int p, Program *prog) {
+  const LibraryProgram *e = &lib->programs[p];
+  int ok = e->codeSize <= INT_MAX && e->constCount <= INT_MAX &&
+           e->slotCount <= e->codeSize && e->maxDepth <= e->codeSize &&
+           e->constOffset % sizeof(double) == 0 &&
+           libraryHas(lib, e->codeOffset, e->codeSize, 1) &&
+           libraryHas(lib, e->constOffset, e->constCount, sizeof(double));
+  clearProgramView(prog);
+  if (ok) {
+    prog->code = (unsigned char *)(lib->map + e->codeOffset);
+    prog->codeSize = (int)e->codeSize;
+    prog->consts = (double *)(lib->map + e->constOffset);
+    prog->constCount = (int)e->constCount;
+    prog->slotCount = (int)e->slotCount;
+    prog->maxDepth = (int)e->maxDepth;
+    ok = verifyProgram(prog);
+  }
+  if (!ok) {
+    clearProgramView(prog);
+  }
+  return ok;
+}
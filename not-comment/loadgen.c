@@ -0,0 +1,223 @@
+#include "graph.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_CLIENTS 4
+#define DEFAULT_REQUESTS 1000
+
+#define MAX_CLIENTS 1024
+
+static const char *const kDefaultLines[] = {
+    "sin(x)\n",
+    "sin(x)*x/5\n",
+    "sin(x)*cos(2*x)+sqrt(x)/10-ln(x+1)/4\n",
+    "sin(x);cos(x);sin(x)*x/5\n",
+    ":view -5 15\n",
+    "x*x/10-3\n",
+    ":view -10 10\n",
+    "tan(x)/4\n",
+};
+
+typedef struct {
+  const char *path;
+  const char *const *lines;
+  int lineCount;
+  int first;
+  int requests;
+  double *latency;
+  int done;
+} LoadClient;
+
+static double nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int sendAll(int fd, const char *data, size_t len) {
+  int ok = 1;
+  while (ok && len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n > 0) {
+      data += n;
+      len -= (size_t)n;
+    } else {
+      ok = (n < 0 && errno == EINTR);
+    }
+  }
+  return ok;
+}
+
+static int readReply(int fd, char **buf, size_t *cap) {
+  size_t len = 0;
+  int done = 0;
+  int ok = 1;
+  while (ok && !done) {
+    if (len + 4096 > *cap) {
+      *cap = *cap ? 2 * *cap : 65536;
+      *buf = (char *)realloc(*buf, *cap);
+    }
+    ssize_t n = recv(fd, *buf + len, *cap - len, 0);
+    if (n > 0) {
+      len += (size_t)n;
+      done = (len == 1 && (*buf)[0] == '\n') ||
+             (len >= 2 && (*buf)[len - 1] == '\n' && (*buf)[len - 2] == '\n');
+    } else {
+      ok = (n < 0 && errno == EINTR);
+    }
+  }
+  return ok;
+}
+
+static void *clientThread(void *p) {
+  LoadClient *cl = (LoadClient *)p;
+  struct sockaddr_un addr;
+  char *buf = NULL;
+  size_t cap = 0;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, cl->path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  int ok = fd >= 0 &&
+           connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  for (int i = 0; ok && i < cl->requests; i++) {
+    const char *line = cl->lines[(cl->first + i) % cl->lineCount];
+    double start = nowNs();
+    ok = sendAll(fd, line, strlen(line)) && readReply(fd, &buf, &cap);
+    if (ok) {
+      cl->latency[cl->done++] = (nowNs() - start) * 1e-6;
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(buf);
+  return NULL;
+}
+
+static int readLines(const char *path, char ***lines) {
+  FILE *in = fopen(path, "r");
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len = 0;
+  int count = 0;
+  int capacity = 0;
+  *lines = NULL;
+  while (in != NULL && (len = getline(&line, &cap, in)) >= 0) {
+    if (len > 1 || (len == 1 && line[0] != '\n')) {
+      if (count == capacity) {
+        capacity = capacity ? 2 * capacity : 16;
+        *lines = (char **)realloc(*lines, sizeof(char *) * capacity);
+      }
+      char *copy = (char *)malloc((size_t)len + 2);
+      memcpy(copy, line, (size_t)len + 1);
+      if (copy[len - 1] != '\n') {
+        copy[len] = '\n';
+        copy[len + 1] = '\0';
+      }
+      (*lines)[count++] = copy;
+    }
+  }
+  free(line);
+  if (in != NULL) {
+    fclose(in);
+  }
+  return count;
+}
+
+static int compareDouble(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+  int idx = (int)ceil(p / 100.0 * n) - 1;
+  idx = (idx < 0) ? 0 : idx;
+  return sorted[idx];
+}
+
+int main(int argc, char **argv) {
+  int clients = DEFAULT_CLIENTS;
+  int requests = DEFAULT_REQUESTS;
+  const char *input = NULL;
+  int ok = argc >= 2;
+  for (int i = 2; ok && i < argc; i++) {
+    if (!strcmp(argv[i], "--clients") && i + 1 < argc) {
+      clients = atoi(argv[++i]);
+      ok = clients >= 1 && clients <= MAX_CLIENTS;
+    } else if (!strcmp(argv[i], "--requests") && i + 1 < argc) {
+      requests = atoi(argv[++i]);
+      ok = requests >= 1;
+    } else if (!strcmp(argv[i], "--input") && i + 1 < argc) {
+      input = argv[++i];
+    } else {
+      ok = 0;
+    }
+  }
+  char **owned = NULL;
+  const char *const *lines = kDefaultLines;
+  int lineCount = (int)(sizeof(kDefaultLines) / sizeof(kDefaultLines[0]));
+  if (ok && input != NULL) {
+    lineCount = readLines(input, &owned);
+    lines = (const char *const *)owned;
+    ok = lineCount > 0;
+  }
+  int retVal = 0;
+  if (!ok) {
+    fprintf(stderr, "usage: loadgen SOCKET [--clients N] [--requests N] "
+                    "[--input FILE]\n");
+    retVal = 1;
+  } else {
+    LoadClient *cl = (LoadClient *)malloc(sizeof(LoadClient) * clients);
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * clients);
+    double start = nowNs();
+    int started = 0;
+    for (int c = 0; c < clients; c++) {
+      cl[c].path = argv[1];
+      cl[c].lines = lines;
+      cl[c].lineCount = lineCount;
+      cl[c].first = c % lineCount;
+      cl[c].requests = requests;
+      cl[c].latency = (double *)malloc(sizeof(double) * requests);
+      cl[c].done = 0;
+      if (pthread_create(&threads[started], NULL, clientThread, &cl[c]) ==
+          0) {
+        started++;
+      }
+    }
+    for (int c = 0; c < started; c++) {
+      pthread_join(threads[c], NULL);
+    }
+    double seconds = (nowNs() - start) * 1e-9;
+    double *all = (double *)malloc(sizeof(double) * clients * requests);
+    int total = 0;
+    for (int c = 0; c < clients; c++) {
+      memcpy(all + total, cl[c].latency, sizeof(double) * cl[c].done);
+      total += cl[c].done;
+      free(cl[c].latency);
+    }
+    printf("clients: %d, requests: %d of %d, seconds: %.3f\n", clients,
+           total, clients * requests, seconds);
+    if (total > 0) {
+      qsort(all, total, sizeof(double), compareDouble);
+      printf("throughput: %.1f req/s\n", total / seconds);
+      printf("latency ms: p50 %.4g p90 %.4g p99 %.4g max %.4g\n",
+             percentile(all, total, 50), percentile(all, total, 90),
+             percentile(all, total, 99), all[total - 1]);
+    }
+    retVal = (total == clients * requests) ? 0 : 1;
+    free(all);
+    free(threads);
+    free(cl);
+  }
+  for (int i = 0; owned != NULL && i < lineCount; i++) {
+    free(owned[i]);
+  }
+  free(owned);
+  return retVal;
+}
@@ -0,0 +1,343 @@
+#include "graph.h"
+
+#define MAX_CANVAS_SIDE 1000000
+#define MAX_THREADS 1024
+#define DEFAULT_CACHE_SIZE 4096
+#define MAX_CACHE_SIZE 10000000
+
+typedef struct {
+  EvalMode mode;
+  Viewport view;
+  int threads;
+  int batch;
+  int cacheSize;
+  int cacheFrames;
+  int cacheStats;
+  int traceSummary;
+  const char *traceFile;
+  const char *outputFile;
+  const char *compileFile;
+  const char *libraryFile;
+  const char *serveSocket;
+  double vars[VAR_COUNT];
+  ParamSweep sweep;
+  MathPrecision precision;
+} Options;
+
+typedef struct {
+  Arena arena;
+  TokenArray infix;
+  LexStream lex;
+  long column;
+  Program *progs;
+  int count;
+  int capacity;
+  FoldStats *fold;
+} SeriesInput;
+
+static int parseValue(Options *opts, const char *name, const char *text) {
+  Viewport *view = &opts->view;
+  char *end = NULL;
+  double v = strtod(text, &end);
+  int ok = (end != text && *end == '\0');
+  if (!strcmp(name, "--width") || !strcmp(name, "--height")) {
+    ok = ok && v >= 1.0 && v <= MAX_CANVAS_SIDE;
+  }
+  if (!strcmp(name, "--threads")) {
+    ok = ok && v >= 1.0 && v <= MAX_THREADS;
+  }
+  if (!strcmp(name, "--cache")) {
+    ok = ok && v >= 0.0 && v <= MAX_CACHE_SIZE;
+  }
+  if (ok && !strcmp(name, "--threads")) {
+    opts->threads = (int)v;
+  } else if (ok && !strcmp(name, "--cache")) {
+    opts->cacheSize = (int)v;
+  } else if (ok && !strcmp(name, "--width")) {
+    view->width = (int)v;
+  } else if (ok && !strcmp(name, "--height")) {
+    view->height = (int)v;
+  } else if (ok && !strcmp(name, "--xmin")) {
+    view->xMin = v;
+  } else if (ok && !strcmp(name, "--xmax")) {
+    view->xMax = v;
+  } else if (ok && !strcmp(name, "--ymin")) {
+    view->yMin = v;
+  } else if (ok && !strcmp(name, "--ymax")) {
+    view->yMax = v;
+  } else {
+    ok = 0;
+  }
+  return ok;
+}
+
+static int parseOptions(int argc, char **argv, Options *opts) {
+  int ok = 1;
+  opts->mode = EVAL_BATCH;
+  opts->threads = 1;
+  opts->batch = 0;
+  opts->cacheSize = DEFAULT_CACHE_SIZE;
+  opts->cacheFrames = 0;
+  opts->cacheStats = 0;
+  opts->traceSummary = 0;
+  opts->traceFile = NULL;
+  opts->outputFile = NULL;
+  opts->compileFile = NULL;
+  opts->libraryFile = NULL;
+  opts->serveSocket = NULL;
+  opts->sweep.var = -1;
+  opts->precision = PRECISION_EXACT;
+  initVars(opts->vars);
+  initViewport(&opts->view);
+  for (int i = 1; ok && i < argc; i++) {
+    if (!strcmp(argv[i], "--jit")) {
+      opts->mode = EVAL_JIT;
+    } else if (!strcmp(argv[i], "--interval")) {
+      opts->mode = EVAL_INTERVAL;
+    } else if (!strcmp(argv[i], "--adaptive")) {
+      opts->mode = EVAL_ADAPTIVE;
+    } else if (!strcmp(argv[i], "--derivative")) {
+      opts->mode = EVAL_DERIVATIVE;
+    } else if (!strcmp(argv[i], "--heatmap")) {
+      opts->mode = EVAL_HEATMAP;
+    } else if (!strcmp(argv[i], "--contour")) {
+      opts->mode = EVAL_CONTOUR;
+    } else if (!strcmp(argv[i], "--batch")) {
+      opts->batch = 1;
+    } else if (!strcmp(argv[i], "--cache-frames")) {
+      opts->cacheFrames = 1;
+    } else if (!strcmp(argv[i], "--cache-stats")) {
+      opts->cacheStats = 1;
+    } else if (!strcmp(argv[i], "--autoscale")) {
+      opts->view.autoscaleY = 1;
+    } else if (!strcmp(argv[i], "--lines")) {
+      opts->view.raster = RASTER_LINES;
+    } else if (!strcmp(argv[i], "--braille")) {
+      opts->view.raster = RASTER_BRAILLE;
+    } else if (!strcmp(argv[i], "--trace-summary")) {
+      opts->traceSummary = 1;
+    } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+      opts->traceFile = argv[++i];
+    } else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+      opts->outputFile = argv[++i];
+    } else if (!strcmp(argv[i], "--compile") && i + 1 < argc) {
+      opts->compileFile = argv[++i];
+    } else if (!strcmp(argv[i], "--param") && i + 1 < argc) {
+      ok = parseVar(argv[++i], opts->vars);
+    } else if (!strcmp(argv[i], "--sweep") && i + 1 < argc) {
+      ok = parseSweep(argv[++i], &opts->sweep);
+    } else if (!strcmp(argv[i], "--precision") && i + 1 < argc) {
+      i++;
+      ok = !strcmp(argv[i], "fast") || !strcmp(argv[i], "exact");
+      opts->precision = !strcmp(argv[i], "fast") ? PRECISION_FAST
+                                                 : PRECISION_EXACT;
+    } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+      opts->serveSocket = argv[++i];
+    } else if (!strcmp(argv[i], "--library") && i + 1 < argc) {
+      opts->libraryFile = argv[++i];
+      opts->batch = 1;
+    } else if (i + 1 < argc) {
+      ok = parseValue(opts, argv[i], argv[i + 1]);
+      i++;
+    } else {
+      ok = 0;
+    }
+  }
+  int pointModes = opts->mode == EVAL_BATCH || opts->mode == EVAL_JIT ||
+                   opts->mode == EVAL_DERIVATIVE;
+  return ok && opts->view.xMin < opts->view.xMax &&
+         opts->view.yMin < opts->view.yMax &&
+         (opts->view.raster == RASTER_POINTS || pointModes);
+}
+
+static void makeBatchConfig(const Options *opts, BatchConfig *cfg) {
+  cfg->view = opts->view;
+  cfg->mode = opts->mode;
+  cfg->cacheSize = opts->cacheSize;
+  cfg->cacheFrames = opts->cacheFrames;
+  cfg->cacheStats = opts->cacheStats;
+  cfg->library = NULL;
+  memcpy(cfg->vars, opts->vars, sizeof(cfg->vars));
+  cfg->sweep = opts->sweep;
+  cfg->precision = opts->precision;
+}
+
+static void startSeries(SeriesInput *in, long column) {
+  resetArena(&in->arena);
+  initTokenArrayArena(&in->infix, &in->arena, 64);
+  initLexStream(&in->lex, &in->infix);
+  in->column = column;
+}
+
+static void finishSeries(SeriesInput *in) {
+  long bad = finishLexStream(&in->lex);
+  if (bad >= 0) {
+    fprintf(stderr, "graph: unexpected '%c' at column %ld\n",
+            in->lex.errorChar, in->column + bad + 1);
+  }
+  if (in->count == in->capacity) {
+    in->capacity = in->capacity ? 2 * in->capacity : 4;
+    in->progs = (Program *)realloc(in->progs,
+                                   sizeof(Program) * in->capacity);
+  }
+  ExprAst ast;
+  parseTokens(&in->infix, &in->arena, &ast);
+  if (ast.error != NULL) {
+    fprintf(stderr, "graph: %s at column %ld\n", ast.error,
+            in->column + lexColumn(&in->lex, ast.errorPos) + 1);
+  }
+  freeLexStream(&in->lex);
+  countFold(&ast, in->fold);
+  initProgram(&in->progs[in->count]);
+  compileAst(&ast, &in->progs[in->count]);
+  in->count++;
+}
+
+static int readSeries(FILE *stream, Program **progs, FoldStats *fold) {
+  SeriesInput in;
+  char *chunk = (char *)malloc(LEX_CHUNK);
+  long pos = 0;
+  int done = 0;
+  in.progs = NULL;
+  in.count = 0;
+  in.capacity = 0;
+  in.fold = fold;
+  initArena(&in.arena, exprArenaSize(256));
+  char *p = fgets(chunk, LEX_CHUNK, stream);
+  int any = (p != NULL);
+  if (any) {
+    startSeries(&in, 0);
+  }
+  while (p != NULL) {
+    size_t len = strcspn(p, ";\n");
+    feedLexStream(&in.lex, p, len);
+    pos += (long)len;
+    p += len;
+    if (*p == ';') {
+      finishSeries(&in);
+      pos++;
+      p++;
+      startSeries(&in, pos);
+    } else if (*p == '\n') {
+      done = 1;
+    }
+    if (done) {
+      p = NULL;
+    } else if (*p == '\0') {
+      p = fgets(chunk, LEX_CHUNK, stream);
+    }
+  }
+  if (any) {
+    finishSeries(&in);
+  }
+  freeArena(&in.arena);
+  free(chunk);
+  *progs = in.progs;
+  return in.count;
+}
+
+int main(int argc, char **argv) {
+  int retVal = 0;
+  Options opts;
+  FrameSink sink;
+  Program *progs = NULL;
+  int count = 0;
+  FoldStats fold = {0, 0};
+  sink.fd = -1;
+  if (!parseOptions(argc, argv, &opts)) {
+    fprintf(stderr,
+            "usage: graph [--batch] [--cache N] [--cache-frames] "
+            "[--cache-stats] [--jit] [--interval] [--adaptive] [--derivative] "
+            "[--heatmap] [--contour] [--param V=X] [--sweep V=A:B:N] "
+            "[--precision exact|fast] "
+            "[--threads N] [--width N] [--height N] [--xmin A] [--xmax B] "
+            "[--ymin A] [--ymax B] [--autoscale] [--lines] [--braille] "
+            "[--output FILE] [--compile LIB] [--library LIB] [--serve SOCKET] "
+            "[--trace FILE] [--trace-summary]\n");
+    retVal = 1;
+  } else if (opts.compileFile != NULL) {
+    if (compileLibrary(stdin, opts.compileFile, opts.cacheSize) < 0) {
+      fprintf(stderr, "graph: cannot write library %s\n", opts.compileFile);
+      retVal = 1;
+    }
+  } else if (opts.serveSocket != NULL) {
+    BatchConfig cfg;
+    makeBatchConfig(&opts, &cfg);
+    if (runServer(opts.serveSocket, &cfg, opts.threads) < 0) {
+      fprintf(stderr, "graph: cannot listen on %s\n", opts.serveSocket);
+      retVal = 1;
+    }
+  } else if (!openFrameSink(&sink, opts.outputFile)) {
+    fprintf(stderr, "graph: cannot open output file %s\n", opts.outputFile);
+    retVal = 1;
+  } else if (opts.batch) {
+    BatchConfig cfg;
+    makeBatchConfig(&opts, &cfg);
+    ProgramLibrary lib;
+    if (opts.libraryFile != NULL && !openProgramLibrary(&lib,
+                                                        opts.libraryFile)) {
+      fprintf(stderr, "graph: cannot load library %s\n", opts.libraryFile);
+      retVal = 1;
+    } else {
+      cfg.library = (opts.libraryFile != NULL) ? &lib : NULL;
+      ThreadPool pool;
+      initThreadPool(&pool, opts.threads);
+      retVal = (runBatch(stdin, &cfg, &pool, &sink) < 0) ? 1 : 0;
+      freeThreadPool(&pool);
+    }
+    if (cfg.library != NULL) {
+      closeProgramLibrary(&lib);
+    }
+  } else if ((count = readSeries(stdin, &progs, &fold)) == 0) {
+    retVal = 0;
+  } else {
+    setProgramPrecision(progs, count, opts.precision);
+    ThreadPool pool;
+    initThreadPool(&pool, opts.threads);
+    Canvas canvas;
+    initCanvas(&canvas, &opts.view);
+    int frames = (opts.sweep.var >= 0) ? opts.sweep.frames : 1;
+    unsigned int used = 0;
+    for (int s = 0; s < count; s++) {
+      used |= programVars(&progs[s]);
+    }
+    Program *bound = NULL;
+    SharedJit **jits = NULL;
+    for (int step = 0; step < frames; step++) {
+      sweepVars(&opts.sweep, step, opts.vars);
+      if (step == 0 || (used & (1u << opts.sweep.var))) {
+        releaseJits(jits, count);
+        freeBoundPrograms(bound, count);
+        bound = bindPrograms(progs, count, opts.vars, opts.mode);
+        jits = (opts.mode == EVAL_JIT)
+                   ? shareJits((bound != NULL) ? bound : progs, count)
+                   : NULL;
+      }
+      canvas.view = opts.view;
+      fillCanvasPrograms(&canvas, (bound != NULL) ? bound : progs, jits,
+                         count, opts.mode, &pool);
+      writeFrame(&sink, &canvas, step > 0);
+    }
+    releaseJits(jits, count);
+    freeBoundPrograms(bound, count);
+    freeCanvas(&canvas);
+    freeThreadPool(&pool);
+    if (opts.cacheStats) {
+      printFoldStats(&fold);
+    }
+
+    for (int s = 0; s < count; s++) {
+      freeProgram(&progs[s]);
+    }
+    retVal = 0;
+  }
+  free(progs);
+  if (sink.fd != -1 && !closeFrameSink(&sink)) {
+    retVal = 1;
+  }
+  if ((opts.traceSummary || opts.traceFile != NULL) &&
+      !traceReport(opts.traceSummary ? stderr : NULL, opts.traceFile)) {
+    retVal = 1;
+  }
+  return retVal;
+}
@@ -0,0 +1,105 @@
+#include "graph.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int writeAll(int fd, struct iovec *iov, int count) {
+  int ok = 1;
+  while (ok && count > 0) {
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0) {
+      ok = (errno == EINTR);
+    } else {
+      size_t left = (size_t)n;
+      while (count > 0 && left >= iov->iov_len) {
+        left -= iov->iov_len;
+        iov++;
+        count--;
+      }
+      if (count > 0) {
+        iov->iov_base = (char *)iov->iov_base + left;
+        iov->iov_len -= left;
+      }
+    }
+  }
+  return ok;
+}
+
+static int growMap(FrameSink *sink, size_t need) {
+  int ok = 1;
+  if (sink->map == NULL || sink->used + need > sink->mapSize) {
+    size_t size = sink->mapSize ? sink->mapSize : FRAME_MAP_INITIAL;
+    while (size < sink->used + need) {
+      size *= 2;
+    }
+    if (sink->map != NULL) {
+      munmap(sink->map, sink->mapSize);
+      sink->map = NULL;
+    }
+    ok = (ftruncate(sink->fd, (off_t)size) == 0);
+    if (ok) {
+      void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     sink->fd, 0);
+      ok = (p != MAP_FAILED);
+      sink->map = ok ? (char *)p : NULL;
+      sink->mapSize = ok ? size : 0;
+    }
+  }
+  return ok;
+}
+
+int openFrameSink(FrameSink *sink, const char *path) {
+  sink->fd = STDOUT_FILENO;
+  sink->map = NULL;
+  sink->mapSize = 0;
+  sink->used = 0;
+  sink->failed = 0;
+  if (path != NULL) {
+    sink->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    sink->failed = (sink->fd < 0) || !growMap(sink, 0);
+  }
+  return !sink->failed;
+}
+
+int writeFrame(FrameSink *sink, const Canvas *canvas, int separate) {
+  TRACE_BEGIN(span);
+  struct iovec iov[2];
+  int count = 0;
+  if (separate) {
+    iov[count].iov_base = "\n";
+    iov[count++].iov_len = 1;
+  }
+  iov[count].iov_base = canvas->cells;
+  iov[count++].iov_len = canvas->stride * canvas->view.height;
+  if (!sink->failed && sink->map == NULL) {
+    sink->failed = !writeAll(sink->fd, iov, count);
+  } else if (!sink->failed) {
+    sink->failed = !growMap(sink, separate + iov[count - 1].iov_len);
+    for (int i = 0; !sink->failed && i < count; i++) {
+      memcpy(sink->map + sink->used, iov[i].iov_base, iov[i].iov_len);
+      sink->used += iov[i].iov_len;
+    }
+  }
+  TRACE_END(span, STAGE_OUTPUT);
+  return !sink->failed;
+}
+
+int closeFrameSink(FrameSink *sink) {
+  if (sink->map != NULL) {
+    munmap(sink->map, sink->mapSize);
+    sink->map = NULL;
+  }
+  if (sink->fd != STDOUT_FILENO && sink->fd >= 0) {
+    if (ftruncate(sink->fd, (off_t)sink->used) != 0) {
+      sink->failed = 1;
+    }
+    if (close(sink->fd) != 0) {
+      sink->failed = 1;
+    }
+  }
+  sink->fd = -1;
+  return !sink->failed;
+}
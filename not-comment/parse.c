@@ -0,0 +1,194 @@
+#include "graph.h"
+
+#define PARSE_OPERAND 1
+#define PARSE_PREFIX 2
+#define PARSE_INFIX 4
+
+static const unsigned char kTokenRoles[] = {
+    PARSE_OPERAND, PARSE_OPERAND, PARSE_INFIX, PARSE_PREFIX | PARSE_INFIX,
+    PARSE_INFIX,   PARSE_INFIX,   PARSE_PREFIX, 0,
+    PARSE_PREFIX,  PARSE_PREFIX,  PARSE_PREFIX, PARSE_PREFIX,
+    PARSE_PREFIX,  PARSE_PREFIX,  PARSE_PREFIX | PARSE_INFIX, PARSE_OPERAND};
+
+static const unsigned char kBindingPower[] = {0, 0, 2, 2, 3, 3, 0, 0,
+                                              1, 1, 1, 1, 1, 1, 4, 0};
+
+#define FUNC_CALL_POWER 4
+
+typedef struct {
+  TokenType type;
+  int left;
+  int power;
+  long pos;
+} ParseFrame;
+
+typedef struct {
+  const char *str;
+  const TokenArray *infix;
+  long next;
+  long pos;
+  Token tok;
+  int atEnd;
+  ExprAst *ast;
+  ParseFrame *frames;
+  int top;
+} Parser;
+
+static void parseError(ExprAst *ast, long pos, const char *error) {
+  if (ast->error == NULL) {
+    ast->error = error;
+    ast->errorPos = pos;
+  }
+}
+
+static void nextToken(Parser *p) {
+  if (p->str != NULL) {
+    int len = 0;
+    while (len == 0 && p->str[p->next] != '\0') {
+      const char *s = p->str + p->next;
+      int space = (*s == ' ' || *s == '\t');
+      len = space ? 0 : lexToken(s, &p->tok);
+      if (len == 0 && !space) {
+        parseError(p->ast, p->next, "unexpected character");
+      }
+      p->pos = p->next;
+      p->next += (len > 0) ? len : 1;
+    }
+    p->atEnd = (len == 0);
+    TRACE_COUNT(COUNTER_TOKENS, len > 0);
+  } else {
+    p->atEnd = (p->next >= p->infix->size);
+    if (!p->atEnd) {
+      p->tok = p->infix->data[p->next];
+      p->pos = p->next;
+      p->next++;
+    }
+  }
+  if (p->atEnd) {
+    p->pos = p->next;
+  }
+}
+
+static int addNode(ExprAst *ast, TokenType type, int left, int right,
+                   double value) {
+  ExprNode *n = &ast->nodes[ast->size];
+  n->type = type;
+  n->left = left;
+  n->right = right;
+  n->value = value;
+  return ast->size++;
+}
+
+static void pushFrame(Parser *p, TokenType type, int left) {
+  ParseFrame *f = &p->frames[++p->top];
+  f->type = type;
+  f->left = left;
+  f->power = kBindingPower[type];
+  f->pos = p->pos;
+}
+
+static int reduceFrames(Parser *p, int cur, int power) {
+  while (p->top >= 0 && p->frames[p->top].power >= power) {
+    const ParseFrame *f = &p->frames[p->top--];
+    cur = (f->left >= 0) ? addNode(p->ast, f->type, f->left, cur, 0.0)
+                         : addNode(p->ast, f->type, cur, -1, 0.0);
+  }
+  return cur;
+}
+
+static int finishFrames(Parser *p, int cur) {
+  cur = reduceFrames(p, cur, 1);
+  while (p->top >= 0) {
+    parseError(p->ast, p->frames[p->top].pos, "missing ')'");
+    p->top--;
+    cur = reduceFrames(p, cur, 1);
+  }
+  return cur;
+}
+
+static int parseLoop(Parser *p) {
+  int cur = -1;
+  int root = -1;
+  int done = 0;
+  nextToken(p);
+  done = p->atEnd;
+  while (!done) {
+    TokenType t = p->tok.type;
+    int role = p->atEnd ? 0 : kTokenRoles[t];
+    if (cur < 0 && !(role & (PARSE_OPERAND | PARSE_PREFIX))) {
+      parseError(p->ast, p->pos, "missing operand");
+      done = 1;
+    } else if (cur < 0 && (role & PARSE_OPERAND)) {
+      cur = addNode(p->ast, t, -1, -1, p->tok.value);
+    } else if (cur < 0) {
+      if (t == TOKEN_LPAREN && p->top >= 0 &&
+          isFunction(p->frames[p->top].type)) {
+        p->frames[p->top].power = FUNC_CALL_POWER;
+      }
+      pushFrame(p, (t == TOKEN_MINUS) ? TOKEN_UMINUS : t, -1);
+    } else if (p->atEnd) {
+      root = finishFrames(p, cur);
+      done = 1;
+    } else if (t == TOKEN_RPAREN) {
+      cur = reduceFrames(p, cur, 1);
+      if (p->top < 0) {
+        parseError(p->ast, p->pos, "unmatched ')'");
+        done = 1;
+      } else {
+        p->top--;
+      }
+    } else if (role & PARSE_INFIX) {
+      t = (t == TOKEN_UMINUS) ? TOKEN_MINUS : t;
+      pushFrame(p, t, reduceFrames(p, cur, kBindingPower[t]));
+      cur = -1;
+    } else {
+      parseError(p->ast, p->pos, "missing operator");
+      done = 1;
+    }
+    if (!done) {
+      nextToken(p);
+    }
+  }
+  return root;
+}
+
+static int parseWith(Parser *p, Arena *arena, ExprAst *ast, long cap) {
+  TRACE_BEGIN(span);
+  ast->nodes = (ExprNode *)arenaAlloc(arena, sizeof(ExprNode) * (cap + 1));
+  ast->size = 0;
+  ast->root = -1;
+  ast->arena = arena;
+  ast->errorPos = -1;
+  ast->error = NULL;
+  p->frames = (ParseFrame *)arenaAlloc(arena, sizeof(ParseFrame) * (cap + 1));
+  p->top = -1;
+  p->next = 0;
+  p->pos = 0;
+  p->ast = ast;
+  ast->root = parseLoop(p);
+  TRACE_END(span, STAGE_PARSE);
+  return ast->root >= 0;
+}
+
+int parseExpr(const char *str, Arena *arena, ExprAst *ast) {
+  Parser p;
+  p.str = str;
+  p.infix = NULL;
+  return parseWith(&p, arena, ast, (long)strlen(str));
+}
+
+int parseTokens(const TokenArray *infix, Arena *arena, ExprAst *ast) {
+  Parser p;
+  p.str = NULL;
+  p.infix = infix;
+  return parseWith(&p, arena, ast, infix->size);
+}
+
+void lowerAst(const ExprAst *ast, TokenArray *postfix) {
+  int count = (ast->root >= 0) ? ast->size : 0;
+  for (int i = 0; i < count; i++) {
+    pushTokenArray(postfix, makeToken(ast->nodes[i].type,
+                                      ast->nodes[i].value));
+  }
+  postfix->depth = rpnDepth(postfix);
+}
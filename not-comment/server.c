@@ -0,0 +1,464 @@
+#include "graph.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVER_MAX_CONNS 1024
+
+#define SERVER_MAX_EVENTS 64
+
+#define SERVER_READ_CHUNK 65536
+
+#define SERVER_MAX_LINE (16 << 20)
+
+#define SERVER_LINE_TOO_LONG "error: line too long\n\n"
+#define SERVER_BUSY "error: server busy\n\n"
+
+#define SERVER_LISTEN_ID SERVER_MAX_CONNS
+#define SERVER_WAKE_ID (SERVER_MAX_CONNS + 1)
+#define SERVER_SIGNAL_ID (SERVER_MAX_CONNS + 2)
+
+typedef struct {
+  int fd;
+  char *in;
+  size_t inStart;
+  size_t inLen;
+  size_t inCap;
+  char *out;
+  size_t outLen;
+  size_t outSent;
+  int busy;
+  int eof;
+  const char *farewell;
+  Viewport view;
+  double vars[VAR_COUNT];
+} ServerConn;
+
+typedef struct {
+  int conn;
+  char *key;
+  long *columns;
+  Viewport view;
+  double vars[VAR_COUNT];
+  char *reply;
+  size_t replyLen;
+} ServerJob;
+
+typedef struct {
+  ServerJob items[SERVER_MAX_CONNS];
+  int head;
+  int count;
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty;
+} JobQueue;
+
+typedef struct {
+  const BatchConfig *cfg;
+  ServerConn conns[SERVER_MAX_CONNS];
+  JobQueue requests;
+  JobQueue replies;
+  ExprCache programs;
+  Arena scratch;
+  pthread_mutex_t compileLock;
+  int listenFd;
+  int epollFd;
+  int wakeFd;
+  int signalFd;
+  unsigned long served;
+} Server;
+
+static void initJobQueue(JobQueue *q) {
+  q->head = 0;
+  q->count = 0;
+  q->stop = 0;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->notEmpty, NULL);
+}
+
+static void pushJob(JobQueue *q, const ServerJob *job) {
+  pthread_mutex_lock(&q->lock);
+  q->items[(q->head + q->count) % SERVER_MAX_CONNS] = *job;
+  q->count++;
+  pthread_cond_signal(&q->notEmpty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static int popJob(JobQueue *q, ServerJob *job, int wait) {
+  int ok = 0;
+  pthread_mutex_lock(&q->lock);
+  while (wait && q->count == 0 && !q->stop) {
+    pthread_cond_wait(&q->notEmpty, &q->lock);
+  }
+  if (q->count > 0) {
+    *job = q->items[q->head];
+    q->head = (q->head + 1) % SERVER_MAX_CONNS;
+    q->count--;
+    ok = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ok;
+}
+
+static void stopJobQueue(JobQueue *q) {
+  pthread_mutex_lock(&q->lock);
+  q->stop = 1;
+  pthread_cond_broadcast(&q->notEmpty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void renderJob(Server *srv, Canvas *canvas, ThreadPool *pool,
+                      ServerJob *job) {
+  EvalMode mode = srv->cfg->mode;
+  Program *progs = NULL;
+  SharedJit **jits = NULL;
+  pthread_mutex_lock(&srv->compileLock);
+  int count = compileSeries(&srv->programs, &srv->scratch, job->key,
+                            job->columns, &progs);
+  setProgramPrecision(progs, count, srv->cfg->precision);
+  if (mode == EVAL_JIT) {
+    jits = shareSeriesJit(&srv->programs, job->key, progs, count);
+  }
+  pthread_mutex_unlock(&srv->compileLock);
+  Program *bound = bindPrograms(progs, count, job->vars, mode);
+  canvas->view = job->view;
+  if (bound != NULL) {
+    fillCanvasPrograms(canvas, bound, NULL, count, mode, pool);
+  } else {
+    fillCanvasPrograms(canvas, progs, jits, count, mode, pool);
+  }
+  size_t cells = canvas->stride * canvas->view.height;
+  job->reply = (char *)malloc(cells + 1);
+  memcpy(job->reply, canvas->cells, cells);
+  job->reply[cells] = '\n';
+  job->replyLen = cells + 1;
+  freeBoundPrograms(bound, count);
+  releaseJits(jits, count);
+  for (int s = 0; s < count; s++) {
+    freeProgram(&progs[s]);
+  }
+  free(progs);
+  free(job->key);
+  free(job->columns);
+  job->key = NULL;
+  job->columns = NULL;
+}
+
+static void *serverWorker(void *p) {
+  Server *srv = (Server *)p;
+  Canvas canvas;
+  ThreadPool pool;
+  ServerJob job;
+  uint64_t one = 1;
+  initCanvas(&canvas, &srv->cfg->view);
+  initThreadPool(&pool, 1);
+  while (popJob(&srv->requests, &job, 1)) {
+    renderJob(srv, &canvas, &pool, &job);
+    pushJob(&srv->replies, &job);
+    if (write(srv->wakeFd, &one, sizeof(one)) < 0) {
+      perror("graph: eventfd");
+    }
+  }
+  freeThreadPool(&pool);
+  freeCanvas(&canvas);
+  return NULL;
+}
+
+static int openListener(const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+  size_t len = strlen(path);
+  int fd = -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (len < sizeof(addr.sun_path)) {
+    memcpy(addr.sun_path, path, len + 1);
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+      unlink(path);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  }
+  if (fd >= 0 && (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+                  listen(fd, SOMAXCONN) != 0)) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+static int watchFd(Server *srv, int fd, uint32_t events, uint32_t id) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.u32 = id;
+  return epoll_ctl(srv->epollFd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+static void closeConn(ServerConn *c) {
+  close(c->fd);
+  free(c->in);
+  free(c->out);
+  c->fd = -1;
+  c->in = NULL;
+  c->out = NULL;
+}
+
+static void acceptConns(Server *srv) {
+  int fd = 0;
+  while ((fd = accept(srv->listenFd, NULL, NULL)) >= 0) {
+    int slot = 0;
+    while (slot < SERVER_MAX_CONNS && srv->conns[slot].fd >= 0) {
+      slot++;
+    }
+    if (slot == SERVER_MAX_CONNS) {
+      send(fd, SERVER_BUSY, strlen(SERVER_BUSY), MSG_DONTWAIT | MSG_NOSIGNAL);
+      close(fd);
+    } else if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 ||
+        !watchFd(srv, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                 (uint32_t)slot)) {
+      close(fd);
+    } else {
+      ServerConn *c = &srv->conns[slot];
+      c->fd = fd;
+      c->in = NULL;
+      c->inStart = 0;
+      c->inLen = 0;
+      c->inCap = 0;
+      c->out = NULL;
+      c->busy = 0;
+      c->eof = 0;
+      c->farewell = NULL;
+      c->view = srv->cfg->view;
+      memcpy(c->vars, srv->cfg->vars, sizeof(c->vars));
+    }
+  }
+}
+
+static void readConn(ServerConn *c) {
+  ssize_t n = 1;
+  while (n != 0 && !c->eof) {
+    if (c->inStart > 0) {
+      memmove(c->in, c->in + c->inStart, c->inLen - c->inStart);
+      c->inLen -= c->inStart;
+      c->inStart = 0;
+    }
+    if (c->inLen + SERVER_READ_CHUNK + 1 > c->inCap) {
+      c->inCap = c->inLen + SERVER_READ_CHUNK + 1;
+      c->in = (char *)realloc(c->in, c->inCap);
+    }
+    n = read(c->fd, c->in + c->inLen, SERVER_READ_CHUNK);
+    if (n > 0) {
+      c->inLen += (size_t)n;
+    } else if (n == 0) {
+      c->eof = 1;
+      if (c->inLen > 0 && c->in[c->inLen - 1] != '\n') {
+        c->in[c->inLen++] = '\n';
+      }
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      n = 0;
+    } else if (errno != EINTR) {
+      c->eof = 1;
+      c->inLen = 0;
+    }
+    if (c->inLen > SERVER_MAX_LINE &&
+        memchr(c->in, '\n', c->inLen) == NULL) {
+      c->eof = 1;
+      c->inLen = 0;
+      c->farewell = SERVER_LINE_TOO_LONG;
+    }
+  }
+}
+
+static void flushConn(ServerConn *c) {
+  int blocked = 0;
+  while (c->out != NULL && !blocked && c->outSent < c->outLen) {
+    ssize_t n = send(c->fd, c->out + c->outSent, c->outLen - c->outSent,
+                     MSG_NOSIGNAL);
+    if (n >= 0) {
+      c->outSent += (size_t)n;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      blocked = 1;
+    } else if (errno != EINTR) {
+      c->eof = 1;
+      c->inStart = c->inLen;
+      c->outSent = c->outLen;
+    }
+  }
+  if (c->out != NULL && c->outSent == c->outLen) {
+    free(c->out);
+    c->out = NULL;
+  }
+}
+
+static void sendReply(ServerConn *c, char *text, size_t len) {
+  c->out = text;
+  c->outLen = len;
+  c->outSent = 0;
+  flushConn(c);
+}
+
+static void sendText(ServerConn *c, const char *reply) {
+  size_t len = strlen(reply);
+  char *text = (char *)malloc(len);
+  memcpy(text, reply, len);
+  sendReply(c, text, len);
+}
+
+static void nextRequest(Server *srv, int slot) {
+  ServerConn *c = &srv->conns[slot];
+  char *nl = NULL;
+  while (c->fd >= 0 && !c->busy && c->out == NULL &&
+         (nl = (char *)memchr(c->in + c->inStart, '\n',
+                              c->inLen - c->inStart)) != NULL) {
+    char *line = c->in + c->inStart;
+    *nl = '\0';
+    c->inStart = (size_t)(nl + 1 - c->in);
+    if (line[0] == ':') {
+      sendText(c, parseBatchCommand(line, &c->view, c->vars)
+                      ? "\n"
+                      : "error: bad command\n\n");
+    } else {
+      ServerJob job;
+      job.conn = slot;
+      size_t len = strlen(line);
+      job.key = (char *)malloc(len + 1);
+      job.columns = (long *)malloc(sizeof(long) * (len + 1));
+      normalizeExpr(line, job.key, job.columns);
+      job.view = c->view;
+      memcpy(job.vars, c->vars, sizeof(job.vars));
+      pushJob(&srv->requests, &job);
+      c->busy = 1;
+    }
+  }
+  if (c->fd >= 0 && c->eof && !c->busy && c->out == NULL &&
+      c->farewell != NULL) {
+    sendText(c, c->farewell);
+    c->farewell = NULL;
+  }
+  if (c->fd >= 0 && c->eof && !c->busy && c->out == NULL) {
+    closeConn(c);
+  }
+}
+
+static void drainReplies(Server *srv) {
+  uint64_t ready = 0;
+  ServerJob job;
+  if (read(srv->wakeFd, &ready, sizeof(ready)) < 0) {
+    ready = 0;
+  }
+  while (popJob(&srv->replies, &job, 0)) {
+    ServerConn *c = &srv->conns[job.conn];
+    c->busy = 0;
+    sendReply(c, job.reply, job.replyLen);
+    srv->served++;
+    nextRequest(srv, job.conn);
+  }
+}
+
+static void serveLoop(Server *srv) {
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  int running = 1;
+  while (running) {
+    int n = epoll_wait(srv->epollFd, events, SERVER_MAX_EVENTS, -1);
+    running = (n >= 0 || errno == EINTR);
+    for (int i = 0; i < n; i++) {
+      uint32_t id = events[i].data.u32;
+      if (id == SERVER_LISTEN_ID) {
+        acceptConns(srv);
+      } else if (id == SERVER_WAKE_ID) {
+        drainReplies(srv);
+      } else if (id == SERVER_SIGNAL_ID) {
+        running = 0;
+      } else if (srv->conns[id].fd >= 0) {
+        readConn(&srv->conns[id]);
+        flushConn(&srv->conns[id]);
+        nextRequest(srv, (int)id);
+      }
+    }
+  }
+}
+
+int runServer(const char *path, const BatchConfig *cfg, int workers) {
+  Server *srv = (Server *)malloc(sizeof(Server));
+  pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * workers);
+  sigset_t stopSignals;
+  sigset_t oldMask;
+  int started = 0;
+  int served = -1;
+  srv->cfg = cfg;
+  for (int i = 0; i < SERVER_MAX_CONNS; i++) {
+    srv->conns[i].fd = -1;
+  }
+  initJobQueue(&srv->requests);
+  initJobQueue(&srv->replies);
+  initExprCache(&srv->programs, cfg->cacheSize);
+  initArena(&srv->scratch, exprArenaSize(256));
+  pthread_mutex_init(&srv->compileLock, NULL);
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGINT);
+  sigaddset(&stopSignals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stopSignals, &oldMask);
+  srv->listenFd = openListener(path);
+  srv->epollFd = epoll_create1(0);
+  srv->wakeFd = eventfd(0, EFD_NONBLOCK);
+  srv->signalFd = signalfd(-1, &stopSignals, SFD_NONBLOCK);
+  int ok = srv->listenFd >= 0 && srv->epollFd >= 0 && srv->wakeFd >= 0 &&
+           srv->signalFd >= 0 &&
+           watchFd(srv, srv->listenFd, EPOLLIN, SERVER_LISTEN_ID) &&
+           watchFd(srv, srv->wakeFd, EPOLLIN, SERVER_WAKE_ID) &&
+           watchFd(srv, srv->signalFd, EPOLLIN, SERVER_SIGNAL_ID);
+  while (ok && started < workers &&
+         pthread_create(&threads[started], NULL, serverWorker, srv) == 0) {
+    started++;
+  }
+  if (ok && started > 0) {
+    serveLoop(srv);
+    served = (int)srv->served;
+  }
+  stopJobQueue(&srv->requests);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  ServerJob job;
+  while (popJob(&srv->replies, &job, 0)) {
+    free(job.reply);
+  }
+  for (int i = 0; i < SERVER_MAX_CONNS; i++) {
+    if (srv->conns[i].fd >= 0) {
+      closeConn(&srv->conns[i]);
+    }
+  }
+  if (cfg->cacheStats) {
+    fprintf(stderr, "cache programs: hits %lu misses %lu evictions %lu\n",
+            srv->programs.hits, srv->programs.misses,
+            srv->programs.evictions);
+    printFoldStats(&srv->programs.fold);
+  }
+  int fds[] = {srv->signalFd, srv->wakeFd, srv->epollFd, srv->listenFd};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  if (srv->listenFd >= 0) {
+    unlink(path);
+  }
+  pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+  pthread_mutex_destroy(&srv->compileLock);
+  pthread_cond_destroy(&srv->requests.notEmpty);
+  pthread_mutex_destroy(&srv->requests.lock);
+  pthread_cond_destroy(&srv->replies.notEmpty);
+  pthread_mutex_destroy(&srv->replies.lock);
+  freeArena(&srv->scratch);
+  freeExprCache(&srv->programs);
+  free(threads);
+  free(srv);
+  return served;
+}
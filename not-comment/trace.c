@@ -0,0 +1,186 @@
+#include "graph.h"
+
+#ifdef GRAPH_TRACE
+
+#include <stdatomic.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#define TRACE_MAX_EVENTS (1 << 20)
+
+typedef struct {
+  unsigned char stage;
+  int tid;
+  double startNs;
+  double durNs;
+  unsigned long long cycles;
+} TraceEvent;
+
+static const char *const kStageNames[STAGE_COUNT] = {
+    "lex", "parse", "eval", "render", "output"};
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static TraceEvent *traceEvents = NULL;
+static int traceEventCount = 0;
+static int traceEventCapacity = 0;
+static unsigned long long stageSpans[STAGE_COUNT];
+static unsigned long long stageCycles[STAGE_COUNT];
+static double stageNs[STAGE_COUNT];
+static double traceEpochNs = -1.0;
+static _Atomic unsigned long long traceCounters[COUNTER_COUNT];
+static atomic_int traceNextTid = 1;
+static _Thread_local int traceTid = 0;
+
+static double traceNowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static unsigned long long traceCycles(void) {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  return (unsigned long long)traceNowNs();
+#endif
+}
+
+void traceBegin(TraceSpan *span) {
+  span->ns = traceNowNs();
+  span->cycles = traceCycles();
+}
+
+void traceEnd(const TraceSpan *span, TraceStage stage) {
+  unsigned long long cycles = traceCycles() - span->cycles;
+  double dur = traceNowNs() - span->ns;
+  if (traceTid == 0) {
+    traceTid = atomic_fetch_add(&traceNextTid, 1);
+  }
+  pthread_mutex_lock(&traceLock);
+  if (traceEpochNs < 0.0 || span->ns < traceEpochNs) {
+    traceEpochNs = span->ns;
+  }
+  stageSpans[stage]++;
+  stageCycles[stage] += cycles;
+  stageNs[stage] += dur;
+  if (traceEventCount == traceEventCapacity &&
+      traceEventCapacity < TRACE_MAX_EVENTS) {
+    traceEventCapacity = traceEventCapacity ? 2 * traceEventCapacity : 1024;
+    traceEvents = (TraceEvent *)realloc(
+        traceEvents, sizeof(TraceEvent) * traceEventCapacity);
+  }
+  if (traceEventCount < traceEventCapacity) {
+    TraceEvent *e = &traceEvents[traceEventCount++];
+    e->stage = (unsigned char)stage;
+    e->tid = traceTid;
+    e->startNs = span->ns;
+    e->durNs = dur;
+    e->cycles = cycles;
+  }
+  pthread_mutex_unlock(&traceLock);
+}
+
+void traceCount(TraceCounter counter, unsigned long long n) {
+  atomic_fetch_add(&traceCounters[counter], n);
+}
+
+void traceMax(TraceCounter counter, unsigned long long v) {
+  unsigned long long cur = atomic_load(&traceCounters[counter]);
+  while (cur < v &&
+         !atomic_compare_exchange_weak(&traceCounters[counter], &cur, v)) {
+  }
+}
+
+void traceSamples(const double *ys, size_t n) {
+  unsigned long long nans = 0;
+  unsigned long long infs = 0;
+  for (size_t i = 0; i < n; i++) {
+    nans += isnan(ys[i]) ? 1 : 0;
+    infs += isinf(ys[i]) ? 1 : 0;
+  }
+  traceCount(COUNTER_SAMPLES, n);
+  traceCount(COUNTER_NAN, nans);
+  traceCount(COUNTER_INF, infs);
+}
+
+static void printSummary(FILE *out) {
+  fprintf(out, "trace: %-8s %10s %16s %12s\n", "stage", "spans", "cycles",
+          "ms");
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    fprintf(out, "trace: %-8s %10llu %16llu %12.3f\n", kStageNames[s],
+            stageSpans[s], stageCycles[s], stageNs[s] / 1e6);
+  }
+  fprintf(out,
+          "trace: tokens %llu, folded %llu, evalRPN stack high-water "
+          "%llu/%d, bytecode depth %llu\n",
+          atomic_load(&traceCounters[COUNTER_TOKENS]),
+          atomic_load(&traceCounters[COUNTER_FOLDED]),
+          atomic_load(&traceCounters[COUNTER_RPN_STACK]), RPN_STACK_SIZE,
+          atomic_load(&traceCounters[COUNTER_PROGRAM_DEPTH]));
+  fprintf(out, "trace: samples %llu, nan %llu, inf %llu, off-canvas %llu\n",
+          atomic_load(&traceCounters[COUNTER_SAMPLES]),
+          atomic_load(&traceCounters[COUNTER_NAN]),
+          atomic_load(&traceCounters[COUNTER_INF]),
+          atomic_load(&traceCounters[COUNTER_OFF_CANVAS]));
+}
+
+static int writeChromeTrace(const char *path) {
+  FILE *f = fopen(path, "w");
+  int ok = (f != NULL);
+  if (ok) {
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (int i = 0; i < traceEventCount; i++) {
+      const TraceEvent *e = &traceEvents[i];
+      fprintf(f,
+              "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+              "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"cycles\":%llu}}\n",
+              (i > 0) ? "," : "", kStageNames[e->stage], e->tid,
+              (e->startNs - traceEpochNs) / 1e3, e->durNs / 1e3, e->cycles);
+    }
+    fprintf(f,
+            "],\"otherData\":{\"tokens\":%llu,\"folded\":%llu,"
+            "\"rpnStackHighWater\":%llu,"
+            "\"programDepth\":%llu,\"samples\":%llu,\"nan\":%llu,"
+            "\"inf\":%llu,\"offCanvas\":%llu}}\n",
+            atomic_load(&traceCounters[COUNTER_TOKENS]),
+            atomic_load(&traceCounters[COUNTER_FOLDED]),
+            atomic_load(&traceCounters[COUNTER_RPN_STACK]),
+            atomic_load(&traceCounters[COUNTER_PROGRAM_DEPTH]),
+            atomic_load(&traceCounters[COUNTER_SAMPLES]),
+            atomic_load(&traceCounters[COUNTER_NAN]),
+            atomic_load(&traceCounters[COUNTER_INF]),
+            atomic_load(&traceCounters[COUNTER_OFF_CANVAS]));
+    ok = (fclose(f) == 0);
+  }
+  return ok;
+}
+
+int traceReport(FILE *summary, const char *jsonPath) {
+  int ok = 1;
+  pthread_mutex_lock(&traceLock);
+  if (summary != NULL) {
+    printSummary(summary);
+  }
+  if (jsonPath != NULL) {
+    ok = writeChromeTrace(jsonPath);
+  }
+  free(traceEvents);
+  traceEvents = NULL;
+  traceEventCount = 0;
+  traceEventCapacity = 0;
+  pthread_mutex_unlock(&traceLock);
+  return ok;
+}
+
+#else
+
+int traceReport(FILE *summary, const char *jsonPath) {
+  if (summary != NULL || jsonPath != NULL) {
+    fprintf(stderr, "graph: built without GRAPH_TRACE (use 'make trace')\n");
+  }
+  return 1;
+}
+
+#endif